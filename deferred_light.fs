@@ -0,0 +1,237 @@
+#version 330 core
+// Deferred lighting pass, added into the light accumulation target of the G-buffer
+out vec4 FragColor;
+
+// Feature defines, inserted after #version by the shader permutation system:
+//   (none)        global light, ambient and fog over the whole screen
+//   AREA_LIGHTS   one area light inside its sphere volume
+//   FLASHLIGHT    flashlight inside its cone volume
+//   AREA_SHADOWS  the area light is shadowed by its cube shadow map
+//   GRID_SHADOWS  the global or area light is shadowed by a ray march through the map cells
+//   STENCIL_ONLY  volume stencil marking pass, writes no color
+
+uniform sampler2D gAlbedoRoughness;
+uniform sampler2D gNormal;
+uniform sampler2D gViewDepth;
+uniform mat4 inverseView;
+
+// Area light of the current volume
+uniform vec3 areaLightPosition;
+uniform float areaLightRadius;
+uniform vec3 areaLightColor;  // Color * intensity
+uniform int areaLightShadowSlot;
+
+// Per-frame camera, global light, flashlight and fog data
+layout (std140) uniform FrameData {
+    mat4 projection;
+    mat4 view;
+    vec3 viewPos;
+    bool flashlightOn;
+    vec3 lightPos;
+    float flashlightCutoff;
+    vec3 lightColor;
+    float flashlightOuterCutoff;
+    vec3 flashlightPos;
+    float flashlightIntensity;
+    vec3 flashlightDir;
+    float fogStart;
+    vec3 fogColor;
+    float fogEnd;
+    float fogDensity;
+    bool fogExponential;
+    vec2 screenSize;
+    float clusterZScale;
+    float clusterZBias;
+    int lightGridWidth;
+    int lightGridHeight;
+};
+
+// Inverse of encodeNormal in gbuffer.fs
+vec3 decodeNormal(vec2 e)
+{
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = clamp(-n.z, 0.0, 1.0);
+    n.xy += vec2(n.x >= 0.0 ? -t : t, n.y >= 0.0 ? -t : t);
+    return normalize(n);
+}
+
+#ifdef AREA_SHADOWS
+// Same cube shadow map lookup as shader.fs
+const float SHADOW_NEAR_PLANE = 0.05;
+const float SHADOW_NORMAL_OFFSET = 0.03;
+uniform sampler2DArrayShadow areaShadowMaps;
+
+float areaShadow(int slot, vec3 position, vec3 normal)
+{
+    vec3 d = position + normal * SHADOW_NORMAL_OFFSET - areaLightPosition;
+    vec3 a = abs(d);
+    int face;
+    float major;
+    vec2 uv;
+    if (a.x >= a.y && a.x >= a.z) {
+        face = d.x > 0.0 ? 0 : 1;
+        major = a.x;
+        uv = vec2(d.x > 0.0 ? -d.z : d.z, -d.y);
+    } else if (a.y >= a.z) {
+        face = d.y > 0.0 ? 2 : 3;
+        major = a.y;
+        uv = vec2(d.x, d.y > 0.0 ? d.z : -d.z);
+    } else {
+        face = d.z > 0.0 ? 4 : 5;
+        major = a.z;
+        uv = vec2(d.z > 0.0 ? d.x : -d.x, -d.y);
+    }
+    float radius = areaLightRadius;
+    float depth = (radius + SHADOW_NEAR_PLANE - 2.0 * radius * SHADOW_NEAR_PLANE / major) / (radius - SHADOW_NEAR_PLANE);
+    return texture(areaShadowMaps, vec4(uv / major * 0.5 + 0.5, float(slot * 6 + face), depth * 0.5 + 0.5));
+}
+#endif
+
+#ifdef GRID_SHADOWS
+// Same grid ray march as shader.fs
+const float CELL_SIZE = 1.0;
+const float WALL_HEIGHT = 4.0;
+const float GRID_SHADOW_NORMAL_OFFSET = 0.01;
+const float GRID_SHADOW_MAX_DISTANCE = 24.0;
+const int GRID_SHADOW_MIN_STEPS = 8;
+const int GRID_SHADOW_MAX_STEPS = 48;
+const float GRID_SHADOW_STEPS_PER_PIXEL = 0.5;
+uniform sampler2D occupancyMap;
+
+int gridShadowSteps(float viewDepth)
+{
+    float cellPixels = CELL_SIZE * projection[1][1] * screenSize.y * 0.5 / max(viewDepth, 0.0001);
+    return clamp(int(cellPixels * GRID_SHADOW_STEPS_PER_PIXEL), GRID_SHADOW_MIN_STEPS, GRID_SHADOW_MAX_STEPS);
+}
+
+float gridShadow(vec3 origin, vec3 lightPosition, int maxSteps)
+{
+    vec3 dir = lightPosition - origin;
+    float dist = length(dir);
+    if (dist < 0.0001) return 1.0;
+    dir /= dist;
+    float marchDistance = min(dist, GRID_SHADOW_MAX_DISTANCE);
+
+    ivec2 gridSize = textureSize(occupancyMap, 0);
+    ivec2 cell = ivec2(floor(origin.xz / CELL_SIZE));
+    ivec2 lightCell = ivec2(floor(lightPosition.xz / CELL_SIZE));
+    ivec2 cellStep = ivec2(dir.x >= 0.0 ? 1 : -1, dir.z >= 0.0 ? 1 : -1);
+    vec2 absDir = max(abs(dir.xz), vec2(0.000001));
+    vec2 cellDelta = CELL_SIZE / absDir;
+    vec2 nextBoundary = abs(vec2(cell + max(cellStep, ivec2(0))) * CELL_SIZE - origin.xz) / absDir;
+
+    for (int i = 0; i < maxSteps; i++) {
+        float enter = min(nextBoundary.x, nextBoundary.y);
+        if (enter >= marchDistance) return 1.0;
+        if (nextBoundary.x < nextBoundary.y) {
+            cell.x += cellStep.x;
+            nextBoundary.x += cellDelta.x;
+        } else {
+            cell.y += cellStep.y;
+            nextBoundary.y += cellDelta.y;
+        }
+        if (cell == lightCell) return 1.0;
+        if (any(lessThan(cell, ivec2(0))) || any(greaterThanEqual(cell, gridSize))) return 0.0;
+
+        float wallHeight = texelFetch(occupancyMap, cell, 0).r * WALL_HEIGHT;
+        if (wallHeight > 0.0) {
+            float exit = min(min(nextBoundary.x, nextBoundary.y), dist);
+            if (origin.y + dir.y * (dir.y < 0.0 ? exit : enter) < wallHeight) return 0.0;
+        }
+    }
+    return 1.0;
+}
+#endif
+
+// Same fog as shader.fs, 1 = no fog, 0 = fully fogged
+float fogFactor(float fogDistance)
+{
+    float factor;
+    if (fogExponential) {
+        float fogAmount = fogDensity * fogDistance;
+        factor = exp(-fogAmount * fogAmount);
+    } else {
+        factor = (fogEnd - fogDistance) / (fogEnd - fogStart);
+    }
+    return clamp(factor, 0.0, 1.0);
+}
+
+void main()
+{
+#ifdef STENCIL_ONLY
+    FragColor = vec4(0.0);
+#else
+    // The G-buffer can be larger than the scene viewport, so it is read by pixel
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    float viewDepth = texelFetch(gViewDepth, pixel, 0).r;
+
+#if !defined(AREA_LIGHTS) && !defined(FLASHLIGHT)
+    // Nothing was drawn here, show the fog color like the forward path's clear
+    if (viewDepth <= 0.0) {
+        FragColor = vec4(fogColor, 1.0);
+        return;
+    }
+#else
+    if (viewDepth <= 0.0) discard;
+#endif
+
+    // World position from the view depth along this pixel's view ray
+    vec2 ndc = gl_FragCoord.xy / screenSize * 2.0 - 1.0;
+    vec3 viewSpacePos = vec3(ndc.x / projection[0][0], ndc.y / projection[1][1], -1.0) * viewDepth;
+    vec3 FragPos = (inverseView * vec4(viewSpacePos, 1.0)).xyz;
+
+    vec4 albedoRoughness = texelFetch(gAlbedoRoughness, pixel, 0);
+    vec3 albedo = albedoRoughness.rgb;
+    float roughness = albedoRoughness.a;
+    vec3 normalOcclusion = texelFetch(gNormal, pixel, 0).xyz;
+    vec3 norm = decodeNormal(normalOcclusion.xy);
+    vec3 viewDir = normalize(viewPos - FragPos);
+    float fog = fogFactor(length(viewPos - FragPos));
+
+    // Lights add up, fog scales every light and the global pass adds the fog color once:
+    // sum(light * fog) + fogColor * (1 - fog) == mix(fogColor, sum(light), fog)
+    vec3 result;
+#if defined(AREA_LIGHTS)
+    vec3 areaDir = areaLightPosition - FragPos;
+    float distance = length(areaDir);
+    if (distance >= areaLightRadius) discard;
+    areaDir = normalize(areaDir);
+    float falloff = 1.0 - distance / areaLightRadius;
+#ifdef AREA_SHADOWS
+    falloff *= areaShadow(areaLightShadowSlot, FragPos, norm);
+#endif
+#ifdef GRID_SHADOWS
+    if (dot(norm, areaDir) > 0.0) falloff *= gridShadow(FragPos + norm * GRID_SHADOW_NORMAL_OFFSET, areaLightPosition, gridShadowSteps(viewDepth));
+#endif
+    float areaDiff = max(dot(norm, areaDir), 0.0);
+    float areaSpec = pow(max(dot(norm, normalize(areaDir + viewDir)), 0.0), 32.0);
+    result = (areaDiff * roughness + areaSpec * (1.0 - roughness)) * areaLightColor * falloff * albedo * fog;
+#elif defined(FLASHLIGHT)
+    vec3 flashDir = normalize(flashlightPos - FragPos);
+    float theta = dot(flashDir, normalize(-flashlightDir));
+    if (theta <= flashlightOuterCutoff) discard;
+    float epsilon = flashlightCutoff - flashlightOuterCutoff;
+    float intensity = clamp((theta - flashlightOuterCutoff) / epsilon, 0.0, 1.0);
+    float flashDiff = max(dot(norm, flashDir), 0.0);
+    float flashSpec = pow(max(dot(norm, normalize(flashDir + viewDir)), 0.0), 32.0);
+    result = (flashDiff * roughness + flashSpec * (1.0 - roughness)) * lightColor * intensity * flashlightIntensity * albedo * fog;
+#else
+    // Ambient and the global light
+    vec3 ambient = 0.2 * lightColor * (1.0 - normalOcclusion.z);
+    vec3 lightDir = normalize(lightPos - FragPos);
+    float diff = max(dot(norm, lightDir), 0.0);
+    float spec = pow(max(dot(norm, normalize(lightDir + viewDir)), 0.0), 32.0);
+#ifdef GRID_SHADOWS
+    if (diff > 0.0) {
+        float shadow = gridShadow(FragPos + norm * GRID_SHADOW_NORMAL_OFFSET, lightPos, gridShadowSteps(viewDepth));
+        diff *= shadow;
+        spec *= shadow;
+    }
+#endif
+    vec3 lit = (ambient + diff * lightColor * roughness + spec * lightColor * (1.0 - roughness)) * albedo;
+    result = lit * fog + fogColor * (1.0 - fog);
+#endif
+
+    FragColor = vec4(result, 1.0);
+#endif
+}
@@ -0,0 +1,40 @@
+#version 330 core
+// Deferred lighting pass: a full-screen quad for the global light,
+// or a light volume (AREA_LIGHTS sphere, FLASHLIGHT cone) placed by model
+layout (location = 0) in vec3 aPos;
+
+uniform mat4 model;
+
+// Per-frame camera, global light, flashlight and fog data
+layout (std140) uniform FrameData {
+    mat4 projection;
+    mat4 view;
+    vec3 viewPos;
+    bool flashlightOn;
+    vec3 lightPos;
+    float flashlightCutoff;
+    vec3 lightColor;
+    float flashlightOuterCutoff;
+    vec3 flashlightPos;
+    float flashlightIntensity;
+    vec3 flashlightDir;
+    float fogStart;
+    vec3 fogColor;
+    float fogEnd;
+    float fogDensity;
+    bool fogExponential;
+    vec2 screenSize;
+    float clusterZScale;
+    float clusterZBias;
+    int lightGridWidth;
+    int lightGridHeight;
+};
+
+void main()
+{
+#if defined(AREA_LIGHTS) || defined(FLASHLIGHT)
+    gl_Position = projection * view * model * vec4(aPos, 1.0);
+#else
+    gl_Position = vec4(aPos.xy, 0.0, 1.0);  // Quad corners are already in clip space
+#endif
+}
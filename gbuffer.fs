@@ -0,0 +1,185 @@
+#version 330 core
+// G-buffer pass of the deferred path, drawn with shader.vs
+layout (location = 0) out vec4 gAlbedoRoughness;  // Albedo in rgb, roughness in a
+layout (location = 1) out vec3 gNormal;           // Octahedral encoded world space normal in rg, ambient occlusion in b
+layout (location = 2) out float gViewDepth;       // Positive view space depth, 0 where nothing was drawn
+
+in vec3 FragPos;
+in vec3 Normal;
+in vec2 TexCoord;
+in mat3 TBN;
+in float Occlusion;
+
+// Feature defines, inserted after #version by the shader permutation system:
+//   USE_TEXTURE        albedo from a texture instead of objectColor
+//   MODEL_TEXTURE      albedo texture is texture_diffuse1 (models) instead of wallTexture
+//   USE_NORMAL_MAP     normal from normalMap
+//   USE_ROUGHNESS_MAP  roughness from roughnessMap
+//   PARALLAX_MAP       parallax occlusion mapping of the wall texture coordinates from heightMap
+//   LOD_DITHER         only the pixels in lodDitherRange of an ordered dither pattern are drawn
+//   MATERIAL_MAP       roughnessMap and heightMap are one packed material map: occlusion, roughness, metallic, height
+
+uniform vec3 objectColor;
+uniform sampler2D wallTexture;
+uniform sampler2D normalMap;
+uniform sampler2D roughnessMap;
+uniform sampler2D texture_diffuse1;
+
+// Per-frame camera, global light, flashlight and fog data
+layout (std140) uniform FrameData {
+    mat4 projection;
+    mat4 view;
+    vec3 viewPos;
+    bool flashlightOn;
+    vec3 lightPos;
+    float flashlightCutoff;
+    vec3 lightColor;
+    float flashlightOuterCutoff;
+    vec3 flashlightPos;
+    float flashlightIntensity;
+    vec3 flashlightDir;
+    float fogStart;
+    vec3 fogColor;
+    float fogEnd;
+    float fogDensity;
+    bool fogExponential;
+    vec2 screenSize;
+    float clusterZScale;
+    float clusterZBias;
+    int lightGridWidth;
+    int lightGridHeight;
+};
+
+#ifdef PARALLAX_MAP
+// Same parallax occlusion mapping as shader.fs
+const float PARALLAX_DEPTH = 0.04;            // World units from the top to the bottom of the height map
+const float PARALLAX_FADE_DISTANCE = 6.0;     // The depth flattens out from here to the cutoff so nothing pops
+const float PARALLAX_CUTOFF_DISTANCE = 8.0;
+const int PARALLAX_MIN_STEPS = 4;
+const int PARALLAX_MAX_STEPS = 24;
+uniform sampler2D heightMap;
+#ifdef MATERIAL_MAP
+#define HEIGHT_CHANNEL a  // Height is the last channel of the packed material map
+#else
+#define HEIGHT_CHANNEL r
+#endif
+
+vec2 parallaxOcclusion(vec2 uv)
+{
+    vec3 dp1 = dFdx(FragPos);
+    vec3 dp2 = dFdy(FragPos);
+    vec2 duv1 = dFdx(uv);
+    vec2 duv2 = dFdy(uv);
+
+    vec3 toEye = viewPos - FragPos;
+    float viewDistance = length(toEye);
+    if (viewDistance >= PARALLAX_CUTOFF_DISTANCE) return uv;
+
+    vec3 n = normalize(Normal);
+    vec3 dp2perp = cross(dp2, n);
+    vec3 dp1perp = cross(n, dp1);
+    float det = dot(dp1, dp2perp);
+    if (abs(det) < 1e-12) return uv;
+    vec3 gradU = (dp2perp * duv1.x + dp1perp * duv2.x) / det;  // Change of uv per world unit
+    vec3 gradV = (dp2perp * duv1.y + dp1perp * duv2.y) / det;
+
+    vec3 v = toEye / viewDistance;
+    float facing = max(dot(v, n), 0.05);
+    float depth = PARALLAX_DEPTH * (1.0 - smoothstep(PARALLAX_FADE_DISTANCE, PARALLAX_CUTOFF_DISTANCE, viewDistance));
+    vec2 fullShift = -vec2(dot(v, gradU), dot(v, gradV)) / facing * depth;  // Shift at the bottom of the height map
+
+    float steps = mix(float(PARALLAX_MAX_STEPS), float(PARALLAX_MIN_STEPS), facing);
+    steps = max(floor(steps * (1.0 - viewDistance / PARALLAX_CUTOFF_DISTANCE)), float(PARALLAX_MIN_STEPS));
+    float layerDepth = 1.0 / steps;
+    vec2 layerShift = fullShift * layerDepth;
+
+    // Step down until the ray is below the surface, then place the hit between the last two layers
+    vec2 current = uv;
+    float rayDepth = 0.0;
+    float surfaceDepth = 1.0 - textureGrad(heightMap, current, duv1, duv2).HEIGHT_CHANNEL;
+    for (int i = 0; i < PARALLAX_MAX_STEPS && float(i) < steps && rayDepth < surfaceDepth; i++) {
+        current += layerShift;
+        rayDepth += layerDepth;
+        surfaceDepth = 1.0 - textureGrad(heightMap, current, duv1, duv2).HEIGHT_CHANNEL;
+    }
+    vec2 previous = current - layerShift;
+    float after = surfaceDepth - rayDepth;
+    float before = 1.0 - textureGrad(heightMap, previous, duv1, duv2).HEIGHT_CHANNEL - (rayDepth - layerDepth);
+    float weight = after / (after - before + 1e-6);
+    return mix(current, previous, clamp(weight, 0.0, 1.0));
+}
+#endif
+
+#ifdef LOD_DITHER
+// Same shading LOD transition dither as shader.fs
+const float DITHER_4X4[16] = float[16](0.0, 8.0, 2.0, 10.0, 12.0, 4.0, 14.0, 6.0, 3.0, 11.0, 1.0, 9.0, 15.0, 7.0, 13.0, 5.0);
+uniform vec2 lodDitherRange;
+
+bool outsideLodDither()
+{
+    ivec2 p = ivec2(gl_FragCoord.xy) & 3;
+    float threshold = (DITHER_4X4[p.y * 4 + p.x] + 0.5) / 16.0;
+    return threshold < lodDitherRange.x || threshold >= lodDitherRange.y;
+}
+#endif
+
+// Unit vector to a point in the [-1,1] square, the lower hemisphere is folded over the diagonals
+vec2 encodeNormal(vec3 n)
+{
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    if (n.z < 0.0) {
+        n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+    }
+    return n.xy;
+}
+
+void main()
+{
+#ifdef LOD_DITHER
+    if (outsideLodDither()) discard;
+#endif
+
+    // Create flipped texture coordinates for all sampling
+    vec2 flippedCoord = vec2(1.0 - TexCoord.x, TexCoord.y);
+#ifdef PARALLAX_MAP
+    flippedCoord = parallaxOcclusion(flippedCoord);
+#endif
+
+    vec3 norm;
+#ifdef USE_NORMAL_MAP
+    // Only x and y are read, BC5 normal maps store no z. Tangent space normals face out, so z is positive
+    vec2 normalXY = texture(normalMap, flippedCoord).rg * 2.0 - 1.0;   // Convert from [0,1] to [-1,1]
+    norm = vec3(normalXY, sqrt(max(1.0 - dot(normalXY, normalXY), 0.0)));
+    norm = normalize(TBN * norm);         // Convert to world space
+#else
+    norm = normalize(Normal);
+#endif
+
+    float roughness = 1.0;
+    float occlusion = Occlusion;
+#ifdef USE_ROUGHNESS_MAP
+#ifdef MATERIAL_MAP
+    // The occlusion map darkens the ambient on top of the baked occlusion, as in shader.fs
+    vec4 material = texture(roughnessMap, flippedCoord);
+    roughness = material.g;
+    occlusion = 1.0 - (1.0 - Occlusion) * material.r;
+#else
+    roughness = texture(roughnessMap, flippedCoord).r; // Single channel
+#endif
+#endif
+
+    vec3 albedo;
+#ifdef USE_TEXTURE
+#ifdef MODEL_TEXTURE
+    albedo = texture(texture_diffuse1, vec2(TexCoord.x, TexCoord.y)).rgb;
+#else
+    albedo = texture(wallTexture, flippedCoord).rgb;
+#endif
+#else
+    albedo = objectColor;
+#endif
+
+    gAlbedoRoughness = vec4(albedo, roughness);
+    gNormal = vec3(encodeNormal(norm), occlusion);
+    gViewDepth = -(view * vec4(FragPos, 1.0)).z;
+}
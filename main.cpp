@@ -16,6 +16,32 @@
 #include <set>
 #include <string>
 #include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <memory>
+#include <filesystem>
+#include <algorithm>
+#include <functional>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <unordered_map>
+#include <chrono>
+#include <limits>
+
+// SSE for the lightmap baker's light evaluation, a scalar loop is used without it
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define LIGHTMAP_USE_SSE
+#endif
+// SSE2 for halving oversized textures, a scalar loop is used without it
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TEXTURE_USE_SSE2
+#endif
 //Image loading
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
@@ -55,6 +81,11 @@ bool playerOnGround = true;
 const float CELL_SIZE = 1.0f;
 const float WALL_HEIGHT = 4.0f;
 
+// Ambient occlusion baked into the wall, floor and ceiling meshes: a fully enclosed corner loses
+// AMBIENT_OCCLUSION_STRENGTH of the ambient light, creases along walls fade out over AMBIENT_OCCLUSION_BAND
+const float AMBIENT_OCCLUSION_STRENGTH = 0.6f;
+const float AMBIENT_OCCLUSION_BAND = 0.5f;
+
 bool useNormalMaps = true;  // Start with normal maps enabled
 bool showGrid = false;  // Show grid or not
 
@@ -63,6 +94,15 @@ float flashlightCutoff = 12.5f;  // Inner cone angle in degrees
 float flashlightOuterCutoff = 17.5f;  // Outer cone angle in degrees
 float flashlightIntensity = 1.0f;  // Brightness multiplier
 
+// Draw distance and fog settings
+float drawDistance = 30.0f;  // Geometry further than this is culled and fully fogged
+const float MIN_DRAW_DISTANCE = 5.0f;
+const float MAX_DRAW_DISTANCE = 100.0f;
+const float DRAW_DISTANCE_STEP = 5.0f;
+bool useExponentialFog = false;  // false = linear fog, true = exponential squared fog
+glm::vec3 fogColor(0.1f, 0.1f, 0.1f);  // Also used as the clear color so the cutoff blends away
+const int CHUNK_SIZE = 8;  // Map cells per culling chunk along X and Z
+const float NEAR_PLANE = 0.1f;
 
 // Controller settings
 bool useController = false;
@@ -93,12 +133,764 @@ struct AreaLight {
     float intensity;
     float radius;  // How far the light reaches
     bool active;   // If the light is enabled
+    bool dynamic = false;  // Moved or changed at runtime, so never baked into the lightmap
+    int shadowSlot = -1;   // Cube shadow map slot, assigned by ShadowMaps every frame
 };
 
+// w of a light's second lightData texel: bit 0 is set if the light is baked into the lightmap,
+// the bits above hold its shadow slot + 1
+float lightDataFlags(const AreaLight& light) {
+    return static_cast<float>((light.dynamic ? 0 : 1) + 2 * (light.shadowSlot + 1));
+}
+
 
 std::vector<AreaLight> areaLights;
 
+// Clustered lighting: the view frustum is split into screen tiles and exponential depth slices,
+// each cluster lists the area lights that reach it. Must match the constants in shader.fs
+const int CLUSTER_X = 16;
+const int CLUSTER_Y = 9;
+const int CLUSTER_Z = 24;
+const int NUM_CLUSTERS = CLUSTER_X * CLUSTER_Y * CLUSTER_Z;
+
+// Texture units of the light buffers, above the units used by materials and models.
+// The light lists hold an offset and count per cluster, or per map cell with the light grid
+const int LIGHT_DATA_TEXTURE_UNIT = 8;
+const int LIGHT_LIST_TEXTURE_UNIT = 9;
+const int LIGHT_INDEX_TEXTURE_UNIT = 10;
+
+// Light assignment of the forward path, toggled with C: per map cell with wall occlusion
+// (built when lights change) or per view frustum cluster (built every frame)
+bool useLightGrid = true;
+
+// Light count benchmark (B key): frame times are averaged at each light count
+const int LIGHT_BENCHMARK_COUNTS[] = {10, 100, 1000};
+const int LIGHT_BENCHMARK_WARMUP_FRAMES = 30;
+const int LIGHT_BENCHMARK_FRAMES = 120;
+bool lightBenchmarkRequested = false;
+
+// GL thread time per frame spent uploading decoded textures, at least one is uploaded every frame
+const double TEXTURE_UPLOAD_BUDGET_MS = 4.0;
+
+// Largest texture side per material class. Bigger images are halved with a box filter after decoding until
+// they fit, a wall cell is 1x4 units and never shows a full resolution phone photo
+enum TextureClass {
+    TEXTURE_CLASS_WALL,
+    TEXTURE_CLASS_OBJECT,
+    TEXTURE_CLASS_FLOOR,   // Floor and ceiling
+    TEXTURE_CLASS_MODEL,
+    TEXTURE_CLASS_COUNT
+};
+const char* const TEXTURE_CLASS_NAMES[TEXTURE_CLASS_COUNT] = {"wall", "object", "floor", "model"};
+int maxTextureSize[TEXTURE_CLASS_COUNT] = {1024, 1024, 1024, 2048};
+
+// Keep textures block compressed in VRAM, encoded once with a CPU generated mip chain and stored in the
+// texture cache keyed by the source file's content. GateWay --compress-textures fills the cache ahead of time
+bool useTextureCompression = true;
+
+// Pack a material's occlusion, roughness, metallic and height maps (_AO, _R, _M, _H) into the channels of one
+// RGBA texture when it has more than one of them, so the wall shader fetches one texture for all of them
+bool packMaterialMaps = true;
+
+// Texture streaming: block compressed textures of the map start with their small mip levels, and finer ones
+// are read from the texture cache when the feedback pass shows them on screen that close
+bool useTextureStreaming = true;
+const int TEXTURE_FEEDBACK_DIVISOR = 8;      // The feedback pass is drawn at the scene size divided by this
+const int TEXTURE_FEEDBACK_INTERVAL = 4;     // Frames between feedback passes
+const int STREAMING_TAIL_SIZE = 64;          // Mip levels this size and smaller are always resident
+const float STREAMING_DROP_DELAY = 3.0f;     // Seconds a level goes unneeded before it is dropped
+
+// VRAM the textures may use. Over it the least recently drawn textures are shrunk, see TextureResidency.
+// Set with --texture-budget <MB>
+int textureBudgetMegabytes = 512;
+
+enum TextureEncoding {
+    TEXTURE_ENCODING_COLOR,    // BC1, or BC3 when the image has alpha
+    TEXTURE_ENCODING_NORMAL,   // BC5 of x and y, the shaders rebuild z
+    TEXTURE_ENCODING_SINGLE    // BC4 of the first channel, for roughness and height maps
+};
+
+// Render path, toggled with R: forward (shader.fs) or deferred (gbuffer.fs + deferred_light.fs)
+bool useDeferredShading = false;
+
+// Baked lighting of the walls, floor and ceiling, made with --bake and toggled with M.
+// Every open cell has a tile slot for its floor, ceiling and the four wall faces around it.
+// Must match the constants in shader.fs
+const int LIGHTMAP_TILE_SIZE = 16;        // Texels along each side of a tile
+const int LIGHTMAP_FACES_PER_CELL = 6;
+const int LIGHTMAP_BOUNCE_RAYS = 144;    // Gather rays per texel for the bounced light
+const float LIGHTMAP_BOUNCE_ALBEDO = 0.5f;  // Average surface color assumed for the bounce
+const int LIGHTMAP_TEXTURE_UNIT = 11;
+const int LIGHTMAP_FACE_TEXTURE_UNIT = 12;
+bool useLightmap = true;
+
+// Cube shadow maps of the area lights. A slot holds the 6 faces of one light's cube
+// as layers of a depth texture array, a face is only rendered again when something in it changes
+const int SHADOW_MAP_SIZE = 256;
+const int MAX_SHADOW_LIGHTS = 16;       // Lights nearest the camera that get a slot
+const int SHADOW_FACE_BUDGET = 12;      // Cube faces rendered per frame at most
+const float SHADOW_NEAR_PLANE = 0.05f;  // Must match shader.fs and deferred_light.fs
+const int AREA_SHADOW_TEXTURE_UNIT = 13;
+
+// Grid ray marched shadows: the fragment shader walks the map cells towards the light through an
+// R8 texture of the cell wall heights, the step limits are in shader.fs and deferred_light.fs
+const int OCCUPANCY_TEXTURE_UNIT = 14;
+
+// Irradiance volume lighting the models, toggled with I: an ambient cube probe at every map cell
+// center and IRRADIANCE_LAYERS heights, holding the global light and the area lights
+const int IRRADIANCE_LAYERS = 4;
+const int IRRADIANCE_TEXTURE_UNIT = 15;
+bool useIrradianceVolume = true;
+
+// Shadow technique, cycled with H
+enum ShadowMode {
+    SHADOW_NONE,
+    SHADOW_MAPS,        // Cube shadow maps of the area lights nearest the camera
+    SHADOW_GRID_MARCH,  // Grid ray march for every area light and the global light
+    SHADOW_MODE_COUNT,
+};
+const char* const SHADOW_MODE_NAMES[] = {"off", "shadow maps", "grid ray march"};
+ShadowMode shadowMode = SHADOW_MAPS;
+
+// Shading LOD of the walls, floor and ceiling, picked per chunk from its distance to the camera and cycled with K.
+// Past each distance a chunk drops its normal and height maps, then specular, then is lit per vertex from the
+// irradiance volume. A chunk only moves back once it is SHADING_LOD_HYSTERESIS inside the distance again
+const float SHADING_LOD_DISTANCES[] = {10.0f, 16.0f, 22.0f};
+const int MAX_SHADING_LOD = sizeof(SHADING_LOD_DISTANCES) / sizeof(SHADING_LOD_DISTANCES[0]);
+const float SHADING_LOD_HYSTERESIS = 1.0f;
+const float SHADING_LOD_FADE_TIME = 0.5f;  // Seconds a dithered transition between two LODs takes
+enum ShadingLodMode {
+    SHADING_LOD_OFF,
+    SHADING_LOD_ON,        // Chunks switch variants at once
+    SHADING_LOD_DITHERED,  // Chunks cross-fade between the two variants with an ordered dither
+    SHADING_LOD_MODE_COUNT,
+};
+const char* const SHADING_LOD_MODE_NAMES[] = {"off", "on", "dithered"};
+ShadingLodMode shadingLodMode = SHADING_LOD_ON;
+bool shadingLodBenchmarkRequested = false;
+
+// Dynamic resolution: the 3D scene is rendered offscreen at a fraction of the window size per axis, picked from
+// the GPU frame time to hold DYNAMIC_RESOLUTION_TARGET_MS, and upscaled to the window with a sharpening filter.
+// T cycles between the dynamic scale and the fixed scales
+const float DYNAMIC_RESOLUTION_TARGET_MS = 14.0f;  // GPU time per frame to hold, some headroom under 60 fps
+const float MIN_RESOLUTION_SCALE = 0.5f;
+const float MAX_RESOLUTION_SCALE = 1.0f;
+const float RESOLUTION_SCALE_STEP = 0.05f;         // The scale moves in steps of this, smaller changes are ignored
+const int DYNAMIC_RESOLUTION_INTERVAL = 15;        // Frames of GPU time averaged per scale decision
+const float UPSCALE_SHARPNESS = 0.5f;              // 0 to 1, only applied below full resolution
+const float FIXED_RESOLUTION_SCALES[] = {1.0f, 0.75f, 0.5f};
+const int NUM_FIXED_RESOLUTION_SCALES = sizeof(FIXED_RESOLUTION_SCALES) / sizeof(FIXED_RESOLUTION_SCALES[0]);
+int resolutionOverride = -1;  // -1 for the dynamic scale, otherwise an index into FIXED_RESOLUTION_SCALES
+
+// Quality governor, U cycles off and the target frame rates. CPU and GPU frame times are averaged over a sliding
+// window of QUALITY_WINDOW_FRAMES, over the budget the next QualityStep is lowered, and the last lowered step is
+// raised again once the frame plus what that step was measured to cost fits in QUALITY_RAISE_HEADROOM of the budget
+enum QualityStep {
+    QUALITY_SHADING_LOD,         // Shading LOD switched on if it was off
+    QUALITY_NORMAL_MAPS,         // Normal and height maps off
+    QUALITY_TEXTURE_RESOLUTION,  // Top mip level of the map textures skipped
+    QUALITY_SHADOWS,             // Shadows off
+    QUALITY_DRAW_DISTANCE,       // Draw distance scaled by QUALITY_DRAW_DISTANCE_SCALE
+    QUALITY_STEP_COUNT,
+};
+const char* const QUALITY_STEP_NAMES[] = {"shading LOD", "normal maps", "texture resolution", "shadows", "draw distance"};
+const int QUALITY_TARGET_FPS[] = {60, 144};
+const int NUM_QUALITY_TARGETS = sizeof(QUALITY_TARGET_FPS) / sizeof(QUALITY_TARGET_FPS[0]);
+const int QUALITY_WINDOW_FRAMES = 90;
+const float QUALITY_RAISE_HEADROOM = 0.85f;
+const float QUALITY_DRAW_DISTANCE_SCALE = 0.6f;
+int qualityGovernorTarget = -1;  // -1 when off, otherwise an index into QUALITY_TARGET_FPS
+
+// Uniform block binding points, shared by every shader program
+const unsigned int FRAME_DATA_BINDING = 0;
+
+struct UniformBlockBinding {
+    const char* name;      // Block name in the GLSL source
+    unsigned int binding;  // Binding point the block's buffer is attached to
+};
+
+const UniformBlockBinding UNIFORM_BLOCK_BINDINGS[] = {
+    {"FrameData", FRAME_DATA_BINDING},
+};
+
+// CPU copy of the std140 FrameData block in shader.vs/shader.fs
+struct FrameUniforms {
+    glm::mat4 projection;
+    glm::mat4 view;
+    glm::vec3 viewPos;
+    int flashlightOn;  // GLSL bools are 4 bytes in std140
+    glm::vec3 lightPos;
+    float flashlightCutoff;
+    glm::vec3 lightColor;
+    float flashlightOuterCutoff;
+    glm::vec3 flashlightPos;
+    float flashlightIntensity;
+    glm::vec3 flashlightDir;
+    float fogStart;
+    glm::vec3 fogColor;
+    float fogEnd;
+    float fogDensity;
+    int fogExponential;
+    glm::vec2 screenSize;    // Framebuffer size in pixels, for the cluster tile of a fragment
+    float clusterZScale;     // Depth slice = log(viewDepth) * clusterZScale + clusterZBias
+    float clusterZBias;
+    int lightGridWidth;      // Map size in cells, for the light grid lookup
+    int lightGridHeight;
+};
+static_assert(sizeof(FrameUniforms) == 256, "FrameUniforms must match the std140 FrameData layout");
+
+// Uniform buffer object attached to a fixed binding point
+class UniformBuffer {
+public:
+    unsigned int ID;
+
+    UniformBuffer(unsigned int binding, size_t size) : size(size) {
+        glGenBuffers(1, &ID);
+        glBindBuffer(GL_UNIFORM_BUFFER, ID);
+        glBufferData(GL_UNIFORM_BUFFER, size, NULL, GL_DYNAMIC_DRAW);
+        glBindBufferBase(GL_UNIFORM_BUFFER, binding, ID);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    }
+
+    // Upload the whole block with a single buffer write, skipped if nothing changed since the last upload
+    bool update(const void* data) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        if (!lastData.empty() && std::memcmp(lastData.data(), bytes, size) == 0) {
+            return false;
+        }
+        lastData.assign(bytes, bytes + size);
+
+        glBindBuffer(GL_UNIFORM_BUFFER, ID);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, size, data);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        return true;
+    }
+
+    ~UniformBuffer() {
+        glDeleteBuffers(1, &ID);
+    }
+
+private:
+    size_t size;
+    std::vector<unsigned char> lastData;
+};
+
+// Per-frame performance counters, printed once per second when stats are shown (P key)
+struct FrameStats {
+    unsigned int uniformUploads = 0;         // glUniform* calls issued
+    unsigned int uniformUploadsSkipped = 0;  // Calls skipped because the value was already set
+    unsigned int shaderBinds = 0;            // glUseProgram calls for shader variants
+    unsigned int visibleLights = 0;          // Area lights assigned to at least one cluster
+    unsigned int clusterLightIndices = 0;    // Entries in the cluster or cell light index list
+    double lightAssignMs = 0.0;              // CPU time spent assigning lights to clusters
+    double gpuFrameMs = 0.0;                 // GPU time of the frame, from a few frames ago
+    unsigned int lightVolumes = 0;           // Deferred light volumes drawn
+    unsigned int shadowFacesRendered = 0;    // Cube shadow map faces rendered
+    unsigned int shadingLodChunks[MAX_SHADING_LOD + 1] = {};  // Visible chunks drawn at each shading LOD
+};
+
+FrameStats frameStats;
+bool showStats = false;
+
+// Fixed set of worker threads running jobs from a shared queue
+class ThreadPool {
+public:
+    // Leaves one hardware thread for the render loop
+    ThreadPool(unsigned int threadCount = std::max(1u, std::thread::hardware_concurrency()) - 1) {
+        for (unsigned int i = 0; i < std::max(1u, threadCount); i++) {
+            workers.emplace_back([this]() { workerLoop(); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            stopping = true;
+        }
+        queueCondition.notify_all();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    // Queue a job to run on a worker thread
+    void submit(std::function<void()> job) {
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            jobs.push_back(std::move(job));
+        }
+        queueCondition.notify_one();
+    }
+
+    // Run job(i) for every i in [0, count) on the workers and the calling thread, returns when all are done.
+    // Workers that only get to the job after every index is taken return without touching it
+    void parallelFor(int count, const std::function<void(int)>& job) {
+        if (count <= 0) return;
+
+        struct Batch {
+            std::atomic<int> next{0};
+            std::atomic<int> done{0};
+            std::mutex mutex;
+            std::condition_variable finished;
+        };
+        std::shared_ptr<Batch> batch = std::make_shared<Batch>();
+        const std::function<void(int)>* jobPtr = &job;
+
+        auto run = [batch, jobPtr, count]() {
+            int index;
+            while ((index = batch->next.fetch_add(1)) < count) {
+                (*jobPtr)(index);
+                if (batch->done.fetch_add(1) + 1 == count) {
+                    std::lock_guard<std::mutex> lock(batch->mutex);
+                    batch->finished.notify_all();
+                }
+            }
+        };
+
+        int helpers = std::min(static_cast<int>(workers.size()), count - 1);
+        for (int i = 0; i < helpers; i++) {
+            submit(run);
+        }
+        run();
+
+        std::unique_lock<std::mutex> lock(batch->mutex);
+        batch->finished.wait(lock, [&]() { return batch->done.load() == count; });
+    }
+
+    size_t size() const {
+        return workers.size();
+    }
+
+private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> jobs;
+    std::mutex queueMutex;
+    std::condition_variable queueCondition;
+    bool stopping = false;
+
+    void workerLoop() {
+        while (true) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                queueCondition.wait(lock, [this]() { return stopping || !jobs.empty(); });
+                if (stopping && jobs.empty()) return;
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+};
+
+// GPU time between begin() and end(), read back a few frames later so it never stalls the pipeline
+class GpuTimer {
+public:
+    GpuTimer() {
+        glGenQueries(QUERY_COUNT, queries);
+    }
+
+    ~GpuTimer() {
+        glDeleteQueries(QUERY_COUNT, queries);
+    }
+
+    void begin() {
+        glBeginQuery(GL_TIME_ELAPSED, queries[frame % QUERY_COUNT]);
+    }
+
+    void end() {
+        glEndQuery(GL_TIME_ELAPSED);
+        frame++;
+
+        // The query begin() will reuse next is the oldest one, read it if the GPU is done with it
+        if (frame >= QUERY_COUNT) {
+            unsigned int query = queries[frame % QUERY_COUNT];
+            int available = 0;
+            glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+            if (available) {
+                GLuint64 nanoseconds = 0;
+                glGetQueryObjectui64v(query, GL_QUERY_RESULT, &nanoseconds);
+                lastMs = nanoseconds / 1000000.0;
+            }
+        }
+    }
+
+    // Most recent finished measurement in milliseconds
+    double milliseconds() const {
+        return lastMs;
+    }
+
+    // Frames between a measurement and its result
+    static const int QUERY_COUNT = 4;
+
+private:
+    unsigned int queries[QUERY_COUNT];
+    unsigned int frame = 0;
+    double lastMs = 0.0;
+};
+
+// Buffer object read in shaders through a samplerBuffer / usamplerBuffer
+class TextureBuffer {
+public:
+    unsigned int buffer;
+    unsigned int texture;
+
+    TextureBuffer(GLenum internalFormat, size_t texelSize) : internalFormat(internalFormat), texelSize(texelSize) {
+        glGenBuffers(1, &buffer);
+        glGenTextures(1, &texture);
+        std::vector<unsigned char> empty(texelSize, 0);
+        update(empty.data(), 1);
+    }
+
+    ~TextureBuffer() {
+        glDeleteTextures(1, &texture);
+        glDeleteBuffers(1, &buffer);
+    }
+
+    // Replace the contents, the old storage is orphaned so the GPU can keep reading last frame's data
+    void update(const void* data, size_t texelCount) {
+        std::vector<unsigned char> empty;
+        if (texelCount == 0) {
+            empty.assign(texelSize, 0);
+            data = empty.data();
+            texelCount = 1;
+        }
+        glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+        glBufferData(GL_TEXTURE_BUFFER, texelCount * texelSize, data, GL_STREAM_DRAW);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+        glBindTexture(GL_TEXTURE_BUFFER, texture);
+        glTexBuffer(GL_TEXTURE_BUFFER, internalFormat, buffer);
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+    }
+
+    void bind(int unit) {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        glBindTexture(GL_TEXTURE_BUFFER, texture);
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+private:
+    GLenum internalFormat;
+    size_t texelSize;
+};
+
+// Assigns area lights to view frustum clusters on the CPU each frame and uploads the result:
+//   lightData            RGBA32F, 2 texels per light: position.xyz + radius, color * intensity + flags
+//   clusterGrid          RG32UI, 1 texel per cluster: offset and count in the index list
+//   clusterLightIndices  R32UI, light indices of every cluster back to back
+class ClusteredLights {
+public:
+    ClusteredLights(ThreadPool& threadPool)
+        : threadPool(threadPool),
+          lightData(GL_RGBA32F, sizeof(glm::vec4)),
+          clusterGrid(GL_RG32UI, 2 * sizeof(unsigned int)),
+          clusterLightIndices(GL_R32UI, sizeof(unsigned int)),
+          clusterLights(NUM_CLUSTERS) {
+        glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+    }
+
+    // Depth slice parameters for FrameData, slice = log(viewDepth) * scale + bias
+    static float sliceScale(float farPlane) {
+        return CLUSTER_Z / std::log(farPlane / NEAR_PLANE);
+    }
+    static float sliceBias(float farPlane) {
+        return -CLUSTER_Z * std::log(NEAR_PLANE) / std::log(farPlane / NEAR_PLANE);
+    }
+
+    // Assign the active lights to the clusters they reach and upload the light buffers
+    void update(const std::vector<AreaLight>& lights, const glm::mat4& view, const glm::mat4& projection, float farPlane) {
+        double startTime = glfwGetTime();
+        if (projection != clusterProjection) buildClusterBounds(projection, farPlane);
+
+        // Light bounds in cluster coordinates, lights outside the frustum are dropped here
+        std::vector<glm::vec4> gpuLights;
+        visible.clear();
+        for (const AreaLight& light : lights) {
+            if (!light.active) continue;
+            LightBounds bounds;
+            glm::vec3 center = glm::vec3(view * glm::vec4(light.position, 1.0f));
+            if (!clusterRange(center, light.radius, projection, farPlane, bounds)) continue;
+            bounds.index = static_cast<unsigned int>(visible.size());
+            visible.push_back(bounds);
+            gpuLights.push_back(glm::vec4(light.position, light.radius));
+            gpuLights.push_back(glm::vec4(light.color * light.intensity, lightDataFlags(light)));
+        }
+
+        // Each job fills the cluster lists of one depth slice, so jobs never share a list
+        threadPool.parallelFor(CLUSTER_Z, [this](int slice) {
+            for (int i = slice * CLUSTER_X * CLUSTER_Y; i < (slice + 1) * CLUSTER_X * CLUSTER_Y; i++) {
+                clusterLights[i].clear();
+            }
+            for (const LightBounds& bounds : visible) {
+                if (slice < bounds.minSlice || slice > bounds.maxSlice) continue;
+                for (int y = bounds.minY; y <= bounds.maxY; y++) {
+                    for (int x = bounds.minX; x <= bounds.maxX; x++) {
+                        int cluster = x + y * CLUSTER_X + slice * CLUSTER_X * CLUSTER_Y;
+                        if (sphereTouchesBox(bounds.center, bounds.radius, clusterMin[cluster], clusterMax[cluster])) {
+                            clusterLights[cluster].push_back(bounds.index);
+                        }
+                    }
+                }
+            }
+        });
+
+        // Flatten the per-cluster lists into the grid and index buffers
+        std::vector<unsigned int> grid(NUM_CLUSTERS * 2);
+        indices.clear();
+        for (int cluster = 0; cluster < NUM_CLUSTERS; cluster++) {
+            size_t count = clusterLights[cluster].size();
+            if (indices.size() + count > static_cast<size_t>(maxTexels)) {
+                count = maxTexels - indices.size();
+                if (!warnedOverflow) {
+                    std::cout << "Cluster light list is full, some lights are dropped" << std::endl;
+                    warnedOverflow = true;
+                }
+            }
+            grid[cluster * 2] = static_cast<unsigned int>(indices.size());
+            grid[cluster * 2 + 1] = static_cast<unsigned int>(count);
+            indices.insert(indices.end(), clusterLights[cluster].begin(), clusterLights[cluster].begin() + count);
+        }
+
+        lightData.update(gpuLights.data(), gpuLights.size());
+        clusterGrid.update(grid.data(), NUM_CLUSTERS);
+        clusterLightIndices.update(indices.data(), indices.size());
+
+        frameStats.visibleLights = static_cast<unsigned int>(visible.size());
+        frameStats.clusterLightIndices = static_cast<unsigned int>(indices.size());
+        frameStats.lightAssignMs = (glfwGetTime() - startTime) * 1000.0;
+    }
+
+    // Bind the light buffers to their fixed texture units
+    void bind() {
+        lightData.bind(LIGHT_DATA_TEXTURE_UNIT);
+        clusterGrid.bind(LIGHT_LIST_TEXTURE_UNIT);
+        clusterLightIndices.bind(LIGHT_INDEX_TEXTURE_UNIT);
+    }
+
+    unsigned int visibleLights() const {
+        return static_cast<unsigned int>(visible.size());
+    }
+
+private:
+    // View space sphere of a light and the cluster ranges it can touch
+    struct LightBounds {
+        glm::vec3 center;
+        float radius;
+        unsigned int index;
+        int minX, maxX, minY, maxY, minSlice, maxSlice;
+    };
+
+    ThreadPool& threadPool;
+    TextureBuffer lightData;
+    TextureBuffer clusterGrid;
+    TextureBuffer clusterLightIndices;
+    int maxTexels = 65536;
+    bool warnedOverflow = false;
+
+    glm::mat4 clusterProjection = glm::mat4(0.0f);
+    std::vector<glm::vec3> clusterMin;  // View space bounding box of each cluster
+    std::vector<glm::vec3> clusterMax;
+    std::vector<LightBounds> visible;
+    std::vector<std::vector<unsigned int>> clusterLights;
+    std::vector<unsigned int> indices;
+
+    static int depthSlice(float depth, float farPlane) {
+        int slice = static_cast<int>(std::floor(std::log(depth) * sliceScale(farPlane) + sliceBias(farPlane)));
+        return std::max(0, std::min(CLUSTER_Z - 1, slice));
+    }
+
+    static float sliceDepth(int slice, float farPlane) {
+        return NEAR_PLANE * std::pow(farPlane / NEAR_PLANE, static_cast<float>(slice) / CLUSTER_Z);
+    }
+
+    static bool sphereTouchesBox(const glm::vec3& center, float radius, const glm::vec3& boxMin, const glm::vec3& boxMax) {
+        glm::vec3 closest = glm::clamp(center, boxMin, boxMax);
+        glm::vec3 offset = center - closest;
+        return glm::dot(offset, offset) <= radius * radius;
+    }
+
+    // Rebuild the view space box of every cluster, only needed when the projection changes
+    void buildClusterBounds(const glm::mat4& projection, float farPlane) {
+        clusterProjection = projection;
+        clusterMin.resize(NUM_CLUSTERS);
+        clusterMax.resize(NUM_CLUSTERS);
+        for (int slice = 0; slice < CLUSTER_Z; slice++) {
+            float nearDepth = sliceDepth(slice, farPlane);
+            float farDepth = sliceDepth(slice + 1, farPlane);
+            for (int y = 0; y < CLUSTER_Y; y++) {
+                for (int x = 0; x < CLUSTER_X; x++) {
+                    // Tile edges in NDC, scaled out to view space at both slice depths
+                    float ndcMinX = 2.0f * x / CLUSTER_X - 1.0f;
+                    float ndcMaxX = 2.0f * (x + 1) / CLUSTER_X - 1.0f;
+                    float ndcMinY = 2.0f * y / CLUSTER_Y - 1.0f;
+                    float ndcMaxY = 2.0f * (y + 1) / CLUSTER_Y - 1.0f;
+                    glm::vec3 boxMin(1e30f), boxMax(-1e30f);
+                    for (float depth : {nearDepth, farDepth}) {
+                        for (float ndcX : {ndcMinX, ndcMaxX}) {
+                            for (float ndcY : {ndcMinY, ndcMaxY}) {
+                                glm::vec3 corner(ndcX * depth / projection[0][0], ndcY * depth / projection[1][1], -depth);
+                                boxMin = glm::min(boxMin, corner);
+                                boxMax = glm::max(boxMax, corner);
+                            }
+                        }
+                    }
+                    int cluster = x + y * CLUSTER_X + slice * CLUSTER_X * CLUSTER_Y;
+                    clusterMin[cluster] = boxMin;
+                    clusterMax[cluster] = boxMax;
+                }
+            }
+        }
+    }
+
+    // Conservative tile and slice ranges of a view space sphere, false if it is outside the frustum
+    static bool clusterRange(const glm::vec3& center, float radius, const glm::mat4& projection, float farPlane, LightBounds& bounds) {
+        float depth = -center.z;
+        if (depth + radius < NEAR_PLANE || depth - radius > farPlane) return false;
+
+        bounds.center = center;
+        bounds.radius = radius;
+        bounds.minSlice = depthSlice(std::max(depth - radius, NEAR_PLANE), farPlane);
+        bounds.maxSlice = depthSlice(std::min(depth + radius, farPlane), farPlane);
+
+        // Sphere crossing the near plane can cover any tile
+        float closestDepth = depth - radius;
+        if (closestDepth <= NEAR_PLANE) {
+            bounds.minX = 0;
+            bounds.maxX = CLUSTER_X - 1;
+            bounds.minY = 0;
+            bounds.maxY = CLUSTER_Y - 1;
+            return true;
+        }
+
+        // Project the sphere's bounding box, the extremes lie on the nearest or farthest depth
+        float minNdcX = 1e30f, maxNdcX = -1e30f, minNdcY = 1e30f, maxNdcY = -1e30f;
+        for (float boxDepth : {closestDepth, depth + radius}) {
+            for (float offset : {-radius, radius}) {
+                float ndcX = (center.x + offset) * projection[0][0] / boxDepth;
+                float ndcY = (center.y + offset) * projection[1][1] / boxDepth;
+                minNdcX = std::min(minNdcX, ndcX);
+                maxNdcX = std::max(maxNdcX, ndcX);
+                minNdcY = std::min(minNdcY, ndcY);
+                maxNdcY = std::max(maxNdcY, ndcY);
+            }
+        }
+        if (maxNdcX < -1.0f || minNdcX > 1.0f || maxNdcY < -1.0f || minNdcY > 1.0f) return false;
+
+        bounds.minX = std::max(0, static_cast<int>(std::floor((minNdcX * 0.5f + 0.5f) * CLUSTER_X)));
+        bounds.maxX = std::min(CLUSTER_X - 1, static_cast<int>(std::floor((maxNdcX * 0.5f + 0.5f) * CLUSTER_X)));
+        bounds.minY = std::max(0, static_cast<int>(std::floor((minNdcY * 0.5f + 0.5f) * CLUSTER_Y)));
+        bounds.maxY = std::min(CLUSTER_Y - 1, static_cast<int>(std::floor((maxNdcY * 0.5f + 0.5f) * CLUSTER_Y)));
+        return true;
+    }
+};
+
+// FNV-1a hash of a uniform name, usable in constant expressions
+constexpr unsigned int uniformNameHash(const char* name) {
+    unsigned int hash = 2166136261u;
+    while (*name) {
+        hash = (hash ^ static_cast<unsigned char>(*name++)) * 16777619u;
+    }
+    return hash;
+}
+
+// Typed uniform name, hashed at compile time when built from a string literal
+template <typename T>
+struct UniformHandle {
+    unsigned int hash;
+    constexpr explicit UniformHandle(const char* name) : hash(uniformNameHash(name)) {}
+};
+
+// Linked program binaries stored on disk so later launches skip compiling shaders
+class ProgramBinaryCache {
+public:
+    // Cache key from both sources plus the driver, a driver update invalidates every entry
+    static uint64_t key(const std::string& vertexCode, const std::string& fragmentCode) {
+        uint64_t hash = 14695981039346656037ull;
+        hashBytes(hash, vertexCode);
+        hashBytes(hash, fragmentCode);
+        hashBytes(hash, driverString());
+        return hash;
+    }
+
+    // Load a cached binary into the program, false if there is none or the driver rejects it
+    static bool load(unsigned int program, uint64_t key) {
+        if (!isSupported()) return false;
+
+        std::ifstream file(path(key), std::ios::binary);
+        if (!file.is_open()) return false;
+
+        uint32_t format = 0;
+        file.read(reinterpret_cast<char*>(&format), sizeof(format));
+        std::vector<char> binary((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        if (!file.good() && !file.eof()) return false;
+        if (binary.empty()) return false;
+
+        glProgramBinary(program, format, binary.data(), static_cast<GLsizei>(binary.size()));
+        int success;
+        glGetProgramiv(program, GL_LINK_STATUS, &success);
+        return success;
+    }
+
+    // Store a linked program's binary, the program must have been linked with the retrievable hint
+    static void save(unsigned int program, uint64_t key) {
+        if (!isSupported()) return;
+
+        int length = 0;
+        glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+        if (length <= 0) return;
+
+        std::vector<char> binary(length);
+        GLenum format = 0;
+        glGetProgramBinary(program, length, NULL, &format, binary.data());
+
+        std::error_code error;
+        std::filesystem::create_directories(SHADER_CACHE_DIR, error);
+        std::ofstream file(path(key), std::ios::binary | std::ios::trunc);
+        if (!file.is_open()) {
+            std::cout << "Failed to write shader cache: " << path(key) << std::endl;
+            return;
+        }
+        uint32_t storedFormat = format;
+        file.write(reinterpret_cast<const char*>(&storedFormat), sizeof(storedFormat));
+        file.write(binary.data(), binary.size());
+    }
+
+    // Program binaries need GL 4.1 or ARB_get_program_binary and at least one binary format
+    static bool isSupported() {
+        static int supported = -1;
+        if (supported == -1) {
+            int formats = 0;
+            if (GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary) {
+                glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+            }
+            supported = formats > 0;
+        }
+        return supported;
+    }
+
+private:
+    static constexpr const char* SHADER_CACHE_DIR = "ShaderCache";
+
+    static void hashBytes(uint64_t& hash, const std::string& data) {
+        for (unsigned char c : data) {
+            hash = (hash ^ c) * 1099511628211ull;
+        }
+        hash = (hash ^ 0xff) * 1099511628211ull;  // Separator so "ab"+"c" and "a"+"bc" differ
+    }
+
+    static const std::string& driverString() {
+        static std::string driver = std::string(reinterpret_cast<const char*>(glGetString(GL_VENDOR))) + "|" +
+                                    reinterpret_cast<const char*>(glGetString(GL_RENDERER)) + "|" +
+                                    reinterpret_cast<const char*>(glGetString(GL_VERSION));
+        return driver;
+    }
 
+    static std::string path(uint64_t key) {
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx.bin", static_cast<unsigned long long>(key));
+        return std::string(SHADER_CACHE_DIR) + "/" + name;
+    }
+};
 
 // You can add more lights here as needed
 // Shader class to handle shaders
@@ -136,112 +928,491 @@ public:
             std::cout << "ERROR::SHADER::FILE_NOT_SUCCESSFULLY_READ" << std::endl;
         }
 
+        begin(vertexCode, fragmentCode);
+        finish();
+    }
+
+    // Constructor from source code, with feature #define lines inserted right after the #version line.
+    // Only starts the compile (or binary cache load), call finish() before using the program
+    Shader(const std::string& vertexCode, const std::string& fragmentCode, const std::string& defines) {
+        begin(insertDefines(vertexCode, defines), insertDefines(fragmentCode, defines));
+    }
+
+    // Insert #define lines after the first line, which must stay the #version directive
+    static std::string insertDefines(const std::string& code, const std::string& defines) {
+        size_t firstLineEnd = code.find('\n');
+        if (firstLineEnd == std::string::npos) return code;
+        return code.substr(0, firstLineEnd + 1) + defines + code.substr(firstLineEnd + 1);
+    }
+
+    // Load the program from the binary cache, or issue compile and link without waiting for them
+    void begin(const std::string& vertexCode, const std::string& fragmentCode) {
+        ID = glCreateProgram();
+        cacheKey = ProgramBinaryCache::key(vertexCode, fragmentCode);
+        if (ProgramBinaryCache::load(ID, cacheKey)) {
+            fromBinaryCache = true;
+            return;
+        }
+
         const char* vShaderCode = vertexCode.c_str();
         const char* fShaderCode = fragmentCode.c_str();
 
-        // Compile shaders
-        unsigned int vertex, fragment;
-        int success;
-        char infoLog[512];
-
         // Vertex shader
         vertex = glCreateShader(GL_VERTEX_SHADER);
         glShaderSource(vertex, 1, &vShaderCode, NULL);
         glCompileShader(vertex);
 
-        // Check for shader compile errors
-        glGetShaderiv(vertex, GL_COMPILE_STATUS, &success);
-        if (!success) {
-            glGetShaderInfoLog(vertex, 512, NULL, infoLog);
-            std::cout << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n" << infoLog << std::endl;
-        }
-
         // Fragment shader
         fragment = glCreateShader(GL_FRAGMENT_SHADER);
         glShaderSource(fragment, 1, &fShaderCode, NULL);
         glCompileShader(fragment);
 
-        // Check for shader compile errors
-        glGetShaderiv(fragment, GL_COMPILE_STATUS, &success);
-        if (!success) {
-            glGetShaderInfoLog(fragment, 512, NULL, infoLog);
-            std::cout << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n" << infoLog << std::endl;
-        }
-
-        // Shader program
-        ID = glCreateProgram();
+        // Shader program, status is only queried in finish() so parallel compiles are not stalled
         glAttachShader(ID, vertex);
         glAttachShader(ID, fragment);
+        if (ProgramBinaryCache::isSupported()) {
+            glProgramParameteri(ID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        }
         glLinkProgram(ID);
+    }
+
+    // Wait for the program, report errors, store it in the binary cache and build the uniform table
+    void finish() {
+        if (ready) return;
+        ready = true;
+
+        if (!fromBinaryCache) {
+            int success;
+            char infoLog[512];
+
+            // Check for shader compile errors
+            glGetShaderiv(vertex, GL_COMPILE_STATUS, &success);
+            if (!success) {
+                glGetShaderInfoLog(vertex, 512, NULL, infoLog);
+                std::cout << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n" << infoLog << std::endl;
+            }
+            glGetShaderiv(fragment, GL_COMPILE_STATUS, &success);
+            if (!success) {
+                glGetShaderInfoLog(fragment, 512, NULL, infoLog);
+                std::cout << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n" << infoLog << std::endl;
+            }
+
+            // Check for linking errors
+            glGetProgramiv(ID, GL_LINK_STATUS, &success);
+            if (!success) {
+                glGetProgramInfoLog(ID, 512, NULL, infoLog);
+                std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
+            } else {
+                ProgramBinaryCache::save(ID, cacheKey);
+            }
+
+            // Delete shaders as they're linked into the program and no longer necessary
+            glDeleteShader(vertex);
+            glDeleteShader(fragment);
+        }
+
+        bindUniformBlocks();
+        reflectUniforms();
+    }
+
+    bool isReady() const {
+        return ready;
+    }
 
-        // Check for linking errors
-        glGetProgramiv(ID, GL_LINK_STATUS, &success);
-        if (!success) {
-            glGetProgramInfoLog(ID, 512, NULL, infoLog);
-            std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
+    bool loadedFromBinaryCache() const {
+        return fromBinaryCache;
+    }
+
+    // Attach every shared uniform block this program uses to its binding point
+    void bindUniformBlocks() {
+        for (const auto& block : UNIFORM_BLOCK_BINDINGS) {
+            unsigned int blockIndex = glGetUniformBlockIndex(ID, block.name);
+            if (blockIndex != GL_INVALID_INDEX) {
+                glUniformBlockBinding(ID, blockIndex, block.binding);
+            }
+        }
+    }
+
+    // Build the uniform table from the program's active uniforms (block members are skipped)
+    void reflectUniforms() {
+        uniforms.clear();
+        uniformNames.clear();
+
+        int count = 0;
+        glGetProgramiv(ID, GL_ACTIVE_UNIFORMS, &count);
+        for (int i = 0; i < count; i++) {
+            char name[256];
+            int size;
+            GLenum type;
+            glGetActiveUniform(ID, i, sizeof(name), NULL, &size, &type, name);
+
+            unsigned int index = i;
+            int blockIndex;
+            glGetActiveUniformsiv(ID, 1, &index, GL_UNIFORM_BLOCK_INDEX, &blockIndex);
+            if (blockIndex != -1) continue;
+
+            // Arrays are reported as "name[0]": add every element, the bare name shares element 0's slot
+            std::string baseName = name;
+            size_t bracket = baseName.find('[');
+            if (bracket == std::string::npos) {
+                addUniform(baseName, glGetUniformLocation(ID, name));
+                continue;
+            }
+            baseName = baseName.substr(0, bracket);
+            for (int element = 0; element < size; element++) {
+                std::string elementName = baseName + "[" + std::to_string(element) + "]";
+                addUniform(elementName, glGetUniformLocation(ID, elementName.c_str()));
+            }
+            int firstSlot = findSlotIndex(uniformNameHash((baseName + "[0]").c_str()));
+            if (firstSlot != -1) uniformNames.push_back({uniformNameHash(baseName.c_str()), firstSlot});
         }
 
-        // Delete shaders as they're linked into the program and no longer necessary
-        glDeleteShader(vertex);
-        glDeleteShader(fragment);
+        // Open-addressing lookup from name hash to table slot
+        size_t lookupSize = 16;
+        while (lookupSize < uniformNames.size() * 2) lookupSize *= 2;
+        uniformLookup.assign(lookupSize, -1);
+        for (size_t entry = 0; entry < uniformNames.size(); entry++) {
+            size_t bucket = uniformNames[entry].hash & (lookupSize - 1);
+            while (uniformLookup[bucket] != -1) bucket = (bucket + 1) & (lookupSize - 1);
+            uniformLookup[bucket] = static_cast<int>(entry);
+        }
     }
 
     // Use the shader
     void use() {
         glUseProgram(ID);
+        boundProgram = ID;
     }
 
-    // Utility uniform functions
-    void setBool(const std::string &name, bool value) const {
-        glUniform1i(glGetUniformLocation(ID, name.c_str()), (int)value);
+    // Program last bound through use(), shared by every shader so redundant binds can be skipped
+    static inline unsigned int boundProgram = 0;
+
+    // Utility uniform functions, resolved through the uniform table and skipped if the value is unchanged
+    void setBool(UniformHandle<bool> uniform, bool value) {
+        int intValue = value;
+        UniformSlot* slot = findUniform(uniform.hash);
+        if (slot && valueChanged(*slot, &intValue, sizeof(intValue))) glUniform1i(slot->location, intValue);
     }
-    void setInt(const std::string &name, int value) const {
-        glUniform1i(glGetUniformLocation(ID, name.c_str()), value);
+    void setInt(UniformHandle<int> uniform, int value) {
+        UniformSlot* slot = findUniform(uniform.hash);
+        if (slot && valueChanged(*slot, &value, sizeof(value))) glUniform1i(slot->location, value);
     }
-    void setFloat(const std::string &name, float value) const {
-        glUniform1f(glGetUniformLocation(ID, name.c_str()), value);
+    void setFloat(UniformHandle<float> uniform, float value) {
+        UniformSlot* slot = findUniform(uniform.hash);
+        if (slot && valueChanged(*slot, &value, sizeof(value))) glUniform1f(slot->location, value);
     }
-    void setVec2(const std::string &name, const glm::vec2 &value) const {
-        glUniform2fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+    void setVec2(UniformHandle<glm::vec2> uniform, const glm::vec2 &value) {
+        UniformSlot* slot = findUniform(uniform.hash);
+        if (slot && valueChanged(*slot, &value[0], sizeof(value))) glUniform2fv(slot->location, 1, &value[0]);
     }
-    void setVec3(const std::string &name, const glm::vec3 &value) const {
-        glUniform3fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+    void setVec3(UniformHandle<glm::vec3> uniform, const glm::vec3 &value) {
+        UniformSlot* slot = findUniform(uniform.hash);
+        if (slot && valueChanged(*slot, &value[0], sizeof(value))) glUniform3fv(slot->location, 1, &value[0]);
     }
-    void setMat4(const std::string &name, const glm::mat4 &mat) const {
-        glUniformMatrix4fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+    void setMat4(UniformHandle<glm::mat4> uniform, const glm::mat4 &mat) {
+        UniformSlot* slot = findUniform(uniform.hash);
+        if (slot && valueChanged(*slot, &mat[0][0], sizeof(mat))) glUniformMatrix4fv(slot->location, 1, GL_FALSE, &mat[0][0]);
     }
-};
 
-// Camera class
-class Camera {
-public:
-    // Camera attributes
-    glm::vec3 Position;
-    glm::vec3 Front;
-    glm::vec3 Up;
-    glm::vec3 Right;
-    glm::vec3 WorldUp;
+    // Name based versions, hashed at runtime
+    void setBool(const std::string &name, bool value) {
+        setBool(UniformHandle<bool>(name.c_str()), value);
+    }
+    void setInt(const std::string &name, int value) {
+        setInt(UniformHandle<int>(name.c_str()), value);
+    }
+    void setFloat(const std::string &name, float value) {
+        setFloat(UniformHandle<float>(name.c_str()), value);
+    }
+    void setVec2(const std::string &name, const glm::vec2 &value) {
+        setVec2(UniformHandle<glm::vec2>(name.c_str()), value);
+    }
+    void setVec3(const std::string &name, const glm::vec3 &value) {
+        setVec3(UniformHandle<glm::vec3>(name.c_str()), value);
+    }
+    void setMat4(const std::string &name, const glm::mat4 &mat) {
+        setMat4(UniformHandle<glm::mat4>(name.c_str()), mat);
+    }
 
-    // Constructor
-    Camera(glm::vec3 position = glm::vec3(0.0f, 0.0f, 0.0f)) {
-        Position = position;
-        WorldUp = glm::vec3(0.0f, 1.0f, 0.0f);
-        updateCameraVectors();
+private:
+    uint64_t cacheKey = 0;
+    unsigned int vertex = 0;
+    unsigned int fragment = 0;
+    bool fromBinaryCache = false;
+    bool ready = false;
+
+    // Active uniform with the last value uploaded to it
+    struct UniformSlot {
+        int location;
+        bool hasValue;
+        unsigned char value[sizeof(glm::mat4)];
+    };
+
+    // Name hash pointing at a slot, several names can share one slot
+    struct UniformName {
+        unsigned int hash;
+        int slot;
+    };
+
+    std::vector<UniformSlot> uniforms;      // Dense table of active uniforms
+    std::vector<UniformName> uniformNames;  // Every name a uniform can be set by
+    std::vector<int> uniformLookup;         // Hash buckets holding indices into uniformNames
+
+    void addUniform(const std::string& name, int location) {
+        if (location < 0) return;
+        unsigned int hash = uniformNameHash(name.c_str());
+        if (findSlotIndex(hash) != -1) {
+            std::cout << "ERROR::SHADER::UNIFORM_HASH_COLLISION " << name << std::endl;
+            return;
+        }
+        UniformSlot slot = {};
+        slot.location = location;
+        uniforms.push_back(slot);
+        uniformNames.push_back({hash, static_cast<int>(uniforms.size() - 1)});
     }
 
-    // Returns the view matrix
-    glm::mat4 GetViewMatrix() {
-        return glm::lookAt(Position, Position + Front, Up);
+    // Linear search used while the table is being built
+    int findSlotIndex(unsigned int hash) const {
+        for (const UniformName& entry : uniformNames) {
+            if (entry.hash == hash) return entry.slot;
+        }
+        return -1;
     }
 
-    // Updates the camera vectors based on the Euler angles
-    void updateCameraVectors() {
-        // Calculate the new Front vector
-        glm::vec3 front;
-        front.x = cos(glm::radians(yaw)) * cos(glm::radians(pitch));
-        front.y = sin(glm::radians(pitch));
-        front.z = sin(glm::radians(yaw)) * cos(glm::radians(pitch));
-        Front = glm::normalize(front);
+    UniformSlot* findUniform(unsigned int hash) {
+        if (uniformLookup.empty()) return nullptr;
+        size_t mask = uniformLookup.size() - 1;
+        for (size_t bucket = hash & mask; uniformLookup[bucket] != -1; bucket = (bucket + 1) & mask) {
+            const UniformName& entry = uniformNames[uniformLookup[bucket]];
+            if (entry.hash == hash) return &uniforms[entry.slot];
+        }
+        return nullptr;
+    }
+
+    // Compare against the cached value, update the cache and count the upload or the skip
+    bool valueChanged(UniformSlot& slot, const void* value, size_t size) {
+        if (slot.hasValue && std::memcmp(slot.value, value, size) == 0) {
+            frameStats.uniformUploadsSkipped++;
+            return false;
+        }
+        std::memcpy(slot.value, value, size);
+        slot.hasValue = true;
+        frameStats.uniformUploads++;
+        return true;
+    }
+};
+
+// Compile-time handles for the uniforms set on every draw
+constexpr UniformHandle<glm::mat4> U_MODEL("model");
+constexpr UniformHandle<glm::vec2> U_TEXTURE_SCALE("textureScale");
+constexpr UniformHandle<float> U_TEXTURE_ROTATION("textureRotation");
+constexpr UniformHandle<glm::vec3> U_OBJECT_COLOR("objectColor");
+constexpr UniformHandle<glm::mat4> U_INVERSE_VIEW("inverseView");
+constexpr UniformHandle<glm::vec3> U_AREA_LIGHT_POSITION("areaLightPosition");
+constexpr UniformHandle<float> U_AREA_LIGHT_RADIUS("areaLightRadius");
+constexpr UniformHandle<glm::vec3> U_AREA_LIGHT_COLOR("areaLightColor");
+constexpr UniformHandle<int> U_AREA_LIGHT_SHADOW_SLOT("areaLightShadowSlot");
+constexpr UniformHandle<glm::mat4> U_LIGHT_VIEW_PROJECTION("lightViewProjection");
+constexpr UniformHandle<glm::vec2> U_LOD_DITHER_RANGE("lodDitherRange");
+constexpr UniformHandle<glm::vec2> U_RENDER_SCALE("renderScale");
+constexpr UniformHandle<float> U_SHARPNESS("sharpness");
+constexpr UniformHandle<int> U_MATERIAL_ID("materialID");
+constexpr UniformHandle<float> U_FEEDBACK_LOD_BIAS("feedbackLodBias");
+
+// Feature bits selecting a specialised variant of shader.vs/shader.fs
+const unsigned int FEATURE_TEXTURE = 1 << 0;         // Diffuse color from a texture instead of objectColor
+const unsigned int FEATURE_MODEL_TEXTURE = 1 << 1;   // Diffuse texture is texture_diffuse1 (models)
+const unsigned int FEATURE_NORMAL_MAP = 1 << 2;
+const unsigned int FEATURE_ROUGHNESS_MAP = 1 << 3;
+const unsigned int FEATURE_FLASHLIGHT = 1 << 4;
+const unsigned int FEATURE_AREA_LIGHTS = 1 << 5;
+const unsigned int FEATURE_STENCIL_ONLY = 1 << 6;    // Deferred light volume stencil pass, no shading
+const unsigned int FEATURE_LIGHT_GRID = 1 << 7;      // Area lights come from the map cell light grid, not clusters
+const unsigned int FEATURE_LIGHTMAP = 1 << 8;        // Global and static area light of walls, floor and ceiling is baked
+const unsigned int FEATURE_AREA_SHADOWS = 1 << 9;    // Area lights with a shadow slot sample their cube shadow map
+const unsigned int FEATURE_GRID_SHADOWS = 1 << 10;   // Area lights and the global light are shadowed by a grid ray march
+const unsigned int FEATURE_IRRADIANCE_VOLUME = 1 << 11;  // Global and area light diffuse comes from the irradiance volume (models)
+const unsigned int FEATURE_PARALLAX_MAP = 1 << 12;   // Parallax occlusion mapping from heightMap
+const unsigned int FEATURE_NO_SPECULAR = 1 << 13;    // Diffuse only, far shading LODs
+const unsigned int FEATURE_VERTEX_LIT = 1 << 14;     // Ambient and diffuse lit per vertex from the irradiance volume, far shading LOD
+const unsigned int FEATURE_LOD_DITHER = 1 << 15;     // Only the pixels of lodDitherRange in an ordered dither pattern are drawn
+const unsigned int FEATURE_MATERIAL_MAP = 1 << 16;   // roughnessMap and heightMap are one packed material map
+const unsigned int FRAME_FEATURES = FEATURE_FLASHLIGHT | FEATURE_AREA_LIGHTS | FEATURE_LIGHT_GRID | FEATURE_LIGHTMAP |
+                                    FEATURE_AREA_SHADOWS | FEATURE_GRID_SHADOWS | FEATURE_IRRADIANCE_VOLUME;  // Decided once per frame, not per material
+
+// #define name for each feature bit, in bit order
+const char* const SHADER_FEATURE_DEFINES[] = {
+    "USE_TEXTURE",
+    "MODEL_TEXTURE",
+    "USE_NORMAL_MAP",
+    "USE_ROUGHNESS_MAP",
+    "FLASHLIGHT",
+    "AREA_LIGHTS",
+    "STENCIL_ONLY",
+    "LIGHT_GRID",
+    "LIGHTMAP",
+    "AREA_SHADOWS",
+    "GRID_SHADOWS",
+    "IRRADIANCE_VOLUME",
+    "PARALLAX_MAP",
+    "NO_SPECULAR",
+    "VERTEX_LIT",
+    "LOD_DITHER",
+    "MATERIAL_MAP",
+};
+const int NUM_SHADER_FEATURES = sizeof(SHADER_FEATURE_DEFINES) / sizeof(SHADER_FEATURE_DEFINES[0]);
+
+// Features of a model lit by the irradiance volume, which replaces the area light loop and its shadow maps
+unsigned int irradianceVolumeFeatures(unsigned int features) {
+    return (features & ~(FEATURE_AREA_LIGHTS | FEATURE_LIGHT_GRID | FEATURE_AREA_SHADOWS)) | FEATURE_IRRADIANCE_VOLUME;
+}
+
+// Features of a wall, floor or ceiling drawn at a shading LOD, each level drops more of the per-pixel work
+unsigned int shadingLodFeatures(unsigned int features, int lod) {
+    if (lod >= 1) features &= ~(FEATURE_NORMAL_MAP | FEATURE_PARALLAX_MAP);
+    if (lod >= 2) features |= FEATURE_NO_SPECULAR;
+    if (lod >= 3) {
+        features &= ~(FEATURE_ROUGHNESS_MAP | FEATURE_MATERIAL_MAP | FEATURE_AREA_LIGHTS | FEATURE_LIGHT_GRID | FEATURE_LIGHTMAP |
+                      FEATURE_AREA_SHADOWS | FEATURE_GRID_SHADOWS);
+        features |= FEATURE_VERTEX_LIT;
+    }
+    return features;
+}
+
+// Specialised shader programs compiled from one source, cached by feature bits
+class ShaderPermutations {
+public:
+    ShaderPermutations(const char* vertexPath, const char* fragmentPath) {
+        vertexCode = readFile(vertexPath);
+        fragmentCode = readFile(fragmentPath);
+    }
+
+    // Texture unit a sampler is set to in every variant, used before the variants are built
+    void setSamplerUnit(const std::string& name, int unit) {
+        samplerUnits.push_back({name, unit});
+    }
+
+    // Get the variant for a feature set, compiling it if it has not been built yet
+    Shader& get(unsigned int features) {
+        auto it = variants.find(features);
+        Shader* shader = it != variants.end() ? it->second.get() : start(features);
+        if (!shader->isReady()) {
+            shader->finish();
+
+            // Sampler units never change, set them once per program
+            glUseProgram(shader->ID);
+            for (const auto& sampler : samplerUnits) {
+                shader->setInt(sampler.first, sampler.second);
+            }
+            glUseProgram(Shader::boundProgram);
+        }
+        return *shader;
+    }
+
+    // Bind the variant for a feature set, skipping glUseProgram if it is already bound
+    Shader& use(unsigned int features) {
+        Shader& shader = get(features);
+        if (shader.ID != Shader::boundProgram) {
+            shader.use();
+            frameStats.shaderBinds++;
+        }
+        return shader;
+    }
+
+    // Compile a list of variants up front so no compile happens while drawing.
+    // Every compile is issued before waiting on any, so drivers with parallel compile overlap them
+    void precompile(const std::set<unsigned int>& featureSets) {
+        double startTime = glfwGetTime();
+        for (unsigned int features : featureSets) {
+            if (variants.find(features) == variants.end()) start(features);
+        }
+        int cached = 0;
+        for (unsigned int features : featureSets) {
+            if (get(features).loadedFromBinaryCache()) cached++;
+        }
+        std::cout << "Prepared " << featureSets.size() << " shader variants (" << cached
+                  << " from binary cache) in " << (glfwGetTime() - startTime) * 1000.0 << " ms" << std::endl;
+    }
+
+    size_t size() const {
+        return variants.size();
+    }
+
+private:
+    std::string vertexCode;
+    std::string fragmentCode;
+    std::map<unsigned int, std::unique_ptr<Shader>> variants;
+    std::vector<std::pair<std::string, int>> samplerUnits = {
+        {"wallTexture", 0},
+        {"normalMap", 1},
+        {"roughnessMap", 2},
+        {"heightMap", 3},
+        {"lightData", LIGHT_DATA_TEXTURE_UNIT},
+        {"lightLists", LIGHT_LIST_TEXTURE_UNIT},
+        {"lightIndices", LIGHT_INDEX_TEXTURE_UNIT},
+        {"lightmap", LIGHTMAP_TEXTURE_UNIT},
+        {"lightmapFaces", LIGHTMAP_FACE_TEXTURE_UNIT},
+        {"areaShadowMaps", AREA_SHADOW_TEXTURE_UNIT},
+        {"occupancyMap", OCCUPANCY_TEXTURE_UNIT},
+        {"irradianceVolume", IRRADIANCE_TEXTURE_UNIT},
+    };
+
+    // Create the variant and start its compile without waiting for it
+    Shader* start(unsigned int features) {
+        std::string defines;
+        for (int bit = 0; bit < NUM_SHADER_FEATURES; bit++) {
+            if (features & (1u << bit)) {
+                defines += std::string("#define ") + SHADER_FEATURE_DEFINES[bit] + "\n";
+            }
+        }
+
+        Shader* shader = new Shader(vertexCode, fragmentCode, defines);
+        variants[features].reset(shader);
+        return shader;
+    }
+
+    static std::string readFile(const char* path) {
+        std::ifstream file(path);
+        if (!file.is_open()) {
+            std::cout << "ERROR::SHADER::FILE_NOT_SUCCESSFULLY_READ " << path << std::endl;
+            return "";
+        }
+        std::stringstream stream;
+        stream << file.rdbuf();
+        return stream.str();
+    }
+};
+
+// Camera class
+class Camera {
+public:
+    // Camera attributes
+    glm::vec3 Position;
+    glm::vec3 Front;
+    glm::vec3 Up;
+    glm::vec3 Right;
+    glm::vec3 WorldUp;
+
+    // Constructor
+    Camera(glm::vec3 position = glm::vec3(0.0f, 0.0f, 0.0f)) {
+        Position = position;
+        WorldUp = glm::vec3(0.0f, 1.0f, 0.0f);
+        updateCameraVectors();
+    }
+
+    // Returns the view matrix
+    glm::mat4 GetViewMatrix() {
+        return glm::lookAt(Position, Position + Front, Up);
+    }
+
+    // Updates the camera vectors based on the Euler angles
+    void updateCameraVectors() {
+        // Calculate the new Front vector
+        glm::vec3 front;
+        front.x = cos(glm::radians(yaw)) * cos(glm::radians(pitch));
+        front.y = sin(glm::radians(pitch));
+        front.z = sin(glm::radians(yaw)) * cos(glm::radians(pitch));
+        Front = glm::normalize(front);
 
         // Also re-calculate the Right and Up vector
         Right = glm::normalize(glm::cross(Front, WorldUp));
@@ -387,181 +1558,2380 @@ void loadFromFile(const std::string& filename) {
             return grid[gridZ][gridX] == 1;
         }
 
+    // True if the cell exists in the map file, rows may be shorter than the map width
+    bool isInside(int x, int z) const {
+        return x >= 0 && z >= 0 && z < height && x < static_cast<int>(grid[z].size());
+    }
+
 };
 
-// Model for rendering cubes (walls)
-class CubeModel {
-public:
-    unsigned int VAO, VBO;
+// Distance on the XZ plane from a point to a rectangle given in world units
+float distanceToRectXZ(const glm::vec3& point, float minX, float minZ, float maxX, float maxZ) {
+    float dx = std::max(std::max(minX - point.x, 0.0f), point.x - maxX);
+    float dz = std::max(std::max(minZ - point.z, 0.0f), point.z - maxZ);
+    return std::sqrt(dx * dx + dz * dz);
+}
 
-    CubeModel() {
-        // Vertex data for a cube with proper texture orientation for each face
-        // Format: position(3), normal(3), texcoord(2), tangent(3), bitangent(3)
-            float vertices[] = {
-                // Front face (negative Z) - Swap U coordinates (0.0f↔1.0f)
-                -0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,         1.0f, 0.0f, 0.0f,    0.0f, 1.0f, 0.0f,
-                 0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 1.0f,         1.0f, 0.0f, 0.0f,    0.0f, 1.0f, 0.0f,
-                 0.5f,  0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,         1.0f, 0.0f, 0.0f,    0.0f, 1.0f, 0.0f,
-                 0.5f,  0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,         1.0f, 0.0f, 0.0f,    0.0f, 1.0f, 0.0f,
-                -0.5f,  0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 0.0f,         1.0f, 0.0f, 0.0f,    0.0f, 1.0f, 0.0f,
-                -0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,         1.0f, 0.0f, 0.0f,    0.0f, 1.0f, 0.0f,
+// Check if a block of map cells lies completely beyond the draw distance
+bool isCellRangeBeyondDrawDistance(const glm::vec3& cameraPos, int minX, int minZ, int maxX, int maxZ) {
+    return distanceToRectXZ(cameraPos,
+                            minX * CELL_SIZE, minZ * CELL_SIZE,
+                            (maxX + 1) * CELL_SIZE, (maxZ + 1) * CELL_SIZE) > drawDistance;
+}
 
-                // Back face (positive Z) - Keep as is, already correct
-                -0.5f, -0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,        -1.0f, 0.0f, 0.0f,    0.0f, 1.0f, 0.0f,
-                 0.5f, -0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 1.0f,        -1.0f, 0.0f, 0.0f,    0.0f, 1.0f, 0.0f,
-                 0.5f,  0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,        -1.0f, 0.0f, 0.0f,    0.0f, 1.0f, 0.0f,
-                 0.5f,  0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,        -1.0f, 0.0f, 0.0f,    0.0f, 1.0f, 0.0f,
-                -0.5f,  0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 0.0f,        -1.0f, 0.0f, 0.0f,    0.0f, 1.0f, 0.0f,
-                -0.5f, -0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,        -1.0f, 0.0f, 0.0f,    0.0f, 1.0f, 0.0f,
+// Check if a bounding sphere lies completely beyond the draw distance
+bool isSphereBeyondDrawDistance(const glm::vec3& cameraPos, const glm::vec3& center, float radius) {
+    return glm::length(center - cameraPos) - radius > drawDistance;
+}
 
-                // Left face (negative X) - Swap U coordinates (0.0f↔1.0f)
-                -0.5f,  0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  1.0f, 0.0f,         0.0f, 0.0f, -1.0f,   0.0f, 1.0f, 0.0f,
-                -0.5f,  0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 0.0f,         0.0f, 0.0f, -1.0f,   0.0f, 1.0f, 0.0f,
-                -0.5f, -0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 1.0f,         0.0f, 0.0f, -1.0f,   0.0f, 1.0f, 0.0f,
-                -0.5f, -0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 1.0f,         0.0f, 0.0f, -1.0f,   0.0f, 1.0f, 0.0f,
-                -0.5f, -0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  1.0f, 1.0f,         0.0f, 0.0f, -1.0f,   0.0f, 1.0f, 0.0f,
-                -0.5f,  0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  1.0f, 0.0f,         0.0f, 0.0f, -1.0f,   0.0f, 1.0f, 0.0f,
+// Walk the cells crossed by a segment on the XZ plane (grid DDA), false if one of them is a wall.
+// The cells holding the two end points are not checked
+bool isSegmentClearXZ(const Map& map, float startX, float startZ, float endX, float endZ) {
+    int x = static_cast<int>(std::floor(startX / CELL_SIZE));
+    int z = static_cast<int>(std::floor(startZ / CELL_SIZE));
+    int lastX = static_cast<int>(std::floor(endX / CELL_SIZE));
+    int lastZ = static_cast<int>(std::floor(endZ / CELL_SIZE));
+
+    float dx = endX - startX;
+    float dz = endZ - startZ;
+    int stepX = dx > 0.0f ? 1 : -1;
+    int stepZ = dz > 0.0f ? 1 : -1;
+
+    // Segment parameter of the next X and Z cell border, and between borders
+    const float NEVER = 1e30f;
+    float tDeltaX = dx != 0.0f ? CELL_SIZE / std::fabs(dx) : NEVER;
+    float tDeltaZ = dz != 0.0f ? CELL_SIZE / std::fabs(dz) : NEVER;
+    float tMaxX = dx != 0.0f ? (stepX > 0 ? (x + 1) * CELL_SIZE - startX : startX - x * CELL_SIZE) / std::fabs(dx) : NEVER;
+    float tMaxZ = dz != 0.0f ? (stepZ > 0 ? (z + 1) * CELL_SIZE - startZ : startZ - z * CELL_SIZE) / std::fabs(dz) : NEVER;
+
+    int steps = std::abs(lastX - x) + std::abs(lastZ - z);
+    for (int i = 0; i < steps; i++) {
+        if (tMaxX < tMaxZ) {
+            x += stepX;
+            tMaxX += tDeltaX;
+        } else {
+            z += stepZ;
+            tMaxZ += tDeltaZ;
+        }
+        if (x == lastX && z == lastZ) break;
+        if (x < 0 || x >= map.width || z < 0 || z >= map.height || map.grid[z][x] == 1) return false;
+    }
+    return true;
+}
 
-                // Right face (positive X) - Swap U coordinates (0.0f↔1.0f)
-                 0.5f,  0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 0.0f,         0.0f, 0.0f, 1.0f,    0.0f, 1.0f, 0.0f,
-                 0.5f,  0.5f, -0.5f,  1.0f,  0.0f,  0.0f,  1.0f, 0.0f,         0.0f, 0.0f, 1.0f,    0.0f, 1.0f, 0.0f,
-                 0.5f, -0.5f, -0.5f,  1.0f,  0.0f,  0.0f,  1.0f, 1.0f,         0.0f, 0.0f, 1.0f,    0.0f, 1.0f, 0.0f,
-                 0.5f, -0.5f, -0.5f,  1.0f,  0.0f,  0.0f,  1.0f, 1.0f,         0.0f, 0.0f, 1.0f,    0.0f, 1.0f, 0.0f,
-                 0.5f, -0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 1.0f,         0.0f, 0.0f, 1.0f,    0.0f, 1.0f, 0.0f,
-                 0.5f,  0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 0.0f,         0.0f, 0.0f, 1.0f,    0.0f, 1.0f, 0.0f,
+// Global light of the frame data, also baked into the lightmap
+glm::vec3 globalLightPosition(const Map& map) {
+    return glm::vec3(map.width * 0.4f, 4.0f, map.height * 0.5f);
+}
+const glm::vec3 GLOBAL_LIGHT_COLOR(1.0f, 1.0f, 1.0f);
 
-                // Bottom face (negative Y) - Swap U coordinates (0.0f↔1.0f)
-                -0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 1.0f,         1.0f, 0.0f, 0.0f,    0.0f, 0.0f, -1.0f,
-                 0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,         1.0f, 0.0f, 0.0f,    0.0f, 0.0f, -1.0f,
-                 0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 0.0f,         1.0f, 0.0f, 0.0f,    0.0f, 0.0f, -1.0f,
-                 0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 0.0f,         1.0f, 0.0f, 0.0f,    0.0f, 0.0f, -1.0f,
-                -0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,         1.0f, 0.0f, 0.0f,    0.0f, 0.0f, -1.0f,
-                -0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 1.0f,         1.0f, 0.0f, 0.0f,    0.0f, 0.0f, -1.0f,
+// Image files under the asset directories, scanned once at startup so texture lookups never probe the disk
+class AssetIndex {
+public:
+    struct Entry {
+        std::string path;    // As passed to stbi_load
+        std::string format;  // Lower case extension without the dot
+    };
+
+    // Add every image file below a directory
+    void scan(const std::string& directory) {
+        std::error_code error;
+        for (std::filesystem::recursive_directory_iterator it(directory, error), end; !error && it != end; it.increment(error)) {
+            if (!it->is_regular_file(error)) continue;
+            std::string format = it->path().extension().string();
+            if (format.empty()) continue;
+            format = format.substr(1);
+            std::transform(format.begin(), format.end(), format.begin(), [](unsigned char c) { return std::tolower(c); });
+            if (std::find(std::begin(IMAGE_FORMATS), std::end(IMAGE_FORMATS), format) == std::end(IMAGE_FORMATS)) continue;
+
+            std::string path = it->path().generic_string();
+            entries[key(path)] = {path, format};
+        }
+    }
 
-                // Top face (positive Y) - Swap U coordinates (0.0f↔1.0f)
-                -0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,         1.0f, 0.0f, 0.0f,    0.0f, 0.0f, 1.0f,
-                 0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 0.0f,         1.0f, 0.0f, 0.0f,    0.0f, 0.0f, 1.0f,
-                 0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f,         1.0f, 0.0f, 0.0f,    0.0f, 0.0f, 1.0f,
-                 0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f,         1.0f, 0.0f, 0.0f,    0.0f, 0.0f, 1.0f,
-                -0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 1.0f,         1.0f, 0.0f, 0.0f,    0.0f, 0.0f, 1.0f,
-                -0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,         1.0f, 0.0f, 0.0f,    0.0f, 0.0f, 1.0f
-            };
+    // Image at this path, null if there is none
+    const Entry* find(const std::string& path) const {
+        auto it = entries.find(key(path));
+        return it != entries.end() ? &it->second : nullptr;
+    }
 
-        // Generate and bind the Vertex Array Object
-        glGenVertexArrays(1, &VAO);
-        glGenBuffers(1, &VBO);
+    // Image for a path without extension, trying the extensions the textures use in order of preference
+    const Entry* findImage(const std::string& basePath) const {
+        for (const char* ext : {".png", ".jpg", ".jpeg"}) {
+            if (const Entry* entry = find(basePath + ext)) return entry;
+        }
+        return nullptr;
+    }
 
-        glBindVertexArray(VAO);
+    size_t size() const {
+        return entries.size();
+    }
 
-        glBindBuffer(GL_ARRAY_BUFFER, VBO);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+    // Every image found, in no particular order
+    std::vector<Entry> images() const {
+        std::vector<Entry> images;
+        for (const auto& entry : entries) images.push_back(entry.second);
+        return images;
+    }
 
-        // Position attribute
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 14 * sizeof(float), (void*)0);
-        glEnableVertexAttribArray(0);
+private:
+    static constexpr const char* IMAGE_FORMATS[] = {"png", "jpg", "jpeg", "tga", "bmp"};
 
-        // Normal attribute
-        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 14 * sizeof(float), (void*)(3 * sizeof(float)));
-        glEnableVertexAttribArray(1);
+    std::unordered_map<std::string, Entry> entries;  // By key()
 
-        // Texture coordinates attribute
-        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 14 * sizeof(float), (void*)(6 * sizeof(float)));
-        glEnableVertexAttribArray(2);
+    // Normalized path with a lower case extension, so "a/./b.JPG" and "a/b.jpg" are the same file
+    static std::string key(const std::string& path) {
+        std::string normalized = std::filesystem::path(path).lexically_normal().generic_string();
+        size_t dot = normalized.find_last_of('.');
+        if (dot != std::string::npos && normalized.find('/', dot) == std::string::npos) {
+            std::transform(normalized.begin() + dot, normalized.end(), normalized.begin() + dot,
+                           [](unsigned char c) { return std::tolower(c); });
+        }
+        return normalized;
+    }
+};
 
-        // Tangent attribute
-        glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, 14 * sizeof(float), (void*)(8 * sizeof(float)));
-        glEnableVertexAttribArray(3);
+AssetIndex assetIndex;
 
-        // Bitangent attribute
-        glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, 14 * sizeof(float), (void*)(11 * sizeof(float)));
-        glEnableVertexAttribArray(4);
-    }
+// Walls with an object_<id> texture are drawn half height, the same lookup TextureManager::loadTexture does
+bool isObjectTextureFile(int textureID) {
+    return assetIndex.findImage("textures/object_" + std::to_string(textureID)) != nullptr;
+}
 
-    void render() {
-        glBindVertexArray(VAO);
-        glDrawArrays(GL_TRIANGLES, 0, 36);
+// Drawn wall height of every cell (x + z * width): 0 for open cells, -1 for cells missing from the map file
+std::vector<float> mapWallHeights(const Map& map) {
+    std::vector<float> heights(map.width * map.height, -1.0f);
+    for (int z = 0; z < map.height; z++) {
+        for (int x = 0; x < map.width; x++) {
+            if (!map.isInside(x, z)) continue;
+            if (map.grid[z][x] == 0) {
+                heights[x + z * map.width] = 0.0f;
+            } else {
+                heights[x + z * map.width] = isObjectTextureFile(map.getTextureID(x, z)) ? 2.0f : WALL_HEIGHT;
+            }
+        }
     }
+    return heights;
+}
 
-    ~CubeModel() {
-        glDeleteVertexArrays(1, &VAO);
-        glDeleteBuffers(1, &VBO);
+// The lightmap of a map is written next to it: map.txt -> map.lightmap
+std::string lightmapPathFor(const std::string& mapFile) {
+    return std::filesystem::path(mapFile).replace_extension(".lightmap").string();
+}
+
+// Hash (FNV-1a) of everything the baked light depends on, a lightmap baked from other inputs is stale
+uint64_t lightmapInputHash(const Map& map, const std::vector<float>& wallHeights, const std::vector<AreaLight>& lights) {
+    uint64_t hash = 14695981039346656037ull;
+    auto add = [&hash](const void* data, size_t size) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; i++) {
+            hash ^= bytes[i];
+            hash *= 1099511628211ull;
+        }
+    };
+
+    int settings[4] = {LIGHTMAP_TILE_SIZE, LIGHTMAP_BOUNCE_RAYS, map.width, map.height};
+    add(settings, sizeof(settings));
+    add(&LIGHTMAP_BOUNCE_ALBEDO, sizeof(LIGHTMAP_BOUNCE_ALBEDO));
+    add(wallHeights.data(), wallHeights.size() * sizeof(float));
+    glm::vec3 globalLight[2] = {globalLightPosition(map), GLOBAL_LIGHT_COLOR};
+    add(globalLight, sizeof(globalLight));
+    for (const AreaLight& light : lights) {
+        if (!light.active || light.dynamic) continue;
+        float values[8] = {light.position.x, light.position.y, light.position.z,
+                           light.color.x, light.color.y, light.color.z, light.intensity, light.radius};
+        add(values, sizeof(values));
     }
-};
-// Vertex structure for 3D models
-struct Vertex {
-    glm::vec3 Position;
-    glm::vec3 Normal;
-    glm::vec2 TexCoords;
-};
+    return hash;
+}
 
-// Texture structure for model textures
-struct Texture {
-    unsigned int id;
-    std::string type;
-    std::string path;
+// Tile slots of an open cell in the lightmap face table, the order must match sampleLightmap() in shader.fs
+enum LightmapFace {
+    LIGHTMAP_FLOOR,
+    LIGHTMAP_CEILING,
+    LIGHTMAP_WALL_NEG_X,  // Face of the wall cell at x - 1
+    LIGHTMAP_WALL_POS_X,  // Face of the wall cell at x + 1
+    LIGHTMAP_WALL_NEG_Z,
+    LIGHTMAP_WALL_POS_Z,
 };
 
-// Mesh class to handle individual meshes in a model
-class Mesh {
+// Header of a .lightmap file, followed by the face table (int32 tile per cell and face, -1 for none)
+// and the RGB32F texels of the atlas row by row
+struct LightmapHeader {
+    char magic[4];
+    int32_t version;
+    int32_t tileSize;
+    int32_t width;        // Map size in cells
+    int32_t height;
+    int32_t tilesPerRow;  // Atlas layout
+    int32_t tileCount;
+    uint64_t inputHash;   // lightmapInputHash() of the bake
+};
+const char LIGHTMAP_MAGIC[4] = {'G', 'W', 'L', 'M'};
+const int32_t LIGHTMAP_VERSION = 1;
+
+// Area lights assigned to map cells: a cell lists the lights whose radius reaches it and that can see
+// it past the walls. Rebuilt only when the lights change, the fragment shader looks up its cell by
+// world XZ, so lights never bleed through walls and static lights cost nothing per frame.
+//   lightData    RGBA32F, 2 texels per light: position.xyz + radius, color * intensity + flags
+//   cellLists    RG32UI, 1 texel per cell (x + z * width): offset and count in the index list
+//   cellIndices  R32UI, light indices of every cell back to back
+class LightGrid {
 public:
-    // Mesh Data
-    std::vector<Vertex> vertices;
-    std::vector<unsigned int> indices;
-    std::vector<Texture> textures;
+    LightGrid(ThreadPool& threadPool)
+        : threadPool(threadPool),
+          lightData(GL_RGBA32F, sizeof(glm::vec4)),
+          cellLists(GL_RG32UI, 2 * sizeof(unsigned int)),
+          cellIndices(GL_R32UI, sizeof(unsigned int)) {
+    }
 
-    // Constructor
-    Mesh(std::vector<Vertex> vertices, std::vector<unsigned int> indices, std::vector<Texture> textures) {
-        this->vertices = vertices;
-        this->indices = indices;
-        this->textures = textures;
+    // Rebuild the cell lists if the lights or the map size changed since the last build
+    void update(const Map& map, const std::vector<AreaLight>& lights) {
+        if (built && map.width == builtWidth && map.height == builtHeight && sameLights(lights, builtLights)) {
+            // Shadow slots only change the light data, the cell lists stay valid
+            if (!sameShadowSlots(lights, builtLights)) {
+                builtLights = lights;
+                uploadLightData(lights);
+            }
+            return;
+        }
 
-        // Now set up mesh and buffer objects
-        setupMesh();
-    }
+        double startTime = glfwGetTime();
+        built = true;
+        builtWidth = map.width;
+        builtHeight = map.height;
+        builtLights = lights;
 
-    // Render the mesh
-    void Draw(Shader &shader) {
-        // Bind appropriate textures
-        unsigned int diffuseNr = 1;
-        unsigned int specularNr = 1;
-        unsigned int normalNr = 1;
-        unsigned int heightNr = 1;
+        std::vector<const AreaLight*> activeLights;
+        for (const AreaLight& light : lights) {
+            if (light.active) activeLights.push_back(&light);
+        }
 
-        for(unsigned int i = 0; i < textures.size(); i++) {
-            glActiveTexture(GL_TEXTURE0 + i); // Active proper texture unit before binding
-            // Retrieve texture number (the N in diffuse_textureN)
-            std::string number;
-            std::string name = textures[i].type;
-            if(name == "texture_diffuse")
-                number = std::to_string(diffuseNr++);
-            else if(name == "texture_specular")
-                number = std::to_string(specularNr++);
-            else if(name == "texture_normal")
-                number = std::to_string(normalNr++);
-            else if(name == "texture_height")
-                number = std::to_string(heightNr++);
+        // Each job fills one row of cells, lights are visited in order so lists are stable
+        std::vector<std::vector<unsigned int>> cellLights(map.width * map.height);
+        threadPool.parallelFor(map.height, [&](int z) {
+            for (unsigned int index = 0; index < activeLights.size(); index++) {
+                const AreaLight& light = *activeLights[index];
+                if (std::fabs((z + 0.5f) * CELL_SIZE - light.position.z) > light.radius + CELL_SIZE) continue;
+
+                int minX = std::max(0, static_cast<int>(std::floor((light.position.x - light.radius) / CELL_SIZE)));
+                int maxX = std::min(map.width - 1, static_cast<int>(std::floor((light.position.x + light.radius) / CELL_SIZE)));
+                for (int x = minX; x <= maxX; x++) {
+                    if (map.grid[z][x] == 1) continue;  // Wall faces look up the open cell in front of them
+                    if (distanceToRectXZ(light.position, x * CELL_SIZE, z * CELL_SIZE, (x + 1) * CELL_SIZE, (z + 1) * CELL_SIZE) >= light.radius) continue;
+                    if (isCellLit(map, light.position, x, z)) cellLights[x + z * map.width].push_back(index);
+                }
+            }
+        });
 
-            // Set the sampler to the correct texture unit
-            shader.setInt((name + number).c_str(), i);
-            // Bind the texture
-            glBindTexture(GL_TEXTURE_2D, textures[i].id);
+        // Flatten the per-cell lists into the list and index buffers
+        std::vector<unsigned int> lists(cellLights.size() * 2);
+        std::vector<unsigned int> indices;
+        for (size_t cell = 0; cell < cellLights.size(); cell++) {
+            lists[cell * 2] = static_cast<unsigned int>(indices.size());
+            lists[cell * 2 + 1] = static_cast<unsigned int>(cellLights[cell].size());
+            indices.insert(indices.end(), cellLights[cell].begin(), cellLights[cell].end());
         }
 
-        // Draw mesh
-        glBindVertexArray(VAO);
-        glDrawElements(GL_TRIANGLES, static_cast<unsigned int>(indices.size()), GL_UNSIGNED_INT, 0);
-        glBindVertexArray(0);
+        uploadLightData(lights);
+        cellLists.update(lists.data(), cellLights.size());
+        cellIndices.update(indices.data(), indices.size());
+        lightCount = static_cast<unsigned int>(activeLights.size());
+        indexCount = static_cast<unsigned int>(indices.size());
 
-        // Reset to default texture unit
-        glActiveTexture(GL_TEXTURE0);
+        std::cout << "Light grid built: " << lightCount << " lights, " << indexCount << " cell entries in "
+                  << (glfwGetTime() - startTime) * 1000.0 << " ms" << std::endl;
     }
 
-private:
-    // Render data
-    unsigned int VAO, VBO, EBO;
+    // Bind the light buffers to the same texture units as the clustered lights
+    void bind() {
+        lightData.bind(LIGHT_DATA_TEXTURE_UNIT);
+        cellLists.bind(LIGHT_LIST_TEXTURE_UNIT);
+        cellIndices.bind(LIGHT_INDEX_TEXTURE_UNIT);
+    }
 
-    // Initializes all the buffer objects/arrays
-    void setupMesh() {
+    unsigned int lights() const {
+        return lightCount;
+    }
+
+    unsigned int entries() const {
+        return indexCount;
+    }
+
+private:
+    ThreadPool& threadPool;
+    TextureBuffer lightData;
+    TextureBuffer cellLists;
+    TextureBuffer cellIndices;
+
+    bool built = false;
+    int builtWidth = 0;
+    int builtHeight = 0;
+    std::vector<AreaLight> builtLights;
+    unsigned int lightCount = 0;
+    unsigned int indexCount = 0;
+
+    // A cell is lit if the light sees its center or any of its (slightly inset) corners
+    static bool isCellLit(const Map& map, const glm::vec3& lightPos, int x, int z) {
+        const float INSET = 0.05f * CELL_SIZE;
+        const float points[5][2] = {
+            {0.5f * CELL_SIZE, 0.5f * CELL_SIZE},
+            {INSET, INSET},
+            {CELL_SIZE - INSET, INSET},
+            {INSET, CELL_SIZE - INSET},
+            {CELL_SIZE - INSET, CELL_SIZE - INSET},
+        };
+        for (const auto& point : points) {
+            if (isSegmentClearXZ(map, lightPos.x, lightPos.z, x * CELL_SIZE + point[0], z * CELL_SIZE + point[1])) return true;
+        }
+        return false;
+    }
+
+    // Active lights in list order, the order the cell lists index them in
+    void uploadLightData(const std::vector<AreaLight>& lights) {
+        std::vector<glm::vec4> gpuLights;
+        for (const AreaLight& light : lights) {
+            if (!light.active) continue;
+            gpuLights.push_back(glm::vec4(light.position, light.radius));
+            gpuLights.push_back(glm::vec4(light.color * light.intensity, lightDataFlags(light)));
+        }
+        lightData.update(gpuLights.data(), gpuLights.size());
+    }
+
+    static bool sameShadowSlots(const std::vector<AreaLight>& a, const std::vector<AreaLight>& b) {
+        for (size_t i = 0; i < a.size(); i++) {
+            if (a[i].shadowSlot != b[i].shadowSlot) return false;
+        }
+        return true;
+    }
+
+    static bool sameLights(const std::vector<AreaLight>& a, const std::vector<AreaLight>& b) {
+        if (a.size() != b.size()) return false;
+        for (size_t i = 0; i < a.size(); i++) {
+            if (a[i].position != b[i].position || a[i].color != b[i].color || a[i].intensity != b[i].intensity ||
+                a[i].radius != b[i].radius || a[i].active != b[i].active || a[i].dynamic != b[i].dynamic) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// Bakes the global light and the static area lights on the walls, floor and ceiling into a lightmap
+// atlas (--bake). Every face an open cell can see gets a tile. Direct light is found with shadow rays
+// walked through the map grid, one bounce is gathered with hemisphere rays and denoised per tile.
+// Tiles are baked on the thread pool, the light terms of four area lights are evaluated at a time
+class LightmapBaker {
+public:
+    LightmapBaker(const Map& map, const std::vector<AreaLight>& lights, ThreadPool& threadPool)
+        : map(map),
+          threadPool(threadPool),
+          wallHeights(mapWallHeights(map)),
+          inputHash(lightmapInputHash(map, wallHeights, lights)),
+          globalLight(globalLightPosition(map)) {
+        // Static lights as arrays of each component, padded to a multiple of 4 with lights that reach nothing
+        for (const AreaLight& light : lights) {
+            if (!light.active || light.dynamic) continue;
+            addLight(light.position, light.color * light.intensity, light.radius);
+        }
+        while (lightX.size() % 4 != 0) {
+            addLight(glm::vec3(0.0f), glm::vec3(0.0f), 0.0f);
+        }
+    }
+
+    bool bake(const std::string& path) {
+        auto startTime = std::chrono::steady_clock::now();
+        layoutTiles();
+        if (tiles.empty()) {
+            std::cerr << "Lightmap bake failed: the map has no open cells" << std::endl;
+            return false;
+        }
+
+        std::cout << "Baking " << tiles.size() << " faces with " << lightColor.size() << " area light slots on "
+                  << threadPool.size() + 1 << " threads" << std::endl;
+        direct.assign(tiles.size() * TEXELS, glm::vec3(0.0f));
+        indirect.assign(tiles.size() * TEXELS, glm::vec3(0.0f));
+        lit.assign(tiles.size() * TEXELS, glm::vec3(0.0f));
+
+        // The bounce reads the direct light of every tile, so each pass finishes before the next starts
+        threadPool.parallelFor(static_cast<int>(tiles.size()), [this](int tile) { bakeDirect(tile); });
+        threadPool.parallelFor(static_cast<int>(tiles.size()), [this](int tile) { gatherBounce(tile); });
+        threadPool.parallelFor(static_cast<int>(tiles.size()), [this](int tile) { denoise(tile); });
+
+        if (!save(path)) return false;
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+        std::cout << "Lightmap saved to " << path << " in " << seconds << " s" << std::endl;
+        return true;
+    }
+
+private:
+    static const int TEXELS = LIGHTMAP_TILE_SIZE * LIGHTMAP_TILE_SIZE;
+
+    // Top of the floor slab and bottom of the ceiling slab, both are cubes 0.1 thick
+    static constexpr float FLOOR_Y = 0.05f;
+    static inline const float CEILING_Y = WALL_HEIGHT - 0.05f;
+    static constexpr float SURFACE_OFFSET = 0.01f;        // Rays start this far in front of their surface
+    static inline const float MAX_BOUNCE_DISTANCE = 16.0f * CELL_SIZE;
+
+    struct Tile {
+        int cellX;
+        int cellZ;
+        int face;           // LightmapFace
+        float wallHeight;   // Wall faces only, texels above it are not on the wall
+    };
+
+    // Cells along a ray on the XZ plane (grid DDA) with the ray parameter each one is entered at
+    struct GridWalk {
+        int x, z;
+        int stepX, stepZ;
+        float tMaxX, tMaxZ;
+        float tDeltaX, tDeltaZ;
+        float tEnter = 0.0f;
+        int enteredFace = -1;  // Face of the previous cell the ray left it through
+
+        GridWalk(const glm::vec3& origin, const glm::vec3& dir) {
+            const float NEVER = 1e30f;
+            x = static_cast<int>(std::floor(origin.x / CELL_SIZE));
+            z = static_cast<int>(std::floor(origin.z / CELL_SIZE));
+            stepX = dir.x > 0.0f ? 1 : -1;
+            stepZ = dir.z > 0.0f ? 1 : -1;
+            tDeltaX = dir.x != 0.0f ? CELL_SIZE / std::fabs(dir.x) : NEVER;
+            tDeltaZ = dir.z != 0.0f ? CELL_SIZE / std::fabs(dir.z) : NEVER;
+            tMaxX = dir.x != 0.0f ? (stepX > 0 ? (x + 1) * CELL_SIZE - origin.x : origin.x - x * CELL_SIZE) / std::fabs(dir.x) : NEVER;
+            tMaxZ = dir.z != 0.0f ? (stepZ > 0 ? (z + 1) * CELL_SIZE - origin.z : origin.z - z * CELL_SIZE) / std::fabs(dir.z) : NEVER;
+        }
+
+        float tExit() const {
+            return std::min(tMaxX, tMaxZ);
+        }
+
+        void step() {
+            if (tMaxX < tMaxZ) {
+                x += stepX;
+                tEnter = tMaxX;
+                tMaxX += tDeltaX;
+                enteredFace = stepX > 0 ? LIGHTMAP_WALL_POS_X : LIGHTMAP_WALL_NEG_X;
+            } else {
+                z += stepZ;
+                tEnter = tMaxZ;
+                tMaxZ += tDeltaZ;
+                enteredFace = stepZ > 0 ? LIGHTMAP_WALL_POS_Z : LIGHTMAP_WALL_NEG_Z;
+            }
+        }
+    };
+
+    const Map& map;
+    ThreadPool& threadPool;
+    std::vector<float> wallHeights;
+    uint64_t inputHash;
+    glm::vec3 globalLight;
+    std::vector<float> lightX, lightY, lightZ, lightRadius;
+    std::vector<glm::vec3> lightColor;
+
+    std::vector<Tile> tiles;
+    std::vector<int32_t> faceTiles;  // Tile per cell and face, -1 for none
+    int tilesPerRow = 0;
+    std::vector<glm::vec3> direct;    // Per tile texel, TEXELS per tile
+    std::vector<glm::vec3> indirect;
+    std::vector<glm::vec3> lit;
+
+    void addLight(const glm::vec3& position, const glm::vec3& color, float radius) {
+        lightX.push_back(position.x);
+        lightY.push_back(position.y);
+        lightZ.push_back(position.z);
+        lightRadius.push_back(radius);
+        lightColor.push_back(color);
+    }
+
+    // Wall height of a cell, 0 if open, -1 outside the map
+    float heightAt(int x, int z) const {
+        if (x < 0 || z < 0 || x >= map.width || z >= map.height) return -1.0f;
+        return wallHeights[x + z * map.width];
+    }
+
+    int tileAt(int x, int z, int face) const {
+        if (x < 0 || z < 0 || x >= map.width || z >= map.height) return -1;
+        return faceTiles[(x + z * map.width) * LIGHTMAP_FACES_PER_CELL + face];
+    }
+
+    // A tile for the floor and ceiling of every open cell and for each wall face next to it
+    void layoutTiles() {
+        tiles.clear();
+        faceTiles.assign(map.width * map.height * LIGHTMAP_FACES_PER_CELL, -1);
+        const int neighbours[4][3] = {
+            {-1, 0, LIGHTMAP_WALL_NEG_X},
+            {1, 0, LIGHTMAP_WALL_POS_X},
+            {0, -1, LIGHTMAP_WALL_NEG_Z},
+            {0, 1, LIGHTMAP_WALL_POS_Z},
+        };
+        for (int z = 0; z < map.height; z++) {
+            for (int x = 0; x < map.width; x++) {
+                if (heightAt(x, z) != 0.0f) continue;
+                addTile(x, z, LIGHTMAP_FLOOR, 0.0f);
+                addTile(x, z, LIGHTMAP_CEILING, 0.0f);
+                for (const auto& neighbour : neighbours) {
+                    float height = heightAt(x + neighbour[0], z + neighbour[1]);
+                    if (height > 0.0f) addTile(x, z, neighbour[2], height);
+                }
+            }
+        }
+        tilesPerRow = static_cast<int>(std::ceil(std::sqrt(static_cast<float>(tiles.size()))));
+    }
+
+    void addTile(int x, int z, int face, float wallHeight) {
+        faceTiles[(x + z * map.width) * LIGHTMAP_FACES_PER_CELL + face] = static_cast<int32_t>(tiles.size());
+        tiles.push_back({x, z, face, wallHeight});
+    }
+
+    // World position and normal of a point on a tile, uv in [0,1]. Wall tiles span the full wall height
+    void tileSurface(const Tile& tile, const glm::vec2& uv, glm::vec3& position, glm::vec3& normal) const {
+        float x = tile.cellX * CELL_SIZE;
+        float z = tile.cellZ * CELL_SIZE;
+        switch (tile.face) {
+            case LIGHTMAP_FLOOR:
+                position = glm::vec3(x + uv.x * CELL_SIZE, FLOOR_Y, z + uv.y * CELL_SIZE);
+                normal = glm::vec3(0.0f, 1.0f, 0.0f);
+                break;
+            case LIGHTMAP_CEILING:
+                position = glm::vec3(x + uv.x * CELL_SIZE, CEILING_Y, z + uv.y * CELL_SIZE);
+                normal = glm::vec3(0.0f, -1.0f, 0.0f);
+                break;
+            case LIGHTMAP_WALL_NEG_X:
+                position = glm::vec3(x, uv.y * WALL_HEIGHT, z + uv.x * CELL_SIZE);
+                normal = glm::vec3(1.0f, 0.0f, 0.0f);
+                break;
+            case LIGHTMAP_WALL_POS_X:
+                position = glm::vec3(x + CELL_SIZE, uv.y * WALL_HEIGHT, z + uv.x * CELL_SIZE);
+                normal = glm::vec3(-1.0f, 0.0f, 0.0f);
+                break;
+            case LIGHTMAP_WALL_NEG_Z:
+                position = glm::vec3(x + uv.x * CELL_SIZE, uv.y * WALL_HEIGHT, z);
+                normal = glm::vec3(0.0f, 0.0f, 1.0f);
+                break;
+            default:
+                position = glm::vec3(x + uv.x * CELL_SIZE, uv.y * WALL_HEIGHT, z + CELL_SIZE);
+                normal = glm::vec3(0.0f, 0.0f, -1.0f);
+                break;
+        }
+    }
+
+    // Inverse of tileSurface() for a point on the tile
+    glm::vec2 tileUV(const Tile& tile, const glm::vec3& position) const {
+        float u = position.x / CELL_SIZE - tile.cellX;
+        float v = position.z / CELL_SIZE - tile.cellZ;
+        if (tile.face == LIGHTMAP_WALL_NEG_X || tile.face == LIGHTMAP_WALL_POS_X) {
+            return glm::vec2(v, position.y / WALL_HEIGHT);
+        }
+        if (tile.face == LIGHTMAP_WALL_NEG_Z || tile.face == LIGHTMAP_WALL_POS_Z) {
+            return glm::vec2(u, position.y / WALL_HEIGHT);
+        }
+        return glm::vec2(u, v);
+    }
+
+    static glm::vec2 texelUV(int texel) {
+        return glm::vec2((texel % LIGHTMAP_TILE_SIZE + 0.5f) / LIGHTMAP_TILE_SIZE,
+                         (texel / LIGHTMAP_TILE_SIZE + 0.5f) / LIGHTMAP_TILE_SIZE);
+    }
+
+    // Texels of half height walls above the wall top are not on any surface
+    bool isTexelOnSurface(const Tile& tile, int texel) const {
+        if (tile.face == LIGHTMAP_FLOOR || tile.face == LIGHTMAP_CEILING) return true;
+        return texelUV(texel).y * WALL_HEIGHT < tile.wallHeight;
+    }
+
+    // False if a wall column stands between the two points. The slabs are not checked, they can only
+    // hide the global light that sits inside the ceiling, and neither is the cell holding the end point
+    bool isVisible(const glm::vec3& from, const glm::vec3& to) const {
+        glm::vec3 dir = to - from;
+        float distance = glm::length(dir);
+        if (distance <= 0.0f) return true;
+        dir /= distance;
+
+        GridWalk walk(from, dir);
+        int lastX = static_cast<int>(std::floor(to.x / CELL_SIZE));
+        int lastZ = static_cast<int>(std::floor(to.z / CELL_SIZE));
+        while (walk.tExit() < distance) {
+            walk.step();
+            if (walk.x == lastX && walk.z == lastZ) return true;
+
+            float height = heightAt(walk.x, walk.z);
+            if (height < 0.0f) return false;
+            if (height > 0.0f) {
+                // Lowest point of the segment inside this cell's column
+                float yEnter = from.y + dir.y * walk.tEnter;
+                float yExit = from.y + dir.y * std::min(walk.tExit(), distance);
+                if (std::min(yEnter, yExit) < height) return false;
+            }
+        }
+        return true;
+    }
+
+    // First surface a ray hits: returns its tile (-1 for wall tops and the map edge) and position,
+    // or false if nothing is hit within maxDistance
+    bool trace(const glm::vec3& origin, const glm::vec3& dir, float maxDistance, int& hitTile, glm::vec3& hitPosition) const {
+        float tSlab = 1e30f;
+        int slabFace = -1;
+        if (dir.y < 0.0f) {
+            tSlab = (FLOOR_Y - origin.y) / dir.y;
+            slabFace = LIGHTMAP_FLOOR;
+        } else if (dir.y > 0.0f) {
+            tSlab = (CEILING_Y - origin.y) / dir.y;
+            slabFace = LIGHTMAP_CEILING;
+        }
+        float tEnd = std::min(tSlab, maxDistance);
+
+        GridWalk walk(origin, dir);
+        while (true) {
+            float height = heightAt(walk.x, walk.z);
+            float tLeave = std::min(walk.tExit(), tEnd);
+            if (height < 0.0f) {
+                hitTile = -1;
+                hitPosition = origin + dir * walk.tEnter;
+                return true;
+            }
+            if (height > 0.0f) {
+                // Side of the wall, seen from the open cell the ray came from
+                if (origin.y + dir.y * walk.tEnter < height) {
+                    int fromX = walk.x, fromZ = walk.z;
+                    if (walk.enteredFace == LIGHTMAP_WALL_POS_X) fromX--;
+                    if (walk.enteredFace == LIGHTMAP_WALL_NEG_X) fromX++;
+                    if (walk.enteredFace == LIGHTMAP_WALL_POS_Z) fromZ--;
+                    if (walk.enteredFace == LIGHTMAP_WALL_NEG_Z) fromZ++;
+                    hitTile = walk.enteredFace >= 0 ? tileAt(fromX, fromZ, walk.enteredFace) : -1;
+                    hitPosition = origin + dir * walk.tEnter;
+                    return true;
+                }
+                // Top of a half height wall
+                if (dir.y < 0.0f && origin.y + dir.y * tLeave < height) {
+                    hitTile = -1;
+                    hitPosition = origin + dir * ((height - origin.y) / dir.y);
+                    return true;
+                }
+            }
+            if (walk.tExit() >= tEnd) {
+                if (tSlab > maxDistance) return false;
+                hitTile = height == 0.0f ? tileAt(walk.x, walk.z, slabFace) : -1;
+                hitPosition = origin + dir * tSlab;
+                return true;
+            }
+            walk.step();
+        }
+    }
+
+    // Diffuse weight (n.l * falloff, 0 out of range) of area lights first..first+3, the shader.fs falloff
+    void areaLightWeights(size_t first, const glm::vec3& position, const glm::vec3& normal, float* weights) const {
+#ifdef LIGHTMAP_USE_SSE
+        __m128 dx = _mm_sub_ps(_mm_loadu_ps(&lightX[first]), _mm_set1_ps(position.x));
+        __m128 dy = _mm_sub_ps(_mm_loadu_ps(&lightY[first]), _mm_set1_ps(position.y));
+        __m128 dz = _mm_sub_ps(_mm_loadu_ps(&lightZ[first]), _mm_set1_ps(position.z));
+        __m128 radius = _mm_loadu_ps(&lightRadius[first]);
+        __m128 distance2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+        __m128 inRange = _mm_cmplt_ps(distance2, _mm_mul_ps(radius, radius));
+        __m128 distance = _mm_sqrt_ps(distance2);
+        __m128 nDotL = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(normal.x), dx), _mm_mul_ps(_mm_set1_ps(normal.y), dy)),
+                                  _mm_mul_ps(_mm_set1_ps(normal.z), dz));
+        nDotL = _mm_max_ps(_mm_div_ps(nDotL, distance), _mm_setzero_ps());  // 0/0 gives 0 here
+        __m128 falloff = _mm_sub_ps(_mm_set1_ps(1.0f), _mm_div_ps(distance, radius));
+        _mm_storeu_ps(weights, _mm_and_ps(_mm_mul_ps(nDotL, falloff), inRange));
+#else
+        for (size_t i = 0; i < 4; i++) {
+            glm::vec3 toLight = glm::vec3(lightX[first + i], lightY[first + i], lightZ[first + i]) - position;
+            float distance = glm::length(toLight);
+            float radius = lightRadius[first + i];
+            weights[i] = distance > 0.0f && distance < radius
+                ? std::max(glm::dot(normal, toLight) / distance, 0.0f) * (1.0f - distance / radius)
+                : 0.0f;
+        }
+#endif
+    }
+
+    // Diffuse light reaching a point from the global light and the area lights, with shadows
+    glm::vec3 directLight(const glm::vec3& position, const glm::vec3& normal) const {
+        glm::vec3 result(0.0f);
+        float nDotL = glm::dot(normal, glm::normalize(globalLight - position));
+        if (nDotL > 0.0f && isVisible(position, globalLight)) result += nDotL * GLOBAL_LIGHT_COLOR;
+
+        // Shadow rays only go to the lights that reach the point
+        float weights[4];
+        for (size_t first = 0; first < lightX.size(); first += 4) {
+            areaLightWeights(first, position, normal, weights);
+            for (size_t i = 0; i < 4; i++) {
+                if (weights[i] <= 0.0f) continue;
+                glm::vec3 lightPosition(lightX[first + i], lightY[first + i], lightZ[first + i]);
+                if (isVisible(position, lightPosition)) result += weights[i] * lightColor[first + i];
+            }
+        }
+        return result;
+    }
+
+    void bakeDirect(int tileIndex) {
+        const Tile& tile = tiles[tileIndex];
+        for (int texel = 0; texel < TEXELS; texel++) {
+            if (!isTexelOnSurface(tile, texel)) continue;
+            glm::vec3 position, normal;
+            tileSurface(tile, texelUV(texel), position, normal);
+            direct[tileIndex * TEXELS + texel] = directLight(position + normal * SURFACE_OFFSET, normal);
+        }
+    }
+
+    // One bounce: cosine weighted rays over the hemisphere, so the bounced light is the albedo
+    // times the average direct light where the rays land
+    void gatherBounce(int tileIndex) {
+        const Tile& tile = tiles[tileIndex];
+        const int strata = static_cast<int>(std::sqrt(static_cast<float>(LIGHTMAP_BOUNCE_RAYS)));
+        std::mt19937 random(static_cast<unsigned int>(tileIndex));  // Same result on every bake
+        std::uniform_real_distribution<float> jitter(0.0f, 1.0f);
+
+        for (int texel = 0; texel < TEXELS; texel++) {
+            if (!isTexelOnSurface(tile, texel)) continue;
+            glm::vec3 position, normal;
+            tileSurface(tile, texelUV(texel), position, normal);
+            position += normal * SURFACE_OFFSET;
+            glm::vec3 tangent = glm::normalize(glm::cross(std::fabs(normal.y) > 0.5f ? glm::vec3(1.0f, 0.0f, 0.0f) : glm::vec3(0.0f, 1.0f, 0.0f), normal));
+            glm::vec3 bitangent = glm::cross(normal, tangent);
+
+            glm::vec3 gathered(0.0f);
+            for (int sy = 0; sy < strata; sy++) {
+                for (int sx = 0; sx < strata; sx++) {
+                    float u1 = (sy + jitter(random)) / strata;
+                    float u2 = (sx + jitter(random)) / strata;
+                    float r = std::sqrt(u1);
+                    float phi = 2.0f * static_cast<float>(M_PI) * u2;
+                    glm::vec3 dir = tangent * (r * std::cos(phi)) + bitangent * (r * std::sin(phi)) + normal * std::sqrt(1.0f - u1);
+
+                    int hitTile;
+                    glm::vec3 hitPosition;
+                    if (trace(position, dir, MAX_BOUNCE_DISTANCE, hitTile, hitPosition) && hitTile >= 0) {
+                        gathered += sampleDirect(hitTile, hitPosition);
+                    }
+                }
+            }
+            indirect[tileIndex * TEXELS + texel] = gathered * (LIGHTMAP_BOUNCE_ALBEDO / (strata * strata));
+        }
+    }
+
+    glm::vec3 sampleDirect(int tileIndex, const glm::vec3& position) const {
+        glm::vec2 uv = tileUV(tiles[tileIndex], position);
+        int x = std::min(std::max(static_cast<int>(uv.x * LIGHTMAP_TILE_SIZE), 0), LIGHTMAP_TILE_SIZE - 1);
+        int y = std::min(std::max(static_cast<int>(uv.y * LIGHTMAP_TILE_SIZE), 0), LIGHTMAP_TILE_SIZE - 1);
+        return direct[tileIndex * TEXELS + x + y * LIGHTMAP_TILE_SIZE];
+    }
+
+    // Box filter the noisy bounce inside its tile, the direct light keeps its sharp shadow edges.
+    // Texels above a half height wall copy the top row of the wall so filtering at its edge stays clean
+    void denoise(int tileIndex) {
+        const Tile& tile = tiles[tileIndex];
+        const int RADIUS = 2;
+        int base = tileIndex * TEXELS;
+        for (int texel = 0; texel < TEXELS; texel++) {
+            if (!isTexelOnSurface(tile, texel)) continue;
+            int tx = texel % LIGHTMAP_TILE_SIZE;
+            int ty = texel / LIGHTMAP_TILE_SIZE;
+            glm::vec3 sum(0.0f);
+            int count = 0;
+            for (int y = std::max(ty - RADIUS, 0); y <= std::min(ty + RADIUS, LIGHTMAP_TILE_SIZE - 1); y++) {
+                for (int x = std::max(tx - RADIUS, 0); x <= std::min(tx + RADIUS, LIGHTMAP_TILE_SIZE - 1); x++) {
+                    int neighbour = x + y * LIGHTMAP_TILE_SIZE;
+                    if (!isTexelOnSurface(tile, neighbour)) continue;
+                    sum += indirect[base + neighbour];
+                    count++;
+                }
+            }
+            lit[base + texel] = direct[base + texel] + sum / static_cast<float>(count);
+        }
+        for (int texel = LIGHTMAP_TILE_SIZE; texel < TEXELS; texel++) {
+            if (!isTexelOnSurface(tile, texel)) lit[base + texel] = lit[base + texel - LIGHTMAP_TILE_SIZE];
+        }
+    }
+
+    bool save(const std::string& path) const {
+        std::ofstream file(path, std::ios::binary);
+        if (!file.is_open()) {
+            std::cerr << "Failed to write lightmap: " << path << std::endl;
+            return false;
+        }
+
+        int tileRows = (static_cast<int>(tiles.size()) + tilesPerRow - 1) / tilesPerRow;
+        LightmapHeader header = {};
+        memcpy(header.magic, LIGHTMAP_MAGIC, sizeof(header.magic));
+        header.version = LIGHTMAP_VERSION;
+        header.tileSize = LIGHTMAP_TILE_SIZE;
+        header.width = map.width;
+        header.height = map.height;
+        header.tilesPerRow = tilesPerRow;
+        header.tileCount = static_cast<int32_t>(tiles.size());
+        header.inputHash = inputHash;
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(faceTiles.data()), faceTiles.size() * sizeof(int32_t));
+
+        // Tiles are stored texel by texel, the atlas is written row by row
+        int atlasWidth = tilesPerRow * LIGHTMAP_TILE_SIZE;
+        int atlasHeight = tileRows * LIGHTMAP_TILE_SIZE;
+        std::vector<glm::vec3> row(atlasWidth);
+        for (int y = 0; y < atlasHeight; y++) {
+            for (int x = 0; x < atlasWidth; x++) {
+                size_t tile = (y / LIGHTMAP_TILE_SIZE) * tilesPerRow + x / LIGHTMAP_TILE_SIZE;
+                int texel = x % LIGHTMAP_TILE_SIZE + (y % LIGHTMAP_TILE_SIZE) * LIGHTMAP_TILE_SIZE;
+                row[x] = tile < tiles.size() ? lit[tile * TEXELS + texel] : glm::vec3(0.0f);
+            }
+            file.write(reinterpret_cast<const char*>(row.data()), row.size() * sizeof(glm::vec3));
+        }
+        return file.good();
+    }
+};
+
+// Baked light of the walls, floor and ceiling, loaded from the file --bake wrote next to the map.
+// A lightmap baked for another map layout or other static lights is not used
+class Lightmap {
+public:
+    Lightmap() : faceTiles(GL_R32I, sizeof(int32_t)) {
+    }
+
+    ~Lightmap() {
+        if (texture) glDeleteTextures(1, &texture);
+    }
+
+    bool load(const std::string& path, const Map& map, const std::vector<AreaLight>& lights) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open()) {
+            std::cout << "No lightmap at " << path << ", run with --bake to make one" << std::endl;
+            return false;
+        }
+
+        LightmapHeader header;
+        if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+            memcmp(header.magic, LIGHTMAP_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != LIGHTMAP_VERSION || header.tileSize != LIGHTMAP_TILE_SIZE ||
+            header.tilesPerRow <= 0 || header.tileCount <= 0) {
+            std::cout << "Lightmap " << path << " has an unknown format, run with --bake to rebake it" << std::endl;
+            return false;
+        }
+        if (header.width != map.width || header.height != map.height ||
+            header.inputHash != lightmapInputHash(map, mapWallHeights(map), lights)) {
+            std::cout << "Lightmap " << path << " is out of date, run with --bake to rebake it" << std::endl;
+            return false;
+        }
+
+        int atlasWidth = header.tilesPerRow * LIGHTMAP_TILE_SIZE;
+        int atlasHeight = (header.tileCount + header.tilesPerRow - 1) / header.tilesPerRow * LIGHTMAP_TILE_SIZE;
+        GLint maxTextureSize = 0;
+        glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+        if (atlasWidth > maxTextureSize || atlasHeight > maxTextureSize) {
+            std::cout << "Lightmap " << path << " is larger than the GPU allows (" << maxTextureSize << ")" << std::endl;
+            return false;
+        }
+
+        std::vector<int32_t> faces(map.width * map.height * LIGHTMAP_FACES_PER_CELL);
+        std::vector<float> texels(static_cast<size_t>(atlasWidth) * atlasHeight * 3);
+        file.read(reinterpret_cast<char*>(faces.data()), faces.size() * sizeof(int32_t));
+        file.read(reinterpret_cast<char*>(texels.data()), texels.size() * sizeof(float));
+        if (!file) {
+            std::cout << "Lightmap " << path << " is truncated, run with --bake to rebake it" << std::endl;
+            return false;
+        }
+
+        if (!texture) glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, atlasWidth, atlasHeight, 0, GL_RGB, GL_FLOAT, texels.data());
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        faceTiles.update(faces.data(), faces.size());
+
+        loaded = true;
+        std::cout << "Lightmap loaded: " << header.tileCount << " faces, " << atlasWidth << "x" << atlasHeight << std::endl;
+        return true;
+    }
+
+    bool isLoaded() const {
+        return loaded;
+    }
+
+    void bind() {
+        glActiveTexture(GL_TEXTURE0 + LIGHTMAP_TEXTURE_UNIT);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glActiveTexture(GL_TEXTURE0);
+        faceTiles.bind(LIGHTMAP_FACE_TEXTURE_UNIT);
+    }
+
+private:
+    unsigned int texture = 0;
+    TextureBuffer faceTiles;
+    bool loaded = false;
+};
+
+// Wall height of every map cell for the grid ray marched shadows, R8 with 1 = WALL_HEIGHT (one byte
+// per cell). Cells outside the map are full height, so shadow rays never leak past a ragged map edge
+class OccupancyGrid {
+public:
+    OccupancyGrid() {
+        glGenTextures(1, &texture);
+    }
+
+    ~OccupancyGrid() {
+        glDeleteTextures(1, &texture);
+    }
+
+    void upload(const Map& map) {
+        std::vector<float> heights = mapWallHeights(map);
+        std::vector<unsigned char> texels(heights.size());
+        for (size_t i = 0; i < heights.size(); i++) {
+            float height = heights[i] < 0.0f ? WALL_HEIGHT : heights[i];
+            texels[i] = static_cast<unsigned char>(std::lround(std::clamp(height / WALL_HEIGHT, 0.0f, 1.0f) * 255.0f));
+        }
+
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);  // Rows of an odd map width are not 4 byte aligned
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, map.width, map.height, 0, GL_RED, GL_UNSIGNED_BYTE, texels.data());
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        std::cout << "Occupancy grid uploaded: " << map.width << "x" << map.height << " cells, " << texels.size() << " bytes" << std::endl;
+    }
+
+    void bind() {
+        glActiveTexture(GL_TEXTURE0 + OCCUPANCY_TEXTURE_UNIT);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+private:
+    unsigned int texture = 0;
+};
+
+// Irradiance volume for the models: one probe per map cell and layer, each an ambient cube (light
+// arriving along +X, -X, +Y, -Y, +Z, -Z) from the global light and every active area light that can
+// see it past the walls. Models read it once per fragment, so their cost does not grow with the light
+// count. Probes are baked on the thread pool and only the cells around lights that changed are rebaked.
+// Stored as an RGB16F 3D texture: x = cell x, y = layer, z = face * map height + cell z
+class IrradianceVolume {
+public:
+    IrradianceVolume(ThreadPool& threadPool) : threadPool(threadPool) {
+        glGenTextures(1, &texture);
+    }
+
+    ~IrradianceVolume() {
+        glDeleteTextures(1, &texture);
+    }
+
+    // Rebake the probes the changed lights reach, everything after a map change
+    void update(const Map& map, const std::vector<AreaLight>& lights) {
+        int minX = map.width, minZ = map.height, maxX = -1, maxZ = -1;
+        auto dirtyAround = [&](const AreaLight& light) {
+            if (!light.active) return;
+            minX = std::min(minX, static_cast<int>(std::floor((light.position.x - light.radius) / CELL_SIZE)));
+            minZ = std::min(minZ, static_cast<int>(std::floor((light.position.z - light.radius) / CELL_SIZE)));
+            maxX = std::max(maxX, static_cast<int>(std::floor((light.position.x + light.radius) / CELL_SIZE)));
+            maxZ = std::max(maxZ, static_cast<int>(std::floor((light.position.z + light.radius) / CELL_SIZE)));
+        };
+
+        if (map.width != width || map.height != height) {
+            width = map.width;
+            height = map.height;
+            probes.assign(static_cast<size_t>(6) * height * IRRADIANCE_LAYERS * width, glm::vec3(0.0f));
+            glBindTexture(GL_TEXTURE_3D, texture);
+            glTexImage3D(GL_TEXTURE_3D, 0, GL_RGB16F, width, IRRADIANCE_LAYERS, 6 * height, 0, GL_RGB, GL_FLOAT, NULL);
+            glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+            glBindTexture(GL_TEXTURE_3D, 0);
+            minX = minZ = 0;
+            maxX = width - 1;
+            maxZ = height - 1;
+        } else {
+            for (size_t i = 0; i < std::max(lights.size(), bakedLights.size()); i++) {
+                if (i < lights.size() && i < bakedLights.size() && sameLight(lights[i], bakedLights[i])) continue;
+                if (i < lights.size()) dirtyAround(lights[i]);
+                if (i < bakedLights.size()) dirtyAround(bakedLights[i]);
+            }
+        }
+        bakedLights = lights;
+
+        minX = std::max(minX, 0);
+        minZ = std::max(minZ, 0);
+        maxX = std::min(maxX, width - 1);
+        maxZ = std::min(maxZ, height - 1);
+        if (minX > maxX || minZ > maxZ) return;
+
+        double startTime = glfwGetTime();
+        glm::vec3 globalPosition = globalLightPosition(map);
+
+        // Lights that reach the dirty cells
+        std::vector<const AreaLight*> nearLights;
+        for (const AreaLight& light : lights) {
+            if (light.active && distanceToRectXZ(light.position, minX * CELL_SIZE, minZ * CELL_SIZE, (maxX + 1) * CELL_SIZE, (maxZ + 1) * CELL_SIZE) < light.radius) {
+                nearLights.push_back(&light);
+            }
+        }
+
+        // Open cells first, then wall cells (and the ring around the dirty cells) copy their open
+        // neighbours so filtering next to a wall does not blend in black
+        threadPool.parallelFor(maxZ - minZ + 1, [&](int row) {
+            int z = minZ + row;
+            for (int x = minX; x <= maxX; x++) {
+                if (!map.isInside(x, z) || map.grid[z][x] == 1) continue;
+                for (int layer = 0; layer < IRRADIANCE_LAYERS; layer++) {
+                    bakeProbe(map, x, layer, z, globalPosition, nearLights);
+                }
+            }
+        });
+        int ringMinZ = std::max(minZ - 1, 0);
+        int ringMaxZ = std::min(maxZ + 1, height - 1);
+        threadPool.parallelFor(ringMaxZ - ringMinZ + 1, [&](int row) {
+            int z = ringMinZ + row;
+            for (int x = std::max(minX - 1, 0); x <= std::min(maxX + 1, width - 1); x++) {
+                if (map.isInside(x, z) && map.grid[z][x] != 1) continue;
+                fillFromNeighbours(map, x, z);
+            }
+        });
+
+        // Upload the rows of each face slab that changed
+        glBindTexture(GL_TEXTURE_3D, texture);
+        for (int face = 0; face < 6; face++) {
+            glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, face * height + ringMinZ, width, IRRADIANCE_LAYERS, ringMaxZ - ringMinZ + 1,
+                            GL_RGB, GL_FLOAT, &probes[index(face, 0, ringMinZ, 0)]);
+        }
+        glBindTexture(GL_TEXTURE_3D, 0);
+
+        std::cout << "Irradiance volume updated: " << (maxX - minX + 1) * (maxZ - minZ + 1) * IRRADIANCE_LAYERS << " probes, "
+                  << nearLights.size() << " lights in " << (glfwGetTime() - startTime) * 1000.0 << " ms" << std::endl;
+    }
+
+    void bind() {
+        glActiveTexture(GL_TEXTURE0 + IRRADIANCE_TEXTURE_UNIT);
+        glBindTexture(GL_TEXTURE_3D, texture);
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+private:
+    ThreadPool& threadPool;
+    unsigned int texture = 0;
+    int width = 0;
+    int height = 0;
+    std::vector<glm::vec3> probes;  // Texture layout, x fastest
+    std::vector<AreaLight> bakedLights;
+
+    size_t index(int face, int layer, int z, int x) const {
+        return ((static_cast<size_t>(face) * height + z) * IRRADIANCE_LAYERS + layer) * width + x;
+    }
+
+    static bool sameLight(const AreaLight& a, const AreaLight& b) {
+        return a.position == b.position && a.color == b.color && a.intensity == b.intensity &&
+               a.radius == b.radius && a.active == b.active;
+    }
+
+    void bakeProbe(const Map& map, int x, int layer, int z, const glm::vec3& globalPosition, const std::vector<const AreaLight*>& lights) {
+        glm::vec3 position((x + 0.5f) * CELL_SIZE, (layer + 0.5f) * WALL_HEIGHT / IRRADIANCE_LAYERS, (z + 0.5f) * CELL_SIZE);
+        glm::vec3 faces[6] = {};
+
+        // Each light adds to the faces it shines on, weighted by the cosine to the face axis
+        auto addLight = [&](const glm::vec3& lightPosition, const glm::vec3& color) {
+            glm::vec3 dir = glm::normalize(lightPosition - position);
+            faces[0] += color * std::max(dir.x, 0.0f);
+            faces[1] += color * std::max(-dir.x, 0.0f);
+            faces[2] += color * std::max(dir.y, 0.0f);
+            faces[3] += color * std::max(-dir.y, 0.0f);
+            faces[4] += color * std::max(dir.z, 0.0f);
+            faces[5] += color * std::max(-dir.z, 0.0f);
+        };
+
+        if (isSegmentClearXZ(map, position.x, position.z, globalPosition.x, globalPosition.z)) {
+            addLight(globalPosition, GLOBAL_LIGHT_COLOR);
+        }
+        for (const AreaLight* light : lights) {
+            float distance = glm::length(light->position - position);
+            if (distance >= light->radius || distance <= 0.0f) continue;
+            if (!isSegmentClearXZ(map, position.x, position.z, light->position.x, light->position.z)) continue;
+            addLight(light->position, light->color * light->intensity * (1.0f - distance / light->radius));  // Same falloff as shader.fs
+        }
+
+        for (int face = 0; face < 6; face++) probes[index(face, layer, z, x)] = faces[face];
+    }
+
+    void fillFromNeighbours(const Map& map, int x, int z) {
+        const int neighbours[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+        for (int face = 0; face < 6; face++) {
+            for (int layer = 0; layer < IRRADIANCE_LAYERS; layer++) {
+                glm::vec3 sum(0.0f);
+                int count = 0;
+                for (const auto& offset : neighbours) {
+                    int nx = x + offset[0];
+                    int nz = z + offset[1];
+                    if (!map.isInside(nx, nz) || map.grid[nz][nx] == 1) continue;
+                    sum += probes[index(face, layer, nz, nx)];
+                    count++;
+                }
+                probes[index(face, layer, z, x)] = count > 0 ? sum / static_cast<float>(count) : glm::vec3(0.0f);
+            }
+        }
+    }
+};
+
+// Replaces the area lights with random lights over the open floor for each count in
+// LIGHT_BENCHMARK_COUNTS, averages the frame times of the forward and the deferred path in every
+// shadow mode at each count and restores the lights, render path and shadow mode when done
+class LightBenchmark {
+public:
+    bool isRunning() const {
+        return stage >= 0;
+    }
+
+    void start(const Map& map) {
+        savedLights = areaLights;
+        savedDeferredShading = useDeferredShading;
+        savedShadowMode = shadowMode;
+        stage = 0;
+        beginStage(map);
+        std::cout << "Light benchmark started, keep the camera still" << std::endl;
+    }
+
+    // Record one frame, moving on to the next light count once enough frames are averaged
+    void recordFrame(const Map& map, double cpuMs, double gpuMs, double lightAssignMs) {
+        if (!isRunning()) return;
+
+        frame++;
+        if (frame <= LIGHT_BENCHMARK_WARMUP_FRAMES) return;
+        cpuTotal += cpuMs;
+        gpuTotal += gpuMs;
+        lightAssignTotal += lightAssignMs;
+        if (frame < LIGHT_BENCHMARK_WARMUP_FRAMES + LIGHT_BENCHMARK_FRAMES) return;
+
+        std::cout << "Lights " << LIGHT_BENCHMARK_COUNTS[stage / STAGES_PER_COUNT]
+                  << (useDeferredShading ? " deferred" : " forward")
+                  << ", shadows " << SHADOW_MODE_NAMES[shadowMode]
+                  << " | CPU " << cpuTotal / LIGHT_BENCHMARK_FRAMES << " ms"
+                  << " | GPU " << gpuTotal / LIGHT_BENCHMARK_FRAMES << " ms"
+                  << " | light assignment " << lightAssignTotal / LIGHT_BENCHMARK_FRAMES << " ms" << std::endl;
+
+        stage++;
+        if (stage == NUM_STAGES) {
+            areaLights = savedLights;
+            useDeferredShading = savedDeferredShading;
+            shadowMode = savedShadowMode;
+            stage = -1;
+            std::cout << "Light benchmark finished" << std::endl;
+            return;
+        }
+        beginStage(map);
+    }
+
+private:
+    // Every light count is run in each shadow mode, forward then deferred
+    static const int STAGES_PER_COUNT = 2 * SHADOW_MODE_COUNT;
+    static const int NUM_STAGES = STAGES_PER_COUNT * sizeof(LIGHT_BENCHMARK_COUNTS) / sizeof(LIGHT_BENCHMARK_COUNTS[0]);
+
+    int stage = -1;
+    int frame = 0;
+    double cpuTotal = 0.0;
+    double gpuTotal = 0.0;
+    double lightAssignTotal = 0.0;
+    std::vector<AreaLight> savedLights;
+    bool savedDeferredShading = false;
+    ShadowMode savedShadowMode = SHADOW_MAPS;
+
+    void beginStage(const Map& map) {
+        frame = 0;
+        cpuTotal = 0.0;
+        gpuTotal = 0.0;
+        lightAssignTotal = 0.0;
+
+        // Both paths and every shadow mode see the same lights
+        useDeferredShading = stage % 2 == 1;
+        shadowMode = static_cast<ShadowMode>(stage % STAGES_PER_COUNT / 2);
+        if (stage % STAGES_PER_COUNT != 0) return;
+
+        std::vector<glm::vec3> openCells;
+        for (int z = 0; z < map.height; z++) {
+            for (int x = 0; x < map.width; x++) {
+                if (map.grid[z][x] == 0) {
+                    openCells.push_back(glm::vec3((x + 0.5f) * CELL_SIZE, 0.0f, (z + 0.5f) * CELL_SIZE));
+                }
+            }
+        }
+
+        areaLights.clear();
+        if (openCells.empty()) return;
+
+        std::mt19937 random(1234);  // Same layout on every run
+        std::uniform_int_distribution<size_t> pickCell(0, openCells.size() - 1);
+        std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+        for (int i = 0; i < LIGHT_BENCHMARK_COUNTS[stage / STAGES_PER_COUNT]; i++) {
+            glm::vec3 position = openCells[pickCell(random)];
+            position.y = 1.0f + 2.0f * unit(random);
+            areaLights.push_back({
+                position,
+                glm::vec3(0.5f + 0.5f * unit(random), 0.5f + 0.5f * unit(random), 0.5f + 0.5f * unit(random)),
+                0.5f,  // intensity
+                4.0f,  // radius
+                true,  // active
+                true   // dynamic
+            });
+        }
+    }
+};
+
+// Shading LOD benchmark (J key): GPU frame time with the shading LOD off and then on from the same view,
+// run it looking down a long sightline
+class ShadingLodBenchmark {
+public:
+    bool isRunning() const {
+        return stage >= 0;
+    }
+
+    void start() {
+        savedMode = shadingLodMode;
+        stage = 0;
+        beginStage();
+        std::cout << "Shading LOD benchmark started, keep the camera still" << std::endl;
+    }
+
+    // Record one frame, switching the shading LOD on once enough frames with it off are averaged
+    void recordFrame(double gpuMs) {
+        if (!isRunning()) return;
+
+        frame++;
+        if (frame <= LIGHT_BENCHMARK_WARMUP_FRAMES) return;
+        gpuTotal += gpuMs;
+        if (frame < LIGHT_BENCHMARK_WARMUP_FRAMES + LIGHT_BENCHMARK_FRAMES) return;
+
+        averages[stage] = gpuTotal / LIGHT_BENCHMARK_FRAMES;
+        std::cout << "Shading LOD " << SHADING_LOD_MODE_NAMES[shadingLodMode]
+                  << " | GPU " << averages[stage] << " ms | chunks per LOD";
+        for (int lod = 0; lod <= MAX_SHADING_LOD; lod++) {
+            std::cout << (lod == 0 ? " " : "/") << frameStats.shadingLodChunks[lod];
+        }
+        std::cout << std::endl;
+
+        stage++;
+        if (stage == NUM_STAGES) {
+            double saved = averages[0] - averages[1];
+            std::cout << "Shading LOD benchmark finished, saved " << saved << " ms of GPU time";
+            if (averages[0] > 0.0) std::cout << " (" << saved / averages[0] * 100.0 << "%)";
+            std::cout << std::endl;
+            shadingLodMode = savedMode;
+            stage = -1;
+            return;
+        }
+        beginStage();
+    }
+
+private:
+    static const int NUM_STAGES = 2;
+
+    int stage = -1;
+    int frame = 0;
+    double gpuTotal = 0.0;
+    double averages[NUM_STAGES] = {};
+    ShadingLodMode savedMode = SHADING_LOD_ON;
+
+    void beginStage() {
+        frame = 0;
+        gpuTotal = 0.0;
+        shadingLodMode = stage == 0 ? SHADING_LOD_OFF : SHADING_LOD_ON;
+    }
+};
+
+// Deferred shading path: materials are written to a G-buffer, then the global light, flashlight and
+// every area light are added as screen-space passes. Area lights and the flashlight are drawn as
+// stencil-tested volumes, so each one only shades the pixels whose surface lies inside it
+class DeferredRenderer {
+public:
+    DeferredRenderer()
+        : gbufferShaders("shader.vs", "gbuffer.fs"),
+          lightShaders("deferred_light.vs", "deferred_light.fs") {
+        lightShaders.setSamplerUnit("gAlbedoRoughness", 0);
+        lightShaders.setSamplerUnit("gNormal", 1);
+        lightShaders.setSamplerUnit("gViewDepth", 2);
+        glGenFramebuffers(1, &framebuffer);
+        createVolumes();
+    }
+
+    ~DeferredRenderer() {
+        deleteTargets();
+        glDeleteFramebuffers(1, &framebuffer);
+        glDeleteVertexArrays(1, &quadVAO);
+        glDeleteBuffers(1, &quadVBO);
+        glDeleteVertexArrays(1, &sphereVAO);
+        glDeleteBuffers(1, &sphereVBO);
+        glDeleteVertexArrays(1, &coneVAO);
+        glDeleteBuffers(1, &coneVBO);
+    }
+
+    // Variants of gbuffer.fs, picked per draw with the same material features as the forward path
+    ShaderPermutations& materialShaders() {
+        return gbufferShaders;
+    }
+
+    // Compile the G-buffer variants for these material feature sets and every lighting pass variant
+    void precompile(const std::set<unsigned int>& materialFeatureSets) {
+        gbufferShaders.precompile(materialFeatureSets);
+        lightShaders.precompile({
+            0,
+            FEATURE_AREA_LIGHTS,
+            FEATURE_FLASHLIGHT,
+            FEATURE_AREA_LIGHTS | FEATURE_AREA_SHADOWS,
+            FEATURE_GRID_SHADOWS,
+            FEATURE_AREA_LIGHTS | FEATURE_GRID_SHADOWS,
+            FEATURE_AREA_LIGHTS | FEATURE_STENCIL_ONLY,
+            FEATURE_FLASHLIGHT | FEATURE_STENCIL_ONLY,
+        });
+    }
+
+    // Bind and clear the G-buffer, resizing it to the scene target first. Drawing stays inside the
+    // viewport, which may be smaller than the targets
+    void beginGeometryPass(int width, int height) {
+        if (width != targetWidth || height != targetHeight) createTargets(width, height);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        const GLenum geometryBuffers[] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2};
+        glDrawBuffers(3, geometryBuffers);
+        glClearColor(0.0f, 0.0f, 0.0f, 0.0f);  // View depth 0 marks pixels with nothing drawn
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+    }
+
+    // Light the G-buffer into the accumulation target, then copy the frameData.screenSize area of it to
+    // the scene framebuffer. With shadow maps, area lights that have a shadow slot sample their cube shadow
+    // map, the grid ray march shadows the global light and every area light
+    void renderLighting(const std::vector<AreaLight>& lights, const FrameUniforms& frameData, bool flashlight, ShadowMode shadows,
+                        unsigned int sceneFramebuffer) {
+        const GLenum lightBuffer = GL_COLOR_ATTACHMENT3;
+        glDrawBuffers(1, &lightBuffer);
+        glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+        glClear(GL_COLOR_BUFFER_BIT);
+
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, albedoRoughnessTexture);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, normalTexture);
+        glActiveTexture(GL_TEXTURE2);
+        glBindTexture(GL_TEXTURE_2D, viewDepthTexture);
+        glActiveTexture(GL_TEXTURE0);
+
+        glm::mat4 inverseView = glm::inverse(frameData.view);
+
+        // Every pass adds into the light target, volumes are never clipped by the near or far plane
+        glDepthMask(GL_FALSE);
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_ONE, GL_ONE);
+        glEnable(GL_DEPTH_CLAMP);
+
+        // Ambient, global light and fog over the whole screen
+        glDisable(GL_DEPTH_TEST);
+        unsigned int gridShadows = shadows == SHADOW_GRID_MARCH ? FEATURE_GRID_SHADOWS : 0;
+        Shader& globalShader = lightShaders.use(gridShadows);
+        globalShader.setMat4(U_INVERSE_VIEW, inverseView);
+        glBindVertexArray(quadVAO);
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+        glEnable(GL_STENCIL_TEST);
+        unsigned int volumes = 0;
+        for (const AreaLight& light : lights) {
+            if (!light.active || isSphereBeyondDrawDistance(frameData.viewPos, light.position, light.radius)) continue;
+
+            glm::mat4 model = glm::translate(glm::mat4(1.0f), light.position);
+            model = glm::scale(model, glm::vec3(light.radius * sphereScale));
+            bool shadowMapped = shadows == SHADOW_MAPS && light.shadowSlot >= 0;
+            unsigned int features = FEATURE_AREA_LIGHTS | gridShadows | (shadowMapped ? FEATURE_AREA_SHADOWS : 0);
+            Shader& shader = beginVolume(sphereVAO, sphereVertexCount, model, features, inverseView);
+            shader.setInt(U_AREA_LIGHT_SHADOW_SLOT, light.shadowSlot);
+            shader.setVec3(U_AREA_LIGHT_POSITION, light.position);
+            shader.setFloat(U_AREA_LIGHT_RADIUS, light.radius);
+            shader.setVec3(U_AREA_LIGHT_COLOR, light.color * light.intensity);
+            glDrawArrays(GL_TRIANGLES, 0, sphereVertexCount);
+            volumes++;
+        }
+
+        if (flashlight) {
+            // Cone from the camera out to the draw distance, wide enough for the outer cutoff
+            float length = drawDistance;
+            float radius = length * std::tan(std::acos(frameData.flashlightOuterCutoff)) * coneScale;
+            glm::mat4 model = glm::inverse(glm::lookAt(frameData.flashlightPos, frameData.flashlightPos + frameData.flashlightDir, glm::vec3(0.0f, 1.0f, 0.0f)));
+            model = glm::scale(model, glm::vec3(radius, radius, length));
+            beginVolume(coneVAO, coneVertexCount, model, FEATURE_FLASHLIGHT, inverseView);
+            glDrawArrays(GL_TRIANGLES, 0, coneVertexCount);
+            volumes++;
+        }
+        frameStats.lightVolumes = volumes;
+
+        // Back to the state the forward draws expect
+        glDisable(GL_STENCIL_TEST);
+        glDisable(GL_CULL_FACE);
+        glDisable(GL_DEPTH_CLAMP);
+        glDisable(GL_BLEND);
+        glEnable(GL_DEPTH_TEST);
+        glDepthMask(GL_TRUE);
+        glBindVertexArray(0);
+
+        // Copy the lit image to the scene target
+        int width = static_cast<int>(frameData.screenSize.x);
+        int height = static_cast<int>(frameData.screenSize.y);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+        glReadBuffer(GL_COLOR_ATTACHMENT3);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, sceneFramebuffer);
+        glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        glBindFramebuffer(GL_FRAMEBUFFER, sceneFramebuffer);
+    }
+
+private:
+    ShaderPermutations gbufferShaders;
+    ShaderPermutations lightShaders;
+
+    unsigned int framebuffer = 0;
+    unsigned int albedoRoughnessTexture = 0;  // RGBA8: albedo, roughness
+    unsigned int normalTexture = 0;           // RGBA16F: octahedral normal, ambient occlusion
+    unsigned int viewDepthTexture = 0;        // R32F: view depth, 0 where nothing was drawn
+    unsigned int lightTexture = 0;            // RGBA16F: light accumulation
+    unsigned int depthStencilBuffer = 0;
+    int targetWidth = 0;
+    int targetHeight = 0;
+
+    unsigned int quadVAO = 0, quadVBO = 0;
+    unsigned int sphereVAO = 0, sphereVBO = 0;
+    unsigned int coneVAO = 0, coneVBO = 0;
+    int sphereVertexCount = 0;
+    int coneVertexCount = 0;
+    float sphereScale = 1.0f;  // Grows the unit sphere mesh so its flat faces enclose the real sphere
+    float coneScale = 1.0f;
+
+    // Stencil pass that marks pixels whose surface is inside the volume, then set up the light pass
+    // that shades them once through the back faces and resets their stencil
+    Shader& beginVolume(unsigned int vao, int vertexCount, const glm::mat4& model, unsigned int features, const glm::mat4& inverseView) {
+        glBindVertexArray(vao);
+
+        glDrawBuffer(GL_NONE);
+        glEnable(GL_DEPTH_TEST);
+        glDisable(GL_CULL_FACE);
+        glStencilFunc(GL_ALWAYS, 0, 0xFF);
+        glStencilOpSeparate(GL_BACK, GL_KEEP, GL_INCR_WRAP, GL_KEEP);
+        glStencilOpSeparate(GL_FRONT, GL_KEEP, GL_DECR_WRAP, GL_KEEP);
+        Shader& stencilShader = lightShaders.use((features & ~(FEATURE_AREA_SHADOWS | FEATURE_GRID_SHADOWS)) | FEATURE_STENCIL_ONLY);
+        stencilShader.setMat4(U_MODEL, model);
+        glDrawArrays(GL_TRIANGLES, 0, vertexCount);
+
+        glDrawBuffer(GL_COLOR_ATTACHMENT3);
+        glDisable(GL_DEPTH_TEST);
+        glEnable(GL_CULL_FACE);
+        glCullFace(GL_FRONT);
+        glStencilFunc(GL_NOTEQUAL, 0, 0xFF);
+        glStencilOp(GL_KEEP, GL_KEEP, GL_ZERO);
+        Shader& shader = lightShaders.use(features);
+        shader.setMat4(U_MODEL, model);
+        shader.setMat4(U_INVERSE_VIEW, inverseView);
+        return shader;
+    }
+
+    unsigned int createTarget(GLenum internalFormat, GLenum format, GLenum attachment) {
+        unsigned int texture;
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, targetWidth, targetHeight, 0, format, GL_FLOAT, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, attachment, GL_TEXTURE_2D, texture, 0);
+        return texture;
+    }
+
+    void createTargets(int width, int height) {
+        deleteTargets();
+        targetWidth = width;
+        targetHeight = height;
+
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        albedoRoughnessTexture = createTarget(GL_RGBA8, GL_RGBA, GL_COLOR_ATTACHMENT0);
+        normalTexture = createTarget(GL_RGBA16F, GL_RGBA, GL_COLOR_ATTACHMENT1);
+        viewDepthTexture = createTarget(GL_R32F, GL_RED, GL_COLOR_ATTACHMENT2);
+        lightTexture = createTarget(GL_RGBA16F, GL_RGBA, GL_COLOR_ATTACHMENT3);
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        glGenRenderbuffers(1, &depthStencilBuffer);
+        glBindRenderbuffer(GL_RENDERBUFFER, depthStencilBuffer);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, depthStencilBuffer);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            std::cout << "ERROR::FRAMEBUFFER:: G-buffer is not complete" << std::endl;
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+
+    void deleteTargets() {
+        unsigned int textures[] = {albedoRoughnessTexture, normalTexture, viewDepthTexture, lightTexture};
+        glDeleteTextures(4, textures);
+        glDeleteRenderbuffers(1, &depthStencilBuffer);
+        albedoRoughnessTexture = normalTexture = viewDepthTexture = lightTexture = depthStencilBuffer = 0;
+    }
+
+    // Position-only triangle list in a new VAO
+    static void uploadPositions(const std::vector<glm::vec3>& positions, unsigned int& vao, unsigned int& vbo) {
+        glGenVertexArrays(1, &vao);
+        glGenBuffers(1, &vbo);
+        glBindVertexArray(vao);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glBufferData(GL_ARRAY_BUFFER, positions.size() * sizeof(glm::vec3), positions.data(), GL_STATIC_DRAW);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)0);
+        glEnableVertexAttribArray(0);
+        glBindVertexArray(0);
+    }
+
+    // Add a triangle wound counter-clockwise when seen from outside, judged against a point inside the mesh
+    static void addOutwardTriangle(std::vector<glm::vec3>& positions, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c, const glm::vec3& inside) {
+        glm::vec3 normal = glm::cross(b - a, c - a);
+        positions.push_back(a);
+        if (glm::dot(normal, a - inside) >= 0.0f) {
+            positions.push_back(b);
+            positions.push_back(c);
+        } else {
+            positions.push_back(c);
+            positions.push_back(b);
+        }
+    }
+
+    void createVolumes() {
+        // Full-screen quad, already in clip space
+        std::vector<glm::vec3> quad = {
+            glm::vec3(-1.0f, -1.0f, 0.0f), glm::vec3(1.0f, -1.0f, 0.0f),
+            glm::vec3(-1.0f, 1.0f, 0.0f), glm::vec3(1.0f, 1.0f, 0.0f),
+        };
+        uploadPositions(quad, quadVAO, quadVBO);
+
+        // Unit sphere around the origin
+        const int SLICES = 16;
+        const int STACKS = 8;
+        std::vector<glm::vec3> sphere;
+        auto spherePoint = [&](int stack, int slice) {
+            float theta = M_PI * stack / STACKS;
+            float phi = 2.0f * M_PI * slice / SLICES;
+            return glm::vec3(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+        };
+        for (int stack = 0; stack < STACKS; stack++) {
+            for (int slice = 0; slice < SLICES; slice++) {
+                glm::vec3 a = spherePoint(stack, slice);
+                glm::vec3 b = spherePoint(stack + 1, slice);
+                glm::vec3 c = spherePoint(stack + 1, slice + 1);
+                glm::vec3 d = spherePoint(stack, slice + 1);
+                if (stack > 0) addOutwardTriangle(sphere, a, b, d, glm::vec3(0.0f));
+                if (stack < STACKS - 1) addOutwardTriangle(sphere, b, c, d, glm::vec3(0.0f));
+            }
+        }
+        sphereVertexCount = static_cast<int>(sphere.size());
+        sphereScale = 1.0f / (std::cos(M_PI / SLICES) * std::cos(M_PI / (2 * STACKS)));
+        uploadPositions(sphere, sphereVAO, sphereVBO);
+
+        // Unit cone with its apex at the origin, opening along -Z to a radius 1 cap at z = -1
+        const int SEGMENTS = 16;
+        std::vector<glm::vec3> cone;
+        glm::vec3 apex(0.0f);
+        glm::vec3 capCenter(0.0f, 0.0f, -1.0f);
+        glm::vec3 inside(0.0f, 0.0f, -0.5f);
+        for (int segment = 0; segment < SEGMENTS; segment++) {
+            float angle0 = 2.0f * M_PI * segment / SEGMENTS;
+            float angle1 = 2.0f * M_PI * (segment + 1) / SEGMENTS;
+            glm::vec3 rim0(std::cos(angle0), std::sin(angle0), -1.0f);
+            glm::vec3 rim1(std::cos(angle1), std::sin(angle1), -1.0f);
+            addOutwardTriangle(cone, apex, rim0, rim1, inside);
+            addOutwardTriangle(cone, capCenter, rim1, rim0, inside);
+        }
+        coneVertexCount = static_cast<int>(cone.size());
+        coneScale = 1.0f / std::cos(M_PI / SEGMENTS);
+        uploadPositions(cone, coneVAO, coneVBO);
+    }
+};
+
+// Offscreen scene target of the dynamic resolution. The targets are allocated at the window size and the
+// scene is drawn into the lower left part of them, so a scale change only moves the viewport
+class DynamicResolution {
+public:
+    DynamicResolution() : upscaleShaders("upscale.vs", "upscale.fs") {
+        upscaleShaders.setSamplerUnit("sceneColor", 0);
+        glGenFramebuffers(1, &framebuffer);
+        glGenVertexArrays(1, &triangleVAO);  // The full-screen triangle comes from gl_VertexID
+    }
+
+    ~DynamicResolution() {
+        deleteTargets();
+        glDeleteFramebuffers(1, &framebuffer);
+        glDeleteVertexArrays(1, &triangleVAO);
+    }
+
+    void precompile() {
+        upscaleShaders.precompile({0});
+    }
+
+    // Fit the targets to the window and pick this frame's scale from the GPU frame time
+    void update(int windowWidth, int windowHeight, double gpuMs) {
+        if (windowWidth != targetWidth || windowHeight != targetHeight) createTargets(windowWidth, windowHeight);
+
+        if (resolutionOverride >= 0) {
+            scale = FIXED_RESOLUTION_SCALES[resolutionOverride];
+            frames = 0;
+            gpuTotal = 0.0;
+        } else if (gpuMs > 0.0) {
+            frames++;
+            if (frames > 0) gpuTotal += gpuMs;  // Frames still measured at the previous scale are skipped
+            if (frames >= DYNAMIC_RESOLUTION_INTERVAL) {
+                double average = gpuTotal / frames;
+                frames = 0;
+                gpuTotal = 0.0;
+
+                // GPU time follows the pixel count, so the scale per axis follows its square root
+                float wanted = scale * static_cast<float>(std::sqrt(DYNAMIC_RESOLUTION_TARGET_MS / average));
+                wanted = glm::clamp(wanted, MIN_RESOLUTION_SCALE, MAX_RESOLUTION_SCALE);
+                if (std::abs(wanted - scale) >= RESOLUTION_SCALE_STEP) {
+                    scale = glm::clamp(std::round(wanted / RESOLUTION_SCALE_STEP) * RESOLUTION_SCALE_STEP,
+                                       MIN_RESOLUTION_SCALE, MAX_RESOLUTION_SCALE);
+                    frames = -GpuTimer::QUERY_COUNT;
+                }
+            }
+        }
+
+        renderWidth = std::max(1, static_cast<int>(std::round(windowWidth * scale)));
+        renderHeight = std::max(1, static_cast<int>(std::round(windowHeight * scale)));
+    }
+
+    // Bind the scene target with this frame's viewport
+    void beginScene() {
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glViewport(0, 0, renderWidth, renderHeight);
+    }
+
+    // Upscale the scene to the whole window
+    void present() {
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(0, 0, targetWidth, targetHeight);
+        glDisable(GL_DEPTH_TEST);
+
+        Shader& shader = upscaleShaders.use(0);
+        shader.setVec2(U_RENDER_SCALE, glm::vec2(renderWidth / float(targetWidth), renderHeight / float(targetHeight)));
+        shader.setFloat(U_SHARPNESS, renderWidth < targetWidth ? UPSCALE_SHARPNESS : 0.0f);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, colorTexture);
+        glBindVertexArray(triangleVAO);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        glBindVertexArray(0);
+
+        glEnable(GL_DEPTH_TEST);
+    }
+
+    unsigned int sceneFramebuffer() const {
+        return framebuffer;
+    }
+
+    // Size of the targets, the window size
+    int width() const {
+        return targetWidth;
+    }
+
+    int height() const {
+        return targetHeight;
+    }
+
+    // Size the scene is drawn at this frame
+    int sceneWidth() const {
+        return renderWidth;
+    }
+
+    int sceneHeight() const {
+        return renderHeight;
+    }
+
+    float currentScale() const {
+        return scale;
+    }
+
+private:
+    ShaderPermutations upscaleShaders;
+    unsigned int framebuffer = 0;
+    unsigned int colorTexture = 0;
+    unsigned int depthStencilBuffer = 0;
+    unsigned int triangleVAO = 0;
+    int targetWidth = 0;
+    int targetHeight = 0;
+    int renderWidth = 1;
+    int renderHeight = 1;
+    float scale = MAX_RESOLUTION_SCALE;
+    int frames = 0;
+    double gpuTotal = 0.0;
+
+    void createTargets(int width, int height) {
+        deleteTargets();
+        targetWidth = width;
+        targetHeight = height;
+
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glGenTextures(1, &colorTexture);
+        glBindTexture(GL_TEXTURE_2D, colorTexture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, colorTexture, 0);
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        glGenRenderbuffers(1, &depthStencilBuffer);
+        glBindRenderbuffer(GL_RENDERBUFFER, depthStencilBuffer);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, depthStencilBuffer);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            std::cout << "ERROR::FRAMEBUFFER:: Scene target is not complete" << std::endl;
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+
+    void deleteTargets() {
+        glDeleteTextures(1, &colorTexture);
+        glDeleteRenderbuffers(1, &depthStencilBuffer);
+        colorTexture = depthStencilBuffer = 0;
+    }
+};
+
+// Model for rendering cubes (walls)
+class CubeModel {
+public:
+    unsigned int VAO, VBO;
+
+    CubeModel() {
+        // Vertex data for a cube with proper texture orientation for each face
+        // Format: position(3), normal(3), texcoord(2), tangent(3), bitangent(3)
+            float vertices[] = {
+                // Front face (negative Z) - Swap U coordinates (0.0f↔1.0f)
+                -0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,         1.0f, 0.0f, 0.0f,    0.0f, 1.0f, 0.0f,
+                 0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 1.0f,         1.0f, 0.0f, 0.0f,    0.0f, 1.0f, 0.0f,
+                 0.5f,  0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,         1.0f, 0.0f, 0.0f,    0.0f, 1.0f, 0.0f,
+                 0.5f,  0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,         1.0f, 0.0f, 0.0f,    0.0f, 1.0f, 0.0f,
+                -0.5f,  0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 0.0f,         1.0f, 0.0f, 0.0f,    0.0f, 1.0f, 0.0f,
+                -0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,         1.0f, 0.0f, 0.0f,    0.0f, 1.0f, 0.0f,
+
+                // Back face (positive Z) - Keep as is, already correct
+                -0.5f, -0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,        -1.0f, 0.0f, 0.0f,    0.0f, 1.0f, 0.0f,
+                 0.5f, -0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 1.0f,        -1.0f, 0.0f, 0.0f,    0.0f, 1.0f, 0.0f,
+                 0.5f,  0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,        -1.0f, 0.0f, 0.0f,    0.0f, 1.0f, 0.0f,
+                 0.5f,  0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,        -1.0f, 0.0f, 0.0f,    0.0f, 1.0f, 0.0f,
+                -0.5f,  0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 0.0f,        -1.0f, 0.0f, 0.0f,    0.0f, 1.0f, 0.0f,
+                -0.5f, -0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,        -1.0f, 0.0f, 0.0f,    0.0f, 1.0f, 0.0f,
+
+                // Left face (negative X) - Swap U coordinates (0.0f↔1.0f)
+                -0.5f,  0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  1.0f, 0.0f,         0.0f, 0.0f, -1.0f,   0.0f, 1.0f, 0.0f,
+                -0.5f,  0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 0.0f,         0.0f, 0.0f, -1.0f,   0.0f, 1.0f, 0.0f,
+                -0.5f, -0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 1.0f,         0.0f, 0.0f, -1.0f,   0.0f, 1.0f, 0.0f,
+                -0.5f, -0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 1.0f,         0.0f, 0.0f, -1.0f,   0.0f, 1.0f, 0.0f,
+                -0.5f, -0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  1.0f, 1.0f,         0.0f, 0.0f, -1.0f,   0.0f, 1.0f, 0.0f,
+                -0.5f,  0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  1.0f, 0.0f,         0.0f, 0.0f, -1.0f,   0.0f, 1.0f, 0.0f,
+
+                // Right face (positive X) - Swap U coordinates (0.0f↔1.0f)
+                 0.5f,  0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 0.0f,         0.0f, 0.0f, 1.0f,    0.0f, 1.0f, 0.0f,
+                 0.5f,  0.5f, -0.5f,  1.0f,  0.0f,  0.0f,  1.0f, 0.0f,         0.0f, 0.0f, 1.0f,    0.0f, 1.0f, 0.0f,
+                 0.5f, -0.5f, -0.5f,  1.0f,  0.0f,  0.0f,  1.0f, 1.0f,         0.0f, 0.0f, 1.0f,    0.0f, 1.0f, 0.0f,
+                 0.5f, -0.5f, -0.5f,  1.0f,  0.0f,  0.0f,  1.0f, 1.0f,         0.0f, 0.0f, 1.0f,    0.0f, 1.0f, 0.0f,
+                 0.5f, -0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 1.0f,         0.0f, 0.0f, 1.0f,    0.0f, 1.0f, 0.0f,
+                 0.5f,  0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 0.0f,         0.0f, 0.0f, 1.0f,    0.0f, 1.0f, 0.0f,
+
+                // Bottom face (negative Y) - Swap U coordinates (0.0f↔1.0f)
+                -0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 1.0f,         1.0f, 0.0f, 0.0f,    0.0f, 0.0f, -1.0f,
+                 0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,         1.0f, 0.0f, 0.0f,    0.0f, 0.0f, -1.0f,
+                 0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 0.0f,         1.0f, 0.0f, 0.0f,    0.0f, 0.0f, -1.0f,
+                 0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 0.0f,         1.0f, 0.0f, 0.0f,    0.0f, 0.0f, -1.0f,
+                -0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,         1.0f, 0.0f, 0.0f,    0.0f, 0.0f, -1.0f,
+                -0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 1.0f,         1.0f, 0.0f, 0.0f,    0.0f, 0.0f, -1.0f,
+
+                // Top face (positive Y) - Swap U coordinates (0.0f↔1.0f)
+                -0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,         1.0f, 0.0f, 0.0f,    0.0f, 0.0f, 1.0f,
+                 0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 0.0f,         1.0f, 0.0f, 0.0f,    0.0f, 0.0f, 1.0f,
+                 0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f,         1.0f, 0.0f, 0.0f,    0.0f, 0.0f, 1.0f,
+                 0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f,         1.0f, 0.0f, 0.0f,    0.0f, 0.0f, 1.0f,
+                -0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 1.0f,         1.0f, 0.0f, 0.0f,    0.0f, 0.0f, 1.0f,
+                -0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,         1.0f, 0.0f, 0.0f,    0.0f, 0.0f, 1.0f
+            };
+
+        // Generate and bind the Vertex Array Object
+        glGenVertexArrays(1, &VAO);
+        glGenBuffers(1, &VBO);
+
+        glBindVertexArray(VAO);
+
+        glBindBuffer(GL_ARRAY_BUFFER, VBO);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+
+        // Position attribute
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 14 * sizeof(float), (void*)0);
+        glEnableVertexAttribArray(0);
+
+        // Normal attribute
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 14 * sizeof(float), (void*)(3 * sizeof(float)));
+        glEnableVertexAttribArray(1);
+
+        // Texture coordinates attribute
+        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 14 * sizeof(float), (void*)(6 * sizeof(float)));
+        glEnableVertexAttribArray(2);
+
+        // Tangent attribute
+        glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, 14 * sizeof(float), (void*)(8 * sizeof(float)));
+        glEnableVertexAttribArray(3);
+
+        // Bitangent attribute
+        glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, 14 * sizeof(float), (void*)(11 * sizeof(float)));
+        glEnableVertexAttribArray(4);
+    }
+
+    void render() {
+        glBindVertexArray(VAO);
+        glDrawArrays(GL_TRIANGLES, 0, 36);
+    }
+
+    ~CubeModel() {
+        glDeleteVertexArrays(1, &VAO);
+        glDeleteBuffers(1, &VBO);
+    }
+};
+// Vertex of the map meshes, the CubeModel layout plus the baked ambient occlusion
+struct MapVertex {
+    glm::vec3 position;
+    glm::vec3 normal;
+    glm::vec2 texCoord;
+    glm::vec3 tangent;
+    glm::vec3 bitangent;
+    float occlusion;  // 0 = open, 1 = fully occluded
+};
+
+// Static walls, floor and ceiling, one mesh per culling chunk with a draw range per texture.
+// Only faces next to a lower cell are emitted. Every vertex gets ambient occlusion from the wall
+// heights of the cells around its corner, so creases with the floor and ceiling and inside corners
+// darken without any runtime pass. Texture coordinates match the scaled cubes the map used to be drawn with
+class MapMeshes {
+public:
+    static constexpr int FLOOR_TEXTURE_ID = 100;
+    static constexpr int CEILING_TEXTURE_ID = 101;
+
+    struct Batch {
+        int first;
+        int count;
+        glm::vec2 textureScale;
+    };
+
+    struct Chunk {
+        int minX, minZ, maxX, maxZ;  // Cell range
+        unsigned int VAO = 0;
+        unsigned int VBO = 0;
+        std::map<int, Batch> batches;  // By texture ID
+    };
+
+    ~MapMeshes() {
+        release();
+    }
+
+    void build(const Map& map) {
+        release();
+        double startTime = glfwGetTime();
+        mapWidth = map.width;
+        mapHeight = map.height;
+        heights = mapWallHeights(map);
+
+        size_t vertexCount = 0;
+        for (int chunkZ = 0; chunkZ < map.height; chunkZ += CHUNK_SIZE) {
+            for (int chunkX = 0; chunkX < map.width; chunkX += CHUNK_SIZE) {
+                Chunk chunk;
+                chunk.minX = chunkX;
+                chunk.minZ = chunkZ;
+                chunk.maxX = std::min(chunkX + CHUNK_SIZE, map.width) - 1;
+                chunk.maxZ = std::min(chunkZ + CHUNK_SIZE, map.height) - 1;
+
+                std::map<int, std::vector<MapVertex>> textureVertices;
+                std::map<int, glm::vec2> textureScales;
+                for (int z = chunk.minZ; z <= chunk.maxZ; z++) {
+                    for (int x = chunk.minX; x <= chunk.maxX; x++) {
+                        float height = heightAt(x, z);
+                        if (height <= 0.0f) {
+                            addFloor(textureVertices[FLOOR_TEXTURE_ID], x, z);
+                            textureScales[FLOOR_TEXTURE_ID] = glm::vec2(4.0f, 4.0f);  // Repeat texture 4 times over the map
+                        }
+                        if (height < WALL_HEIGHT) {
+                            addCeiling(textureVertices[CEILING_TEXTURE_ID], x, z);
+                            textureScales[CEILING_TEXTURE_ID] = glm::vec2(4.0f, 4.0f);
+                        }
+                        if (height > 0.0f) {
+                            int textureID = map.getTextureID(x, z);
+                            addWall(textureVertices[textureID], x, z, height);
+                            textureScales[textureID] = glm::vec2(1.0f, height / 2.0f);
+                        }
+                    }
+                }
+
+                // One buffer per chunk, the vertices of each texture back to back
+                std::vector<MapVertex> vertices;
+                for (const auto& entry : textureVertices) {
+                    if (entry.second.empty()) continue;
+                    chunk.batches[entry.first] = {static_cast<int>(vertices.size()), static_cast<int>(entry.second.size()), textureScales[entry.first]};
+                    vertices.insert(vertices.end(), entry.second.begin(), entry.second.end());
+                    textures.insert(entry.first);
+                }
+                if (vertices.empty()) continue;
+                upload(chunk, vertices);
+                vertexCount += vertices.size();
+                chunkList.push_back(std::move(chunk));
+            }
+        }
+
+        std::cout << "Map meshes built: " << chunkList.size() << " chunks, " << vertexCount << " vertices in "
+                  << (glfwGetTime() - startTime) * 1000.0 << " ms" << std::endl;
+    }
+
+    const std::vector<Chunk>& chunks() const {
+        return chunkList;
+    }
+
+    // Every texture ID some chunk has a batch for
+    const std::set<int>& textureIDs() const {
+        return textures;
+    }
+
+    void draw(const Chunk& chunk, const Batch& batch) const {
+        glBindVertexArray(chunk.VAO);
+        glDrawArrays(GL_TRIANGLES, batch.first, batch.count);
+    }
+
+private:
+    std::vector<Chunk> chunkList;
+    std::set<int> textures;
+    std::vector<float> heights;
+    int mapWidth = 0;
+    int mapHeight = 0;
+
+    // Top and bottom of the floor and ceiling slabs the map used to be drawn with, both 0.1 thick
+    static constexpr float FLOOR_Y = 0.05f;
+    static inline const float CEILING_Y = WALL_HEIGHT - 0.05f;
+
+    // Wall height of a cell, cells outside the map and missing from it are open
+    float heightAt(int x, int z) const {
+        if (x < 0 || z < 0 || x >= mapWidth || z >= mapHeight) return 0.0f;
+        return std::max(heights[x + z * mapWidth], 0.0f);
+    }
+
+    // Occlusion of a vertex from its two side neighbours and the diagonal one, a corner with both
+    // sides blocked is fully occluded whatever the diagonal
+    static float vertexOcclusion(bool side1, bool side2, bool corner) {
+        int blocked = (side1 && side2) ? 3 : side1 + side2 + corner;
+        return blocked / 3.0f * AMBIENT_OCCLUSION_STRENGTH;
+    }
+
+    // Two triangles facing the corners' normal, split along the diagonal whose ends are most alike so
+    // a single dark or bright corner fades evenly
+    static void addQuad(std::vector<MapVertex>& out, MapVertex corners[4]) {
+        glm::vec3 facing = glm::cross(corners[1].position - corners[0].position, corners[2].position - corners[0].position);
+        if (glm::dot(facing, corners[0].normal) < 0.0f) std::swap(corners[1], corners[3]);
+
+        const int splitA[6] = {0, 1, 2, 0, 2, 3};
+        const int splitB[6] = {1, 2, 3, 1, 3, 0};
+        bool useA = std::fabs(corners[0].occlusion - corners[2].occlusion) <= std::fabs(corners[1].occlusion - corners[3].occlusion);
+        for (int i : (useA ? splitA : splitB)) out.push_back(corners[i]);
+    }
+
+    // Horizontal face of cell (x, z) at height y, blocks tells if a neighbour of that wall height occludes it
+    void addHorizontal(std::vector<MapVertex>& out, int x, int z, float y, bool facingUp,
+                       const std::function<bool(float)>& blocks, const std::function<glm::vec2(float, float)>& texCoord) {
+        MapVertex corners[4];
+        const int cornerOffsets[4][2] = {{0, 0}, {1, 0}, {1, 1}, {0, 1}};
+        for (int i = 0; i < 4; i++) {
+            int dx = cornerOffsets[i][0] ? 1 : -1;
+            int dz = cornerOffsets[i][1] ? 1 : -1;
+            float worldX = (x + cornerOffsets[i][0]) * CELL_SIZE;
+            float worldZ = (z + cornerOffsets[i][1]) * CELL_SIZE;
+
+            MapVertex& v = corners[i];
+            v.position = glm::vec3(worldX, y, worldZ);
+            v.normal = glm::vec3(0.0f, facingUp ? 1.0f : -1.0f, 0.0f);
+            v.texCoord = texCoord(worldX, worldZ);
+            v.tangent = glm::vec3(1.0f, 0.0f, 0.0f);
+            v.bitangent = glm::vec3(0.0f, 0.0f, facingUp ? 1.0f : -1.0f);
+            v.occlusion = vertexOcclusion(blocks(heightAt(x + dx, z)), blocks(heightAt(x, z + dz)), blocks(heightAt(x + dx, z + dz)));
+        }
+        addQuad(out, corners);
+    }
+
+    void addFloor(std::vector<MapVertex>& out, int x, int z) {
+        float mapSizeX = mapWidth * CELL_SIZE;
+        float mapSizeZ = mapHeight * CELL_SIZE;
+        addHorizontal(out, x, z, FLOOR_Y, true,
+                      [](float height) { return height > 0.0f; },
+                      [=](float worldX, float worldZ) { return glm::vec2(1.0f - worldX / mapSizeX, worldZ / mapSizeZ); });
+    }
+
+    void addCeiling(std::vector<MapVertex>& out, int x, int z) {
+        float mapSizeX = mapWidth * CELL_SIZE;
+        float mapSizeZ = mapHeight * CELL_SIZE;
+        addHorizontal(out, x, z, CEILING_Y, false,
+                      [](float height) { return height >= WALL_HEIGHT; },
+                      [=](float worldX, float worldZ) { return glm::vec2(1.0f - worldX / mapSizeX, 1.0f - worldZ / mapSizeZ); });
+    }
+
+    // Sides of wall cell (x, z) above each lower neighbour and the top of a half height wall
+    void addWall(std::vector<MapVertex>& out, int x, int z, float height) {
+        if (height < WALL_HEIGHT) {
+            addHorizontal(out, x, z, height, true,
+                          [=](float neighbour) { return neighbour > height; },
+                          [=](float worldX, float worldZ) { return glm::vec2(1.0f - (worldX / CELL_SIZE - x), worldZ / CELL_SIZE - z); });
+        }
+
+        // Outward normal, tangent and the axis the cube's texture U grows along for -Z, +Z, -X, +X
+        struct Side {
+            int dx, dz;
+            glm::vec3 tangent;
+            glm::vec3 uAxis;
+        };
+        const Side sides[4] = {
+            {0, -1, glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(-1.0f, 0.0f, 0.0f)},
+            {0, 1, glm::vec3(-1.0f, 0.0f, 0.0f), glm::vec3(-1.0f, 0.0f, 0.0f)},
+            {-1, 0, glm::vec3(0.0f, 0.0f, -1.0f), glm::vec3(0.0f, 0.0f, 1.0f)},
+            {1, 0, glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(0.0f, 0.0f, -1.0f)},
+        };
+        for (const Side& side : sides) {
+            int openX = x + side.dx;
+            int openZ = z + side.dz;
+            float bottom = heightAt(openX, openZ);
+            if (bottom >= height) continue;
+
+            // Rows at the bottom and top crease and one band inside each, so crease darkening stays near the edge
+            float band = std::min(AMBIENT_OCCLUSION_BAND, (height - bottom) * 0.5f);
+            std::vector<float> rows = {bottom, bottom + band};
+            if (height - band > bottom + band) rows.push_back(height - band);
+            rows.push_back(height);
+
+            // The face's two vertical edges, an edge is an inside corner where the cell beside the open one is a wall
+            int alongX = side.dz != 0 ? 1 : 0;
+            int alongZ = side.dx != 0 ? 1 : 0;
+            float edgeX[2], edgeZ[2], lateral[2];
+            for (int e = 0; e < 2; e++) {
+                int s = e == 0 ? -1 : 1;
+                edgeX[e] = (x + (side.dx != 0 ? (side.dx > 0 ? 1 : 0) : (s > 0 ? 1 : 0))) * CELL_SIZE;
+                edgeZ[e] = (z + (side.dz != 0 ? (side.dz > 0 ? 1 : 0) : (s > 0 ? 1 : 0))) * CELL_SIZE;
+                lateral[e] = heightAt(openX + s * alongX, openZ + s * alongZ);
+            }
+
+            for (size_t r = 0; r + 1 < rows.size(); r++) {
+                MapVertex corners[4];
+                const int rowOf[4] = {0, 0, 1, 1};
+                const int edgeOf[4] = {0, 1, 1, 0};
+                for (int i = 0; i < 4; i++) {
+                    float y = rows[r + rowOf[i]];
+                    int e = edgeOf[i];
+                    bool creased = y == bottom || (y == height && height >= WALL_HEIGHT);
+                    bool besideWall = lateral[e] >= y && lateral[e] > bottom;
+
+                    // Same texture coordinates as the cube face
+                    float localX = edgeX[e] / CELL_SIZE - x - 0.5f;
+                    float localZ = edgeZ[e] / CELL_SIZE - z - 0.5f;
+                    float u = glm::dot(glm::vec3(localX, 0.0f, localZ), side.uAxis) + 0.5f;
+
+                    MapVertex& v = corners[i];
+                    v.position = glm::vec3(edgeX[e], y, edgeZ[e]);
+                    v.normal = glm::vec3(static_cast<float>(side.dx), 0.0f, static_cast<float>(side.dz));
+                    v.texCoord = glm::vec2(u, 1.0f - y / height);
+                    v.tangent = side.tangent;
+                    v.bitangent = glm::vec3(0.0f, 1.0f, 0.0f);
+                    v.occlusion = vertexOcclusion(creased, besideWall, creased);
+                }
+                addQuad(out, corners);
+            }
+        }
+    }
+
+    void upload(Chunk& chunk, const std::vector<MapVertex>& vertices) {
+        glGenVertexArrays(1, &chunk.VAO);
+        glGenBuffers(1, &chunk.VBO);
+        glBindVertexArray(chunk.VAO);
+        glBindBuffer(GL_ARRAY_BUFFER, chunk.VBO);
+        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(MapVertex), vertices.data(), GL_STATIC_DRAW);
+
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(MapVertex), (void*)offsetof(MapVertex, position));
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(MapVertex), (void*)offsetof(MapVertex, normal));
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(MapVertex), (void*)offsetof(MapVertex, texCoord));
+        glEnableVertexAttribArray(2);
+        glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(MapVertex), (void*)offsetof(MapVertex, tangent));
+        glEnableVertexAttribArray(3);
+        glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, sizeof(MapVertex), (void*)offsetof(MapVertex, bitangent));
+        glEnableVertexAttribArray(4);
+        // Other meshes leave attribute 5 disabled, its default value 0 means no occlusion
+        glVertexAttribPointer(5, 1, GL_FLOAT, GL_FALSE, sizeof(MapVertex), (void*)offsetof(MapVertex, occlusion));
+        glEnableVertexAttribArray(5);
+        glBindVertexArray(0);
+    }
+
+    void release() {
+        for (Chunk& chunk : chunkList) {
+            glDeleteVertexArrays(1, &chunk.VAO);
+            glDeleteBuffers(1, &chunk.VBO);
+        }
+        chunkList.clear();
+        textures.clear();
+    }
+};
+
+// Shading LOD of every map mesh chunk. A chunk moves one level out when its distance passes the next
+// SHADING_LOD_DISTANCES entry and back only once it is SHADING_LOD_HYSTERESIS inside it, so a camera
+// standing near a boundary does not flip the chunk between variants every frame
+class ShadingLod {
+public:
+    // One draw of a chunk, a chunk in a dithered transition is drawn at both levels
+    struct Draw {
+        int lod;
+        bool dithered;
+        glm::vec2 ditherRange;  // Part of the dither pattern drawn, [0, 1) is every pixel
+    };
+
+    // Move every chunk to its level for this camera position. maxLod caps the level to what the
+    // render path can draw, chunks above it drop to it without a transition
+    void update(const std::vector<MapMeshes::Chunk>& chunks, const glm::vec3& cameraPos, int maxLod, float time) {
+        states.resize(chunks.size());
+        for (size_t i = 0; i < chunks.size(); i++) {
+            const MapMeshes::Chunk& chunk = chunks[i];
+            ChunkState& state = states[i];
+            if (state.fadeStart >= 0.0f && time - state.fadeStart >= SHADING_LOD_FADE_TIME) state.fadeStart = -1.0f;
+
+            int lod = 0;
+            if (shadingLodMode != SHADING_LOD_OFF) {
+                float distance = distanceToRectXZ(cameraPos,
+                                                  chunk.minX * CELL_SIZE, chunk.minZ * CELL_SIZE,
+                                                  (chunk.maxX + 1) * CELL_SIZE, (chunk.maxZ + 1) * CELL_SIZE);
+                lod = state.lod;
+                while (lod < MAX_SHADING_LOD && distance > SHADING_LOD_DISTANCES[lod]) lod++;
+                while (lod > 0 && distance < SHADING_LOD_DISTANCES[lod - 1] - SHADING_LOD_HYSTERESIS) lod--;
+            }
+
+            if (lod > maxLod || state.lod > maxLod || (state.fadeStart >= 0.0f && state.previousLod > maxLod)) {
+                lod = std::min(lod, maxLod);
+                state.fadeStart = -1.0f;
+            } else if (lod != state.lod && shadingLodMode == SHADING_LOD_DITHERED) {
+                state.previousLod = state.lod;
+                state.fadeStart = time;
+            }
+            state.lod = lod;
+        }
+    }
+
+    // Draws of a chunk this frame, the new level covers more of the dither pattern as its transition goes on
+    int draws(size_t chunk, float time, Draw out[2]) const {
+        const ChunkState& state = states[chunk];
+        if (state.fadeStart < 0.0f) {
+            out[0] = {state.lod, false, glm::vec2(0.0f, 1.0f)};
+            return 1;
+        }
+        float fade = std::min((time - state.fadeStart) / SHADING_LOD_FADE_TIME, 1.0f);
+        out[0] = {state.previousLod, true, glm::vec2(fade, 1.0f)};
+        out[1] = {state.lod, true, glm::vec2(0.0f, fade)};
+        return 2;
+    }
+
+private:
+    struct ChunkState {
+        int lod = 0;
+        int previousLod = 0;      // Level faded out while a dithered transition runs
+        float fadeStart = -1.0f;  // Time the transition started, negative when there is none
+    };
+
+    std::vector<ChunkState> states;
+};
+
+// VRAM of the textures against textureBudgetMegabytes. Each texture is added with its size and how its owner
+// shrinks and restores it. Binding a texture marks it used, and at the end of a frame over the budget the
+// least recently used textures are shrunk until the rest fits. A shrunk texture is restored when it is bound
+// again. GL thread only
+class TextureResidency {
+public:
+    using Shrink = std::function<size_t()>;  // Frees what it can of the texture, returns the size left
+    using Restore = std::function<void()>;
+
+    void add(unsigned int texture, size_t bytes, Shrink shrink, Restore restore) {
+        remove(texture);
+        textures[texture] = {bytes, frame, false, std::move(shrink), std::move(restore)};
+        totalBytes += bytes;
+    }
+
+    void remove(unsigned int texture) {
+        auto it = textures.find(texture);
+        if (it == textures.end()) return;
+        totalBytes -= it->second.bytes;
+        textures.erase(it);
+    }
+
+    // New size of a texture after its owner uploaded or dropped levels
+    void setBytes(unsigned int texture, size_t bytes) {
+        auto it = textures.find(texture);
+        if (it == textures.end()) return;
+        totalBytes = totalBytes - it->second.bytes + bytes;
+        it->second.bytes = bytes;
+    }
+
+    // Mark a texture used this frame, restoring it if it was shrunk. Call before binding it
+    void use(unsigned int texture) {
+        auto it = textures.find(texture);
+        if (it == textures.end()) return;
+        it->second.lastUse = frame;
+        if (it->second.shrunk) {
+            it->second.shrunk = false;
+            it->second.restore();
+        }
+    }
+
+    // Shrink the least recently used textures until the rest fits the budget. Textures used this frame are
+    // kept, so a view that needs more than the budget stays over it
+    void endFrame() {
+        size_t budget = static_cast<size_t>(textureBudgetMegabytes) * 1024 * 1024;
+        if (totalBytes > budget) {
+            std::vector<std::pair<unsigned int, unsigned int>> candidates;  // Last use and texture
+            for (const auto& entry : textures) {
+                if (!entry.second.shrunk && entry.second.lastUse != frame) candidates.push_back({entry.second.lastUse, entry.first});
+            }
+            std::sort(candidates.begin(), candidates.end());
+            for (size_t i = 0; i < candidates.size() && totalBytes > budget; i++) {
+                Entry& entry = textures[candidates[i].second];
+                size_t bytes = entry.shrink();
+                entry.shrunk = bytes < entry.bytes;  // Streamed textures already at their tail have nothing to free
+                totalBytes = totalBytes - entry.bytes + bytes;
+                entry.bytes = bytes;
+            }
+        }
+        frame++;
+    }
+
+    double megabytes() const {
+        return totalBytes / (1024.0 * 1024.0);
+    }
+
+    // True while a texture waits for its next use to be restored
+    bool shrunk(unsigned int texture) const {
+        auto it = textures.find(texture);
+        return it != textures.end() && it->second.shrunk;
+    }
+
+    int shrunkTextures() const {
+        int count = 0;
+        for (const auto& entry : textures) count += entry.second.shrunk;
+        return count;
+    }
+
+private:
+    struct Entry {
+        size_t bytes;
+        unsigned int lastUse;  // Frame
+        bool shrunk;
+        Shrink shrink;
+        Restore restore;
+    };
+
+    std::unordered_map<unsigned int, Entry> textures;  // By texture name
+    size_t totalBytes = 0;
+    unsigned int frame = 0;
+};
+
+TextureResidency textureResidency;
+
+// Replace every level of a texture with a 1x1 placeholder, returns the placeholder's size
+size_t replaceWithPlaceholder(unsigned int texture, const unsigned char* placeholder) {
+    glBindTexture(GL_TEXTURE_2D, texture);
+    int width = 1, height = 1;
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
+    // GL 3.3 has no way to free a level but to redefine it empty
+    int topLevel = static_cast<int>(std::floor(std::log2(std::max(std::max(width, height), 1))));
+    for (int level = topLevel; level > 0; level--) {
+        glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA8, 0, 0, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    }
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, placeholder);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return 4;
+}
+
+// Vertex structure for 3D models
+struct Vertex {
+    glm::vec3 Position;
+    glm::vec3 Normal;
+    glm::vec2 TexCoords;
+};
+
+// Texture structure for model textures
+struct Texture {
+    unsigned int id;
+    std::string type;
+    std::string path;
+};
+
+// Mesh class to handle individual meshes in a model
+class Mesh {
+public:
+    // Mesh Data
+    std::vector<Vertex> vertices;
+    std::vector<unsigned int> indices;
+    std::vector<Texture> textures;
+
+    // Constructor
+    Mesh(std::vector<Vertex> vertices, std::vector<unsigned int> indices, std::vector<Texture> textures) {
+        this->vertices = vertices;
+        this->indices = indices;
+        this->textures = textures;
+
+        // Now set up mesh and buffer objects
+        setupMesh();
+    }
+
+    // Render the mesh
+    void Draw(Shader &shader) {
+        // Bind appropriate textures
+        unsigned int diffuseNr = 1;
+        unsigned int specularNr = 1;
+        unsigned int normalNr = 1;
+        unsigned int heightNr = 1;
+
+        for(unsigned int i = 0; i < textures.size(); i++) {
+            glActiveTexture(GL_TEXTURE0 + i); // Active proper texture unit before binding
+            // Retrieve texture number (the N in diffuse_textureN)
+            std::string number;
+            std::string name = textures[i].type;
+            if(name == "texture_diffuse")
+                number = std::to_string(diffuseNr++);
+            else if(name == "texture_specular")
+                number = std::to_string(specularNr++);
+            else if(name == "texture_normal")
+                number = std::to_string(normalNr++);
+            else if(name == "texture_height")
+                number = std::to_string(heightNr++);
+
+            // Set the sampler to the correct texture unit
+            shader.setInt((name + number).c_str(), i);
+            // Bind the texture
+            textureResidency.use(textures[i].id);
+            glBindTexture(GL_TEXTURE_2D, textures[i].id);
+        }
+
+        // Draw mesh
+        glBindVertexArray(VAO);
+        glDrawElements(GL_TRIANGLES, static_cast<unsigned int>(indices.size()), GL_UNSIGNED_INT, 0);
+        glBindVertexArray(0);
+
+        // Reset to default texture unit
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+private:
+    // Render data
+    unsigned int VAO, VBO, EBO;
+
+    // Initializes all the buffer objects/arrays
+    void setupMesh() {
         // Create buffers/arrays
         glGenVertexArrays(1, &VAO);
         glGenBuffers(1, &VBO);
@@ -592,6 +3962,689 @@ private:
     }
 };
 
+// 64-bit xxHash (XXH64) of a block of bytes
+uint64_t hashBytes(const unsigned char* data, size_t size, uint64_t seed = 0) {
+    const uint64_t PRIME1 = 11400714785074694791ULL;
+    const uint64_t PRIME2 = 14029467366897019727ULL;
+    const uint64_t PRIME3 = 1609587929392839161ULL;
+    const uint64_t PRIME4 = 9650029242287828579ULL;
+    const uint64_t PRIME5 = 2870177450012600261ULL;
+    auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+    auto mixLane = [&](uint64_t acc, uint64_t input) { return rotl(acc + input * PRIME2, 31) * PRIME1; };
+    auto read64 = [](const unsigned char* p) { uint64_t v; std::memcpy(&v, p, 8); return v; };
+    auto read32 = [](const unsigned char* p) { uint32_t v; std::memcpy(&v, p, 4); return v; };
+
+    const unsigned char* p = data;
+    const unsigned char* end = data + size;
+    uint64_t h;
+    if (size >= 32) {
+        uint64_t v[4] = {seed + PRIME1 + PRIME2, seed + PRIME2, seed, seed - PRIME1};
+        for (; p + 32 <= end; p += 32) {
+            for (int i = 0; i < 4; i++) v[i] = mixLane(v[i], read64(p + i * 8));
+        }
+        h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+        for (int i = 0; i < 4; i++) h = (h ^ mixLane(0, v[i])) * PRIME1 + PRIME4;
+    } else {
+        h = seed + PRIME5;
+    }
+    h += size;
+
+    for (; p + 8 <= end; p += 8) h = rotl(h ^ mixLane(0, read64(p)), 27) * PRIME1 + PRIME4;
+    if (p + 4 <= end) {
+        h = rotl(h ^ (read32(p) * PRIME1), 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++) h = rotl(h ^ (*p * PRIME5), 11) * PRIME1;
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+// Whole file, empty if it could not be read
+std::vector<unsigned char> readFileBytes(const std::string& filename) {
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    if (!file.is_open()) return {};
+    std::vector<unsigned char> bytes(static_cast<size_t>(file.tellg()));
+    file.seekg(0);
+    if (!file.read(reinterpret_cast<char*>(bytes.data()), bytes.size())) return {};
+    return bytes;
+}
+
+// Identity of an image: the file contents and the channels it is decoded to
+uint64_t imageContentKey(const std::vector<unsigned char>& bytes, int desiredChannels) {
+    return hashBytes(bytes.data(), bytes.size(), static_cast<uint64_t>(desiredChannels));
+}
+
+// Identity of a texture for sharing: the image and what it was fitted and encoded to, so copies of one
+// image loaded under different maximum sizes or encodings stay separate textures, like in the texture cache
+uint64_t textureShareKey(uint64_t content, int maxSize, TextureEncoding encoding) {
+    uint64_t fields[3] = {content, static_cast<uint64_t>(maxSize), static_cast<uint64_t>(encoding)};
+    return hashBytes(reinterpret_cast<const unsigned char*>(fields), sizeof(fields), 0);
+}
+
+// Decode to desiredChannels, 0 keeps the file's channels. 1 is the grey level, 2 keeps red and green for
+// normal maps where stbi_load would make grey and alpha. The pixels are freed with stbi_image_free
+unsigned char* decodeImage(const std::vector<unsigned char>& bytes, int desiredChannels, int& width, int& height, int& channels) {
+    unsigned char* pixels = stbi_load_from_memory(bytes.data(), static_cast<int>(bytes.size()), &width, &height, &channels,
+                                                  desiredChannels == 2 ? 3 : desiredChannels);
+    if (pixels == nullptr) return nullptr;
+    if (desiredChannels == 2) {
+        size_t texels = static_cast<size_t>(width) * height;
+        for (size_t i = 0; i < texels; i++) {
+            pixels[i * 2] = pixels[i * 3];
+            pixels[i * 2 + 1] = pixels[i * 3 + 1];
+        }
+    }
+    if (desiredChannels > 0) channels = desiredChannels;
+    return pixels;
+}
+
+// Halve an image with a 2x2 box filter. The rows are summed 16 bytes at a time with SSE2, the horizontal
+// pairs are summed per channel. An odd last row or column is dropped, like in a mip chain
+void halveImage(const unsigned char* source, int width, int height, int channels, unsigned char* destination) {
+    int halfWidth = std::max(width / 2, 1);
+    int halfHeight = std::max(height / 2, 1);
+    size_t rowBytes = static_cast<size_t>(width) * channels;
+    std::vector<uint16_t> rowSums(rowBytes);
+
+    for (int y = 0; y < halfHeight; y++) {
+        const unsigned char* row0 = source + static_cast<size_t>(2 * y) * rowBytes;
+        const unsigned char* row1 = source + static_cast<size_t>(std::min(2 * y + 1, height - 1)) * rowBytes;
+        size_t i = 0;
+#ifdef TEXTURE_USE_SSE2
+        __m128i zero = _mm_setzero_si128();
+        for (; i + 16 <= rowBytes; i += 16) {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row0 + i));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row1 + i));
+            __m128i low = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+            __m128i high = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(&rowSums[i]), low);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(&rowSums[i + 8]), high);
+        }
+#endif
+        for (; i < rowBytes; i++) {
+            rowSums[i] = static_cast<uint16_t>(row0[i] + row1[i]);
+        }
+
+        unsigned char* out = destination + static_cast<size_t>(y) * halfWidth * channels;
+        for (int x = 0; x < halfWidth; x++) {
+            const uint16_t* left = &rowSums[static_cast<size_t>(2 * x) * channels];
+            const uint16_t* right = &rowSums[static_cast<size_t>(std::min(2 * x + 1, width - 1)) * channels];
+            for (int c = 0; c < channels; c++) {
+                out[x * channels + c] = static_cast<unsigned char>((left[c] + right[c] + 2) >> 2);
+            }
+        }
+    }
+}
+
+// Halve a decoded image until neither side is over maxSize. The pixels stay freeable with stbi_image_free
+unsigned char* fitImage(unsigned char* pixels, int& width, int& height, int channels, int maxSize) {
+    while (pixels != nullptr && std::max(width, height) > maxSize) {
+        int halfWidth = std::max(width / 2, 1);
+        int halfHeight = std::max(height / 2, 1);
+        unsigned char* half = static_cast<unsigned char*>(STBI_MALLOC(static_cast<size_t>(halfWidth) * halfHeight * channels));
+        if (half == nullptr) break;
+        halveImage(pixels, width, height, channels, half);
+        stbi_image_free(pixels);
+        pixels = half;
+        width = halfWidth;
+        height = halfHeight;
+    }
+    return pixels;
+}
+
+// Approximate GPU memory of an 8 bit texture with its mip chain
+double textureMegabytes(int width, int height, int channels) {
+    return static_cast<double>(width) * height * channels * 4.0 / 3.0 / (1024.0 * 1024.0);
+}
+
+// Round a color to RGB565 and back
+uint16_t packRGB565(const unsigned char* rgb) {
+    return static_cast<uint16_t>(((rgb[0] * 31 + 127) / 255) << 11 | ((rgb[1] * 63 + 127) / 255) << 5 | ((rgb[2] * 31 + 127) / 255));
+}
+
+void unpackRGB565(uint16_t color, int* rgb) {
+    int r = color >> 11, g = (color >> 5) & 63, b = color & 31;
+    rgb[0] = (r << 3) | (r >> 2);
+    rgb[1] = (g << 2) | (g >> 4);
+    rgb[2] = (b << 3) | (b >> 2);
+}
+
+// BC1 block of 16 RGBA texels. The endpoints are the texels furthest apart along the block's main color
+// axis, found by power iteration on the color covariance, and every texel takes the nearest palette color
+void encodeBC1Block(const unsigned char* rgba, unsigned char* out) {
+    float mean[3] = {0.0f, 0.0f, 0.0f};
+    for (int i = 0; i < 16; i++) {
+        for (int c = 0; c < 3; c++) mean[c] += rgba[i * 4 + c] / 16.0f;
+    }
+    float covariance[3][3] = {};
+    for (int i = 0; i < 16; i++) {
+        float d[3] = {rgba[i * 4] - mean[0], rgba[i * 4 + 1] - mean[1], rgba[i * 4 + 2] - mean[2]};
+        for (int a = 0; a < 3; a++) {
+            for (int b = 0; b < 3; b++) covariance[a][b] += d[a] * d[b];
+        }
+    }
+    float axis[3] = {1.0f, 1.0f, 1.0f};
+    for (int iteration = 0; iteration < 4; iteration++) {
+        float next[3];
+        for (int a = 0; a < 3; a++) next[a] = covariance[a][0] * axis[0] + covariance[a][1] * axis[1] + covariance[a][2] * axis[2];
+        float length = std::max(std::max(std::fabs(next[0]), std::fabs(next[1])), std::fabs(next[2]));
+        if (length < 1e-6f) break;
+        for (int a = 0; a < 3; a++) axis[a] = next[a] / length;
+    }
+
+    int minTexel = 0, maxTexel = 0;
+    float minDot = 1e30f, maxDot = -1e30f;
+    for (int i = 0; i < 16; i++) {
+        float dot = rgba[i * 4] * axis[0] + rgba[i * 4 + 1] * axis[1] + rgba[i * 4 + 2] * axis[2];
+        if (dot < minDot) { minDot = dot; minTexel = i; }
+        if (dot > maxDot) { maxDot = dot; maxTexel = i; }
+    }
+
+    // color0 > color1 selects the 4 color mode, equal endpoints leave every index at 0
+    uint16_t color0 = packRGB565(&rgba[maxTexel * 4]);
+    uint16_t color1 = packRGB565(&rgba[minTexel * 4]);
+    if (color0 < color1) std::swap(color0, color1);
+    uint32_t indices = 0;
+    if (color0 != color1) {
+        int palette[4][3];
+        unpackRGB565(color0, palette[0]);
+        unpackRGB565(color1, palette[1]);
+        for (int c = 0; c < 3; c++) {
+            palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+            palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+        }
+        for (int i = 0; i < 16; i++) {
+            int best = 0, bestError = 1 << 30;
+            for (int p = 0; p < 4; p++) {
+                int dr = rgba[i * 4] - palette[p][0], dg = rgba[i * 4 + 1] - palette[p][1], db = rgba[i * 4 + 2] - palette[p][2];
+                int error = dr * dr + dg * dg + db * db;
+                if (error < bestError) { bestError = error; best = p; }
+            }
+            indices |= static_cast<uint32_t>(best) << (2 * i);
+        }
+    }
+    out[0] = color0 & 0xff;
+    out[1] = color0 >> 8;
+    out[2] = color1 & 0xff;
+    out[3] = color1 >> 8;
+    for (int i = 0; i < 4; i++) out[4 + i] = (indices >> (8 * i)) & 0xff;
+}
+
+// BC4 block of 16 values taken every stride bytes, in the 8 value mode between the block's min and max
+void encodeBC4Block(const unsigned char* values, int stride, unsigned char* out) {
+    int high = 0, low = 255;
+    for (int i = 0; i < 16; i++) {
+        high = std::max(high, static_cast<int>(values[i * stride]));
+        low = std::min(low, static_cast<int>(values[i * stride]));
+    }
+    uint64_t indices = 0;
+    if (high > low) {
+        // Index 0 is the max, 1 the min and 2..7 the steps from max to min
+        for (int i = 0; i < 16; i++) {
+            int step = ((high - values[i * stride]) * 7 + (high - low) / 2) / (high - low);
+            uint64_t index = step == 0 ? 0 : step == 7 ? 1 : step + 1;
+            indices |= index << (3 * i);
+        }
+    }
+    out[0] = static_cast<unsigned char>(high);
+    out[1] = static_cast<unsigned char>(low);
+    for (int i = 0; i < 6; i++) out[2 + i] = (indices >> (8 * i)) & 0xff;
+}
+
+// Block compressed image with its whole mip chain, level 0 first
+struct CompressedImage {
+    GLenum format = 0;
+    int width = 0;
+    int height = 0;
+    std::vector<std::vector<unsigned char>> levels;
+
+    static int blockBytes(GLenum format) {
+        return format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT || format == GL_COMPRESSED_RED_RGTC1 ? 8 : 16;
+    }
+
+    size_t bytes() const {
+        size_t total = 0;
+        for (const std::vector<unsigned char>& level : levels) total += level.size();
+        return total;
+    }
+
+    // Size of a mip level of a texture with this level 0 size
+    static size_t levelBytes(GLenum format, int width, int height, int level) {
+        int levelWidth = std::max(width >> level, 1);
+        int levelHeight = std::max(height >> level, 1);
+        return static_cast<size_t>((levelWidth + 3) / 4) * ((levelHeight + 3) / 4) * blockBytes(format);
+    }
+};
+
+// Encode an image and the mip levels halved from it. Block rows are split over the pool if there is one
+CompressedImage compressImage(const unsigned char* pixels, int width, int height, int channels, TextureEncoding encoding,
+                              ThreadPool* pool) {
+    CompressedImage image;
+    image.width = width;
+    image.height = height;
+    bool alpha = false;
+    if (encoding == TEXTURE_ENCODING_COLOR && (channels == 2 || channels == 4)) {
+        size_t texels = static_cast<size_t>(width) * height;
+        for (size_t i = 0; i < texels && !alpha; i++) alpha = pixels[i * channels + channels - 1] < 255;
+    }
+    if (encoding == TEXTURE_ENCODING_NORMAL) {
+        image.format = GL_COMPRESSED_RG_RGTC2;
+    } else if (encoding == TEXTURE_ENCODING_SINGLE) {
+        image.format = GL_COMPRESSED_RED_RGTC1;
+    } else {
+        image.format = alpha ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+    }
+    int blockBytes = CompressedImage::blockBytes(image.format);
+
+    std::vector<unsigned char> current(pixels, pixels + static_cast<size_t>(width) * height * channels);
+    while (true) {
+        int blocksX = (width + 3) / 4;
+        int blocksY = (height + 3) / 4;
+        std::vector<unsigned char> level(static_cast<size_t>(blocksX) * blocksY * blockBytes);
+        auto encodeRow = [&](int by) {
+            unsigned char rgba[64];
+            for (int bx = 0; bx < blocksX; bx++) {
+                // Edge blocks repeat the last row and column
+                for (int i = 0; i < 16; i++) {
+                    int x = std::min(bx * 4 + i % 4, width - 1);
+                    int y = std::min(by * 4 + i / 4, height - 1);
+                    const unsigned char* texel = &current[(static_cast<size_t>(y) * width + x) * channels];
+                    rgba[i * 4] = texel[0];
+                    rgba[i * 4 + 1] = channels >= 3 ? texel[1] : texel[0];
+                    rgba[i * 4 + 2] = channels >= 3 ? texel[2] : texel[0];
+                    rgba[i * 4 + 3] = channels == 4 ? texel[3] : channels == 2 ? texel[1] : 255;
+                }
+                if (encoding == TEXTURE_ENCODING_NORMAL && channels == 2) {
+                    for (int i = 0; i < 16; i++) rgba[i * 4 + 1] = rgba[i * 4 + 3];
+                }
+
+                unsigned char* out = &level[(static_cast<size_t>(by) * blocksX + bx) * blockBytes];
+                if (image.format == GL_COMPRESSED_RG_RGTC2) {
+                    encodeBC4Block(rgba, 4, out);
+                    encodeBC4Block(rgba + 1, 4, out + 8);
+                } else if (image.format == GL_COMPRESSED_RED_RGTC1) {
+                    encodeBC4Block(rgba, 4, out);
+                } else if (image.format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT) {
+                    encodeBC4Block(rgba + 3, 4, out);  // The BC3 alpha block is a BC4 block
+                    encodeBC1Block(rgba, out + 8);
+                } else {
+                    encodeBC1Block(rgba, out);
+                }
+            }
+        };
+        if (pool != nullptr && blocksY > 1) {
+            pool->parallelFor(blocksY, encodeRow);
+        } else {
+            for (int by = 0; by < blocksY; by++) encodeRow(by);
+        }
+        image.levels.push_back(std::move(level));
+
+        if (width == 1 && height == 1) break;
+        std::vector<unsigned char> half(static_cast<size_t>(std::max(width / 2, 1)) * std::max(height / 2, 1) * channels);
+        halveImage(current.data(), width, height, channels, half.data());
+        current.swap(half);
+        width = std::max(width / 2, 1);
+        height = std::max(height / 2, 1);
+    }
+    return image;
+}
+
+// Block compressed textures stored on disk as KTX 1 files, so later launches skip decoding and encoding
+class TextureCache {
+public:
+    // Whether the driver can sample an encoding block compressed, BC4 and BC5 are core but BC1 and BC3 are not
+    static bool canCompress(TextureEncoding encoding) {
+        return useTextureCompression && (encoding != TEXTURE_ENCODING_COLOR || GLEW_EXT_texture_compression_s3tc);
+    }
+
+    // Compressed image for a file from the cache, or decoded, fitted under maxSize, encoded and stored in the
+    // cache. fromCache tells which. False if the file does not decode
+    static bool loadOrEncode(const std::vector<unsigned char>& bytes, uint64_t content, int desiredChannels, int maxSize,
+                             TextureEncoding encoding, ThreadPool* pool, CompressedImage& image, bool& fromCache) {
+        std::string cachePath = path(content, maxSize, encoding);
+        fromCache = load(cachePath, image);
+        if (fromCache) return true;
+
+        int width, height, channels;
+        unsigned char* pixels = decodeImage(bytes, desiredChannels, width, height, channels);
+        pixels = fitImage(pixels, width, height, channels, maxSize);
+        if (pixels == nullptr) return false;
+        image = compressImage(pixels, width, height, channels, encoding, pool);
+        stbi_image_free(pixels);
+        save(cachePath, image);
+        return true;
+    }
+
+    // Upload the levels from firstLevel to the last into the bound texture, the finer ones are left out
+    static void upload(const CompressedImage& image, int firstLevel = 0) {
+        int levelCount = static_cast<int>(image.levels.size());
+        for (int level = firstLevel; level < levelCount; level++) {
+            uploadLevel(image, level, image.levels[level]);
+        }
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levelCount - 1);
+    }
+
+    // Upload a range read by load(path, firstLevel, endLevel, image), whose first level is firstLevel
+    static void uploadRange(const CompressedImage& image, int firstLevel) {
+        for (size_t i = 0; i < image.levels.size(); i++) {
+            uploadLevel(image, firstLevel + static_cast<int>(i), image.levels[i]);
+        }
+    }
+
+    static std::string path(uint64_t content, int maxSize, TextureEncoding encoding) {
+        char name[64];
+        std::snprintf(name, sizeof(name), "%016llx_%d_%d_v%d.ktx", static_cast<unsigned long long>(content), maxSize,
+                      static_cast<int>(encoding), CACHE_VERSION);
+        return std::string(TEXTURE_CACHE_DIR) + "/" + name;
+    }
+
+    // Every level of a cached image, false if the file is missing or not one this cache wrote
+    static bool load(const std::string& path, CompressedImage& image) {
+        return load(path, 0, std::numeric_limits<int>::max(), image);
+    }
+
+    // Levels [firstLevel, endLevel) of a cached image, the others are skipped over without being read.
+    // image.levels[0] is firstLevel, width and height stay those of level 0
+    static bool load(const std::string& path, int firstLevel, int endLevel, CompressedImage& image) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open()) return false;
+
+        unsigned char identifier[12];
+        uint32_t header[KTX_HEADER_FIELDS];
+        file.read(reinterpret_cast<char*>(identifier), sizeof(identifier));
+        file.read(reinterpret_cast<char*>(header), sizeof(header));
+        if (!file || std::memcmp(identifier, KTX_IDENTIFIER, sizeof(identifier)) != 0 || header[KTX_ENDIANNESS] != 0x04030201 ||
+            header[KTX_FACES] != 1 || header[KTX_MIPMAP_LEVELS] == 0 || header[KTX_PIXEL_WIDTH] == 0 || header[KTX_PIXEL_HEIGHT] == 0) {
+            return false;
+        }
+        file.seekg(header[KTX_KEY_VALUE_BYTES], std::ios::cur);
+
+        image.format = header[KTX_INTERNAL_FORMAT];
+        if (image.format != GL_COMPRESSED_RGB_S3TC_DXT1_EXT && image.format != GL_COMPRESSED_RGBA_S3TC_DXT5_EXT &&
+            image.format != GL_COMPRESSED_RED_RGTC1 && image.format != GL_COMPRESSED_RG_RGTC2) {
+            return false;
+        }
+        image.width = static_cast<int>(header[KTX_PIXEL_WIDTH]);
+        image.height = static_cast<int>(header[KTX_PIXEL_HEIGHT]);
+        int levelCount = std::min(static_cast<int>(header[KTX_MIPMAP_LEVELS]), endLevel);
+        if (firstLevel >= levelCount) return false;
+        image.levels.assign(levelCount - firstLevel, {});
+        for (int level = 0; level < levelCount; level++) {
+            // Each level is its size followed by its blocks, levels before the range are seeked past
+            uint32_t size = 0;
+            file.read(reinterpret_cast<char*>(&size), sizeof(size));
+            if (!file || size != CompressedImage::levelBytes(image.format, image.width, image.height, level)) return false;
+            if (level < firstLevel) {
+                file.seekg(size, std::ios::cur);
+                continue;
+            }
+            std::vector<unsigned char>& data = image.levels[level - firstLevel];
+            data.resize(size);
+            file.read(reinterpret_cast<char*>(data.data()), size);
+            if (!file) return false;
+        }
+        return true;
+    }
+
+private:
+    static constexpr const char* TEXTURE_CACHE_DIR = "TextureCache";
+
+    static constexpr int CACHE_VERSION = 1;  // Bump when the encoders change
+    static constexpr unsigned char KTX_IDENTIFIER[12] = {0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n'};
+
+    static void uploadLevel(const CompressedImage& image, int level, const std::vector<unsigned char>& data) {
+        glCompressedTexImage2D(GL_TEXTURE_2D, level, image.format, std::max(image.width >> level, 1), std::max(image.height >> level, 1),
+                               0, static_cast<GLsizei>(data.size()), data.data());
+    }
+
+    // KTX header fields after the identifier
+    enum { KTX_ENDIANNESS, KTX_TYPE, KTX_TYPE_SIZE, KTX_FORMAT, KTX_INTERNAL_FORMAT, KTX_BASE_INTERNAL_FORMAT, KTX_PIXEL_WIDTH, KTX_PIXEL_HEIGHT,
+           KTX_PIXEL_DEPTH, KTX_ARRAY_ELEMENTS, KTX_FACES, KTX_MIPMAP_LEVELS, KTX_KEY_VALUE_BYTES, KTX_HEADER_FIELDS };
+
+    static void save(const std::string& path, const CompressedImage& image) {
+        std::error_code error;
+        std::filesystem::create_directories(TEXTURE_CACHE_DIR, error);
+        // Written under a temporary name so a reader never sees half a file
+        std::string temporaryPath = path + ".tmp" + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+        {
+            std::ofstream file(temporaryPath, std::ios::binary | std::ios::trunc);
+            if (!file.is_open()) {
+                std::cout << "Failed to write texture cache: " << path << std::endl;
+                return;
+            }
+            uint32_t header[KTX_HEADER_FIELDS] = {};
+            header[KTX_ENDIANNESS] = 0x04030201;
+            header[KTX_TYPE_SIZE] = 1;
+            header[KTX_INTERNAL_FORMAT] = image.format;
+            header[KTX_BASE_INTERNAL_FORMAT] = image.format == GL_COMPRESSED_RED_RGTC1 ? GL_RED
+                                              : image.format == GL_COMPRESSED_RG_RGTC2 ? GL_RG
+                                              : image.format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT ? GL_RGBA : GL_RGB;
+            header[KTX_PIXEL_WIDTH] = image.width;
+            header[KTX_PIXEL_HEIGHT] = image.height;
+            header[KTX_FACES] = 1;
+            header[KTX_MIPMAP_LEVELS] = static_cast<uint32_t>(image.levels.size());
+            file.write(reinterpret_cast<const char*>(KTX_IDENTIFIER), sizeof(KTX_IDENTIFIER));
+            file.write(reinterpret_cast<const char*>(header), sizeof(header));
+            // Block sizes are multiples of 8, so levels need no padding
+            for (const std::vector<unsigned char>& level : image.levels) {
+                uint32_t size = static_cast<uint32_t>(level.size());
+                file.write(reinterpret_cast<const char*>(&size), sizeof(size));
+                file.write(reinterpret_cast<const char*>(level.data()), size);
+            }
+        }
+        std::filesystem::rename(temporaryPath, path, error);
+        if (error) std::filesystem::remove(temporaryPath, error);
+    }
+};
+
+// GPU textures shared by every texture loader, one per textureShareKey. Each map entry, material or
+// model holding a texture name holds a reference to it, and the texture is deleted with the last reference.
+// GL thread only
+class SharedTextures {
+public:
+    // Texture made from this content, 0 if there is none
+    unsigned int find(uint64_t content) const {
+        auto it = byContent.find(content);
+        return it != byContent.end() ? it->second : 0;
+    }
+
+    bool contains(unsigned int texture) const {
+        return references.find(texture) != references.end();
+    }
+
+    // Content key recorded by setContent, 0 if there is none
+    uint64_t content(unsigned int texture) const {
+        auto it = contents.find(texture);
+        return it != contents.end() ? it->second : 0;
+    }
+
+    void addReference(unsigned int texture) {
+        references[texture]++;
+    }
+
+    // Record what a texture was made from, so later loads of the same content can share it
+    void setContent(unsigned int texture, uint64_t content) {
+        byContent[content] = texture;
+        contents[texture] = content;
+    }
+
+    // Move every reference of a texture to the one with the same content, then delete it
+    void merge(unsigned int duplicate, unsigned int original) {
+        references[original] += references[duplicate];
+        references.erase(duplicate);
+        contents.erase(duplicate);
+        textureResidency.remove(duplicate);
+        glDeleteTextures(1, &duplicate);
+    }
+
+    // Drop a reference, returns true if that was the last one and the texture was deleted
+    bool release(unsigned int texture) {
+        auto it = references.find(texture);
+        if (it == references.end() || --it->second > 0) return false;
+        references.erase(it);
+        auto content = contents.find(texture);
+        if (content != contents.end()) {
+            byContent.erase(content->second);
+            contents.erase(content);
+        }
+        textureResidency.remove(texture);
+        glDeleteTextures(1, &texture);
+        return true;
+    }
+
+    // Textures alive, each unique image counted once
+    size_t size() const {
+        return references.size();
+    }
+
+private:
+    std::unordered_map<unsigned int, int> references;     // By texture name
+    std::unordered_map<unsigned int, uint64_t> contents;  // Content key of each texture that has one
+    std::unordered_map<uint64_t, unsigned int> byContent;
+};
+
+SharedTextures sharedTextures;
+
+// Shown by a shrunk model texture until it is drawn again
+const unsigned char MODEL_TEXTURE_PLACEHOLDER[4] = {128, 128, 128, 255};
+
+// A model texture's file, block compressed or decoded, ready for uploadModelTexture
+struct ModelTextureImage {
+    CompressedImage compressed;  // Used instead of the pixels when it has levels
+    bool fromCache = false;
+    unsigned char* pixels = nullptr;  // stbi_load result, fitted under the model texture size
+    int width = 0, height = 0, channels = 0;
+    int sourceWidth = 0, sourceHeight = 0;
+};
+
+// Block compress a model texture's file through the texture cache when the driver can sample it, else decode
+// it. Safe on a worker thread. False if the file did not decode
+bool decodeModelTexture(const std::vector<unsigned char>& bytes, uint64_t content, ModelTextureImage& image) {
+    if (TextureCache::canCompress(TEXTURE_ENCODING_COLOR) &&
+        TextureCache::loadOrEncode(bytes, content, 0, maxTextureSize[TEXTURE_CLASS_MODEL], TEXTURE_ENCODING_COLOR,
+                                   nullptr, image.compressed, image.fromCache)) {
+        return true;
+    }
+
+    image.pixels = stbi_load_from_memory(bytes.data(), static_cast<int>(bytes.size()), &image.width, &image.height,
+                                         &image.channels, 0);
+    if (!image.pixels) return false;
+    image.sourceWidth = image.width;
+    image.sourceHeight = image.height;
+    image.pixels = fitImage(image.pixels, image.width, image.height, image.channels, maxTextureSize[TEXTURE_CLASS_MODEL]);
+    return true;
+}
+
+// Upload a decoded model texture into texture, generating it if it is 0, and free its pixels. Returns the size
+// in VRAM
+size_t uploadModelTexture(unsigned int& texture, const std::string& path, ModelTextureImage& image, const char* verb) {
+    if (texture == 0) glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    if (!image.compressed.levels.empty()) {
+        TextureCache::upload(image.compressed);
+        std::cout << verb << " texture: " << path << (image.fromCache ? " (texture cache, " : " (compressed, ")
+                  << image.compressed.bytes() / (1024.0 * 1024.0) << " MB)" << std::endl;
+        return image.compressed.bytes();
+    }
+
+    int width = image.width, height = image.height, nrComponents = image.channels;
+    GLenum format;
+    if (nrComponents == 1)
+        format = GL_RED;
+    else if (nrComponents == 3)
+        format = GL_RGB;
+    else if (nrComponents == 4)
+        format = GL_RGBA;
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);  // Rows of 1 and 3 byte texels are not 4 byte aligned
+    glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, image.pixels);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 1000);  // A shrunk texture was left with level 0 only
+    glGenerateMipmap(GL_TEXTURE_2D);
+
+    std::cout << verb << " texture: " << path;
+    if (width != image.sourceWidth || height != image.sourceHeight) {
+        std::cout << " (" << image.sourceWidth << "x" << image.sourceHeight << " -> " << width << "x" << height << ", "
+                  << textureMegabytes(image.sourceWidth, image.sourceHeight, nrComponents) << " -> "
+                  << textureMegabytes(width, height, nrComponents) << " MB)";
+    }
+    std::cout << std::endl;
+    stbi_image_free(image.pixels);
+    image.pixels = nullptr;
+    return static_cast<size_t>(textureMegabytes(width, height, nrComponents) * 1024.0 * 1024.0);
+}
+
+// Model textures shrunk under the texture budget and drawn again. Their files are read from the texture cache
+// or decoded on the workers, and they show their placeholder until update() uploads them
+class ModelTextureReloads {
+public:
+    // GL thread
+    void request(unsigned int texture, const std::string& path) {
+        if (loading.insert(texture).second) requested.push_back({texture, path});
+    }
+
+    // Start the requested reloads and upload the ones the workers finished. GL thread, once a frame
+    void update(ThreadPool& threadPool) {
+        for (const Request& request : requested) {
+            threadPool.submit([this, request]() {
+                Reload reload{request};
+                std::vector<unsigned char> bytes = readFileBytes(request.path);
+                reload.decoded = !bytes.empty() && decodeModelTexture(bytes, imageContentKey(bytes, 0), reload.image);
+                std::lock_guard<std::mutex> lock(finishedMutex);
+                finished.push_back(std::move(reload));
+            });
+        }
+        requested.clear();
+
+        std::vector<Reload> reloads;
+        {
+            std::lock_guard<std::mutex> lock(finishedMutex);
+            reloads.swap(finished);
+        }
+        for (Reload& reload : reloads) {
+            unsigned int texture = reload.request.texture;
+            loading.erase(texture);
+            if (!reload.decoded) {
+                std::cout << "Texture failed to reload: " << reload.request.path << std::endl;
+            } else if (textureResidency.shrunk(texture)) {
+                // Shrunk again before the reload got back, the next use asks for it again
+                stbi_image_free(reload.image.pixels);
+            } else {
+                textureResidency.setBytes(texture, uploadModelTexture(texture, reload.request.path, reload.image, "Reloaded"));
+            }
+        }
+    }
+
+private:
+    struct Request {
+        unsigned int texture;
+        std::string path;
+    };
+
+    struct Reload {
+        Request request;
+        bool decoded = false;
+        ModelTextureImage image;
+    };
+
+    std::vector<Request> requested;    // Not yet on the workers
+    std::set<unsigned int> loading;    // Requested and not uploaded yet
+    std::mutex finishedMutex;
+    std::vector<Reload> finished;      // Decoded by the workers, guarded by finishedMutex
+};
+
+ModelTextureReloads modelTextureReloads;
+
 // Utility function to load texture
 unsigned int TextureFromFile(const char *path, const std::string &directory, bool gamma) {
     std::string filename = std::string(path);
@@ -614,54 +4667,44 @@ unsigned int TextureFromFile(const char *path, const std::string &directory, boo
     possiblePaths.push_back(parentDir + "/textures/" + filename);
     possiblePaths.push_back(parentDir + "/textures/" + filename.substr(filename.find_last_of("/\\") + 1));
 
-    // Create texture ID
-    unsigned int textureID;
-    glGenTextures(1, &textureID);
-
-    // Try each possible path
-    unsigned char *data = nullptr;
-    std::string successPath;
-    int width, height, nrComponents;
-
+    // Look each possible path up in the asset index, only the file that exists is opened
     for (const auto& tryPath : possiblePaths) {
-        data = stbi_load(tryPath.c_str(), &width, &height, &nrComponents, 0);
-        if (data) {
-            successPath = tryPath;
-            break;
-        }
-    }
-
-    // If we found a texture, load it
-    if (data) {
-        GLenum format;
-        if (nrComponents == 1)
-            format = GL_RED;
-        else if (nrComponents == 3)
-            format = GL_RGB;
-        else if (nrComponents == 4)
-            format = GL_RGBA;
-
-        glBindTexture(GL_TEXTURE_2D, textureID);
-        glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-        glGenerateMipmap(GL_TEXTURE_2D);
-
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        if (const AssetIndex::Entry* entry = assetIndex.find(tryPath)) {
+            std::string successPath = entry->path;
+            std::vector<unsigned char> bytes = readFileBytes(successPath);
+            if (bytes.empty()) break;
+
+            // The same image under another name or in another model is not decoded again
+            uint64_t content = imageContentKey(bytes, 0);
+            uint64_t shareKey = textureShareKey(content, maxTextureSize[TEXTURE_CLASS_MODEL], TEXTURE_ENCODING_COLOR);
+            unsigned int textureID = sharedTextures.find(shareKey);
+            if (textureID != 0) {
+                sharedTextures.addReference(textureID);
+                std::cout << "Shared texture: " << successPath << " (same image as an earlier texture)" << std::endl;
+                return textureID;
+            }
 
-        std::cout << "Loaded texture: " << successPath << std::endl;
-        stbi_image_free(data);
-    }
-    else {
-        std::cout << "Texture failed to load at path: " << path << std::endl;
-        std::cout << "Tried paths:" << std::endl;
-        for (const auto& tryPath : possiblePaths) {
-            std::cout << "  " << tryPath << std::endl;
+            ModelTextureImage image;
+            if (!decodeModelTexture(bytes, content, image)) break;
+            size_t gpuBytes = uploadModelTexture(textureID, successPath, image, "Loaded");
+            sharedTextures.addReference(textureID);
+            sharedTextures.setContent(textureID, shareKey);
+
+            // Over the texture budget it becomes a placeholder, and is read again from the texture cache or
+            // decoded on the workers when a model using it is drawn
+            textureResidency.add(textureID, gpuBytes,
+                                 [textureID]() { return replaceWithPlaceholder(textureID, MODEL_TEXTURE_PLACEHOLDER); },
+                                 [textureID, successPath]() { modelTextureReloads.request(textureID, successPath); });
+            return textureID;
         }
     }
 
-    return textureID;
+    std::cout << "Texture failed to load at path: " << path << std::endl;
+    std::cout << "Tried paths:" << std::endl;
+    for (const auto& tryPath : possiblePaths) {
+        std::cout << "  " << tryPath << std::endl;
+    }
+    return 0;
 }
 
 // Global vector to store loaded textures
@@ -800,42 +4843,300 @@ private:
                     textures.insert(textures.end(), specularMaps.begin(), specularMaps.end());
                 }
 
-        return Mesh(vertices, indices, textures);
+        return Mesh(vertices, indices, textures);
+    }
+
+    // Texture loading
+    std::vector<Texture> loadMaterialTextures(aiMaterial *mat, aiTextureType type, std::string typeName) {
+        std::vector<Texture> textures;
+         std::cout << "Looking for textures of type: " << typeName << ", count: " << mat->GetTextureCount(type) << std::endl;
+           // Try all common texture types if no textures found
+    if (mat->GetTextureCount(type) == 0 && type == aiTextureType_DIFFUSE) {
+        // Try PBR base color (glTF uses this)
+        return loadMaterialTextures(mat, aiTextureType_BASE_COLOR, typeName);
+    }
+
+        for(unsigned int i = 0; i < mat->GetTextureCount(type); i++) {
+            aiString str;
+            mat->GetTexture(type, i, &str);
+        std::cout << "Texture path from model: " << str.C_Str() << std::endl;
+            // Check if texture was loaded before
+            bool skip = false;
+            for(unsigned int j = 0; j < textures_loaded.size(); j++) {
+                if(std::strcmp(textures_loaded[j].path.data(), str.C_Str()) == 0) {
+                    textures.push_back(textures_loaded[j]);
+                    if (textures_loaded[j].id != 0) sharedTextures.addReference(textures_loaded[j].id);
+                    skip = true;
+                    break;
+                }
+            }
+            if(!skip) {   // If texture hasn't been loaded already, load it
+                Texture texture;
+               texture.id = TextureFromFile(str.C_Str(), directory, false);
+                texture.type = typeName;
+                texture.path = str.C_Str();
+                textures.push_back(texture);
+                textures_loaded.push_back(texture);
+            }
+        }
+        return textures;
+    }
+};
+
+// A model drawn into the shadow maps, bounded by a sphere for the light radius test
+struct ShadowCaster {
+    Model* model;
+    glm::mat4 transform;
+    glm::vec3 center;
+    float radius;
+};
+
+// Cube shadow maps of the area lights nearest the camera, cached between frames. Walls are static, so a
+// face is only rendered when its light gets a slot, when a caster inside the light radius moves, or when
+// map cells change (invalidateCells). At most SHADOW_FACE_BUDGET faces are rendered per frame, nearest
+// lights first, and a light only uses its slot once every face has been rendered.
+// Faces are layers slot * 6 + face in the order +X, -X, +Y, -Y, +Z, -Z, as in a GL cube map
+class ShadowMaps {
+public:
+    ShadowMaps() : depthShader("shadow_depth.vs", "shadow_depth.fs") {
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT24, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, MAX_SHADOW_LIGHTS * 6, 0,
+                     GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+        glGenFramebuffers(1, &framebuffer);
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glDrawBuffer(GL_NONE);
+        glReadBuffer(GL_NONE);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+
+    ~ShadowMaps() {
+        glDeleteFramebuffers(1, &framebuffer);
+        glDeleteTextures(1, &texture);
+    }
+
+    // Assign slots, re-render the faces that changed within the budget and set every light's shadowSlot
+    void update(std::vector<AreaLight>& lights, const Map& map, const std::vector<ShadowCaster>& casters,
+                const glm::vec3& cameraPos, CubeModel& cube) {
+        facesRendered = 0;
+        if (map.width != mapWidth || map.height != mapHeight) {
+            mapWidth = map.width;
+            mapHeight = map.height;
+            wallHeights.clear();
+            for (Slot& slot : slots) slot = Slot();
+        }
+        if (wallHeights.empty()) wallHeights = mapWallHeights(map);
+
+        // Lights that get a slot: active and within the draw distance, nearest first
+        std::vector<int> wanted;
+        for (size_t i = 0; i < lights.size(); i++) {
+            lights[i].shadowSlot = -1;
+            if (lights[i].active && !isSphereBeyondDrawDistance(cameraPos, lights[i].position, lights[i].radius)) {
+                wanted.push_back(static_cast<int>(i));
+            }
+        }
+        std::sort(wanted.begin(), wanted.end(), [&](int a, int b) {
+            return glm::length(lights[a].position - cameraPos) < glm::length(lights[b].position - cameraPos);
+        });
+        if (wanted.size() > MAX_SHADOW_LIGHTS) wanted.resize(MAX_SHADOW_LIGHTS);
+
+        // Slots keep their light while it stays wanted and unchanged, freed slots go to the new lights
+        std::vector<int> slotOfLight(lights.size(), -1);
+        for (int s = 0; s < MAX_SHADOW_LIGHTS; s++) {
+            Slot& slot = slots[s];
+            if (slot.light < 0) continue;
+            bool keep = slot.light < static_cast<int>(lights.size()) &&
+                        std::find(wanted.begin(), wanted.end(), slot.light) != wanted.end() &&
+                        lights[slot.light].position == slot.position && lights[slot.light].radius == slot.radius;
+            if (keep) {
+                slotOfLight[slot.light] = s;
+            } else {
+                slot = Slot();
+            }
+        }
+        for (int light : wanted) {
+            if (slotOfLight[light] >= 0) continue;
+            for (int s = 0; s < MAX_SHADOW_LIGHTS; s++) {
+                if (slots[s].light >= 0) continue;
+                slots[s].light = light;
+                slots[s].position = lights[light].position;
+                slots[s].radius = lights[light].radius;
+                slotOfLight[light] = s;
+                break;
+            }
+        }
+
+        // Casters that moved, appeared or left the light radius dirty the faces that see them
+        for (Slot& slot : slots) {
+            if (slot.light < 0) continue;
+            std::vector<std::pair<int, glm::mat4>> inside;
+            for (size_t c = 0; c < casters.size(); c++) {
+                if (glm::length(casters[c].center - slot.position) < slot.radius + casters[c].radius) {
+                    inside.push_back({static_cast<int>(c), casters[c].transform});
+                }
+            }
+            for (const auto& caster : inside) {
+                if (!containsCaster(slot.casters, caster)) slot.dirtyFaces |= facesSeeing(slot, casters[caster.first]);
+            }
+            for (const auto& caster : slot.casters) {
+                if (!containsCaster(inside, caster)) {
+                    slot.dirtyFaces |= caster.first < static_cast<int>(casters.size()) ? facesSeeing(slot, casters[caster.first]) : ALL_FACES;
+                }
+            }
+            slot.casters = inside;
+        }
+
+        // Render dirty faces, nearest lights first, until the budget is spent
+        bool rendering = false;
+        GLint viewport[4];
+        for (int light : wanted) {
+            Slot& slot = slots[slotOfLight[light]];
+            while (slot.dirtyFaces != 0 && facesRendered < SHADOW_FACE_BUDGET) {
+                if (!rendering) {
+                    glGetIntegerv(GL_VIEWPORT, viewport);
+                    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+                    glViewport(0, 0, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE);
+                    glEnable(GL_POLYGON_OFFSET_FILL);
+                    glPolygonOffset(2.0f, 4.0f);
+                    depthShader.use();
+                    rendering = true;
+                }
+                int face = 0;
+                while (!(slot.dirtyFaces & (1u << face))) face++;
+                renderFace(slotOfLight[light], face, map, casters, cube);
+                slot.dirtyFaces &= ~(1u << face);
+                facesRendered++;
+            }
+            if (slot.dirtyFaces == 0) slot.ready = true;
+            if (slot.ready) lights[light].shadowSlot = slotOfLight[light];
+        }
+        if (rendering) {
+            glDisable(GL_POLYGON_OFFSET_FILL);
+            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+        }
+        frameStats.shadowFacesRendered = facesRendered;
+    }
+
+    // Re-render the lights that reach a block of cells, for map changes such as doors
+    void invalidateCells(int minX, int minZ, int maxX, int maxZ) {
+        wallHeights.clear();  // Read again on the next update
+        for (Slot& slot : slots) {
+            if (slot.light < 0) continue;
+            if (distanceToRectXZ(slot.position, minX * CELL_SIZE, minZ * CELL_SIZE, (maxX + 1) * CELL_SIZE, (maxZ + 1) * CELL_SIZE) < slot.radius) {
+                slot.dirtyFaces = ALL_FACES;
+            }
+        }
+    }
+
+    void bind() {
+        glActiveTexture(GL_TEXTURE0 + AREA_SHADOW_TEXTURE_UNIT);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+    // Lights using their shadow map this frame
+    int readyLights() const {
+        int count = 0;
+        for (const Slot& slot : slots) {
+            if (slot.light >= 0 && slot.ready) count++;
+        }
+        return count;
+    }
+
+private:
+    static const unsigned int ALL_FACES = 0x3F;
+
+    struct Slot {
+        int light = -1;  // Index in the light list, -1 if free
+        glm::vec3 position = glm::vec3(0.0f);
+        float radius = 0.0f;
+        unsigned int dirtyFaces = ALL_FACES;
+        bool ready = false;  // Every face has been rendered since the slot was assigned
+        std::vector<std::pair<int, glm::mat4>> casters;  // Casters inside the radius when last rendered
+    };
+
+    Shader depthShader;
+    unsigned int texture = 0;
+    unsigned int framebuffer = 0;
+    Slot slots[MAX_SHADOW_LIGHTS];
+    std::vector<float> wallHeights;
+    int mapWidth = -1;
+    int mapHeight = -1;
+    int facesRendered = 0;
+
+    static bool containsCaster(const std::vector<std::pair<int, glm::mat4>>& list, const std::pair<int, glm::mat4>& caster) {
+        for (const auto& entry : list) {
+            if (entry.first == caster.first && entry.second == caster.second) return true;
+        }
+        return false;
     }
 
-    // Texture loading
-    std::vector<Texture> loadMaterialTextures(aiMaterial *mat, aiTextureType type, std::string typeName) {
-        std::vector<Texture> textures;
-         std::cout << "Looking for textures of type: " << typeName << ", count: " << mat->GetTextureCount(type) << std::endl;
-           // Try all common texture types if no textures found
-    if (mat->GetTextureCount(type) == 0 && type == aiTextureType_DIFFUSE) {
-        // Try PBR base color (glTF uses this)
-        return loadMaterialTextures(mat, aiTextureType_BASE_COLOR, typeName);
+    // View direction and up vector of each cube face
+    static void faceAxes(int face, glm::vec3& direction, glm::vec3& up) {
+        const glm::vec3 directions[6] = {
+            glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(-1.0f, 0.0f, 0.0f),
+            glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f),
+            glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(0.0f, 0.0f, -1.0f),
+        };
+        const glm::vec3 ups[6] = {
+            glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f),
+            glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(0.0f, 0.0f, -1.0f),
+            glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f),
+        };
+        direction = directions[face];
+        up = ups[face];
     }
 
-        for(unsigned int i = 0; i < mat->GetTextureCount(type); i++) {
-            aiString str;
-            mat->GetTexture(type, i, &str);
-        std::cout << "Texture path from model: " << str.C_Str() << std::endl;
-            // Check if texture was loaded before
-            bool skip = false;
-            for(unsigned int j = 0; j < textures_loaded.size(); j++) {
-                if(std::strcmp(textures_loaded[j].path.data(), str.C_Str()) == 0) {
-                    textures.push_back(textures_loaded[j]);
-                    skip = true;
-                    break;
-                }
-            }
-            if(!skip) {   // If texture hasn't been loaded already, load it
-                Texture texture;
-               texture.id = TextureFromFile(str.C_Str(), directory, false);
-                texture.type = typeName;
-                texture.path = str.C_Str();
-                textures.push_back(texture);
-                textures_loaded.push_back(texture);
+    // Faces whose half space in front of the light holds part of the caster's sphere
+    static unsigned int facesSeeing(const Slot& slot, const ShadowCaster& caster) {
+        unsigned int faces = 0;
+        for (int face = 0; face < 6; face++) {
+            glm::vec3 direction, up;
+            faceAxes(face, direction, up);
+            if (glm::dot(caster.center - slot.position, direction) + caster.radius > 0.0f) faces |= 1u << face;
+        }
+        return faces;
+    }
+
+    void renderFace(int slotIndex, int face, const Map& map, const std::vector<ShadowCaster>& casters, CubeModel& cube) {
+        const Slot& slot = slots[slotIndex];
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, texture, 0, slotIndex * 6 + face);
+        glClear(GL_DEPTH_BUFFER_BIT);
+
+        glm::vec3 direction, up;
+        faceAxes(face, direction, up);
+        glm::mat4 projection = glm::perspective(glm::radians(90.0f), 1.0f, SHADOW_NEAR_PLANE, slot.radius);
+        depthShader.setMat4(U_LIGHT_VIEW_PROJECTION, projection * glm::lookAt(slot.position, slot.position + direction, up));
+
+        // Walls within the light radius, the floor and ceiling never shadow anything inside the room
+        int minX = std::max(0, static_cast<int>(std::floor((slot.position.x - slot.radius) / CELL_SIZE)));
+        int maxX = std::min(map.width - 1, static_cast<int>(std::floor((slot.position.x + slot.radius) / CELL_SIZE)));
+        int minZ = std::max(0, static_cast<int>(std::floor((slot.position.z - slot.radius) / CELL_SIZE)));
+        int maxZ = std::min(map.height - 1, static_cast<int>(std::floor((slot.position.z + slot.radius) / CELL_SIZE)));
+        for (int z = minZ; z <= maxZ; z++) {
+            for (int x = minX; x <= maxX; x++) {
+                float wallHeight = wallHeights[x + z * map.width];
+                if (wallHeight <= 0.0f) continue;
+                glm::mat4 model = glm::translate(glm::mat4(1.0f), glm::vec3((x + 0.5f) * CELL_SIZE, wallHeight * 0.5f, (z + 0.5f) * CELL_SIZE));
+                model = glm::scale(model, glm::vec3(CELL_SIZE, wallHeight, CELL_SIZE));
+                depthShader.setMat4(U_MODEL, model);
+                cube.render();
             }
         }
-        return textures;
+
+        for (const auto& caster : slot.casters) {
+            depthShader.setMat4(U_MODEL, casters[caster.first].transform);
+            casters[caster.first].model->Draw(depthShader);
+        }
     }
 };
 
@@ -847,116 +5148,61 @@ public:
     std::map<int, unsigned int> roughnessMaps;
     std::map<int, bool> hasNormalMap;
     std::map<int, bool> hasRoughnessMap;
+    std::map<int, unsigned int> heightMaps;
+    std::map<int, bool> hasHeightMap;
+    std::map<int, bool> hasMaterialMap;  // Roughness and height maps are one packed material map
     std::map<int, bool> isObjectTexture;
 
-    // Load a texture with the standard naming convention (wall_[textureID])
+    TextureManager(ThreadPool& threadPool) : threadPool(threadPool) {}
+
+    // Decode jobs still running hold a pointer to this manager, wait for them before it goes away
+    ~TextureManager() {
+        while (decodesRunning.load() > 0) {
+            std::this_thread::yield();
+        }
+        for (DecodedImage* image = decodedImages.takeAll(); image != nullptr;) {
+            DecodedImage* next = image->next;
+            stbi_image_free(image->pixels);
+            delete image;
+            image = next;
+        }
+        for (DecodedImage* image : readyImages) {
+            stbi_image_free(image->pixels);
+            delete image;
+        }
+    }
+
+    // Load a texture with the standard naming convention (object_[textureID], then wall_[textureID]).
+    // The file is decoded on the thread pool, a placeholder stands in until uploadDecodedTextures uploads it
     void loadTexture(int textureID) {
         // Skip if already loaded
         if (textures.find(textureID) != textures.end()) {
             return;
         }
 
-        // Try different file extensions for diffuse texture
-        std::string extensions[] = {".png", ".jpg", ".jpeg"};
-        bool loaded = false;
-
-      // First try to load as an object texture
-    std::string objectFilename = "textures/object_" + std::to_string(textureID);
-    for (const auto& ext : extensions) {
-        // Try loading the object texture first
-        unsigned int textureHandle;
-        glGenTextures(1, &textureHandle);
-
-        int width, height, nrChannels;
-        unsigned char* data = stbi_load((objectFilename + ext).c_str(), &width, &height, &nrChannels, 0);
-        if (data) {
-            GLenum format;
-            if (nrChannels == 1)
-                format = GL_RED;
-            else if (nrChannels == 3)
-                format = GL_RGB;
-            else if (nrChannels == 4)
-                format = GL_RGBA;
-
-            glBindTexture(GL_TEXTURE_2D, textureHandle);
-            glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-            glGenerateMipmap(GL_TEXTURE_2D);
-
-            // Set texture parameters
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-            // Store texture in the map
-            textures[textureID] = textureHandle;
-            isObjectTexture[textureID] = true; // Mark as an object texture
-
-            std::cout << "Loaded object texture: " << objectFilename + ext << std::endl;
-            loaded = true;
-            stbi_image_free(data);
-            break; // Exit the loop once a texture is successfully loaded
-        }
-        if (data) stbi_image_free(data);
-    }
-
-    // If not loaded as object, try as wall texture
-    if (!loaded) {
-        std::string wallFilename = "textures/wall_" + std::to_string(textureID);
-        for (const auto& ext : extensions) {
-            unsigned int textureHandle;
-            glGenTextures(1, &textureHandle);
-
-            int width, height, nrChannels;
-            unsigned char* data = stbi_load((wallFilename + ext).c_str(), &width, &height, &nrChannels, 0);
-            if (data) {
-                GLenum format;
-                if (nrChannels == 1)
-                    format = GL_RED;
-                else if (nrChannels == 3)
-                    format = GL_RGB;
-                else if (nrChannels == 4)
-                    format = GL_RGBA;
-
-                glBindTexture(GL_TEXTURE_2D, textureHandle);
-                glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-                glGenerateMipmap(GL_TEXTURE_2D);
-
-                // Set texture parameters
-                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-                // Store texture in the map
-                textures[textureID] = textureHandle;
-                isObjectTexture[textureID] = false; // Mark as a wall texture
-
-                std::cout << "Loaded wall texture: " << wallFilename + ext << std::endl;
-                loaded = true;
-                stbi_image_free(data);
-                break;
-            }
-            if (data) stbi_image_free(data);
+        // First try to load as an object texture, then as a wall texture
+        std::string baseName = "object_" + std::to_string(textureID);
+        std::string filename = findImageFile("textures/" + baseName);
+        isObjectTexture[textureID] = !filename.empty();
+        if (filename.empty()) {
+            baseName = "wall_" + std::to_string(textureID);
+            filename = findImageFile("textures/" + baseName);
         }
-    }
 
-    if (!loaded) {
-        std::cout << "Failed to load texture for ID: " << textureID << " (tried both object_ and wall_ prefixes)" << std::endl;
-        // Add a default texture or placeholder
-        textures[textureID] = 0;
-        isObjectTexture[textureID] = false;
-    }
+        if (filename.empty()) {
+            std::cout << "Failed to load texture for ID: " << textureID << " (tried both object_ and wall_ prefixes)" << std::endl;
+            // Add a default texture or placeholder
+            textures[textureID] = 0;
+        } else {
+            textures[textureID] = requestImage(filename, PLACEHOLDER_DIFFUSE, 0,
+                                               isObjectTexture[textureID] ? "object texture" : "wall texture",
+                                               textureClass(textureID, baseName), TEXTURE_ENCODING_COLOR);
+        }
 
-    // Now try to load the normal map and roughness map
-    if (isObjectTexture[textureID]) {
-        loadNormalMapWithName(textureID, "object_" + std::to_string(textureID));
-        loadRoughnessMapWithName(textureID, "object_" + std::to_string(textureID));
-    } else {
-        loadNormalMap(textureID);
-        loadRoughnessMap(textureID);
+        // Now try to load the normal map and the roughness, metallic, height and occlusion maps
+        loadNormalMapWithName(textureID, baseName);
+        loadMaterialMapsWithName(textureID, baseName);
     }
-}
 
     // Add a method to check if a texture is an object
             bool isObject(int textureID) {
@@ -974,333 +5220,1143 @@ public:
             return;
         }
 
-        // Try different file extensions for diffuse texture
-        std::string extensions[] = {".png", ".jpg", ".jpeg"};
-        bool loaded = false;
+        std::string filename = findImageFile("textures/" + baseName);
+        if (filename.empty()) {
+            std::cout << "Failed to load texture for base name: " << baseName << " (tried png, jpg, jpeg)" << std::endl;
+            // Add a default texture or placeholder
+            textures[textureID] = 0;
+        } else {
+            textures[textureID] = requestImage(filename, PLACEHOLDER_DIFFUSE, 0, "texture", textureClass(textureID, baseName),
+                                               TEXTURE_ENCODING_COLOR);
+        }
+
+        // Now try to load the normal map with _N suffix
+        loadNormalMapWithName(textureID, baseName);
 
-        for (const auto& ext : extensions) {
-            // Construct the filename with custom base name
-            std::string filename = "textures/" + baseName + ext;
+        // And the roughness (_R) and height (_H) maps, packed with the metallic and occlusion maps if there are several
+        loadMaterialMapsWithName(textureID, baseName);
+    }
+
+    // Load the maps of a material's surface properties. One of them is loaded on its own, several are packed
+    // into one RGBA texture: occlusion, roughness, metallic, height. Missing maps get the value of no map
+    void loadMaterialMapsWithName(int textureID, const std::string& baseName) {
+        static const char* const suffixes[4] = {"_AO", "_R", "_M", "_H"};
+        std::vector<std::string> files(4);
+        int found = 0;
+        for (int c = 0; c < 4; c++) {
+            files[c] = findImageFile("textures/" + baseName + suffixes[c]);
+            if (!files[c].empty()) found++;
+        }
+        if (!packMaterialMaps || found < 2) {
+            loadRoughnessMapWithName(textureID, baseName);
+            loadHeightMapWithName(textureID, baseName);
+            return;
+        }
 
-            // Load the texture
-            unsigned int textureHandle;
-            glGenTextures(1, &textureHandle);
+        unsigned int texture = requestPackedImage(files, textureClass(textureID, baseName));
+        sharedTextures.addReference(texture);  // Held as both the roughness and the height map
+        roughnessMaps[textureID] = texture;
+        heightMaps[textureID] = texture;
+        hasRoughnessMap[textureID] = true;
+        hasHeightMap[textureID] = !files[3].empty();
+        hasMaterialMap[textureID] = true;
+    }
 
-            int width, height, nrChannels;
-            unsigned char* data = stbi_load(filename.c_str(), &width, &height, &nrChannels, 0);
-            if (data) {
-                GLenum format;
-                if (nrChannels == 1)
-                    format = GL_RED;
-                else if (nrChannels == 3)
-                    format = GL_RGB;
-                else if (nrChannels == 4)
-                    format = GL_RGBA;
+    // Load a normal map with a custom base name (_N suffix)
+    void loadNormalMapWithName(int textureID, const std::string& baseName) {
+        std::string filename = findImageFile("textures/" + baseName + "_N");
+        hasNormalMap[textureID] = !filename.empty();
+        if (filename.empty()) {
+            std::cout << "No normal map found for base name: " << baseName << std::endl;
+            return;
+        }
+        normalMaps[textureID] = requestImage(filename, PLACEHOLDER_NORMAL, 2, "normal map", textureClass(textureID, baseName),
+                                           TEXTURE_ENCODING_NORMAL);
+    }
 
-                glBindTexture(GL_TEXTURE_2D, textureHandle);
-                glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-                glGenerateMipmap(GL_TEXTURE_2D);
+    // Load a roughness map with a custom base name (_R suffix)
+    void loadRoughnessMapWithName(int textureID, const std::string& baseName) {
+        std::string filename = findImageFile("textures/" + baseName + "_R");
+        hasRoughnessMap[textureID] = !filename.empty();
+        if (filename.empty()) {
+            std::cout << "No roughness map found for base name: " << baseName << std::endl;
+            return;
+        }
+        roughnessMaps[textureID] = requestImage(filename, PLACEHOLDER_ROUGHNESS, 1, "roughness map", textureClass(textureID, baseName),
+                                              TEXTURE_ENCODING_SINGLE);
+    }
 
-                // Set texture parameters
-                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    // Load a height map (_H suffix), white is the top of the surface. Only the first channel is used
+    void loadHeightMapWithName(int textureID, const std::string& baseName) {
+        std::string filename = findImageFile("textures/" + baseName + "_H");
+        hasHeightMap[textureID] = !filename.empty();
+        if (filename.empty()) return;
+        heightMaps[textureID] = requestImage(filename, PLACEHOLDER_HEIGHT, 1, "height map", textureClass(textureID, baseName),
+                                           TEXTURE_ENCODING_SINGLE);
+    }
 
-                // Store texture in the map
-                textures[textureID] = textureHandle;
+    // Upload images the workers have decoded, for up to budgetMs but at least one, and hand the
+    // waiting files to free workers. Called once per frame on the GL thread
+    void uploadDecodedTextures(double budgetMs) {
+        for (DecodedImage* image = decodedImages.takeAll(); image != nullptr; image = image->next) {
+            readyImages.push_back(image);
+        }
 
-                std::cout << "Loaded texture: " << filename << std::endl;
-                loaded = true;
-                stbi_image_free(data);
-                break; // Exit the loop once a texture is successfully loaded
+        double startTime = glfwGetTime();
+        while (!readyImages.empty()) {
+            DecodedImage* image = readyImages.front();
+            readyImages.pop_front();
+            decodesInFlight--;
+            upload(*image);
+            stbi_image_free(image->pixels);
+            delete image;
+            if ((glfwGetTime() - startTime) * 1000.0 >= budgetMs) break;
+        }
+        startDecodes();
+
+        if (loadsPending > 0 && decodesInFlight == 0 && waitingImages.empty()) {
+            std::cout << "Textures loaded: " << loadsPending - loadsShared << " images decoded on " << threadPool.size()
+                      << " workers in " << (glfwGetTime() - loadStartTime) * 1000.0 << " ms, " << loadsShared
+                      << " duplicates shared, " << sharedTextures.size() << " unique textures" << std::endl;
+            for (int c = 0; c < TEXTURE_CLASS_COUNT; c++) {
+                if (sourceMegabytes[c] == 0.0) continue;
+                std::cout << "  " << TEXTURE_CLASS_NAMES[c] << " textures (max " << maxTextureSize[c] << "): "
+                          << sourceMegabytes[c] << " MB at file size, " << uploadedMegabytes[c] << " MB uploaded" << std::endl;
             }
-            if (data) stbi_image_free(data); // Free data even if loading failed
+            loadsPending = 0;
+            loadsShared = 0;
         }
+    }
 
-        if (!loaded) {
-            std::cout << "Failed to load texture for base name: " << baseName << " (tried png, jpg, jpeg)" << std::endl;
-            // Add a default texture or placeholder
-            textures[textureID] = 0;
+    // Images requested but not uploaded yet
+    size_t pendingTextures() const {
+        return waitingImages.size() + decodesInFlight;
+    }
+
+    // Sample every texture of a material from a lower mip level, each skipped level halves the resolution.
+    // The textures keep their full mip chains so the top levels come back without a reload
+    void setSkippedMipLevels(int levels) {
+        skippedMipLevels = levels;
+        for (const std::map<int, unsigned int>* maps : {&textures, &normalMaps, &roughnessMaps, &heightMaps}) {
+            for (const auto& texture : *maps) {
+                if (texture.second != 0) applySkippedMipLevels(texture.second);
+            }
         }
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
 
-        // Now try to load the normal map with _N suffix
-        loadNormalMapWithName(textureID, baseName);
+    int getSkippedMipLevels() const {
+        return skippedMipLevels;
+    }
+
+    // Bind textures with normal map and roughness map support
+    void bindTexture(int textureID) {
+        // If the texture doesn't exist yet, try to load it
+        if (textures.find(textureID) == textures.end()) {
+            loadTexture(textureID);
+        }
+
+        // Mark the textures used, a texture shrunk under the texture budget is reloaded
+        for (std::map<int, unsigned int>* maps : {&textures, &normalMaps, &roughnessMaps, &heightMaps}) {
+            auto texture = maps->find(textureID);
+            if (texture != maps->end()) textureResidency.use(texture->second);
+        }
+
+        // Bind the color texture to texture unit 0
+        glActiveTexture(GL_TEXTURE0);
+        if (textures.find(textureID) != textures.end() && textures[textureID] != 0) {
+            glBindTexture(GL_TEXTURE_2D, textures[textureID]);
+        } else {
+            // Unbind if no texture
+            glBindTexture(GL_TEXTURE_2D, 0);
+        }
+
+        // Bind the normal map to texture unit 1 if available
+        glActiveTexture(GL_TEXTURE1);
+        if (hasNormalMap[textureID]) {
+            glBindTexture(GL_TEXTURE_2D, normalMaps[textureID]);
+        } else {
+            // Unbind if no normal map
+            glBindTexture(GL_TEXTURE_2D, 0);
+        }
+
+        // Bind the roughness map to texture unit 2 if available
+        glActiveTexture(GL_TEXTURE2);
+        if (hasRoughnessMap[textureID]) {
+            glBindTexture(GL_TEXTURE_2D, roughnessMaps[textureID]);
+        } else {
+            // Unbind if no roughness map
+            glBindTexture(GL_TEXTURE_2D, 0);
+        }
+
+        // Bind the height map to texture unit 3 if available
+        glActiveTexture(GL_TEXTURE3);
+        glBindTexture(GL_TEXTURE_2D, hasHeightMap[textureID] ? heightMaps[textureID] : 0);
+
+        // Reset active texture
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+    // Check if a normal map exists for a specific texture
+    bool hasNormalMapForTexture(int textureID) {
+        return hasNormalMap[textureID];
+    }
+
+    // Check if a roughness map exists for a specific texture
+    bool hasRoughnessMapForTexture(int textureID) {
+        return hasRoughnessMap[textureID];
+    }
 
-        // Now try to load the roughness map with _R suffix
-        loadRoughnessMapWithName(textureID, baseName);
+    // Shader features needed to draw a wall, floor or ceiling with this texture and its maps
+    unsigned int shaderFeatures(int textureID) {
+        unsigned int features = 0;
+        if (textureID > 0) features |= FEATURE_TEXTURE;
+        // Only use normal map if both available AND the toggle is on
+        if (useNormalMaps && hasNormalMap[textureID]) features |= FEATURE_NORMAL_MAP;
+        if (hasRoughnessMap[textureID]) features |= FEATURE_ROUGHNESS_MAP;
+        // Parallax is surface detail like the normal map and toggled with it
+        if (useNormalMaps && hasHeightMap[textureID]) features |= FEATURE_PARALLAX_MAP;
+        if (hasMaterialMap[textureID]) features |= FEATURE_MATERIAL_MAP;
+        return features;
     }
 
-    // Load a normal map with the standard naming convention (wall_[textureID]_N)
-    void loadNormalMap(int textureID) {
-        // Default to no normal map
-        hasNormalMap[textureID] = false;
+    // Preload all textures needed for a map
+    void preloadMapTextures(const Map& map) {
+        std::set<int> uniqueTextureIDs;
+
+        // Collect all unique texture IDs from the map
+        for (int z = 0; z < map.height; z++) {
+            for (int x = 0; x < map.width; x++) {
+                int texID = map.getTextureID(x, z);
+                if (texID > 0) {
+                    uniqueTextureIDs.insert(texID);
+                }
+            }
+        }
 
-        // Try different file extensions for normal map
-        std::string extensions[] = {".png", ".jpg", ".jpeg"};
+        // Load each unique texture, normal map, and roughness map if available
+        for (int texID : uniqueTextureIDs) {
+            loadTexture(texID);
+        }
+    }
 
-        for (const auto& ext : extensions) {
-            // Construct the filename with _N suffix
-            std::string filename = "textures/wall_" + std::to_string(textureID) + "_N" + ext;
+    // Drop a texture ID and its maps. The GPU textures go once nothing else shares them
+    void unloadTexture(int textureID) {
+        for (std::map<int, unsigned int>* maps : {&textures, &normalMaps, &roughnessMaps, &heightMaps}) {
+            auto it = maps->find(textureID);
+            if (it == maps->end()) continue;
+            uint64_t content = it->second != 0 ? sharedTextures.content(it->second) : 0;
+            if (it->second != 0 && sharedTextures.release(it->second)) {
+                streamedTextures.erase(it->second);
+                requestsByTexture.erase(it->second);
+                if (content != 0) releaseClaim(content);
+                for (auto request = textureByRequest.begin(); request != textureByRequest.end();) {
+                    request = request->second == it->second ? textureByRequest.erase(request) : std::next(request);
+                }
+            }
+            maps->erase(it);
+        }
+        hasNormalMap.erase(textureID);
+        hasRoughnessMap.erase(textureID);
+        hasHeightMap.erase(textureID);
+        hasMaterialMap.erase(textureID);
+        isObjectTexture.erase(textureID);
+    }
 
-            // Load the texture
-            unsigned int textureHandle;
-            glGenTextures(1, &textureHandle);
+    // Pick the finest mip level each streamed texture needs from the feedback pass, whose LODs are the finest
+    // log2 of texture coordinate units per pixel of each texture ID. Finer levels are read from the texture
+    // cache on the workers, levels unneeded for STREAMING_DROP_DELAY seconds are dropped
+    void updateStreaming(const std::map<int, float>& lodByTextureID, double time) {
+        std::unordered_map<unsigned int, int> neededLevels;
+        for (const auto& lod : lodByTextureID) {
+            for (const std::map<int, unsigned int>* maps : {&textures, &normalMaps, &roughnessMaps, &heightMaps}) {
+                auto texture = maps->find(lod.first);
+                if (texture == maps->end()) continue;
+                auto streamed = streamedTextures.find(texture->second);
+                if (streamed == streamedTextures.end()) continue;
+                const StreamedTexture& stream = streamed->second;
+                int level = static_cast<int>(std::floor(lod.second + std::log2(static_cast<float>(std::max(stream.width, stream.height)))));
+                auto needed = neededLevels.find(texture->second);
+                if (needed == neededLevels.end() || level < needed->second) neededLevels[texture->second] = level;
+            }
+        }
 
-            int width, height, nrChannels;
-            unsigned char* data = stbi_load(filename.c_str(), &width, &height, &nrChannels, 0);
-            if (data) {
-                GLenum format;
-                if (nrChannels == 1)
-                    format = GL_RED;
-                else if (nrChannels == 3)
-                    format = GL_RGB;
-                else if (nrChannels == 4)
-                    format = GL_RGBA;
+        for (auto& entry : streamedTextures) {
+            StreamedTexture& stream = entry.second;
+            if (stream.cachePath.empty()) continue;
+            // Never finer than the levels the quality governor skips, never coarser than the tail
+            int tail = streamingTailLevel(stream.width, stream.height, stream.levels);
+            auto needed = neededLevels.find(entry.first);
+            int level = needed != neededLevels.end() ? std::min(needed->second, tail) : tail;
+            level = std::clamp(level, std::min(skippedMipLevels, tail), tail);
+            if (level <= stream.wantedLevel || time - stream.wantedTime >= STREAMING_DROP_DELAY) {
+                stream.wantedLevel = level;
+                stream.wantedTime = time;
+            }
 
-                glBindTexture(GL_TEXTURE_2D, textureHandle);
-                glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-                glGenerateMipmap(GL_TEXTURE_2D);
+            if (stream.loading) continue;
+            if (stream.wantedLevel < stream.residentLevel && decodesInFlight < static_cast<int>(threadPool.size())) {
+                loadStreamedLevels(entry.first, stream);
+            } else if (stream.wantedLevel > stream.residentLevel) {
+                dropStreamedLevels(entry.first, stream);
+                textureResidency.setBytes(entry.first, streamedBytes(stream));
+            }
+        }
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
 
-                // Set texture parameters
-                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    // Resident and full size of the streamed textures in megabytes, for the stats line
+    void streamingMegabytes(double& resident, double& full) const {
+        size_t residentBytes = 0, fullBytes = 0;
+        for (const auto& entry : streamedTextures) {
+            residentBytes += streamedBytes(entry.second);
+            for (int level = 0; level < entry.second.residentLevel; level++) {
+                fullBytes += CompressedImage::levelBytes(entry.second.format, entry.second.width, entry.second.height, level);
+            }
+        }
+        resident = residentBytes / (1024.0 * 1024.0);
+        full = (residentBytes + fullBytes) / (1024.0 * 1024.0);
+    }
 
-                // Store normal map in the map
-                normalMaps[textureID] = textureHandle;
-                hasNormalMap[textureID] = true;
+private:
+    // One decoded image on its way from a worker to the GL thread
+    struct DecodedImage {
+        unsigned int texture;   // Texture name the placeholder was made on
+        std::string filename;
+        const char* kind;       // For the log, "normal map" and so on
+        int width = 0;
+        int height = 0;
+        int channels = 0;
+        int sourceWidth = 0;    // Size of the file, before fitting under the class's maximum size
+        int sourceHeight = 0;
+        TextureClass textureClass = TEXTURE_CLASS_WALL;
+        unsigned char* pixels = nullptr;  // stbi_load result, null if decoding failed or skipped
+        CompressedImage compressed;       // Used instead of the pixels when it has levels
+        bool fromCache = false;
+        uint64_t content = 0;   // textureShareKey of the file and request
+        bool duplicate = false; // Another request with the same content was decoded instead
+        std::string cachePath;  // Texture cache file to stream the finer levels from, empty if they are uploaded now
+        int streamLevel = -1;   // Levels from here of a streamed texture, -1 for a new image
+        bool reload = false;    // Restores a texture shrunk under the texture budget
+        DecodedImage* next = nullptr;
+    };
+
+    // A block compressed texture whose finer mip levels come and go with the feedback pass
+    struct StreamedTexture {
+        std::string cachePath;  // Empty once the file stopped matching the texture, it then stays as it is
+        GLenum format;
+        int width, height;      // Level 0
+        int levels;
+        int residentLevel;      // Finest level uploaded
+        int wantedLevel;        // Finest level needed within the drop delay
+        double wantedTime;      // When wantedLevel was last needed
+        bool loading = false;   // A worker is reading the finer levels
+    };
+
+    // Lock-free queue from the decode workers to the GL thread. Workers push onto a stack, the single
+    // consumer takes the whole stack at once and reverses it, so nodes are never popped one by one
+    class DecodedImageQueue {
+    public:
+        void push(DecodedImage* image) {
+            image->next = head.load(std::memory_order_relaxed);
+            while (!head.compare_exchange_weak(image->next, image, std::memory_order_release, std::memory_order_relaxed)) {
+            }
+        }
 
-                std::cout << "Loaded normal map: " << filename << std::endl;
-                stbi_image_free(data);
-                return; // Exit once we found a valid normal map
+        // Every image pushed so far, oldest first
+        DecodedImage* takeAll() {
+            DecodedImage* stack = head.exchange(nullptr, std::memory_order_acquire);
+            DecodedImage* list = nullptr;
+            while (stack != nullptr) {
+                DecodedImage* next = stack->next;
+                stack->next = list;
+                list = stack;
+                stack = next;
             }
-            if (data) stbi_image_free(data); // Free data even if loading failed
+            return list;
         }
 
-        std::cout << "No normal map found for texture ID: " << textureID << std::endl;
+    private:
+        std::atomic<DecodedImage*> head{nullptr};
+    };
+
+    // A file waiting for a free worker
+    struct ImageRequest {
+        unsigned int texture;
+        std::string filename;
+        int desiredChannels;  // 0 keeps the file's channels
+        const char* kind;
+        TextureClass textureClass;
+        int maxSize;          // maxTextureSize of the class when it was requested
+        TextureEncoding encoding;
+        bool compress;        // Through the texture cache instead of uploading the decoded pixels
+        bool stream;          // Upload only the tail of the mip chain, see updateStreaming
+        std::vector<std::string> packedFiles;  // Per channel files of a packed material map, empty for one file
+        const unsigned char* placeholder = nullptr;  // Shown again when the texture is shrunk under the texture budget
+        bool reload = false;
+    };
+
+    // 1x1 stand-ins shown until the real image is uploaded
+    static constexpr unsigned char PLACEHOLDER_DIFFUSE[4] = {128, 128, 128, 255};
+    static constexpr unsigned char PLACEHOLDER_NORMAL[4] = {128, 128, 255, 255};  // Flat
+    static constexpr unsigned char PLACEHOLDER_ROUGHNESS[4] = {255, 255, 255, 255};  // Fully rough, like no roughness map
+    static constexpr unsigned char PLACEHOLDER_HEIGHT[4] = {255, 255, 255, 255};  // Flat at the top of the surface
+    static constexpr unsigned char PLACEHOLDER_MATERIAL[4] = {255, 255, 0, 255};  // What each packed channel is without its map
+
+    ThreadPool& threadPool;
+    DecodedImageQueue decodedImages;
+    std::deque<DecodedImage*> readyImages;    // Taken from the queue, waiting for the upload budget
+    std::deque<ImageRequest> waitingImages;   // Not handed to a worker yet
+    int decodesInFlight = 0;                  // Handed to a worker and not uploaded yet, GL thread only
+    std::atomic<int> decodesRunning{0};       // Decode jobs that have not finished
+    int loadsPending = 0;                     // Images requested since the last "Textures loaded" report
+    int loadsShared = 0;                      // Of those, how many share another image's texture
+    double loadStartTime = 0.0;
+    int skippedMipLevels = 0;
+    std::map<std::string, unsigned int> textureByRequest;   // By file name and channels, each file is requested once
+    std::mutex claimedContentMutex;
+    std::set<uint64_t> claimedContent;                       // Share keys a worker has decoded or is decoding
+    std::multimap<uint64_t, unsigned int> waitingDuplicates; // Placeholders of duplicates whose original is not uploaded yet
+    double sourceMegabytes[TEXTURE_CLASS_COUNT] = {};        // Uploaded images at their file size, for the memory report
+    double uploadedMegabytes[TEXTURE_CLASS_COUNT] = {};      // The same images as uploaded
+    std::unordered_map<unsigned int, StreamedTexture> streamedTextures;  // By texture name
+    std::unordered_map<unsigned int, ImageRequest> requestsByTexture;    // To reload a texture shrunk under the budget
+
+    // Class of a material's textures, floor and ceiling by name since they use texture IDs like the walls
+    TextureClass textureClass(int textureID, const std::string& baseName) {
+        if (baseName.rfind("floor_", 0) == 0 || baseName.rfind("ceiling_", 0) == 0) return TEXTURE_CLASS_FLOOR;
+        return isObject(textureID) ? TEXTURE_CLASS_OBJECT : TEXTURE_CLASS_WALL;
     }
 
-    // Load a normal map with a custom base name
-    void loadNormalMapWithName(int textureID, const std::string& baseName) {
-        // Default to no normal map
-        hasNormalMap[textureID] = false;
+    // The first of the supported extensions the asset index has for a path without extension, empty if none
+    static std::string findImageFile(const std::string& basePath) {
+        const AssetIndex::Entry* entry = assetIndex.findImage(basePath);
+        return entry != nullptr ? entry->path : "";
+    }
 
-        // Try different file extensions for normal map
-        std::string extensions[] = {".png", ".jpg", ".jpeg"};
+    // Create a texture showing the placeholder and queue the file for decoding into it
+    unsigned int requestImage(const std::string& filename, const unsigned char* placeholder, int desiredChannels, const char* kind,
+                              TextureClass textureClass, TextureEncoding encoding) {
+        // Several IDs can use the same file, they share its texture
+        std::string requestKey = filename + "#" + std::to_string(desiredChannels) + "#" + std::to_string(encoding);
+        auto existing = textureByRequest.find(requestKey);
+        if (existing != textureByRequest.end()) {
+            sharedTextures.addReference(existing->second);
+            return existing->second;
+        }
 
-        for (const auto& ext : extensions) {
-            // Construct the filename with _N suffix
-            std::string filename = "textures/" + baseName + "_N" + ext;
+        unsigned int textureHandle = createPlaceholder(placeholder, requestKey);
+        ImageRequest request{textureHandle, filename, desiredChannels, kind, textureClass, maxTextureSize[textureClass],
+                             encoding, TextureCache::canCompress(encoding), useTextureStreaming};
+        request.placeholder = placeholder;
+        requestsByTexture[textureHandle] = request;
+        waitingImages.push_back(request);
+        startDecodes();
+        return textureHandle;
+    }
 
-            // Load the texture
-            unsigned int textureHandle;
-            glGenTextures(1, &textureHandle);
+    // Like requestImage for a packed material map, made from one channel of each file. It stays uncompressed,
+    // in BC3 the unrelated channels would share one color block's endpoints
+    unsigned int requestPackedImage(const std::vector<std::string>& files, TextureClass textureClass) {
+        std::string name;
+        for (const std::string& file : files) {
+            if (file.empty()) continue;
+            name += (name.empty() ? "" : " + ") + file;
+        }
+        std::string requestKey = name + "#packed";
+        auto existing = textureByRequest.find(requestKey);
+        if (existing != textureByRequest.end()) {
+            sharedTextures.addReference(existing->second);
+            return existing->second;
+        }
 
-            int width, height, nrChannels;
-            unsigned char* data = stbi_load(filename.c_str(), &width, &height, &nrChannels, 0);
-            if (data) {
-                GLenum format;
-                if (nrChannels == 1)
-                    format = GL_RED;
-                else if (nrChannels == 3)
-                    format = GL_RGB;
-                else if (nrChannels == 4)
-                    format = GL_RGBA;
+        unsigned int textureHandle = createPlaceholder(PLACEHOLDER_MATERIAL, requestKey);
+        ImageRequest request{textureHandle, name, 4, "material map", textureClass, maxTextureSize[textureClass],
+                             TEXTURE_ENCODING_COLOR, false, false, files};
+        request.placeholder = PLACEHOLDER_MATERIAL;
+        requestsByTexture[textureHandle] = request;
+        waitingImages.push_back(request);
+        startDecodes();
+        return textureHandle;
+    }
 
-                glBindTexture(GL_TEXTURE_2D, textureHandle);
-                glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-                glGenerateMipmap(GL_TEXTURE_2D);
+    // 1x1 texture showing a placeholder until its image is uploaded, with the first reference to it
+    unsigned int createPlaceholder(const unsigned char* placeholder, const std::string& requestKey) {
+        unsigned int textureHandle;
+        glGenTextures(1, &textureHandle);
+        glBindTexture(GL_TEXTURE_2D, textureHandle);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, placeholder);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glBindTexture(GL_TEXTURE_2D, 0);
 
-                // Set texture parameters
-                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        sharedTextures.addReference(textureHandle);
+        textureByRequest[requestKey] = textureHandle;
 
-                // Store normal map in the map
-                normalMaps[textureID] = textureHandle;
-                hasNormalMap[textureID] = true;
+        if (loadsPending == 0) loadStartTime = glfwGetTime();
+        loadsPending++;
+        return textureHandle;
+    }
 
-                std::cout << "Loaded normal map: " << filename << std::endl;
-                stbi_image_free(data);
-                return; // Exit once we found a valid normal map
+    // Pack one channel of each file into RGBA, at the size of the first file found. Missing files and files
+    // of another size take the placeholder value, so a broken map never takes down the others
+    static unsigned char* decodePackedImage(const std::vector<std::string>& files, uint64_t& content, int& width, int& height) {
+        std::vector<uint64_t> fileContents;
+        unsigned char* packed = nullptr;
+        for (int c = 0; c < 4; c++) {
+            std::vector<unsigned char> bytes = files[c].empty() ? std::vector<unsigned char>() : readFileBytes(files[c]);
+            fileContents.push_back(bytes.empty() ? 0 : imageContentKey(bytes, 1));
+            int channelWidth, channelHeight, channels;
+            unsigned char* pixels = bytes.empty() ? nullptr : decodeImage(bytes, 1, channelWidth, channelHeight, channels);
+            if (pixels != nullptr && packed == nullptr) {
+                width = channelWidth;
+                height = channelHeight;
+                packed = static_cast<unsigned char*>(STBI_MALLOC(static_cast<size_t>(width) * height * 4));
+                for (size_t i = 0; packed != nullptr && i < static_cast<size_t>(width) * height; i++) {
+                    std::memcpy(&packed[i * 4], PLACEHOLDER_MATERIAL, 4);
+                }
             }
-            if (data) stbi_image_free(data); // Free data even if loading failed
+            if (pixels != nullptr && packed != nullptr && channelWidth == width && channelHeight == height) {
+                for (size_t i = 0; i < static_cast<size_t>(width) * height; i++) packed[i * 4 + c] = pixels[i];
+            } else if (pixels != nullptr) {
+                std::cout << "Material map " << files[c] << " is not the size of the other maps, left out" << std::endl;
+            }
+            stbi_image_free(pixels);
         }
+        content = hashBytes(reinterpret_cast<const unsigned char*>(fileContents.data()), fileContents.size() * sizeof(uint64_t), 4);
+        return packed;
+    }
 
-        std::cout << "No normal map found for base name: " << baseName << std::endl;
+    // Hand waiting files to the workers. Decoded photos are large, so only as many images as there are
+    // workers are decoded or waiting for upload at once
+    void startDecodes() {
+        int maxInFlight = static_cast<int>(threadPool.size());
+        while (!waitingImages.empty() && decodesInFlight < maxInFlight) {
+            ImageRequest request = waitingImages.front();
+            waitingImages.pop_front();
+            decodesInFlight++;
+            decodesRunning++;
+            threadPool.submit([this, request]() {
+                DecodedImage* image = new DecodedImage{request.texture, request.filename, request.kind};
+                image->textureClass = request.textureClass;
+                image->reload = request.reload;  // A reload has claimed its content already
+                if (!request.packedFiles.empty()) {
+                    uint64_t content = 0;
+                    image->pixels = decodePackedImage(request.packedFiles, content, image->width, image->height);
+                    image->content = textureShareKey(content, request.maxSize, request.encoding);
+                    image->channels = 4;
+                    if (!request.reload) {
+                        std::lock_guard<std::mutex> lock(claimedContentMutex);
+                        image->duplicate = !claimedContent.insert(image->content).second;
+                    }
+                    image->sourceWidth = image->width;
+                    image->sourceHeight = image->height;
+                    image->pixels = fitImage(image->pixels, image->width, image->height, image->channels, request.maxSize);
+                    decodedImages.push(image);
+                    decodesRunning--;
+                    return;
+                }
+                std::vector<unsigned char> bytes = readFileBytes(request.filename);
+                if (!bytes.empty()) {
+                    // Copies of a file under other names are hashed but decoded only once
+                    uint64_t content = imageContentKey(bytes, request.desiredChannels);
+                    image->content = textureShareKey(content, request.maxSize, request.encoding);
+                    if (!request.reload) {
+                        std::lock_guard<std::mutex> lock(claimedContentMutex);
+                        image->duplicate = !claimedContent.insert(image->content).second;
+                    }
+                    if (!image->duplicate && request.compress) {
+                        // Only the header is decoded for the memory report when the cache has the image
+                        stbi_info_from_memory(bytes.data(), static_cast<int>(bytes.size()), &image->sourceWidth,
+                                              &image->sourceHeight, &image->channels);
+                        if (request.desiredChannels > 0) image->channels = request.desiredChannels;
+                        if (!TextureCache::loadOrEncode(bytes, content, request.desiredChannels, request.maxSize,
+                                                        request.encoding, &threadPool, image->compressed, image->fromCache)) {
+                            image->compressed = CompressedImage();
+                        }
+                        // Finer levels can only be streamed back in from a file the cache managed to write
+                        std::string cachePath = TextureCache::path(content, request.maxSize, request.encoding);
+                        std::error_code error;
+                        if (request.stream && !image->compressed.levels.empty() && std::filesystem::exists(cachePath, error)) {
+                            image->cachePath = cachePath;
+                        }
+                        image->width = image->compressed.width;
+                        image->height = image->compressed.height;
+                    } else if (!image->duplicate) {
+                        image->pixels = decodeImage(bytes, request.desiredChannels, image->width, image->height, image->channels);
+                        image->sourceWidth = image->width;
+                        image->sourceHeight = image->height;
+                        image->pixels = fitImage(image->pixels, image->width, image->height, image->channels, request.maxSize);
+                    }
+                }
+                decodedImages.push(image);
+                decodesRunning--;
+            });
+        }
     }
 
-    // Load a roughness map with the standard naming convention (wall_[textureID]_R)
-    void loadRoughnessMap(int textureID) {
-        // Default to no roughness map
-        hasRoughnessMap[textureID] = false;
+    // Replace a placeholder with its decoded image, or with the texture that already has its content
+    void upload(const DecodedImage& image) {
+        // Unloaded while it was decoding. Its claim goes with it, so a later request decodes the image again
+        if (!sharedTextures.contains(image.texture)) {
+            if (image.content != 0 && !image.duplicate && !image.reload && image.streamLevel < 0) releaseClaim(image.content);
+            return;
+        }
+        if (image.streamLevel >= 0) {
+            uploadStreamedLevels(image);
+            return;
+        }
 
-        // Try different file extensions for roughness map
-        std::string extensions[] = {".png", ".jpg", ".jpeg"};
+        unsigned int original = image.content != 0 && !image.reload ? sharedTextures.find(image.content) : 0;
+        if (image.duplicate || original != 0) {
+            if (original == 0 && isClaimed(image.content)) {
+                waitingDuplicates.emplace(image.content, image.texture);
+            } else if (original == 0) {
+                requeueDuplicate(image.texture);  // The original was unloaded before it uploaded
+            } else {
+                shareTexture(image.texture, original);
+                std::cout << "Shared " << image.kind << ": " << image.filename << " (same image as an earlier texture)" << std::endl;
+            }
+            return;
+        }
 
-        for (const auto& ext : extensions) {
-            // Construct the filename with _R suffix
-            std::string filename = "textures/wall_" + std::to_string(textureID) + "_R" + ext;
+        bool compressed = !image.compressed.levels.empty();
+        if (image.pixels == nullptr && !compressed) {
+            std::cout << "Failed to decode " << image.kind << ": " << image.filename << std::endl;
+            return;
+        }
 
-            // Load the texture
-            unsigned int textureHandle;
-            glGenTextures(1, &textureHandle);
+        glBindTexture(GL_TEXTURE_2D, image.texture);
+        if (compressed && !image.cachePath.empty()) {
+            // Only the tail for now, the placeholder's level goes since levels below the base level are kept
+            const CompressedImage& levels = image.compressed;
+            int levelCount = static_cast<int>(levels.levels.size());
+            int tail = streamingTailLevel(levels.width, levels.height, levelCount);
+            TextureCache::upload(levels, tail);
+            if (tail > 0) glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 0, 0, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+            streamedTextures[image.texture] = {image.cachePath, levels.format, levels.width, levels.height, levelCount, tail, tail, 0.0};
+        } else if (compressed) {
+            TextureCache::upload(image.compressed);
+        } else {
+            GLenum format = GL_RGB;
+            GLenum internalFormat = GL_RGB8;
+            if (image.channels == 1) {
+                format = GL_RED;
+                internalFormat = GL_R8;
+            } else if (image.channels == 2) {
+                format = GL_RG;
+                internalFormat = GL_RG8;
+            } else if (image.channels == 4) {
+                format = GL_RGBA;
+                internalFormat = GL_RGBA8;
+            }
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);  // Rows of 1 and 3 byte texels are not 4 byte aligned
+            glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, image.width, image.height, 0, format, GL_UNSIGNED_BYTE, image.pixels);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 1000);  // A shrunk texture was left with level 0 only
+            glGenerateMipmap(GL_TEXTURE_2D);
+        }
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        if (skippedMipLevels > 0 || !image.cachePath.empty()) applySkippedMipLevels(image.texture);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        sharedTextures.setContent(image.texture, image.content);
+
+        double source = textureMegabytes(image.sourceWidth, image.sourceHeight, image.channels);
+        double uploaded = compressed ? image.compressed.bytes() / (1024.0 * 1024.0) : textureMegabytes(image.width, image.height, image.channels);
+        auto streamed = streamedTextures.find(image.texture);
+        size_t gpuBytes = streamed != streamedTextures.end() ? streamedBytes(streamed->second) : static_cast<size_t>(uploaded * 1024.0 * 1024.0);
+        unsigned int texture = image.texture;
+        if (image.reload) {
+            textureResidency.setBytes(texture, gpuBytes);
+        } else {
+            textureResidency.add(texture, gpuBytes, [this, texture]() { return shrinkTexture(texture); },
+                                 [this, texture]() { restoreTexture(texture); });
+            sourceMegabytes[image.textureClass] += source;
+            uploadedMegabytes[image.textureClass] += uploaded;
+        }
+        std::cout << (image.reload ? "Reloaded " : "Loaded ") << image.kind << ": " << image.filename;
+        if (compressed) {
+            std::cout << (image.fromCache ? " (texture cache, " : " (compressed, ") << source << " -> " << uploaded << " MB"
+                      << (image.cachePath.empty() ? ")" : ", streamed)");
+        } else if (image.width != image.sourceWidth || image.height != image.sourceHeight) {
+            std::cout << " (" << image.sourceWidth << "x" << image.sourceHeight << " -> " << image.width << "x" << image.height
+                      << ", " << source << " -> " << uploaded << " MB)";
+        }
+        std::cout << std::endl;
 
-            int width, height, nrChannels;
-            unsigned char* data = stbi_load(filename.c_str(), &width, &height, &nrChannels, 0);
-            if (data) {
-                GLenum format;
-                if (nrChannels == 1)
-                    format = GL_RED;
-                else if (nrChannels == 3)
-                    format = GL_RGB;
-                else if (nrChannels == 4)
-                    format = GL_RGBA;
+        // Duplicates that finished before this image
+        auto waiting = waitingDuplicates.equal_range(image.content);
+        for (auto it = waiting.first; it != waiting.second; ++it) {
+            if (sharedTextures.contains(it->second)) shareTexture(it->second, image.texture);
+        }
+        waitingDuplicates.erase(waiting.first, waiting.second);
+    }
 
-                glBindTexture(GL_TEXTURE_2D, textureHandle);
-                glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-                glGenerateMipmap(GL_TEXTURE_2D);
+    bool isClaimed(uint64_t content) {
+        std::lock_guard<std::mutex> lock(claimedContentMutex);
+        return claimedContent.count(content) > 0;
+    }
 
-                // Set texture parameters
-                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    // Forget that an image was decoded, once its texture is deleted or its decode thrown away. Duplicates
+    // waiting on it have no pixels of their own, so they are decoded again and the first becomes the original
+    void releaseClaim(uint64_t content) {
+        {
+            std::lock_guard<std::mutex> lock(claimedContentMutex);
+            claimedContent.erase(content);
+        }
+        auto waiting = waitingDuplicates.equal_range(content);
+        std::vector<unsigned int> duplicates;
+        for (auto it = waiting.first; it != waiting.second; ++it) duplicates.push_back(it->second);
+        waitingDuplicates.erase(waiting.first, waiting.second);
+        for (unsigned int duplicate : duplicates) requeueDuplicate(duplicate);
+    }
 
-                // Store roughness map in the map
-                roughnessMaps[textureID] = textureHandle;
-                hasRoughnessMap[textureID] = true;
+    // Queue a duplicate's placeholder for decoding as if it had been requested on its own
+    void requeueDuplicate(unsigned int texture) {
+        auto request = requestsByTexture.find(texture);
+        if (!sharedTextures.contains(texture) || request == requestsByTexture.end()) return;
+        waitingImages.push_back(request->second);
+        startDecodes();
+    }
 
-                std::cout << "Loaded roughness map: " << filename << std::endl;
-                stbi_image_free(data);
-                return; // Exit once we found a valid roughness map
+    // Point everything that uses a duplicate's placeholder at the original texture and delete the placeholder
+    void shareTexture(unsigned int duplicate, unsigned int original) {
+        for (std::map<int, unsigned int>* maps : {&textures, &normalMaps, &roughnessMaps, &heightMaps}) {
+            for (auto& texture : *maps) {
+                if (texture.second == duplicate) texture.second = original;
             }
-            if (data) stbi_image_free(data); // Free data even if loading failed
         }
+        for (auto& request : textureByRequest) {
+            if (request.second == duplicate) request.second = original;
+        }
+        requestsByTexture.erase(duplicate);
+        sharedTextures.merge(duplicate, original);
+        loadsShared++;
+    }
 
-        std::cout << "No roughness map found for texture ID: " << textureID << std::endl;
+    // Coarsest level a streamed texture may go down to, the first one no larger than STREAMING_TAIL_SIZE
+    static int streamingTailLevel(int width, int height, int levels) {
+        int level = 0;
+        while (level < levels - 1 && std::max(width >> level, height >> level) > STREAMING_TAIL_SIZE) level++;
+        return level;
     }
 
-    // Load a roughness map with a custom base name
-// Continue the loadRoughnessMapWithName method
-    void loadRoughnessMapWithName(int textureID, const std::string& baseName) {
-        // Default to no roughness map
-        hasRoughnessMap[textureID] = false;
+    // Read the levels a streamed texture is missing down to its wanted level on a worker
+    void loadStreamedLevels(unsigned int texture, StreamedTexture& stream) {
+        stream.loading = true;
+        decodesInFlight++;
+        decodesRunning++;
+        std::string cachePath = stream.cachePath;
+        int level = stream.wantedLevel;
+        int endLevel = stream.residentLevel;
+        threadPool.submit([this, texture, cachePath, level, endLevel]() {
+            DecodedImage* image = new DecodedImage{texture, cachePath, "streamed levels"};
+            image->streamLevel = level;
+            if (!TextureCache::load(cachePath, level, endLevel, image->compressed)) image->compressed = CompressedImage();
+            decodedImages.push(image);
+            decodesRunning--;
+        });
+    }
+
+    // Upload the levels a worker has read, from streamLevel up to the ones resident. Nothing is dropped
+    // while a load runs, so they still join up with the resident levels
+    void uploadStreamedLevels(const DecodedImage& image) {
+        auto streamed = streamedTextures.find(image.texture);
+        if (streamed == streamedTextures.end()) return;
+        StreamedTexture& stream = streamed->second;
+        stream.loading = false;
+
+        const CompressedImage& levels = image.compressed;
+        if (levels.format != stream.format || levels.width != stream.width || levels.height != stream.height ||
+            static_cast<int>(levels.levels.size()) != stream.residentLevel - image.streamLevel) {
+            std::cout << "Texture cache file changed or missing, stopped streaming " << image.filename << std::endl;
+            stream.cachePath.clear();
+            return;
+        }
+        glBindTexture(GL_TEXTURE_2D, image.texture);
+        TextureCache::uploadRange(levels, image.streamLevel);
+        stream.residentLevel = image.streamLevel;
+        applySkippedMipLevels(image.texture);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        textureResidency.setBytes(image.texture, streamedBytes(stream));
+    }
+
+    static size_t streamedBytes(const StreamedTexture& stream) {
+        size_t bytes = 0;
+        for (int level = stream.residentLevel; level < stream.levels; level++) {
+            bytes += CompressedImage::levelBytes(stream.format, stream.width, stream.height, level);
+        }
+        return bytes;
+    }
 
-        // Try different file extensions for roughness map
-        std::string extensions[] = {".png", ".jpg", ".jpeg"};
+    // Free what the texture residency asks of a texture: the levels of a streamed texture above its tail,
+    // the whole image of the others. Returns the size left
+    size_t shrinkTexture(unsigned int texture) {
+        auto streamed = streamedTextures.find(texture);
+        if (streamed != streamedTextures.end()) {
+            StreamedTexture& stream = streamed->second;
+            int tail = streamingTailLevel(stream.width, stream.height, stream.levels);
+            if (!stream.loading && stream.residentLevel < tail) {
+                stream.wantedLevel = tail;
+                dropStreamedLevels(texture, stream);
+                glBindTexture(GL_TEXTURE_2D, 0);
+            }
+            return streamedBytes(stream);
+        }
+        return replaceWithPlaceholder(texture, requestsByTexture[texture].placeholder);
+    }
 
-        for (const auto& ext : extensions) {
-            // Construct the filename with _R suffix
-            std::string filename = "textures/" + baseName + "_R" + ext;
+    // Decode a shrunk texture again, through the texture cache if it is compressed. Its placeholder shows
+    // until then. Streamed textures get their levels back from the feedback pass instead
+    void restoreTexture(unsigned int texture) {
+        auto request = requestsByTexture.find(texture);
+        if (request == requestsByTexture.end() || streamedTextures.count(texture) > 0) return;
+        ImageRequest reload = request->second;
+        reload.reload = true;
+        waitingImages.push_front(reload);  // Ahead of new loads, it is being drawn
+        startDecodes();
+    }
 
-            // Load the texture
-            unsigned int textureHandle;
-            glGenTextures(1, &textureHandle);
+    // Free the levels of a streamed texture finer than its wanted level. Leaves the texture bound
+    void dropStreamedLevels(unsigned int texture, StreamedTexture& stream) {
+        int dropped = stream.residentLevel;
+        stream.residentLevel = stream.wantedLevel;
+        applySkippedMipLevels(texture);
+        // GL 3.3 has no way to free a level but to redefine it empty
+        for (int level = dropped; level < stream.residentLevel; level++) {
+            glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA8, 0, 0, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        }
+    }
 
-            int width, height, nrChannels;
-            unsigned char* data = stbi_load(filename.c_str(), &width, &height, &nrChannels, 0);
-            if (data) {
-                GLenum format;
-                if (nrChannels == 1)
-                    format = GL_RED;
-                else if (nrChannels == 3)
-                    format = GL_RGB;
-                else if (nrChannels == 4)
-                    format = GL_RGBA;
+    // Move the base level of a texture, never past its 1x1 level or below the resident levels of a
+    // streamed texture. Leaves the texture bound
+    void applySkippedMipLevels(unsigned int texture) {
+        glBindTexture(GL_TEXTURE_2D, texture);
+        auto streamed = streamedTextures.find(texture);
+        if (streamed != streamedTextures.end()) {
+            const StreamedTexture& stream = streamed->second;
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, std::max(stream.residentLevel, std::min(skippedMipLevels, stream.levels - 1)));
+            return;
+        }
+        int width = 1, height = 1;
+        glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
+        glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
+        int topLevel = static_cast<int>(std::floor(std::log2(std::max(std::max(width, height), 1))));
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, std::min(skippedMipLevels, topLevel));
+    }
+};
 
-                glBindTexture(GL_TEXTURE_2D, textureHandle);
-                glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-                glGenerateMipmap(GL_TEXTURE_2D);
+// Feedback for texture streaming. Every few frames the visible map chunks are drawn into a small target
+// recording the texture ID and the finest texture coordinate LOD of each pixel. The target is read back
+// through a ring of pixel buffers a few frames later, so the GL thread never waits for the GPU
+class TextureFeedback {
+public:
+    TextureFeedback() : feedbackShaders("shader.vs", "texture_feedback.fs") {
+        glGenFramebuffers(1, &framebuffer);
+        glGenTextures(1, &colorTexture);
+        glGenRenderbuffers(1, &depthBuffer);
+        glGenBuffers(READBACK_COUNT, pixelBuffers);
+    }
 
-                // Set texture parameters
-                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    ~TextureFeedback() {
+        for (Readback& readback : readbacks) {
+            if (readback.fence != 0) glDeleteSync(readback.fence);
+        }
+        glDeleteBuffers(READBACK_COUNT, pixelBuffers);
+        glDeleteRenderbuffers(1, &depthBuffer);
+        glDeleteTextures(1, &colorTexture);
+        glDeleteFramebuffers(1, &framebuffer);
+    }
 
-                // Store roughness map in the map
-                roughnessMaps[textureID] = textureHandle;
-                hasRoughnessMap[textureID] = true;
+    void precompile() {
+        feedbackShaders.precompile({0});
+    }
 
-                std::cout << "Loaded roughness map: " << filename << std::endl;
-                stbi_image_free(data);
-                return; // Exit once we found a valid roughness map
+    // Draw the chunks into the feedback target and start reading it back, on every TEXTURE_FEEDBACK_INTERVAL
+    // frame that has a free pixel buffer. Restores the viewport and binds the default framebuffer
+    void render(const MapMeshes& mapMeshes, const std::vector<const MapMeshes::Chunk*>& chunks, int sceneWidth, int sceneHeight) {
+        if (++frame % TEXTURE_FEEDBACK_INTERVAL != 0 || readbacks[nextReadback].fence != 0) return;
+        int width = std::max(1, sceneWidth / TEXTURE_FEEDBACK_DIVISOR);
+        int height = std::max(1, sceneHeight / TEXTURE_FEEDBACK_DIVISOR);
+        if (width != targetWidth || height != targetHeight) createTarget(width, height);
+
+        int viewport[4];
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glViewport(0, 0, width, height);
+        glClearColor(0.0f, 0.0f, 0.0f, 0.0f);  // Alpha 0 marks pixels with nothing drawn
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+        // Same projection as the scene at 1/TEXTURE_FEEDBACK_DIVISOR of its pixels, the bias takes the
+        // larger pixels back out of the LOD
+        Shader& shader = feedbackShaders.use(0);
+        shader.setMat4(U_MODEL, glm::mat4(1.0f));
+        shader.setFloat(U_FEEDBACK_LOD_BIAS, std::log2(static_cast<float>(TEXTURE_FEEDBACK_DIVISOR)));
+        for (int texID : mapMeshes.textureIDs()) {
+            shader.setInt(U_MATERIAL_ID, texID);
+            auto rotIter = textureRotations.find(texID);
+            shader.setFloat(U_TEXTURE_ROTATION, rotIter != textureRotations.end() ? glm::radians(rotIter->second) : 0.0f);
+            for (const MapMeshes::Chunk* chunk : chunks) {
+                auto batch = chunk->batches.find(texID);
+                if (batch == chunk->batches.end()) continue;
+                shader.setVec2(U_TEXTURE_SCALE, batch->second.textureScale);
+                mapMeshes.draw(*chunk, batch->second);
             }
-            if (data) stbi_image_free(data); // Free data even if loading failed
         }
+        glBindVertexArray(0);
 
-        std::cout << "No roughness map found for base name: " << baseName << std::endl;
+        Readback& readback = readbacks[nextReadback];
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pixelBuffers[nextReadback]);
+        glBufferData(GL_PIXEL_PACK_BUFFER, static_cast<size_t>(width) * height * 4, nullptr, GL_STREAM_READ);
+        glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        readback.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        readback.width = width;
+        readback.height = height;
+        nextReadback = (nextReadback + 1) % READBACK_COUNT;
+
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
     }
 
-    // Bind textures with normal map and roughness map support
-    void bindTexture(int textureID) {
-        // If the texture doesn't exist yet, try to load it
-        if (textures.find(textureID) == textures.end()) {
-            loadTexture(textureID);
+    // Finest LOD of each texture ID in the oldest readback, false while the GPU has not finished it
+    bool collect(std::map<int, float>& lodByTextureID) {
+        Readback& readback = readbacks[oldestReadback];
+        if (readback.fence == 0 || glClientWaitSync(readback.fence, 0, 0) == GL_TIMEOUT_EXPIRED) return false;
+        glDeleteSync(readback.fence);
+        readback.fence = 0;
+
+        lodByTextureID.clear();
+        size_t pixelCount = static_cast<size_t>(readback.width) * readback.height;
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pixelBuffers[oldestReadback]);
+        const unsigned char* pixels = static_cast<const unsigned char*>(glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, pixelCount * 4, GL_MAP_READ_BIT));
+        if (pixels != nullptr) {
+            // Neighbouring pixels mostly share a texture, so the map is only searched when the ID changes
+            auto current = lodByTextureID.end();
+            for (size_t i = 0; i < pixelCount; i++) {
+                const unsigned char* pixel = &pixels[i * 4];
+                if (pixel[3] != 255) continue;
+                int texID = pixel[0] | (pixel[1] << 8);
+                float lod = pixel[2] / 8.0f - 16.0f;  // Inverse of the encoding in texture_feedback.fs
+                if (current == lodByTextureID.end() || current->first != texID) {
+                    current = lodByTextureID.emplace(texID, lod).first;
+                }
+                current->second = std::min(current->second, lod);
+            }
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
         }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        oldestReadback = (oldestReadback + 1) % READBACK_COUNT;
+        return true;
+    }
 
-        // Bind the color texture to texture unit 0
-        glActiveTexture(GL_TEXTURE0);
-        if (textures.find(textureID) != textures.end() && textures[textureID] != 0) {
-            glBindTexture(GL_TEXTURE_2D, textures[textureID]);
-        } else {
-            // Unbind if no texture
-            glBindTexture(GL_TEXTURE_2D, 0);
+private:
+    static const int READBACK_COUNT = 3;
+
+    struct Readback {
+        GLsync fence = 0;  // Set while the GPU may still be writing the pixel buffer
+        int width = 0;
+        int height = 0;
+    };
+
+    ShaderPermutations feedbackShaders;
+    unsigned int framebuffer = 0;
+    unsigned int colorTexture = 0;
+    unsigned int depthBuffer = 0;
+    unsigned int pixelBuffers[READBACK_COUNT];
+    Readback readbacks[READBACK_COUNT];
+    int nextReadback = 0;
+    int oldestReadback = 0;
+    int targetWidth = 0;
+    int targetHeight = 0;
+    unsigned int frame = 0;
+
+    void createTarget(int width, int height) {
+        targetWidth = width;
+        targetHeight = height;
+        glBindTexture(GL_TEXTURE_2D, colorTexture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, colorTexture, 0);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            std::cout << "Texture feedback framebuffer is not complete" << std::endl;
         }
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+};
 
-        // Bind the normal map to texture unit 1 if available
-        glActiveTexture(GL_TEXTURE1);
-        if (hasNormalMap[textureID]) {
-            glBindTexture(GL_TEXTURE_2D, normalMaps[textureID]);
-        } else {
-            // Unbind if no normal map
-            glBindTexture(GL_TEXTURE_2D, 0);
+// Steps the quality governor lowers over a frame time budget and raises again once there is room, ranked
+// so the first ones cost the least to look at. The governor only lowers what is not already lower
+class QualityGovernor {
+public:
+    QualityGovernor(TextureManager& textureManager) : textureManager(textureManager) {}
+
+    // Record one frame, deciding on a step once the window is full. The GPU time is left to the
+    // dynamic resolution while its scale can still drop
+    void recordFrame(double cpuMs, double gpuMs, float resolutionScale) {
+        if (qualityGovernorTarget < 0) {
+            if (level > 0) {
+                while (level > 0) raise(--level);
+                std::cout << "Quality governor off, every step restored" << std::endl;
+            }
+            resetWindow();
+            return;
         }
 
-        // Bind the roughness map to texture unit 2 if available
-        glActiveTexture(GL_TEXTURE2);
-        if (hasRoughnessMap[textureID]) {
-            glBindTexture(GL_TEXTURE_2D, roughnessMaps[textureID]);
-        } else {
-            // Unbind if no roughness map
-            glBindTexture(GL_TEXTURE_2D, 0);
+        cpuWindow[next] = cpuMs;
+        gpuWindow[next] = gpuMs;
+        next = (next + 1) % QUALITY_WINDOW_FRAMES;
+        if (filled < QUALITY_WINDOW_FRAMES) filled++;
+        if (filled < QUALITY_WINDOW_FRAMES) return;
+
+        double cpu = 0.0, gpu = 0.0;
+        for (int i = 0; i < QUALITY_WINDOW_FRAMES; i++) {
+            cpu += cpuWindow[i];
+            gpu += gpuWindow[i];
+        }
+        cpu /= QUALITY_WINDOW_FRAMES;
+        gpu /= QUALITY_WINDOW_FRAMES;
+        bool dynamicResolution = resolutionOverride < 0;
+        bool resolutionCanDrop = dynamicResolution && resolutionScale > MIN_RESOLUTION_SCALE;
+        bool resolutionLowered = dynamicResolution && resolutionScale < MAX_RESOLUTION_SCALE;
+        double frameMs = resolutionCanDrop ? cpu : std::max(cpu, gpu);
+        double budgetMs = 1000.0 / QUALITY_TARGET_FPS[qualityGovernorTarget];
+
+        // First full window after a change: what the step saved is what raising it will cost
+        if (measuringStep >= 0) {
+            stepCostMs[measuringStep] = std::max(changeFrameMs - frameMs, 0.0);
+            std::cout << "Quality governor: " << QUALITY_STEP_NAMES[measuringStep] << " saved " << stepCostMs[measuringStep]
+                      << " ms (CPU " << changeCpuMs << " -> " << cpu << " ms, GPU " << changeGpuMs << " -> " << gpu << " ms)" << std::endl;
+            measuringStep = -1;
         }
 
-        // Reset active texture
-        glActiveTexture(GL_TEXTURE0);
+        if (frameMs > budgetMs && level < QUALITY_STEP_COUNT) {
+            std::cout << "Quality governor: " << frameMs << " ms over the " << budgetMs << " ms budget, lowering "
+                      << QUALITY_STEP_NAMES[level] << std::endl;
+            if (lower(level)) {
+                startMeasuring(level, frameMs, cpu, gpu);
+            } else {
+                stepCostMs[level] = 0.0;
+                std::cout << "Quality governor: " << QUALITY_STEP_NAMES[level] << " was already set" << std::endl;
+            }
+            level++;
+            resetWindow();
+        } else if (level > 0 && !resolutionLowered && frameMs + stepCostMs[level - 1] < budgetMs * QUALITY_RAISE_HEADROOM) {
+            level--;
+            std::cout << "Quality governor: " << frameMs << " ms of the " << budgetMs << " ms budget, raising "
+                      << QUALITY_STEP_NAMES[level] << " back (measured at " << stepCostMs[level] << " ms)" << std::endl;
+            raise(level);
+            resetWindow();
+        }
     }
 
-    // Check if a normal map exists for a specific texture
-    bool hasNormalMapForTexture(int textureID) {
-        return hasNormalMap[textureID];
+    // Steps lowered at the moment
+    int loweredSteps() const {
+        return level;
     }
 
-    // Check if a roughness map exists for a specific texture
-    bool hasRoughnessMapForTexture(int textureID) {
-        return hasRoughnessMap[textureID];
+private:
+    TextureManager& textureManager;
+    int level = 0;                                 // Steps lowered, in QualityStep order
+    bool changed[QUALITY_STEP_COUNT] = {};         // Whether lowering the step changed anything
+    double stepCostMs[QUALITY_STEP_COUNT] = {};    // Frame time a lowered step was measured to save
+    double cpuWindow[QUALITY_WINDOW_FRAMES] = {};
+    double gpuWindow[QUALITY_WINDOW_FRAMES] = {};
+    int next = 0;
+    int filled = 0;
+    int measuringStep = -1;
+    double changeFrameMs = 0.0;
+    double changeCpuMs = 0.0;
+    double changeGpuMs = 0.0;
+
+    // Values the lowered steps replaced
+    ShadingLodMode savedShadingLodMode = SHADING_LOD_OFF;
+    ShadowMode savedShadowMode = SHADOW_NONE;
+    float savedDrawDistance = 0.0f;
+
+    void resetWindow() {
+        next = 0;
+        filled = 0;
     }
 
-    // Preload all textures needed for a map
-    void preloadMapTextures(const Map& map) {
-        std::set<int> uniqueTextureIDs;
+    void startMeasuring(int step, double frameMs, double cpu, double gpu) {
+        measuringStep = step;
+        changeFrameMs = frameMs;
+        changeCpuMs = cpu;
+        changeGpuMs = gpu;
+    }
 
-        // Collect all unique texture IDs from the map
-        for (int z = 0; z < map.height; z++) {
-            for (int x = 0; x < map.width; x++) {
-                int texID = map.getTextureID(x, z);
-                if (texID > 0) {
-                    uniqueTextureIDs.insert(texID);
+    // Lower a step, false if it was already as low as the governor would set it
+    bool lower(int step) {
+        changed[step] = false;
+        switch (step) {
+            case QUALITY_SHADING_LOD:
+                if (shadingLodMode == SHADING_LOD_OFF) {
+                    savedShadingLodMode = shadingLodMode;
+                    shadingLodMode = SHADING_LOD_ON;
+                    changed[step] = true;
                 }
-            }
+                break;
+            case QUALITY_NORMAL_MAPS:
+                if (useNormalMaps) {
+                    useNormalMaps = false;
+                    changed[step] = true;
+                }
+                break;
+            case QUALITY_TEXTURE_RESOLUTION:
+                if (textureManager.getSkippedMipLevels() == 0) {
+                    textureManager.setSkippedMipLevels(1);
+                    changed[step] = true;
+                }
+                break;
+            case QUALITY_SHADOWS:
+                if (shadowMode != SHADOW_NONE) {
+                    savedShadowMode = shadowMode;
+                    shadowMode = SHADOW_NONE;
+                    changed[step] = true;
+                }
+                break;
+            case QUALITY_DRAW_DISTANCE:
+                if (drawDistance > MIN_DRAW_DISTANCE) {
+                    savedDrawDistance = drawDistance;
+                    drawDistance = std::max(MIN_DRAW_DISTANCE, drawDistance * QUALITY_DRAW_DISTANCE_SCALE);
+                    changed[step] = true;
+                }
+                break;
         }
+        return changed[step];
+    }
 
-        // Load each unique texture, normal map, and roughness map if available
-        for (int texID : uniqueTextureIDs) {
-            loadTexture(texID);
+    // Put back what lowering a step replaced
+    void raise(int step) {
+        if (!changed[step]) return;
+        changed[step] = false;
+        switch (step) {
+            case QUALITY_SHADING_LOD:
+                shadingLodMode = savedShadingLodMode;
+                break;
+            case QUALITY_NORMAL_MAPS:
+                useNormalMaps = true;
+                break;
+            case QUALITY_TEXTURE_RESOLUTION:
+                textureManager.setSkippedMipLevels(0);
+                break;
+            case QUALITY_SHADOWS:
+                shadowMode = savedShadowMode;
+                break;
+            case QUALITY_DRAW_DISTANCE:
+                drawDistance = savedDrawDistance;
+                break;
         }
     }
 };
@@ -1707,6 +6763,28 @@ void processControllerInput(Camera& camera, const Map& map, float deltaTime) {
         yButtonPressed = false;
     }
 
+    // Change draw distance with D-pad up/down
+    static bool dpadUpPressed = false;
+    if (state.buttons[GLFW_GAMEPAD_BUTTON_DPAD_UP] == GLFW_PRESS) {
+        if (!dpadUpPressed) {
+            drawDistance = std::min(MAX_DRAW_DISTANCE, drawDistance + DRAW_DISTANCE_STEP);
+            std::cout << "Draw distance " << drawDistance << std::endl;
+            dpadUpPressed = true;
+        }
+    } else {
+        dpadUpPressed = false;
+    }
+    static bool dpadDownPressed = false;
+    if (state.buttons[GLFW_GAMEPAD_BUTTON_DPAD_DOWN] == GLFW_PRESS) {
+        if (!dpadDownPressed) {
+            drawDistance = std::max(MIN_DRAW_DISTANCE, drawDistance - DRAW_DISTANCE_STEP);
+            std::cout << "Draw distance " << drawDistance << std::endl;
+            dpadDownPressed = true;
+        }
+    } else {
+        dpadDownPressed = false;
+    }
+
     // Toggle fullscreen with Start button
     static bool startButtonPressed = false;
     if (state.buttons[GLFW_GAMEPAD_BUTTON_START] == GLFW_PRESS) {
@@ -1768,8 +6846,8 @@ void renderDebugCircle(Shader& shader, const Camera& camera, float radius) {
 
     // Render the circle
     glm::mat4 model = glm::mat4(1.0f);
-    shader.setMat4("model", model);
-    shader.setVec3("objectColor", glm::vec3(1.0f, 0.0f, 0.0f)); // Red circle
+    shader.setMat4(U_MODEL, model);
+    shader.setVec3(U_OBJECT_COLOR, glm::vec3(1.0f, 0.0f, 0.0f)); // Red circle
 
     glBindVertexArray(VAO);
     glDrawArrays(GL_LINES, 0, circlePoints.size());
@@ -1884,6 +6962,178 @@ if (glfwGetKey(window, GLFW_KEY_L) == GLFW_PRESS) {
     lKeyPressed = false;
 }
 
+    // Add the - and = keys to shrink and grow the draw distance
+    static bool minusKeyPressed = false;
+    if (glfwGetKey(window, GLFW_KEY_MINUS) == GLFW_PRESS) {
+        if (!minusKeyPressed) {
+            drawDistance = std::max(MIN_DRAW_DISTANCE, drawDistance - DRAW_DISTANCE_STEP);
+            std::cout << "Draw distance " << drawDistance << std::endl;
+            minusKeyPressed = true;
+        }
+    } else {
+        minusKeyPressed = false;
+    }
+    static bool equalKeyPressed = false;
+    if (glfwGetKey(window, GLFW_KEY_EQUAL) == GLFW_PRESS) {
+        if (!equalKeyPressed) {
+            drawDistance = std::min(MAX_DRAW_DISTANCE, drawDistance + DRAW_DISTANCE_STEP);
+            std::cout << "Draw distance " << drawDistance << std::endl;
+            equalKeyPressed = true;
+        }
+    } else {
+        equalKeyPressed = false;
+    }
+
+    // Add the P key toggle for performance stats
+    static bool pKeyPressed = false;
+    if (glfwGetKey(window, GLFW_KEY_P) == GLFW_PRESS) {
+        if (!pKeyPressed) {
+            showStats = !showStats;
+            std::cout << "Stats " << (showStats ? "shown" : "hidden") << std::endl;
+            pKeyPressed = true;
+        }
+    } else {
+        pKeyPressed = false;
+    }
+
+    // Add the R key to switch between forward and deferred shading
+    static bool rKeyPressed = false;
+    if (glfwGetKey(window, GLFW_KEY_R) == GLFW_PRESS) {
+        if (!rKeyPressed) {
+            useDeferredShading = !useDeferredShading;
+            std::cout << "Render path " << (useDeferredShading ? "deferred" : "forward") << std::endl;
+            rKeyPressed = true;
+        }
+    } else {
+        rKeyPressed = false;
+    }
+
+    // Add the H key to cycle the shadow modes
+    static bool hKeyPressed = false;
+    if (glfwGetKey(window, GLFW_KEY_H) == GLFW_PRESS) {
+        if (!hKeyPressed) {
+            shadowMode = static_cast<ShadowMode>((shadowMode + 1) % SHADOW_MODE_COUNT);
+            std::cout << "Shadows: " << SHADOW_MODE_NAMES[shadowMode] << std::endl;
+            hKeyPressed = true;
+        }
+    } else {
+        hKeyPressed = false;
+    }
+
+    // Add the I key toggle for the irradiance volume lighting the models in the forward path
+    static bool iKeyPressed = false;
+    if (glfwGetKey(window, GLFW_KEY_I) == GLFW_PRESS) {
+        if (!iKeyPressed) {
+            useIrradianceVolume = !useIrradianceVolume;
+            std::cout << "Irradiance volume for models " << (useIrradianceVolume ? "enabled" : "disabled") << std::endl;
+            iKeyPressed = true;
+        }
+    } else {
+        iKeyPressed = false;
+    }
+
+    // Add the M key toggle for the baked lightmap of the forward path
+    static bool mKeyPressed = false;
+    if (glfwGetKey(window, GLFW_KEY_M) == GLFW_PRESS) {
+        if (!mKeyPressed) {
+            useLightmap = !useLightmap;
+            std::cout << "Lightmap " << (useLightmap ? "enabled" : "disabled") << std::endl;
+            mKeyPressed = true;
+        }
+    } else {
+        mKeyPressed = false;
+    }
+
+    // Add the C key to switch the forward path between the light grid and clustered lights
+    static bool cKeyPressed = false;
+    if (glfwGetKey(window, GLFW_KEY_C) == GLFW_PRESS) {
+        if (!cKeyPressed) {
+            useLightGrid = !useLightGrid;
+            std::cout << "Light assignment " << (useLightGrid ? "map cell grid" : "view clusters") << std::endl;
+            cKeyPressed = true;
+        }
+    } else {
+        cKeyPressed = false;
+    }
+
+    // Add the B key to run the light count benchmark
+    static bool bKeyPressed = false;
+    if (glfwGetKey(window, GLFW_KEY_B) == GLFW_PRESS) {
+        if (!bKeyPressed) {
+            lightBenchmarkRequested = true;
+            bKeyPressed = true;
+        }
+    } else {
+        bKeyPressed = false;
+    }
+
+    // Add the K key to cycle the shading LOD of far walls, floor and ceiling
+    static bool kKeyPressed = false;
+    if (glfwGetKey(window, GLFW_KEY_K) == GLFW_PRESS) {
+        if (!kKeyPressed) {
+            shadingLodMode = static_cast<ShadingLodMode>((shadingLodMode + 1) % SHADING_LOD_MODE_COUNT);
+            std::cout << "Shading LOD: " << SHADING_LOD_MODE_NAMES[shadingLodMode] << std::endl;
+            kKeyPressed = true;
+        }
+    } else {
+        kKeyPressed = false;
+    }
+
+    // Add the J key to run the shading LOD benchmark
+    static bool jKeyPressed = false;
+    if (glfwGetKey(window, GLFW_KEY_J) == GLFW_PRESS) {
+        if (!jKeyPressed) {
+            shadingLodBenchmarkRequested = true;
+            jKeyPressed = true;
+        }
+    } else {
+        jKeyPressed = false;
+    }
+
+    // Add the T key to cycle the dynamic resolution and the fixed resolution scales
+    static bool tKeyPressed = false;
+    if (glfwGetKey(window, GLFW_KEY_T) == GLFW_PRESS) {
+        if (!tKeyPressed) {
+            resolutionOverride = resolutionOverride + 1 < NUM_FIXED_RESOLUTION_SCALES ? resolutionOverride + 1 : -1;
+            if (resolutionOverride < 0) {
+                std::cout << "Resolution: dynamic, target GPU time " << DYNAMIC_RESOLUTION_TARGET_MS << " ms" << std::endl;
+            } else {
+                std::cout << "Resolution: fixed " << FIXED_RESOLUTION_SCALES[resolutionOverride] * 100.0f << "%" << std::endl;
+            }
+            tKeyPressed = true;
+        }
+    } else {
+        tKeyPressed = false;
+    }
+
+    // Add the U key to cycle the quality governor's target frame rate
+    static bool uKeyPressed = false;
+    if (glfwGetKey(window, GLFW_KEY_U) == GLFW_PRESS) {
+        if (!uKeyPressed) {
+            qualityGovernorTarget = qualityGovernorTarget + 1 < NUM_QUALITY_TARGETS ? qualityGovernorTarget + 1 : -1;
+            if (qualityGovernorTarget < 0) {
+                std::cout << "Quality governor disabled" << std::endl;
+            } else {
+                std::cout << "Quality governor targeting " << QUALITY_TARGET_FPS[qualityGovernorTarget] << " fps" << std::endl;
+            }
+            uKeyPressed = true;
+        }
+    } else {
+        uKeyPressed = false;
+    }
+
+    // Add the O key toggle between linear and exponential fog
+    static bool oKeyPressed = false;
+    if (glfwGetKey(window, GLFW_KEY_O) == GLFW_PRESS) {
+        if (!oKeyPressed) {
+            useExponentialFog = !useExponentialFog;
+            std::cout << "Fog " << (useExponentialFog ? "exponential" : "linear") << std::endl;
+            oKeyPressed = true;
+        }
+    } else {
+        oKeyPressed = false;
+    }
+
 }
 
 void renderGrid(Shader& shader, const Map& map) {
@@ -1920,8 +7170,8 @@ void renderGrid(Shader& shader, const Map& map) {
 
     // Render the grid
     glm::mat4 model = glm::mat4(1.0f);
-    shader.setMat4("model", model);
-    shader.setVec3("objectColor", glm::vec3(0.5f, 0.5f, 0.5f)); // Lighter gray for visibility
+    shader.setMat4(U_MODEL, model);
+    shader.setVec3(U_OBJECT_COLOR, glm::vec3(0.5f, 0.5f, 0.5f)); // Lighter gray for visibility
 
     // Temporarily disable depth testing to ensure grid is visible
     glDisable(GL_DEPTH_TEST);
@@ -1982,210 +7232,127 @@ void createDefaultMapFile() {
     }
 }
 
-                    // In createShaderFiles(), update the vertex shader:
-                    void createShaderFiles() {
-                        // Vertex shader
-                        std::ofstream vShader("shader.vs");
-                        if (vShader.is_open()) {
-                            vShader << "#version 330 core\n";
-                            vShader << "layout (location = 0) in vec3 aPos;\n";
-                            vShader << "layout (location = 1) in vec3 aNormal;\n";
-                            vShader << "layout (location = 2) in vec2 aTexCoord;\n";
-                            vShader << "layout (location = 3) in vec3 aTangent;\n";
-                            vShader << "layout (location = 4) in vec3 aBitangent;\n\n";
-                            vShader << "out vec3 FragPos;\n";
-                            vShader << "out vec3 Normal;\n";
-                            vShader << "out vec2 TexCoord;\n";
-                            vShader << "out mat3 TBN;\n\n";
-                            vShader << "uniform mat4 model;\n";
-                            vShader << "uniform mat4 view;\n";
-                            vShader << "uniform mat4 projection;\n";
-                            // Add texture scale uniform
-                            vShader << "uniform vec2 textureScale = vec2(1.0, 1.0);\n";
-                            // Add texture rotation uniform
-                            vShader << "uniform float textureRotation = 0.0;\n\n";
-                            vShader << "void main()\n";
-                            vShader << "{\n";
-                            vShader << "    FragPos = vec3(model * vec4(aPos, 1.0));\n";
-                            vShader << "    Normal = mat3(transpose(inverse(model))) * aNormal;\n";
-
-                            // Add rotation to texture coordinates
-                            vShader << "    // Apply rotation to texture coordinates\n";
-                            vShader << "    vec2 rotatedTexCoord = aTexCoord;\n";
-                            vShader << "    if (textureRotation != 0.0) {\n";
-                            vShader << "        // Rotate around center (0.5, 0.5)\n";
-                            vShader << "        vec2 center = vec2(0.5, 0.5);\n";
-                            vShader << "        rotatedTexCoord -= center;\n";
-                            vShader << "        \n";
-                            vShader << "        // Apply rotation matrix\n";
-                            vShader << "        float s = sin(textureRotation);\n";
-                            vShader << "        float c = cos(textureRotation);\n";
-                            vShader << "        rotatedTexCoord = vec2(\n";
-                            vShader << "            rotatedTexCoord.x * c - rotatedTexCoord.y * s,\n";
-                            vShader << "            rotatedTexCoord.x * s + rotatedTexCoord.y * c\n";
-                            vShader << "        );\n";
-                            vShader << "        \n";
-                            vShader << "        // Move back from center\n";
-                            vShader << "        rotatedTexCoord += center;\n";
-                            vShader << "    }\n";
-                            vShader << "    \n";
-                            vShader << "    // Apply scale after rotation\n";
-                            vShader << "    TexCoord = rotatedTexCoord * textureScale;\n";
-
-                            vShader << "    // Calculate TBN matrix for normal mapping\n";
-                            vShader << "    vec3 T = normalize(mat3(model) * aTangent);\n";
-                            vShader << "    vec3 B = normalize(mat3(model) * aBitangent);\n";
-                            vShader << "    vec3 N = normalize(mat3(model) * aNormal);\n";
-                            vShader << "    TBN = mat3(T, B, N);\n";
-                            vShader << "    gl_Position = projection * view * vec4(FragPos, 1.0);\n";
-                            vShader << "}\n";
-                            vShader.close();
-                        }
 
-                        // Fragment shader with multiple area lights
-                        std::ofstream fShader("shader.fs");
-                        if (fShader.is_open()) {
-                            fShader << "#version 330 core\n";
-                            fShader << "out vec4 FragColor;\n\n";
-
-                            fShader << "in vec3 FragPos;\n";
-                            fShader << "in vec3 Normal;\n";
-                            fShader << "in vec2 TexCoord;\n";
-                            fShader << "in mat3 TBN;\n\n";
-
-                            fShader << "uniform vec3 lightPos;\n";
-                            fShader << "uniform vec3 lightColor;\n";
-                            fShader << "uniform vec3 objectColor;\n";
-                            fShader << "uniform sampler2D wallTexture;\n";
-                            fShader << "uniform sampler2D normalMap;\n";
-                            fShader << "uniform sampler2D roughnessMap;\n";
-                            fShader << "uniform bool useTexture;\n";
-                            fShader << "uniform bool useNormalMap;\n";
-                            fShader << "uniform bool useRoughnessMap;\n";
-                            fShader << "uniform sampler2D texture_diffuse1;\n";
-                            fShader << "uniform int textureType;\n\n";
-
-                            fShader << "// Flashlight uniforms\n";
-                            fShader << "uniform bool flashlightOn;\n";
-                            fShader << "uniform vec3 viewPos;\n";
-                            fShader << "uniform vec3 flashlightPos;\n";
-                            fShader << "uniform vec3 flashlightDir;\n";
-                            fShader << "uniform float flashlightCutoff;\n";
-                            fShader << "uniform float flashlightOuterCutoff;\n";
-                            fShader << "uniform float flashlightIntensity;\n\n";
-
-                            // Multiple area lights
-                            fShader << "// Area Light uniforms\n";
-                            fShader << "const int MAX_AREA_LIGHTS = 10;\n";  // Maximum number of area lights
-                            fShader << "uniform int numAreaLights;\n";
-                            fShader << "uniform bool areaLightActive[MAX_AREA_LIGHTS];\n";
-                            fShader << "uniform vec3 areaLightPos[MAX_AREA_LIGHTS];\n";
-                            fShader << "uniform vec3 areaLightColor[MAX_AREA_LIGHTS];\n";
-                            fShader << "uniform float areaLightIntensity[MAX_AREA_LIGHTS];\n";
-                            fShader << "uniform float areaLightRadius[MAX_AREA_LIGHTS];\n\n";
-
-                            fShader << "void main()\n";
-                            fShader << "{\n";
-                            fShader << "    // Create flipped texture coordinates for all sampling\n";
-                            fShader << "    vec2 flippedCoord = vec2(1.0 - TexCoord.x, TexCoord.y);\n\n";
-
-                            fShader << "    // Ambient\n";
-                            fShader << "    float ambientStrength = 0.2;\n";
-                            fShader << "    vec3 ambient = ambientStrength * lightColor;\n\n";
-
-                            fShader << "    // Get normal from normal map if available\n";
-                            fShader << "    vec3 norm;\n";
-                            fShader << "    if(useNormalMap) {\n";
-                            fShader << "        norm = texture(normalMap, flippedCoord).rgb;\n";
-                            fShader << "        norm = normalize(norm * 2.0 - 1.0);   // Convert from [0,1] to [-1,1]\n";
-                            fShader << "        norm = normalize(TBN * norm);         // Convert to world space\n";
-                            fShader << "    } else {\n";
-                            fShader << "        norm = normalize(Normal);\n";
-                            fShader << "    }\n\n";
-
-                            fShader << "    // Get roughness from roughness map if available\n";
-                            fShader << "    float roughness = 1.0;\n";
-                            fShader << "    if(useRoughnessMap) {\n";
-                            fShader << "        roughness = texture(roughnessMap, flippedCoord).r; // Assuming single channel\n";
-                            fShader << "    }\n\n";
-
-                            fShader << "    // Diffuse from global light\n";
-                            fShader << "    vec3 lightDir = normalize(lightPos - FragPos);\n";
-                            fShader << "    float diff = max(dot(norm, lightDir), 0.0);\n";
-                            fShader << "    // Adjust diffuse with roughness\n";
-                            fShader << "    vec3 diffuse = diff * lightColor * roughness;\n\n";
-
-                            fShader << "    // Specular (Blinn-Phong)\n";
-                            fShader << "    vec3 viewDir = normalize(viewPos - FragPos);\n";
-                            fShader << "    vec3 halfwayDir = normalize(lightDir + viewDir);\n";
-                            fShader << "    float spec = pow(max(dot(norm, halfwayDir), 0.0), 32.0);\n";
-                            fShader << "    // Adjust specular with roughness (less specular with higher roughness)\n";
-                            fShader << "    vec3 specular = spec * lightColor * (1.0 - roughness);\n\n";
-
-                            fShader << "    // Flashlight (Spotlight)\n";
-                            fShader << "    vec3 flashlightDiffuse = vec3(0.0);\n";
-                            fShader << "    vec3 flashlightSpecular = vec3(0.0);\n";
-                            fShader << "    if(flashlightOn) {\n";
-                            fShader << "        vec3 flashDir = normalize(flashlightPos - FragPos);\n";
-                            fShader << "        float theta = dot(flashDir, normalize(-flashlightDir));\n";
-                            fShader << "        float epsilon = flashlightCutoff - flashlightOuterCutoff;\n";
-                            fShader << "        float intensity = clamp((theta - flashlightOuterCutoff) / epsilon, 0.0, 1.0);\n";
-                            fShader << "        \n";
-                            fShader << "        if(theta > flashlightOuterCutoff) {\n";
-                            fShader << "            float flashDiff = max(dot(norm, flashDir), 0.0);\n";
-                            fShader << "            float flashSpec = pow(max(dot(norm, normalize(flashDir + viewDir)), 0.0), 32.0);\n";
-                            fShader << "            \n";
-                            fShader << "            flashlightDiffuse = flashDiff * lightColor * intensity * flashlightIntensity * roughness;\n";
-                            fShader << "            flashlightSpecular = flashSpec * lightColor * intensity * flashlightIntensity * (1.0 - roughness);\n";
-                            fShader << "        }\n";
-                            fShader << "    }\n\n";
-
-                            // Area Lights - updated to handle multiple lights
-                            fShader << "    // Area Light contributions\n";
-                            fShader << "    vec3 areaLightDiffuse = vec3(0.0);\n";
-                            fShader << "    vec3 areaLightSpecular = vec3(0.0);\n";
-                            fShader << "    for(int i = 0; i < numAreaLights; i++) {\n";
-                            fShader << "        if(areaLightActive[i]) {\n";
-                            fShader << "            // Calculate distance and falloff\n";
-                            fShader << "            vec3 areaDir = areaLightPos[i] - FragPos;\n";
-                            fShader << "            float distance = length(areaDir);\n";
-                            fShader << "            if(distance < areaLightRadius[i]) {\n";
-                            fShader << "                // Normalize direction\n";
-                            fShader << "                areaDir = normalize(areaDir);\n";
-                            fShader << "                // Calculate falloff (1 at center, 0 at radius)\n";
-                            fShader << "                float falloff = 1.0 - distance/areaLightRadius[i];\n";
-                            fShader << "                // Diffuse\n";
-                            fShader << "                float areaDiff = max(dot(norm, areaDir), 0.0);\n";
-                            fShader << "                areaLightDiffuse += areaDiff * areaLightColor[i] * areaLightIntensity[i] * roughness * falloff;\n";
-                            fShader << "                // Specular\n";
-                            fShader << "                float areaSpec = pow(max(dot(norm, normalize(areaDir + viewDir)), 0.0), 32.0);\n";
-                            fShader << "                areaLightSpecular += areaSpec * areaLightColor[i] * areaLightIntensity[i] * (1.0 - roughness) * falloff;\n";
-                            fShader << "            }\n";
-                            fShader << "        }\n";
-                            fShader << "    }\n\n";
-
-                            fShader << "    // Result\n";
-                            fShader << "    vec3 result;\n";
-                            fShader << "    if (useTexture) {\n";
-                            fShader << "        vec3 texColor;\n";
-                            fShader << "        if (textureType == 1) { // Model texture\n";
-                            fShader << "            texColor = texture(texture_diffuse1, vec2(TexCoord.x, TexCoord.y)).rgb;\n";
-                            fShader << "        } else { // Wall texture\n";
-                            fShader << "            texColor = texture(wallTexture, flippedCoord).rgb;\n";
-                            fShader << "        }\n";
-                            fShader << "        // Apply lighting calculations to the texture color for both models and walls\n";
-                            fShader << "        result = (ambient + diffuse + specular + flashlightDiffuse + flashlightSpecular + areaLightDiffuse + areaLightSpecular) * texColor;\n";
-                            fShader << "    } else {\n";
-                            fShader << "        result = (ambient + diffuse + specular + flashlightDiffuse + flashlightSpecular + areaLightDiffuse + areaLightSpecular) * objectColor;\n";
-                            fShader << "    }\n\n";
-
-                            fShader << "    FragColor = vec4(result, 1.0);\n";
-                            fShader << "}\n";
-                            fShader.close();
-                        }
+// Area lights placed in map.txt's rooms, shared by the game and the lightmap baker
+void addMapAreaLights() {
+    // Add as many area lights as you need
+    areaLights.push_back({
+        glm::vec3(27.0f, 3.0f, 4.0f),  // position
+        glm::vec3(0.9f, 0.8f, 0.8f),   // color (warm yellowish)
+        1.0f,                          // intensity
+        8.0f,                          // radius
+        true                           // active
+    });
+
+    areaLights.push_back({
+        glm::vec3(36.0f, 3.0f, 4.0f),  // position
+        glm::vec3(0.9f, 0.8f, 0.8f),   // color (warm yellowish)
+        1.0f,                          // intensity
+        8.0f,                          // radius
+        true                           // active
+    });
+}
+
+// Lightmap baker: GateWay --bake [map file], writes the lightmap next to the map and exits
+int bakeLightmap(const std::string& mapFile) {
+    assetIndex.scan("textures");  // Object walls are half height, see isObjectTextureFile
+    if (mapFile == "map.txt") createDefaultMapFile();
+    Map map(mapFile);
+    if (map.width == 0 || map.height == 0) return 1;
+
+    addMapAreaLights();
+    ThreadPool threadPool;
+    LightmapBaker baker(map, areaLights, threadPool);
+    return baker.bake(lightmapPathFor(mapFile)) ? 0 : 1;
+}
+
+// Texture cache filler: GateWay --compress-textures, encodes every image the loaders can ask for and exits.
+// The loaders' choices are worked out from the file names, like TextureManager does at run time
+int compressTextures() {
+    assetIndex.scan("textures");
+    assetIndex.scan("Models");
+    std::vector<AssetIndex::Entry> images = assetIndex.images();
+
+    // Like loadMaterialMapsWithName, a material with two or more of these maps gets them packed into one
+    // uncompressed texture, so they are never encoded alone
+    std::set<std::string> packedMaps;
+    if (packMaterialMaps) {
+        static const char* const suffixes[4] = {"_AO", "_R", "_M", "_H"};
+        for (const AssetIndex::Entry& entry : images) {
+            std::string name = std::filesystem::path(entry.path).stem().string();
+            for (const char* suffix : suffixes) {
+                size_t length = std::strlen(suffix);
+                if (name.size() <= length || name.compare(name.size() - length, length, suffix) != 0) continue;
+                std::string baseName = name.substr(0, name.size() - length);
+                std::vector<std::string> members;
+                for (const char* member : suffixes) {
+                    if (const AssetIndex::Entry* found = assetIndex.findImage("textures/" + baseName + member)) {
+                        members.push_back(found->path);
                     }
+                }
+                if (members.size() >= 2) packedMaps.insert(members.begin(), members.end());
+            }
+        }
+    }
+
+    ThreadPool threadPool;
+    std::atomic<int> encoded{0}, cached{0}, failed{0};
+    auto startTime = std::chrono::steady_clock::now();
+
+    threadPool.parallelFor(static_cast<int>(images.size()), [&](int i) {
+        const std::string& path = images[i].path;
+        if (packedMaps.count(path) > 0) return;
+        std::string name = std::filesystem::path(path).stem().string();
+        auto hasSuffix = [&](const char* suffix) { return name.size() > 2 && name.compare(name.size() - 2, 2, suffix) == 0; };
+
+        int desiredChannels = 0;
+        TextureEncoding encoding = TEXTURE_ENCODING_COLOR;
+        if (hasSuffix("_N")) {
+            encoding = TEXTURE_ENCODING_NORMAL;
+            desiredChannels = 2;
+        } else if (hasSuffix("_R")) {
+            encoding = TEXTURE_ENCODING_SINGLE;
+            desiredChannels = 1;
+        } else if (hasSuffix("_H")) {
+            encoding = TEXTURE_ENCODING_SINGLE;
+            desiredChannels = 1;
+        }
+        TextureClass textureClass = TEXTURE_CLASS_WALL;
+        if (path.rfind("Models/", 0) == 0) {
+            textureClass = TEXTURE_CLASS_MODEL;
+        } else if (name.rfind("object_", 0) == 0) {
+            textureClass = TEXTURE_CLASS_OBJECT;
+        } else if (name.rfind("floor_", 0) == 0 || name.rfind("ceiling_", 0) == 0) {
+            textureClass = TEXTURE_CLASS_FLOOR;
+        }
+
+        std::vector<unsigned char> bytes = readFileBytes(path);
+        CompressedImage image;
+        bool fromCache = false;
+        if (bytes.empty() || !TextureCache::loadOrEncode(bytes, imageContentKey(bytes, desiredChannels), desiredChannels,
+                                                         maxTextureSize[textureClass], encoding, nullptr, image, fromCache)) {
+            failed++;
+        } else {
+            (fromCache ? cached : encoded)++;
+        }
+    });
+
+    std::cout << "Texture cache: " << encoded << " encoded, " << cached << " already cached, " << failed << " failed, "
+              << packedMaps.size() << " packed material maps skipped, in "
+              << std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count() << " s" << std::endl;
+    return failed > 0 ? 1 : 0;
+}
 
-int main() {
+int main(int argc, char** argv) {
+    if (argc > 1 && std::string(argv[1]) == "--bake") {
+        return bakeLightmap(argc > 2 ? argv[2] : "map.txt");
+    }
+    if (argc > 1 && std::string(argv[1]) == "--compress-textures") {
+        return compressTextures();
+    }
+    for (int i = 1; i + 1 < argc; i++) {
+        if (std::string(argv[i]) == "--texture-budget") textureBudgetMegabytes = std::max(1, std::atoi(argv[i + 1]));
+    }
 
 
     // Initialize GLFW
@@ -2233,6 +7400,13 @@ if (err != GLEW_OK) {
 std::cout << "OpenGL version: " << glGetString(GL_VERSION) << std::endl;
 std::cout << "GLSL version: " << glGetString(GL_SHADING_LANGUAGE_VERSION) << std::endl;
 
+// Let the driver compile shaders on its own threads when it can
+if (GLEW_KHR_parallel_shader_compile) {
+    glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+} else if (GLEW_ARB_parallel_shader_compile) {
+    glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+}
+
 
 // Initialize GLFW and GLEW, etc...
 
@@ -2260,21 +7434,36 @@ detectControllers();
 // Enable depth testing
 glEnable(GL_DEPTH_TEST);
 
-    // Create default map and shader files if they don't exist
+    // Create default map file if it doesn't exist, shader.vs/shader.fs are only ever read
     createDefaultMapFile();
-    createShaderFiles();
 
 
     // Initialize camera
     Camera camera(glm::vec3(2.5f, playerHeight, 8.5f));
 
 
-    //Textures handling manager
-    TextureManager textureManager;
+    // Every image the textures and models can use, looked up instead of probing file names
+    double indexStartTime = glfwGetTime();
+    assetIndex.scan("textures");
+    assetIndex.scan("Models");
+    std::cout << "Asset index: " << assetIndex.size() << " images in " << (glfwGetTime() - indexStartTime) * 1000.0 << " ms" << std::endl;
+
+    // Worker threads for per-frame jobs and texture decoding
+    ThreadPool threadPool;
+
+    //Textures handling manager, the images are decoded on the thread pool and uploaded from the main loop
+    TextureManager textureManager(threadPool);
+
+    // Show a cleared window while textures, models and shaders load
+    glClearColor(fogColor.x, fogColor.y, fogColor.z, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glfwSwapBuffers(window);
 
     //Floor Textures
     // Load floor texture (using ID 100 to avoid conflicts with wall textures)
         textureManager.loadTextureWithName(100, "floor_1");
+    // Load ceiling texture
+        textureManager.loadTextureWithName(101, "ceiling_1");
 
     // Load map
     Map map("map.txt");
@@ -2282,45 +7471,137 @@ glEnable(GL_DEPTH_TEST);
     // Preload all textures needed for the map
     textureManager.preloadMapTextures(map);
 
-    // Load shaders
-    Shader shader("shader.vs", "shader.fs");
-    shader.use();
-    shader.setInt("wallTexture", 0); // Texture unit 0
-    shader.setInt("normalMap", 1);   // Texture unit 1
-
-            // Add as many area lights as you need
-        areaLights.push_back({
-            glm::vec3(27.0f, 3.0f, 4.0f),  // position
-            glm::vec3(0.9f, 0.8f, 0.8f),   // color (warm yellowish)
-            1.0f,                          // intensity
-            8.0f,                          // radius
-            true                           // active
-        });
+    // Load shaders, each draw picks the variant compiled for its features
+    ShaderPermutations shaders("shader.vs", "shader.fs");
 
-        areaLights.push_back({
-            glm::vec3(36.0f, 3.0f, 4.0f),  // position
-            glm::vec3(0.9f, 0.8f, 0.8f),   // color (warm yellowish)
-            1.0f,                          // intensity
-            8.0f,                          // radius
-            true                           // active
-        });
+    // Static area lights of the map, the same ones --bake bakes into the lightmap
+    addMapAreaLights();
+
+    // Baked lighting of the walls, floor and ceiling, used by the forward path when it matches the map
+    Lightmap lightmap;
+    lightmap.load(lightmapPathFor("map.txt"), map, areaLights);
 
+    // Uniform buffers for per-frame data, shared by every shader program
+    UniformBuffer frameUniformBuffer(FRAME_DATA_BINDING, sizeof(FrameUniforms));
+
+    // Light clustering runs on the worker threads
+    ClusteredLights clusteredLights(threadPool);
+    LightGrid lightGrid(threadPool);
+    lightGrid.update(map, areaLights);
+    LightBenchmark lightBenchmark;
+    ShadingLodBenchmark shadingLodBenchmark;
+    GpuTimer gpuFrameTimer;
+    std::cout << "Thread pool started with " << threadPool.size() << " workers" << std::endl;
 
     // Create cube model
     CubeModel cubeModel;
 
+    // Walls, floor and ceiling with baked ambient occlusion
+    MapMeshes mapMeshes;
+    mapMeshes.build(map);
+    ShadingLod shadingLod;
+
     //Models
     Model cakeModel("Models/Cake/scene.gltf");
     Model dogModel("Models/Dog/scene.gltf");  // New model
 
+    // Precompile every variant the walls, floor, ceiling, models and grid can ask for
+    std::set<unsigned int> materialFeatureSets = {
+        0,                                        // Untextured walls and grid
+        FEATURE_TEXTURE | FEATURE_MODEL_TEXTURE,  // Models
+    };
+    for (const auto& texture : textureManager.textures) {
+        unsigned int features = textureManager.shaderFeatures(texture.first);
+        materialFeatureSets.insert(features);
+        materialFeatureSets.insert(features & ~(FEATURE_NORMAL_MAP | FEATURE_PARALLAX_MAP));  // Normal and height maps toggled off with N
+    }
+    std::set<unsigned int> shaderFeatureSets;
+    std::vector<unsigned int> frameFeatureSets = {
+        0,
+        FEATURE_FLASHLIGHT,
+        FEATURE_AREA_LIGHTS,
+        FEATURE_FLASHLIGHT | FEATURE_AREA_LIGHTS,
+        FEATURE_AREA_LIGHTS | FEATURE_LIGHT_GRID,
+        FEATURE_FLASHLIGHT | FEATURE_AREA_LIGHTS | FEATURE_LIGHT_GRID,
+    };
+    for (size_t i = 0, count = frameFeatureSets.size(); i < count; i++) {
+        if (frameFeatureSets[i] & FEATURE_AREA_LIGHTS) frameFeatureSets.push_back(frameFeatureSets[i] | FEATURE_AREA_SHADOWS);
+        frameFeatureSets.push_back(frameFeatureSets[i] | FEATURE_GRID_SHADOWS);
+    }
+    for (unsigned int features : materialFeatureSets) {
+        for (unsigned int frameFeatureSet : frameFeatureSets) {
+            shaderFeatureSets.insert(features | frameFeatureSet);
+            // Walls, floor and ceiling also read the lightmap, models never do
+            if (lightmap.isLoaded() && !(features & FEATURE_MODEL_TEXTURE)) {
+                shaderFeatureSets.insert(features | frameFeatureSet | FEATURE_LIGHTMAP);
+            }
+            // Models can take the area lights from the irradiance volume instead
+            if (features & FEATURE_MODEL_TEXTURE) {
+                shaderFeatureSets.insert(features | irradianceVolumeFeatures(frameFeatureSet));
+            }
+            // Far walls, floor and ceiling drop to cheaper variants, the first LOD is the N toggle's variant
+            if (!(features & FEATURE_MODEL_TEXTURE)) {
+                for (int lod = 2; lod <= MAX_SHADING_LOD; lod++) {
+                    shaderFeatureSets.insert(shadingLodFeatures(features | frameFeatureSet, lod));
+                    if (lightmap.isLoaded()) shaderFeatureSets.insert(shadingLodFeatures(features | frameFeatureSet | FEATURE_LIGHTMAP, lod));
+                }
+            }
+        }
+    }
+    shaders.precompile(shaderFeatureSets);
+
+    // Dithered shading LOD transitions draw the walls with the dither variants, they are only
+    // prepared the first time that mode is used
+    std::set<unsigned int> ditherFeatureSets;
+    for (unsigned int features : shaderFeatureSets) {
+        if (!(features & FEATURE_MODEL_TEXTURE)) ditherFeatureSets.insert(features | FEATURE_LOD_DITHER);
+    }
+    std::set<unsigned int> ditherMaterialFeatureSets;
+    for (unsigned int features : materialFeatureSets) {
+        if (!(features & FEATURE_MODEL_TEXTURE)) ditherMaterialFeatureSets.insert(features | FEATURE_LOD_DITHER);
+    }
+    bool ditherVariantsReady = false;
+
+    // Area light shadows, the depth textures and framebuffer are shared by every light
+    ShadowMaps shadowMaps;
+    OccupancyGrid occupancyGrid;
+    occupancyGrid.upload(map);
+    IrradianceVolume irradianceVolume(threadPool);
+
+    // Deferred path, switched to with R
+    DeferredRenderer deferredRenderer;
+    deferredRenderer.precompile(materialFeatureSets);
+
+    // Offscreen scene target, upscaled to the window
+    DynamicResolution dynamicResolution;
+    dynamicResolution.precompile();
+    QualityGovernor qualityGovernor(textureManager);
+
+    // Which mip levels of the map textures are on screen, for texture streaming
+    TextureFeedback textureFeedback;
+    textureFeedback.precompile();
+    std::map<int, float> feedbackLods;
+
 
                 // Main loop
                 while (!glfwWindowShouldClose(window)) {
                     // Per-frame time logic
                     float currentFrame = glfwGetTime();
+                    double frameStartTime = glfwGetTime();
                     deltaTime = currentFrame - lastFrame;
                     lastFrame = currentFrame;
 
+                    // Reset the per-frame counters
+                    frameStats = FrameStats();
+
+                    // Stream texture levels by the latest feedback, then textures decoded since the last frame
+                    // replace their placeholders
+                    if (useTextureStreaming && textureFeedback.collect(feedbackLods)) {
+                        textureManager.updateStreaming(feedbackLods, currentFrame);
+                    }
+                    textureManager.uploadDecodedTextures(TEXTURE_UPLOAD_BUDGET_MS);
+                    modelTextureReloads.update(threadPool);
+
                     // Process input
                     processInput(window);
                     processControllerInput(camera, map, deltaTime);
@@ -2329,197 +7610,297 @@ glEnable(GL_DEPTH_TEST);
                     // Update camera orientation based on mouse movement
                     camera.updateCameraVectors();
 
-                    // Render
-                    glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
-                    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-                    // Activate shader
-                    shader.use();
-
-                    // Set uniform for roughness map
-                    shader.setInt("roughnessMap", 2);  // Roughness map on texture unit 2
-
-                    // Set uniforms
-                    glm::mat4 projection = glm::perspective(glm::radians(fov), (float)SCREEN_WIDTH / (float)SCREEN_HEIGHT, 0.1f, 100.0f);
-                    glm::mat4 view = camera.GetViewMatrix();
-                    shader.setMat4("projection", projection);
-                    shader.setMat4("view", view);
-
-                    // Set lighting
-                    shader.setVec3("lightPos", glm::vec3(map.width * 0.4f, 4.0f, map.height * 0.5f));
-                    shader.setVec3("lightColor", glm::vec3(1.0f, 1.0f, 1.0f));
-
-                    // Flashlight setup (as in your original code)
-                    float flashlightCutoffCos = cos(glm::radians(flashlightCutoff));
-                    float flashlightOuterCutoffCos = cos(glm::radians(flashlightOuterCutoff));
-
-                    // Set flashlight uniforms
-                    shader.setBool("flashlightOn", flashlightOn);
-                    shader.setVec3("viewPos", camera.Position);
-                    shader.setVec3("flashlightPos", camera.Position);
-                    shader.setVec3("flashlightDir", camera.Front);
-                    shader.setFloat("flashlightCutoff", flashlightCutoffCos);
-                    shader.setFloat("flashlightOuterCutoff", flashlightOuterCutoffCos);
-                    shader.setFloat("flashlightIntensity", flashlightIntensity);
-
+                    if (lightBenchmarkRequested) {
+                        lightBenchmarkRequested = false;
+                        if (!lightBenchmark.isRunning()) lightBenchmark.start(map);
+                    }
+                    if (shadingLodBenchmarkRequested) {
+                        shadingLodBenchmarkRequested = false;
+                        if (!shadingLodBenchmark.isRunning()) shadingLodBenchmark.start();
+                    }
 
-                        // Add this after setting the flashlight uniforms:
+                    // Model placement of this frame, the models also cast area light shadows
+                    glm::vec3 cakePosition(15.0f, 0.5f, 10.0f);
+                    glm::mat4 cakeModelMatrix = glm::translate(glm::mat4(1.0f), cakePosition);
+                    float rotationAngle = currentFrame * glm::radians(45.0f); // Rotate 45 degrees per second
+                    cakeModelMatrix = glm::rotate(cakeModelMatrix, rotationAngle, glm::vec3(0.0f, 1.0f, 0.0f));
+                    cakeModelMatrix = glm::scale(cakeModelMatrix, glm::vec3(0.1f, 0.1f, 0.1f));
+
+                    glm::vec3 dogPosition(18.0f, 0.6f, 10.0f);
+                    glm::mat4 dogModelMatrix = glm::translate(glm::mat4(1.0f), dogPosition);
+                    dogModelMatrix = glm::rotate(dogModelMatrix, glm::radians(-90.0f), glm::vec3(1.0f, 0.0f, 0.0f));
+                    dogModelMatrix = glm::scale(dogModelMatrix, glm::vec3(0.50f, 0.50f, 0.50f)); // Adjust scale as needed
+
+                    std::vector<ShadowCaster> shadowCasters = {
+                        {&cakeModel, cakeModelMatrix, cakePosition, 1.0f},
+                        {&dogModel, dogModelMatrix, dogPosition, 1.0f},
+                    };
+
+                    // Scene resolution of this frame, the window size changes with fullscreen
+                    int framebufferWidth, framebufferHeight;
+                    glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+                    framebufferWidth = std::max(framebufferWidth, 1);
+                    framebufferHeight = std::max(framebufferHeight, 1);
+                    dynamicResolution.update(framebufferWidth, framebufferHeight, gpuFrameTimer.milliseconds());
 
-                            // Set area light uniforms
-                            shader.setInt("numAreaLights", areaLights.size());
+                    // Render
+                    gpuFrameTimer.begin();
+
+                    // Cube shadow maps first, they render into their own framebuffer
+                    if (shadowMode == SHADOW_MAPS) {
+                        shadowMaps.update(areaLights, map, shadowCasters, camera.Position, cubeModel);
+                        shadowMaps.bind();
+                    } else {
+                        for (AreaLight& light : areaLights) light.shadowSlot = -1;
+                    }
 
-                            for (int i = 0; i < areaLights.size(); i++) {
-                                std::string indexStr = std::to_string(i);
-                                shader.setBool(("areaLightActive[" + indexStr + "]").c_str(), areaLights[i].active);
-                                shader.setVec3(("areaLightPos[" + indexStr + "]").c_str(), areaLights[i].position);
-                                shader.setVec3(("areaLightColor[" + indexStr + "]").c_str(), areaLights[i].color);
-                                shader.setFloat(("areaLightIntensity[" + indexStr + "]").c_str(), areaLights[i].intensity);
-                                shader.setFloat(("areaLightRadius[" + indexStr + "]").c_str(), areaLights[i].radius);
-}
+                    dynamicResolution.beginScene();
+                    glClearColor(fogColor.x, fogColor.y, fogColor.z, 1.0f);
+                    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-                    // Render the map
-                    for (int z = 0; z < map.height; ++z) {
-                        for (int x = 0; x < map.width; ++x) {
-                            if (map.grid[z][x] == 1) {  // Wall
-                                int texID = map.getTextureID(x, z);
-                                //shader.setVec2("textureScale", glm::vec2(1.0f, 1.0f));  // Default texture scaling
+                    // Fill the per-frame uniform block
+                    // Far plane follows the draw distance, fog hides the cutoff, the aspect follows the window
+                    FrameUniforms frameData = {};
+                    frameData.projection = glm::perspective(glm::radians(fov), (float)framebufferWidth / (float)framebufferHeight, NEAR_PLANE, drawDistance);
+                    frameData.view = camera.GetViewMatrix();
+                    frameData.viewPos = camera.Position;
+
+                    // Global lighting
+                    frameData.lightPos = globalLightPosition(map);
+                    frameData.lightColor = GLOBAL_LIGHT_COLOR;
+
+                    // Flashlight follows the camera, cutoffs are passed as cosines
+                    frameData.flashlightOn = flashlightOn;
+                    frameData.flashlightPos = camera.Position;
+                    frameData.flashlightDir = camera.Front;
+                    frameData.flashlightCutoff = cos(glm::radians(flashlightCutoff));
+                    frameData.flashlightOuterCutoff = cos(glm::radians(flashlightOuterCutoff));
+                    frameData.flashlightIntensity = flashlightIntensity;
+
+                    // Fog
+                    frameData.fogColor = fogColor;
+                    frameData.fogStart = drawDistance * 0.5f;
+                    frameData.fogEnd = drawDistance;
+                    frameData.fogDensity = 2.5f / drawDistance;  // Fog is ~99.8% opaque at the draw distance
+                    frameData.fogExponential = useExponentialFog;
+
+                    // Cluster lookup, in pixels of the scene target
+                    frameData.screenSize = glm::vec2(dynamicResolution.sceneWidth(), dynamicResolution.sceneHeight());
+                    frameData.clusterZScale = ClusteredLights::sliceScale(drawDistance);
+                    frameData.clusterZBias = ClusteredLights::sliceBias(drawDistance);
+                    frameData.lightGridWidth = map.width;
+                    frameData.lightGridHeight = map.height;
+
+                    frameUniformBuffer.update(&frameData);
+
+                    // Forward: lights that are on this frame select the shader variants for every draw.
+                    // Deferred: draws only write materials to the G-buffer, lights are added afterwards
+                    ShaderPermutations& sceneShaders = useDeferredShading ? deferredRenderer.materialShaders() : shaders;
+                    unsigned int frameFeatures = 0;
+                    if (useDeferredShading) {
+                        deferredRenderer.beginGeometryPass(dynamicResolution.width(), dynamicResolution.height());
+                    } else if (useLightGrid) {
+                        // Cell lists are only rebuilt when the lights change
+                        lightGrid.update(map, areaLights);
+                        lightGrid.bind();
+                        frameStats.visibleLights = lightGrid.lights();
+                        frameStats.clusterLightIndices = lightGrid.entries();
+
+                        if (flashlightOn) frameFeatures |= FEATURE_FLASHLIGHT;
+                        if (lightGrid.lights() > 0) frameFeatures |= FEATURE_AREA_LIGHTS | FEATURE_LIGHT_GRID;
+                        if (lightGrid.lights() > 0 && shadowMode == SHADOW_MAPS && shadowMaps.readyLights() > 0) frameFeatures |= FEATURE_AREA_SHADOWS;
+                    } else {
+                        // Assign the area lights to clusters of this frame's view
+                        clusteredLights.update(areaLights, frameData.view, frameData.projection, drawDistance);
+                        clusteredLights.bind();
+
+                        if (flashlightOn) frameFeatures |= FEATURE_FLASHLIGHT;
+                        if (clusteredLights.visibleLights() > 0) frameFeatures |= FEATURE_AREA_LIGHTS;
+                        if (clusteredLights.visibleLights() > 0 && shadowMode == SHADOW_MAPS && shadowMaps.readyLights() > 0) frameFeatures |= FEATURE_AREA_SHADOWS;
+                    }
 
-                                    // Determine the height based on whether it's an object
-                                    float wallHeight = textureManager.isObject(texID) ? 2.0f : WALL_HEIGHT;
+                    // Walls, floor and ceiling take the global and static area light from the lightmap
+                    if (!useDeferredShading && useLightmap && lightmap.isLoaded()) {
+                        lightmap.bind();
+                        frameFeatures |= FEATURE_LIGHTMAP;
+                    }
 
-                                    // Set texture scaling appropriately
-                                    float textureYScale = wallHeight / 2.0f;
-                                    shader.setVec2("textureScale", glm::vec2(1.0f, textureYScale));
+                    // The grid ray march reads the wall heights in both paths
+                    if (shadowMode == SHADOW_GRID_MARCH) {
+                        occupancyGrid.bind();
+                        if (!useDeferredShading) frameFeatures |= FEATURE_GRID_SHADOWS;
+                    }
 
+                    // Models take the global and area light from the irradiance volume, so their cost
+                    // does not grow with the light count. The vertex lit shading LOD reads it too
+                    unsigned int modelFeatures = (frameFeatures & ~FEATURE_LIGHTMAP) | FEATURE_TEXTURE | FEATURE_MODEL_TEXTURE;
+                    if (!useDeferredShading && useIrradianceVolume) {
+                        irradianceVolume.update(map, areaLights);
+                        irradianceVolume.bind();
+                        modelFeatures = irradianceVolumeFeatures(modelFeatures);
+                    }
 
-                                // This will bind both the color texture, normal map, and roughness map if available
-                                textureManager.bindTexture(texID);
+                    // Far chunks are shaded with cheaper variants. The vertex lit level reads the irradiance
+                    // volume, the deferred path only has the material levels
+                    int maxShadingLod = useDeferredShading ? 1 : (useIrradianceVolume ? MAX_SHADING_LOD : MAX_SHADING_LOD - 1);
+                    shadingLod.update(mapMeshes.chunks(), camera.Position, maxShadingLod, currentFrame);
+                    if (shadingLodMode == SHADING_LOD_DITHERED && !ditherVariantsReady) {
+                        shaders.precompile(ditherFeatureSets);
+                        deferredRenderer.materialShaders().precompile(ditherMaterialFeatureSets);
+                        ditherVariantsReady = true;
+                    }
 
-                                shader.setBool("useTexture", texID > 0);
-                                 shader.setInt("textureType", 0);  // Use the same path as wall textures
-                                // Only use normal map if both available AND the toggle is on
-                                shader.setBool("useNormalMap", useNormalMaps && textureManager.hasNormalMapForTexture(texID));
-                                // Use roughness map if available
-                                shader.setBool("useRoughnessMap", textureManager.hasRoughnessMapForTexture(texID));
+                    // Render the walls, floor and ceiling of the chunks within the draw distance,
+                    // texture by texture so each material is set up once per frame and shader variant
+                    std::vector<std::pair<const MapMeshes::Chunk*, ShadingLod::Draw>> chunkDraws;
+                    std::vector<const MapMeshes::Chunk*> visibleChunks;
+                    for (size_t i = 0; i < mapMeshes.chunks().size(); i++) {
+                        const MapMeshes::Chunk& chunk = mapMeshes.chunks()[i];
+                        if (isCellRangeBeyondDrawDistance(camera.Position, chunk.minX, chunk.minZ, chunk.maxX, chunk.maxZ)) continue;
+                        visibleChunks.push_back(&chunk);
+
+                        ShadingLod::Draw draws[2];
+                        int drawCount = shadingLod.draws(i, currentFrame, draws);
+                        for (int d = 0; d < drawCount; d++) chunkDraws.push_back({&chunk, draws[d]});
+                        frameStats.shadingLodChunks[draws[drawCount - 1].lod]++;
+                    }
+                    std::stable_sort(chunkDraws.begin(), chunkDraws.end(), [](const auto& a, const auto& b) {
+                        return std::make_pair(a.second.lod, a.second.dithered) < std::make_pair(b.second.lod, b.second.dithered);
+                    });
+                    for (int texID : mapMeshes.textureIDs()) {
+                        bool textureBound = false;
+                        unsigned int boundFeatures = ~0u;
+                        Shader* shader = nullptr;
+                        for (const auto& chunkDraw : chunkDraws) {
+                            auto batch = chunkDraw.first->batches.find(texID);
+                            if (batch == chunkDraw.first->batches.end()) continue;
+
+                            const ShadingLod::Draw& draw = chunkDraw.second;
+                            unsigned int features = shadingLodFeatures(frameFeatures | textureManager.shaderFeatures(texID), draw.lod);
+                            if (draw.dithered) features |= FEATURE_LOD_DITHER;
+                            if (features != boundFeatures) {
+                                shader = &sceneShaders.use(features);
+                                shader->setMat4(U_MODEL, glm::mat4(1.0f));  // Map meshes are built in world space
+                                shader->setVec2(U_TEXTURE_SCALE, batch->second.textureScale);
 
                                 if (texID == 0) {
                                     // Fallback to color for walls without texture
-                                    shader.setVec3("objectColor", glm::vec3(0.7f, 0.7f, 0.7f));
+                                    shader->setVec3(U_OBJECT_COLOR, glm::vec3(0.7f, 0.7f, 0.7f));
                                 }
                                 //***** MANUAL TEXTURE RORATION FOR SPECIFIC PICTURES *****
-                                         // Set texture rotation if specified in the rotation map
-                                        auto rotIter = textureRotations.find(texID);
-                                        if (rotIter != textureRotations.end()) {
-                                            shader.setFloat("textureRotation", glm::radians(rotIter->second));
-                                        } else {
-                                            shader.setFloat("textureRotation", 0.0f);
-                                        }
-
-                                   // Create model matrix with appropriate height
-                                    glm::mat4 model = glm::mat4(1.0f);
-                                    model = glm::translate(model, glm::vec3(
-                                        (x + 0.5f) * CELL_SIZE,
-                                        wallHeight * 0.5f,  // Center Y based on actual height
-                                        (z + 0.5f) * CELL_SIZE
-                                    ));
-                                    model = glm::scale(model, glm::vec3(CELL_SIZE, wallHeight, CELL_SIZE));
-                                    shader.setMat4("model", model);
-
-                                cubeModel.render();
+                                auto rotIter = textureRotations.find(texID);
+                                if (rotIter != textureRotations.end()) {
+                                    shader->setFloat(U_TEXTURE_ROTATION, glm::radians(rotIter->second));
+                                } else {
+                                    shader->setFloat(U_TEXTURE_ROTATION, 0.0f);
+                                }
+                                boundFeatures = features;
+                            }
+                            if (!textureBound) {
+                                // This will bind both the color texture, normal map, and roughness map if available
+                                textureManager.bindTexture(texID);
+                                textureBound = true;
                             }
+                            if (draw.dithered) shader->setVec2(U_LOD_DITHER_RANGE, draw.ditherRange);
+                            mapMeshes.draw(*chunkDraw.first, batch->second);
                         }
                     }
 
-                    // Render floor
-                    glm::mat4 floorModel = glm::mat4(1.0f);
-                    floorModel = glm::translate(floorModel, glm::vec3(map.width * CELL_SIZE * 0.5f, 0.0f, map.height * CELL_SIZE * 0.5f));
-                    floorModel = glm::scale(floorModel, glm::vec3(map.width * CELL_SIZE, 0.1f, map.height * CELL_SIZE));
-                    shader.setMat4("model", floorModel);
-
-                    // Set texture scaling
-                    shader.setVec2("textureScale", glm::vec2(4.0f, 4.0f));  // Repeat texture 4 times in both directions
-
-                    // Bind floor texture
-                    textureManager.bindTexture(100);  // Use ID 100 for floor
-                    shader.setBool("useTexture", true);
-                    shader.setInt("textureType", 0);  // Use the same path as wall textures
-                    shader.setBool("useNormalMap", useNormalMaps && textureManager.hasNormalMapForTexture(100));
-                    shader.setBool("useRoughnessMap", textureManager.hasRoughnessMapForTexture(100));
-
-                    cubeModel.render();
-
-                    // Render ceiling
-                    glm::mat4 ceilingModel = glm::mat4(1.0f);
-                    ceilingModel = glm::translate(ceilingModel, glm::vec3(map.width * CELL_SIZE * 0.5f, WALL_HEIGHT, map.height * CELL_SIZE * 0.5f));
-                    ceilingModel = glm::scale(ceilingModel, glm::vec3(map.width * CELL_SIZE, 0.1f, map.height * CELL_SIZE));
-                    shader.setMat4("model", ceilingModel);
-
-                    // Load and bind ceiling texture
-                    textureManager.loadTextureWithName(101, "ceiling_1");
-                    textureManager.bindTexture(101);
-                    shader.setBool("useTexture", true);
-                    shader.setInt("textureType", 0);  // Use the same path as wall textures
-                    shader.setBool("useNormalMap", useNormalMaps && textureManager.hasNormalMapForTexture(101));
-                    shader.setBool("useRoughnessMap", textureManager.hasRoughnessMapForTexture(101));
-
-                    // Set texture scaling
-                    shader.setVec2("textureScale", glm::vec2(4.0f, 4.0f));
-
-                    cubeModel.render();
-
                     // **********************  Render cake model **********************
-                            glm::mat4 cakeModelMatrix = glm::mat4(1.0f);
-                            float posX = 15.0f;
-                            float posY = 0.5f;
-                            float posZ = 10.0f;
-
-                            cakeModelMatrix = glm::translate(cakeModelMatrix, glm::vec3(posX, posY, posZ));
-                            float rotationAngle = currentFrame * glm::radians(45.0f); // Rotate 45 degrees per second
-                            cakeModelMatrix = glm::rotate(cakeModelMatrix, rotationAngle, glm::vec3(0.0f, 1.0f, 0.0f));
-                            cakeModelMatrix = glm::scale(cakeModelMatrix, glm::vec3(0.1f, 0.1f, 0.1f));
-
-                            shader.setMat4("model", cakeModelMatrix);
-                            shader.setBool("useTexture", true);
-                            shader.setInt("textureType", 1);  // Signal it's a model texture
+                            // Skip the model when it is beyond the draw distance
+                            if (!isSphereBeyondDrawDistance(camera.Position, cakePosition, 1.0f)) {
 
-                                                // Add these lines to ensure proper lighting
-                            shader.setBool("useNormalMap", false);  // Models often don't have separate normal maps
-                            shader.setBool("useRoughnessMap", false);
-                            shader.setFloat("textureRotation", 0.0f);
-
-                            // Move viewPos uniform here to make sure it's set right before model rendering
-                            shader.setVec3("viewPos", camera.Position);
+                            // Model texture path, models often don't have separate normal or roughness maps
+                            Shader& shader = sceneShaders.use(modelFeatures);
+                            shader.setMat4(U_MODEL, cakeModelMatrix);
+                            shader.setFloat(U_TEXTURE_ROTATION, 0.0f);
 
                             // Then draw the model
                             cakeModel.Draw(shader);
+                            }
 
 
 
                     // ****************************Render dog Model ******************
-                            glm::mat4 dogModelMatrix = glm::mat4(1.0f);
-                            dogModelMatrix = glm::translate(dogModelMatrix, glm::vec3(18.0f, 0.6f, 10.0f));
-                                dogModelMatrix = glm::rotate(dogModelMatrix, glm::radians(-90.0f), glm::vec3(1.0f, 0.0f, 0.0f));
-                            dogModelMatrix = glm::scale(dogModelMatrix, glm::vec3(0.50f, 0.50f, 0.50f)); // Adjust scale as needed
-                            shader.setMat4("model", dogModelMatrix);
-                            // Missing for dog model:
-                            shader.setBool("useTexture", true);
-                            shader.setInt("textureType", 1);  // Signal it's a model texture
-                            shader.setBool("useNormalMap", false);
-                            shader.setBool("useRoughnessMap", false);
-                            shader.setFloat("textureRotation", 0.0f);
-                            shader.setVec3("viewPos", camera.Position);
+                            if (!isSphereBeyondDrawDistance(camera.Position, dogPosition, 1.0f)) {
+                            Shader& shader = sceneShaders.use(modelFeatures);
+                            shader.setMat4(U_MODEL, dogModelMatrix);
+                            shader.setFloat(U_TEXTURE_ROTATION, 0.0f);
 
 
                             // Before drawing the dog model
-                            shader.setVec2("textureScale", glm::vec2(1.00f, 1.00f));  // Reset to default scaling
+                            shader.setVec2(U_TEXTURE_SCALE, glm::vec2(1.00f, 1.00f));  // Reset to default scaling
                             // Right before drawing the dog model
 
                             dogModel.Draw(shader);
+                            }
+
 
+                    // Light the G-buffer and show it, the grid below is drawn forward on top
+                    if (useDeferredShading) {
+                        deferredRenderer.renderLighting(areaLights, frameData, flashlightOn, shadowMode, dynamicResolution.sceneFramebuffer());
+                    }
 
                     // Render grid if enabled
                     if (showGrid) {
-                        renderGrid(shader, map);
+                        renderGrid(shaders.use(frameFeatures & ~FEATURE_LIGHTMAP), map);
+                    }
+
+                    dynamicResolution.present();
+                    if (useTextureStreaming) {
+                        textureFeedback.render(mapMeshes, visibleChunks, dynamicResolution.sceneWidth(), dynamicResolution.sceneHeight());
+                    }
+
+                    // Over the texture budget, shrink the textures drawn longest ago
+                    textureResidency.endFrame();
+
+                    gpuFrameTimer.end();
+                    frameStats.gpuFrameMs = gpuFrameTimer.milliseconds();
+                    double cpuFrameMs = (glfwGetTime() - frameStartTime) * 1000.0;
+                    lightBenchmark.recordFrame(map, cpuFrameMs, frameStats.gpuFrameMs, frameStats.lightAssignMs);
+                    shadingLodBenchmark.recordFrame(frameStats.gpuFrameMs);
+                    if (!lightBenchmark.isRunning() && !shadingLodBenchmark.isRunning()) {
+                        qualityGovernor.recordFrame(cpuFrameMs, frameStats.gpuFrameMs, dynamicResolution.currentScale());
+                    }
+
+                    // Print the counters of this frame once per second
+                    static float lastStatsTime = 0.0f;
+                    if (showStats && currentFrame - lastStatsTime >= 1.0f) {
+                        lastStatsTime = currentFrame;
+                        std::cout << "Frame " << deltaTime * 1000.0f << " ms (CPU " << cpuFrameMs
+                                  << " ms, GPU " << frameStats.gpuFrameMs << " ms)"
+                                  << " | uniform uploads " << frameStats.uniformUploads
+                                  << ", skipped " << frameStats.uniformUploadsSkipped
+                                  << " | shader binds " << frameStats.shaderBinds
+                                  << " of " << sceneShaders.size() << " variants"
+                                  << " | " << (useDeferredShading ? "deferred" : (useLightGrid ? "forward, light grid" : "forward, clusters"))
+                                  << ((frameFeatures & FEATURE_LIGHTMAP) ? ", lightmap" : "")
+                                  << ((modelFeatures & FEATURE_IRRADIANCE_VOLUME) ? ", irradiance volume" : "")
+                                  << " | resolution " << dynamicResolution.sceneWidth() << "x" << dynamicResolution.sceneHeight()
+                                  << (resolutionOverride >= 0 ? " fixed" : " dynamic")
+                                  << " | quality steps lowered " << qualityGovernor.loweredSteps()
+                                  << " | shadows " << SHADOW_MODE_NAMES[shadowMode];
+                        std::cout << " | textures " << textureResidency.megabytes() << " of " << textureBudgetMegabytes
+                                  << " MB, " << textureResidency.shrunkTextures() << " shrunk";
+                        if (useTextureStreaming) {
+                            double residentMegabytes, fullMegabytes;
+                            textureManager.streamingMegabytes(residentMegabytes, fullMegabytes);
+                            std::cout << " | streamed textures " << residentMegabytes << " of " << fullMegabytes << " MB";
+                        }
+                        if (shadowMode == SHADOW_MAPS) {
+                            std::cout << " " << shadowMaps.readyLights() << ", faces rendered " << frameStats.shadowFacesRendered;
+                        }
+                        std::cout << " | shading LOD " << SHADING_LOD_MODE_NAMES[shadingLodMode] << ", chunks per LOD";
+                        for (int lod = 0; lod <= MAX_SHADING_LOD; lod++) {
+                            std::cout << (lod == 0 ? " " : "/") << frameStats.shadingLodChunks[lod];
+                        }
+                        if (useDeferredShading) {
+                            std::cout << " | light volumes " << frameStats.lightVolumes << std::endl;
+                        } else {
+                            std::cout << " | lights " << frameStats.visibleLights
+                                      << ", list entries " << frameStats.clusterLightIndices
+                                      << ", assigned in " << frameStats.lightAssignMs << " ms" << std::endl;
+                        }
                     }
 
                     // Swap buffers and poll IO events
@@ -5,130 +5,498 @@ in vec3 FragPos;
 in vec3 Normal;
 in vec2 TexCoord;
 in mat3 TBN;
+in float Occlusion;
+#ifdef VERTEX_LIT
+in vec3 VertexLight;
+#endif
+
+// Feature defines, inserted after #version by the shader permutation system:
+//   USE_TEXTURE        diffuse color from a texture instead of objectColor
+//   MODEL_TEXTURE      diffuse texture is texture_diffuse1 (models) instead of wallTexture
+//   USE_NORMAL_MAP     normal from normalMap
+//   USE_ROUGHNESS_MAP  roughness from roughnessMap
+//   PARALLAX_MAP       parallax occlusion mapping of the wall texture coordinates from heightMap
+//   FLASHLIGHT         flashlight spotlight contribution
+//   AREA_LIGHTS        area light contributions from the fragment's light cluster
+//   LIGHT_GRID         area lights come from the fragment's map cell instead of its cluster
+//   LIGHTMAP           global and static area light of walls, floor and ceiling come from the baked lightmap
+//   AREA_SHADOWS       area lights with a shadow slot are shadowed by their cube shadow map
+//   GRID_SHADOWS       area lights and the global light are shadowed by a ray march through the map cells
+//   IRRADIANCE_VOLUME  diffuse of the global and area lights comes from the irradiance volume (models)
+//   NO_SPECULAR        diffuse only (far shading LODs)
+//   VERTEX_LIT         ambient and diffuse of the global and area lights were lit per vertex (far shading LOD)
+//   LOD_DITHER         only the pixels in lodDitherRange of an ordered dither pattern are drawn
+//   MATERIAL_MAP       roughnessMap and heightMap are one packed material map: occlusion, roughness, metallic, height
 
-uniform vec3 lightPos;
-uniform vec3 lightColor;
 uniform vec3 objectColor;
 uniform sampler2D wallTexture;
 uniform sampler2D normalMap;
 uniform sampler2D roughnessMap;
-uniform bool useTexture;
-uniform bool useNormalMap;
-uniform bool useRoughnessMap;
 uniform sampler2D texture_diffuse1;
-uniform int textureType;
-
-// Flashlight uniforms
-uniform bool flashlightOn;
-uniform vec3 viewPos;
-uniform vec3 flashlightPos;
-uniform vec3 flashlightDir;
-uniform float flashlightCutoff;
-uniform float flashlightOuterCutoff;
-uniform float flashlightIntensity;
-
-// Area Light uniforms
-const int MAX_AREA_LIGHTS = 10;
-uniform int numAreaLights;
-uniform bool areaLightActive[MAX_AREA_LIGHTS];
-uniform vec3 areaLightPos[MAX_AREA_LIGHTS];
-uniform vec3 areaLightColor[MAX_AREA_LIGHTS];
-uniform float areaLightIntensity[MAX_AREA_LIGHTS];
-uniform float areaLightRadius[MAX_AREA_LIGHTS];
+
+// Per-frame camera, global light, flashlight and fog data
+layout (std140) uniform FrameData {
+    mat4 projection;
+    mat4 view;
+    vec3 viewPos;
+    bool flashlightOn;
+    vec3 lightPos;
+    float flashlightCutoff;
+    vec3 lightColor;
+    float flashlightOuterCutoff;
+    vec3 flashlightPos;
+    float flashlightIntensity;
+    vec3 flashlightDir;
+    float fogStart;
+    vec3 fogColor;
+    float fogEnd;
+    float fogDensity;
+    bool fogExponential;
+    vec2 screenSize;
+    float clusterZScale;
+    float clusterZBias;
+    int lightGridWidth;
+    int lightGridHeight;
+};
+
+// Area lights listed per view cluster or per map cell, the sizes must match main.cpp
+const int CLUSTER_X = 16;
+const int CLUSTER_Y = 9;
+const int CLUSTER_Z = 24;
+const float CELL_SIZE = 1.0;
+const float WALL_HEIGHT = 4.0;
+uniform samplerBuffer lightData;       // 2 texels per light: position + radius, color * intensity + 1 if baked
+uniform usamplerBuffer lightLists;     // Per cluster or cell: offset and count in lightIndices
+uniform usamplerBuffer lightIndices;   // Light indices of every cluster or cell back to back
+
+#ifdef AREA_SHADOWS
+// Cube shadow maps, 6 layers per slot in the order +X, -X, +Y, -Y, +Z, -Z, rendered with a
+// 90 degree projection from SHADOW_NEAR_PLANE to the light radius. Must match main.cpp
+const float SHADOW_NEAR_PLANE = 0.05;
+const float SHADOW_NORMAL_OFFSET = 0.03;
+uniform sampler2DArrayShadow areaShadowMaps;
+
+// 1 where the area light reaches FragPos, 0 in its shadow
+float areaShadow(int slot, vec3 lightPosition, float radius)
+{
+    vec3 d = FragPos + normalize(Normal) * SHADOW_NORMAL_OFFSET - lightPosition;
+    vec3 a = abs(d);
+    int face;
+    float major;
+    vec2 uv;
+    if (a.x >= a.y && a.x >= a.z) {
+        face = d.x > 0.0 ? 0 : 1;
+        major = a.x;
+        uv = vec2(d.x > 0.0 ? -d.z : d.z, -d.y);
+    } else if (a.y >= a.z) {
+        face = d.y > 0.0 ? 2 : 3;
+        major = a.y;
+        uv = vec2(d.x, d.y > 0.0 ? d.z : -d.z);
+    } else {
+        face = d.z > 0.0 ? 4 : 5;
+        major = a.z;
+        uv = vec2(d.z > 0.0 ? d.x : -d.x, -d.y);
+    }
+    // Window depth of the face's perspective projection at this distance along its axis
+    float depth = (radius + SHADOW_NEAR_PLANE - 2.0 * radius * SHADOW_NEAR_PLANE / major) / (radius - SHADOW_NEAR_PLANE);
+    return texture(areaShadowMaps, vec4(uv / major * 0.5 + 0.5, float(slot * 6 + face), depth * 0.5 + 0.5));
+}
+#endif
+
+#ifdef GRID_SHADOWS
+// Grid ray marched shadows: a ray walks the map cells from the surface towards the light (2D DDA)
+// and compares its height over every crossed cell with the cell's wall
+const float GRID_SHADOW_NORMAL_OFFSET = 0.01;   // Ray origin is lifted off the surface by this
+const float GRID_SHADOW_MAX_DISTANCE = 24.0;    // Walls further along the ray are ignored
+const int GRID_SHADOW_MIN_STEPS = 8;
+const int GRID_SHADOW_MAX_STEPS = 48;
+const float GRID_SHADOW_STEPS_PER_PIXEL = 0.5;  // Cells a ray may cross per pixel a cell spans on screen
+uniform sampler2D occupancyMap;                 // R8 wall height / WALL_HEIGHT per cell, 1 outside the map
+
+// Cells a shadow ray from this view depth may cross, fewer where cells look small on screen
+int gridShadowSteps(float viewDepth)
+{
+    float cellPixels = CELL_SIZE * projection[1][1] * screenSize.y * 0.5 / max(viewDepth, 0.0001);
+    return clamp(int(cellPixels * GRID_SHADOW_STEPS_PER_PIXEL), GRID_SHADOW_MIN_STEPS, GRID_SHADOW_MAX_STEPS);
+}
+
+// 1 if no wall stands between origin and the light, 0 if one does. The origin and light cells are not
+// tested, rays that cross more than maxSteps cells or GRID_SHADOW_MAX_DISTANCE stop early and count as lit
+float gridShadow(vec3 origin, vec3 lightPosition, int maxSteps)
+{
+    vec3 dir = lightPosition - origin;
+    float dist = length(dir);
+    if (dist < 0.0001) return 1.0;
+    dir /= dist;
+    float marchDistance = min(dist, GRID_SHADOW_MAX_DISTANCE);
+
+    ivec2 gridSize = textureSize(occupancyMap, 0);
+    ivec2 cell = ivec2(floor(origin.xz / CELL_SIZE));
+    ivec2 lightCell = ivec2(floor(lightPosition.xz / CELL_SIZE));
+    ivec2 cellStep = ivec2(dir.x >= 0.0 ? 1 : -1, dir.z >= 0.0 ? 1 : -1);
+    vec2 absDir = max(abs(dir.xz), vec2(0.000001));
+    vec2 cellDelta = CELL_SIZE / absDir;  // Ray length across one cell along x and z
+    vec2 nextBoundary = abs(vec2(cell + max(cellStep, ivec2(0))) * CELL_SIZE - origin.xz) / absDir;
+
+    for (int i = 0; i < maxSteps; i++) {
+        float enter = min(nextBoundary.x, nextBoundary.y);
+        if (enter >= marchDistance) return 1.0;
+        if (nextBoundary.x < nextBoundary.y) {
+            cell.x += cellStep.x;
+            nextBoundary.x += cellDelta.x;
+        } else {
+            cell.y += cellStep.y;
+            nextBoundary.y += cellDelta.y;
+        }
+        if (cell == lightCell) return 1.0;
+        if (any(lessThan(cell, ivec2(0))) || any(greaterThanEqual(cell, gridSize))) return 0.0;
+
+        float wallHeight = texelFetch(occupancyMap, cell, 0).r * WALL_HEIGHT;
+        if (wallHeight > 0.0) {
+            // Lowest point of the ray over this cell
+            float exit = min(min(nextBoundary.x, nextBoundary.y), dist);
+            if (origin.y + dir.y * (dir.y < 0.0 ? exit : enter) < wallHeight) return 0.0;
+        }
+    }
+    return 1.0;
+}
+#endif
+
+#ifdef IRRADIANCE_VOLUME
+// Ambient cube probes at every map cell center and IRRADIANCE_LAYERS heights spread over the wall
+// height. The faces +X, -X, +Y, -Y, +Z, -Z are slabs along z, each as deep as the map. Must match main.cpp
+uniform sampler3D irradianceVolume;
+
+// Light arriving along n at FragPos, the 3 faces n points towards blended by the squared normal
+vec3 sampleIrradiance(vec3 n)
+{
+    ivec3 size = textureSize(irradianceVolume, 0);
+    float mapDepth = float(size.z / 6);
+    vec2 xy = vec2(FragPos.x / (float(size.x) * CELL_SIZE), FragPos.y / WALL_HEIGHT);
+    float z = clamp(FragPos.z / CELL_SIZE, 0.5, mapDepth - 0.5);  // Never filter across into the next slab
+    vec3 faceOffsets = vec3(n.x >= 0.0 ? 0.0 : 1.0, n.y >= 0.0 ? 2.0 : 3.0, n.z >= 0.0 ? 4.0 : 5.0) * mapDepth;
+    vec3 weights = n * n;
+    return weights.x * texture(irradianceVolume, vec3(xy, (faceOffsets.x + z) / float(size.z))).rgb +
+           weights.y * texture(irradianceVolume, vec3(xy, (faceOffsets.y + z) / float(size.z))).rgb +
+           weights.z * texture(irradianceVolume, vec3(xy, (faceOffsets.z + z) / float(size.z))).rgb;
+}
+#endif
+
+#ifdef PARALLAX_MAP
+// Parallax occlusion mapping: the view ray is marched down through the height map in layers. Fewer
+// layers where the view is head-on or the wall is far, plain normal mapping past the cutoff distance
+const float PARALLAX_DEPTH = 0.04;            // World units from the top to the bottom of the height map
+const float PARALLAX_FADE_DISTANCE = 6.0;     // The depth flattens out from here to the cutoff so nothing pops
+const float PARALLAX_CUTOFF_DISTANCE = 8.0;
+const int PARALLAX_MIN_STEPS = 4;
+const int PARALLAX_MAX_STEPS = 24;
+uniform sampler2D heightMap;
+#ifdef MATERIAL_MAP
+#define HEIGHT_CHANNEL a  // Height is the last channel of the packed material map
+#else
+#define HEIGHT_CHANNEL r
+#endif
+
+// Texture coordinates where the view ray through uv hits the height field. The texture space
+// gradients are found from screen space derivatives, so texture rotation, flips and scale need no tangents
+vec2 parallaxOcclusion(vec2 uv)
+{
+    vec3 dp1 = dFdx(FragPos);
+    vec3 dp2 = dFdy(FragPos);
+    vec2 duv1 = dFdx(uv);
+    vec2 duv2 = dFdy(uv);
+
+    vec3 toEye = viewPos - FragPos;
+    float viewDistance = length(toEye);
+    if (viewDistance >= PARALLAX_CUTOFF_DISTANCE) return uv;
+
+    vec3 n = normalize(Normal);
+    vec3 dp2perp = cross(dp2, n);
+    vec3 dp1perp = cross(n, dp1);
+    float det = dot(dp1, dp2perp);
+    if (abs(det) < 1e-12) return uv;
+    vec3 gradU = (dp2perp * duv1.x + dp1perp * duv2.x) / det;  // Change of uv per world unit
+    vec3 gradV = (dp2perp * duv1.y + dp1perp * duv2.y) / det;
+
+    vec3 v = toEye / viewDistance;
+    float facing = max(dot(v, n), 0.05);
+    float depth = PARALLAX_DEPTH * (1.0 - smoothstep(PARALLAX_FADE_DISTANCE, PARALLAX_CUTOFF_DISTANCE, viewDistance));
+    vec2 fullShift = -vec2(dot(v, gradU), dot(v, gradV)) / facing * depth;  // Shift at the bottom of the height map
+
+    float steps = mix(float(PARALLAX_MAX_STEPS), float(PARALLAX_MIN_STEPS), facing);
+    steps = max(floor(steps * (1.0 - viewDistance / PARALLAX_CUTOFF_DISTANCE)), float(PARALLAX_MIN_STEPS));
+    float layerDepth = 1.0 / steps;
+    vec2 layerShift = fullShift * layerDepth;
+
+    // Step down until the ray is below the surface, then place the hit between the last two layers
+    vec2 current = uv;
+    float rayDepth = 0.0;
+    float surfaceDepth = 1.0 - textureGrad(heightMap, current, duv1, duv2).HEIGHT_CHANNEL;
+    for (int i = 0; i < PARALLAX_MAX_STEPS && float(i) < steps && rayDepth < surfaceDepth; i++) {
+        current += layerShift;
+        rayDepth += layerDepth;
+        surfaceDepth = 1.0 - textureGrad(heightMap, current, duv1, duv2).HEIGHT_CHANNEL;
+    }
+    vec2 previous = current - layerShift;
+    float after = surfaceDepth - rayDepth;
+    float before = 1.0 - textureGrad(heightMap, previous, duv1, duv2).HEIGHT_CHANNEL - (rayDepth - layerDepth);
+    float weight = after / (after - before + 1e-6);
+    return mix(current, previous, clamp(weight, 0.0, 1.0));
+}
+#endif
+
+#ifdef LOD_DITHER
+// A chunk changing shading LOD is drawn with both variants over complementary parts of a 4x4 ordered
+// dither pattern, the new variant covering more of it as the transition goes on
+const float DITHER_4X4[16] = float[16](0.0, 8.0, 2.0, 10.0, 12.0, 4.0, 14.0, 6.0, 3.0, 11.0, 1.0, 9.0, 15.0, 7.0, 13.0, 5.0);
+uniform vec2 lodDitherRange;  // Pattern values in [x, y) are drawn
+
+bool outsideLodDither()
+{
+    ivec2 p = ivec2(gl_FragCoord.xy) & 3;
+    float threshold = (DITHER_4X4[p.y * 4 + p.x] + 0.5) / 16.0;
+    return threshold < lodDitherRange.x || threshold >= lodDitherRange.y;
+}
+#endif
+
+// Cluster of this fragment from its screen tile and view depth
+int clusterIndex()
+{
+    ivec2 tile = ivec2(gl_FragCoord.xy / screenSize * vec2(CLUSTER_X, CLUSTER_Y));
+    tile = clamp(tile, ivec2(0), ivec2(CLUSTER_X - 1, CLUSTER_Y - 1));
+    float viewDepth = max(-(view * vec4(FragPos, 1.0)).z, 0.0001);
+    int slice = clamp(int(floor(log(viewDepth) * clusterZScale + clusterZBias)), 0, CLUSTER_Z - 1);
+    return tile.x + tile.y * CLUSTER_X + slice * CLUSTER_X * CLUSTER_Y;
+}
+
+// Map cell of this fragment, wall faces are pushed along their normal into the open cell they face.
+// -1 outside the map
+int cellIndex()
+{
+    ivec2 cell = ivec2(floor((FragPos.xz + normalize(Normal).xz * 0.01 * CELL_SIZE) / CELL_SIZE));
+    if (cell.x < 0 || cell.y < 0 || cell.x >= lightGridWidth || cell.y >= lightGridHeight) return -1;
+    return cell.x + cell.y * lightGridWidth;
+}
+
+#ifdef LIGHTMAP
+// Baked lighting, every open cell has a tile slot for its floor, ceiling and the four wall faces around it.
+// The sizes and slot order must match main.cpp
+const int LIGHTMAP_TILE_SIZE = 16;
+const int LIGHTMAP_FACES_PER_CELL = 6;
+uniform sampler2D lightmap;            // Atlas of tiles, diffuse light of the global and static area lights
+uniform isamplerBuffer lightmapFaces;  // Per cell and face slot: tile in the atlas, -1 for none
+
+// Baked light at this fragment, false if its face has no tile (models, wall tops)
+bool sampleLightmap(out vec3 baked)
+{
+    baked = vec3(0.0);
+    int cell = cellIndex();
+    if (cell < 0) return false;
+
+    // Face slot and position on the face, wall tiles span the full wall height
+    vec3 n = normalize(Normal);
+    int face;
+    vec2 uv;
+    if (n.y > 0.5) {
+        face = 0;
+        uv = FragPos.xz / CELL_SIZE;
+    } else if (n.y < -0.5) {
+        face = 1;
+        uv = FragPos.xz / CELL_SIZE;
+    } else if (abs(n.x) > abs(n.z)) {
+        face = n.x > 0.0 ? 2 : 3;
+        uv = vec2(FragPos.z / CELL_SIZE, FragPos.y / WALL_HEIGHT);
+    } else {
+        face = n.z > 0.0 ? 4 : 5;
+        uv = vec2(FragPos.x / CELL_SIZE, FragPos.y / WALL_HEIGHT);
+    }
+    int tile = texelFetch(lightmapFaces, cell * LIGHTMAP_FACES_PER_CELL + face).r;
+    if (tile < 0) return false;
+    uv.x = fract(uv.x);
+    if (face < 2) uv.y = fract(uv.y);
+
+    // Stay half a texel inside the tile so filtering never reads the neighbouring tiles
+    ivec2 atlasSize = textureSize(lightmap, 0);
+    int tilesPerRow = atlasSize.x / LIGHTMAP_TILE_SIZE;
+    vec2 tileOrigin = vec2(tile % tilesPerRow, tile / tilesPerRow) * float(LIGHTMAP_TILE_SIZE);
+    vec2 texel = clamp(uv * float(LIGHTMAP_TILE_SIZE), vec2(0.5), vec2(float(LIGHTMAP_TILE_SIZE) - 0.5));
+    baked = texture(lightmap, (tileOrigin + texel) / vec2(atlasSize)).rgb;
+    return true;
+}
+#endif
 
 void main()
 {
+#ifdef LOD_DITHER
+    if (outsideLodDither()) discard;
+#endif
+
     // Create flipped texture coordinates for all sampling
     vec2 flippedCoord = vec2(1.0 - TexCoord.x, TexCoord.y);
+#ifdef PARALLAX_MAP
+    flippedCoord = parallaxOcclusion(flippedCoord);
+#endif
 
-    // Ambient
+    // Ambient, darkened in corners and creases by the baked occlusion
+#ifdef VERTEX_LIT
+    vec3 ambient = VertexLight;
+#else
     float ambientStrength = 0.2;
-    vec3 ambient = ambientStrength * lightColor;
+    vec3 ambient = ambientStrength * lightColor * (1.0 - Occlusion);
+#endif
 
     // Get normal from normal map if available
     vec3 norm;
-    if(useNormalMap) {
-        norm = texture(normalMap, flippedCoord).rgb;
-        norm = normalize(norm * 2.0 - 1.0);   // Convert from [0,1] to [-1,1]
-        norm = normalize(TBN * norm);         // Convert to world space
-    } else {
-        norm = normalize(Normal);
-    }
+#ifdef USE_NORMAL_MAP
+    // Only x and y are read, BC5 normal maps store no z. Tangent space normals face out, so z is positive
+    vec2 normalXY = texture(normalMap, flippedCoord).rg * 2.0 - 1.0;   // Convert from [0,1] to [-1,1]
+    norm = vec3(normalXY, sqrt(max(1.0 - dot(normalXY, normalXY), 0.0)));
+    norm = normalize(TBN * norm);         // Convert to world space
+#else
+    norm = normalize(Normal);
+#endif
 
     // Get roughness from roughness map if available
     float roughness = 1.0;
-    if(useRoughnessMap) {
-        roughness = texture(roughnessMap, flippedCoord).r; // Assuming single channel
-    }
+#ifdef USE_ROUGHNESS_MAP
+#ifdef MATERIAL_MAP
+    // One fetch for roughness and the occlusion map, metallic is packed but not shaded
+    vec4 material = texture(roughnessMap, flippedCoord);
+    roughness = material.g;
+    ambient *= material.r;
+#else
+    roughness = texture(roughnessMap, flippedCoord).r; // Single channel
+#endif
+#endif
+
+    // Baked diffuse of the global and static area lights replaces their per-pixel diffuse
+    bool lightmapped = false;
+    vec3 baked = vec3(0.0);
+#ifdef LIGHTMAP
+    lightmapped = sampleLightmap(baked);
+#endif
 
     // Diffuse from global light
     vec3 lightDir = normalize(lightPos - FragPos);
     float diff = max(dot(norm, lightDir), 0.0);
+
+    // Shadow rays start just off the surface, the step count follows the fragment's size on screen
+    float globalShadow = 1.0;
+#ifdef GRID_SHADOWS
+    int shadowSteps = gridShadowSteps(-(view * vec4(FragPos, 1.0)).z);
+    vec3 shadowOrigin = FragPos + normalize(Normal) * GRID_SHADOW_NORMAL_OFFSET;
+    if (diff > 0.0) globalShadow = gridShadow(shadowOrigin, lightPos, shadowSteps);
+#endif
+
     // Adjust diffuse with roughness
-    vec3 diffuse = diff * lightColor * roughness;
+#if defined(VERTEX_LIT)
+    vec3 diffuse = vec3(0.0);  // Already in the vertex light
+#elif defined(IRRADIANCE_VOLUME)
+    vec3 diffuse = sampleIrradiance(norm) * roughness;
+#else
+    vec3 diffuse = (lightmapped ? baked : diff * lightColor * globalShadow) * roughness;
+#endif
 
-    // Specular (Blinn-Phong)
+    // Specular (Blinn-Phong), dropped by the far shading LODs
     vec3 viewDir = normalize(viewPos - FragPos);
+#ifdef NO_SPECULAR
+    vec3 specular = vec3(0.0);
+#else
     vec3 halfwayDir = normalize(lightDir + viewDir);
     float spec = pow(max(dot(norm, halfwayDir), 0.0), 32.0);
     // Adjust specular with roughness (less specular with higher roughness)
-    vec3 specular = spec * lightColor * (1.0 - roughness);
+    vec3 specular = spec * lightColor * (1.0 - roughness) * globalShadow;
+#endif
 
     // Flashlight (Spotlight)
     vec3 flashlightDiffuse = vec3(0.0);
     vec3 flashlightSpecular = vec3(0.0);
-    if(flashlightOn) {
-        vec3 flashDir = normalize(flashlightPos - FragPos);
-        float theta = dot(flashDir, normalize(-flashlightDir));
-        float epsilon = flashlightCutoff - flashlightOuterCutoff;
-        float intensity = clamp((theta - flashlightOuterCutoff) / epsilon, 0.0, 1.0);
-        
-        if(theta > flashlightOuterCutoff) {
-            float flashDiff = max(dot(norm, flashDir), 0.0);
-            float flashSpec = pow(max(dot(norm, normalize(flashDir + viewDir)), 0.0), 32.0);
-            
-            flashlightDiffuse = flashDiff * lightColor * intensity * flashlightIntensity * roughness;
-            flashlightSpecular = flashSpec * lightColor * intensity * flashlightIntensity * (1.0 - roughness);
-        }
+#ifdef FLASHLIGHT
+    vec3 flashDir = normalize(flashlightPos - FragPos);
+    float theta = dot(flashDir, normalize(-flashlightDir));
+    float epsilon = flashlightCutoff - flashlightOuterCutoff;
+    float intensity = clamp((theta - flashlightOuterCutoff) / epsilon, 0.0, 1.0);
+
+    if(theta > flashlightOuterCutoff) {
+        float flashDiff = max(dot(norm, flashDir), 0.0);
+        flashlightDiffuse = flashDiff * lightColor * intensity * flashlightIntensity * roughness;
+#ifndef NO_SPECULAR
+        float flashSpec = pow(max(dot(norm, normalize(flashDir + viewDir)), 0.0), 32.0);
+        flashlightSpecular = flashSpec * lightColor * intensity * flashlightIntensity * (1.0 - roughness);
+#endif
     }
+#endif
 
     // Area Light contributions
     vec3 areaLightDiffuse = vec3(0.0);
     vec3 areaLightSpecular = vec3(0.0);
-    for(int i = 0; i < numAreaLights; i++) {
-        if(areaLightActive[i]) {
-            // Calculate distance and falloff
-            vec3 areaDir = areaLightPos[i] - FragPos;
-            float distance = length(areaDir);
-            if(distance < areaLightRadius[i]) {
-                // Normalize direction
-                areaDir = normalize(areaDir);
-                // Calculate falloff (1 at center, 0 at radius)
-                float falloff = 1.0 - distance/areaLightRadius[i];
-                // Diffuse
-                float areaDiff = max(dot(norm, areaDir), 0.0);
-                areaLightDiffuse += areaDiff * areaLightColor[i] * areaLightIntensity[i] * roughness * falloff;
-                // Specular
-                float areaSpec = pow(max(dot(norm, normalize(areaDir + viewDir)), 0.0), 32.0);
-                areaLightSpecular += areaSpec * areaLightColor[i] * areaLightIntensity[i] * (1.0 - roughness) * falloff;
-            }
+#ifdef AREA_LIGHTS
+#ifdef LIGHT_GRID
+    int cell = cellIndex();
+    uvec2 lightList = cell >= 0 ? texelFetch(lightLists, cell).xy : uvec2(0u);
+#else
+    uvec2 lightList = texelFetch(lightLists, clusterIndex()).xy;
+#endif
+    for(uint i = 0u; i < lightList.y; i++) {
+        int lightIndex = int(texelFetch(lightIndices, int(lightList.x + i)).r);
+        vec4 positionRadius = texelFetch(lightData, lightIndex * 2);
+        vec4 areaLightColorFlags = texelFetch(lightData, lightIndex * 2 + 1);
+        int flags = int(areaLightColorFlags.w);
+        if (lightmapped && (flags & 1) != 0) continue;  // Already in the lightmap
+        vec3 areaLightColor = areaLightColorFlags.rgb;
+        // Calculate distance and falloff
+        vec3 areaDir = positionRadius.xyz - FragPos;
+        float distance = length(areaDir);
+        if(distance < positionRadius.w) {
+            // Normalize direction
+            areaDir = normalize(areaDir);
+            // Calculate falloff (1 at center, 0 at radius)
+            float falloff = 1.0 - distance/positionRadius.w;
+#ifdef AREA_SHADOWS
+            int shadowSlot = (flags >> 1) - 1;
+            if (shadowSlot >= 0) falloff *= areaShadow(shadowSlot, positionRadius.xyz, positionRadius.w);
+#endif
+#ifdef GRID_SHADOWS
+            if (dot(norm, areaDir) > 0.0) falloff *= gridShadow(shadowOrigin, positionRadius.xyz, shadowSteps);
+#endif
+            // Diffuse
+            float areaDiff = max(dot(norm, areaDir), 0.0);
+            areaLightDiffuse += areaDiff * areaLightColor * roughness * falloff;
+#ifndef NO_SPECULAR
+            // Specular
+            float areaSpec = pow(max(dot(norm, normalize(areaDir + viewDir)), 0.0), 32.0);
+            areaLightSpecular += areaSpec * areaLightColor * (1.0 - roughness) * falloff;
+#endif
         }
     }
+#endif
 
     // Result
     vec3 result;
-    if (useTexture) {
-        vec3 texColor;
-        if (textureType == 1) { // Model texture
-            texColor = texture(texture_diffuse1, vec2(TexCoord.x, TexCoord.y)).rgb;
-        } else { // Wall texture
-            texColor = texture(wallTexture, flippedCoord).rgb;
-        }
-        // Apply lighting calculations to the texture color for both models and walls
-        result = (ambient + diffuse + specular + flashlightDiffuse + flashlightSpecular + areaLightDiffuse + areaLightSpecular) * texColor;
+#ifdef USE_TEXTURE
+    vec3 texColor;
+#ifdef MODEL_TEXTURE
+    texColor = texture(texture_diffuse1, vec2(TexCoord.x, TexCoord.y)).rgb;
+#else
+    texColor = texture(wallTexture, flippedCoord).rgb;
+#endif
+    // Apply lighting calculations to the texture color for both models and walls
+    result = (ambient + diffuse + specular + flashlightDiffuse + flashlightSpecular + areaLightDiffuse + areaLightSpecular) * texColor;
+#else
+    result = (ambient + diffuse + specular + flashlightDiffuse + flashlightSpecular + areaLightDiffuse + areaLightSpecular) * objectColor;
+#endif
+
+    // Distance fog hides the draw distance cutoff
+    float fogDistance = length(viewPos - FragPos);
+    float fogFactor;
+    if (fogExponential) {
+        float fogAmount = fogDensity * fogDistance;
+        fogFactor = exp(-fogAmount * fogAmount);
     } else {
-        result = (ambient + diffuse + specular + flashlightDiffuse + flashlightSpecular + areaLightDiffuse + areaLightSpecular) * objectColor;
+        fogFactor = (fogEnd - fogDistance) / (fogEnd - fogStart);
     }
+    fogFactor = clamp(fogFactor, 0.0, 1.0);
+    result = mix(fogColor, result, fogFactor);
 
     FragColor = vec4(result, 1.0);
 }
@@ -4,18 +4,66 @@ layout (location = 1) in vec3 aNormal;
 layout (location = 2) in vec2 aTexCoord;
 layout (location = 3) in vec3 aTangent;
 layout (location = 4) in vec3 aBitangent;
+layout (location = 5) in float aOcclusion;  // Baked ambient occlusion of the map meshes, 0 for other meshes
 
 out vec3 FragPos;
 out vec3 Normal;
 out vec2 TexCoord;
 out mat3 TBN;
+out float Occlusion;
 
 uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+
+// Per-frame camera, global light, flashlight and fog data
+layout (std140) uniform FrameData {
+    mat4 projection;
+    mat4 view;
+    vec3 viewPos;
+    bool flashlightOn;
+    vec3 lightPos;
+    float flashlightCutoff;
+    vec3 lightColor;
+    float flashlightOuterCutoff;
+    vec3 flashlightPos;
+    float flashlightIntensity;
+    vec3 flashlightDir;
+    float fogStart;
+    vec3 fogColor;
+    float fogEnd;
+    float fogDensity;
+    bool fogExponential;
+    vec2 screenSize;
+    float clusterZScale;
+    float clusterZBias;
+    int lightGridWidth;
+    int lightGridHeight;
+};
 uniform vec2 textureScale = vec2(1.0, 1.0);
 uniform float textureRotation = 0.0;
 
+#ifdef VERTEX_LIT
+// Far walls, floor and ceiling are lit per vertex from the irradiance volume, see sampleIrradiance in shader.fs
+const float CELL_SIZE = 1.0;
+const float WALL_HEIGHT = 4.0;
+const float VERTEX_LIGHT_OFFSET = 0.5;  // Vertices on cell edges read the probes of the open cell they face
+uniform sampler3D irradianceVolume;
+out vec3 VertexLight;
+
+// Light arriving along n at position, the 3 faces n points towards blended by the squared normal
+vec3 vertexIrradiance(vec3 position, vec3 n)
+{
+    ivec3 size = textureSize(irradianceVolume, 0);
+    float mapDepth = float(size.z / 6);
+    vec2 xy = vec2(position.x / (float(size.x) * CELL_SIZE), position.y / WALL_HEIGHT);
+    float z = clamp(position.z / CELL_SIZE, 0.5, mapDepth - 0.5);
+    vec3 faceOffsets = vec3(n.x >= 0.0 ? 0.0 : 1.0, n.y >= 0.0 ? 2.0 : 3.0, n.z >= 0.0 ? 4.0 : 5.0) * mapDepth;
+    vec3 weights = n * n;
+    return weights.x * textureLod(irradianceVolume, vec3(xy, (faceOffsets.x + z) / float(size.z)), 0.0).rgb +
+           weights.y * textureLod(irradianceVolume, vec3(xy, (faceOffsets.y + z) / float(size.z)), 0.0).rgb +
+           weights.z * textureLod(irradianceVolume, vec3(xy, (faceOffsets.z + z) / float(size.z)), 0.0).rgb;
+}
+#endif
+
 void main()
 {
     FragPos = vec3(model * vec4(aPos, 1.0));
@@ -46,5 +94,10 @@ void main()
     vec3 B = normalize(mat3(model) * aBitangent);
     vec3 N = normalize(mat3(model) * aNormal);
     TBN = mat3(T, B, N);
+    Occlusion = aOcclusion;
+#ifdef VERTEX_LIT
+    // Ambient and the diffuse of the global and area lights, the fragment shader only adds the flashlight
+    VertexLight = 0.2 * lightColor * (1.0 - aOcclusion) + vertexIrradiance(FragPos + N * VERTEX_LIGHT_OFFSET * CELL_SIZE, N);
+#endif
     gl_Position = projection * view * vec4(FragPos, 1.0);
 }
@@ -0,0 +1,11 @@
+#version 330 core
+// Depth only pass into one face of an area light's cube shadow map
+layout (location = 0) in vec3 aPos;
+
+uniform mat4 lightViewProjection;
+uniform mat4 model;
+
+void main()
+{
+    gl_Position = lightViewProjection * model * vec4(aPos, 1.0);
+}
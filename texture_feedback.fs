@@ -0,0 +1,21 @@
+#version 330 core
+// Texture streaming feedback, drawn with shader.vs into a small target that is read back a few frames later.
+// Each pixel stores the texture ID drawn there and how fine a mip level its texture coordinates need
+out vec4 FragColor;
+
+in vec2 TexCoord;
+
+uniform int materialID;
+uniform float feedbackLodBias;  // log2 of how many scene pixels one feedback pixel covers
+
+void main()
+{
+    // log2 of texture coordinate units per scene pixel, the texture's own size is added on the CPU
+    vec2 dx = dFdx(TexCoord);
+    vec2 dy = dFdy(TexCoord);
+    float lod = 0.5 * log2(max(max(dot(dx, dx), dot(dy, dy)), 1e-20)) - feedbackLodBias;
+
+    // ID in red and green, the LOD in eighths from -16 in blue, alpha marks a written pixel
+    FragColor = vec4(float(materialID & 255) / 255.0, float((materialID >> 8) & 255) / 255.0,
+                     clamp(floor((lod + 16.0) * 8.0), 0.0, 255.0) / 255.0, 1.0);
+}
@@ -0,0 +1,37 @@
+#version 330 core
+// Dynamic resolution upscale: the scene target is filtered up to the window, then sharpened with a
+// contrast adaptive sharpen that backs off where the neighbourhood already has strong contrast
+out vec4 FragColor;
+
+in vec2 ScreenUV;
+
+uniform sampler2D sceneColor;
+uniform vec2 renderScale;  // Drawn part of the scene target, it starts at the lower left corner
+uniform float sharpness;   // 0 for a plain bilinear upscale, up to 1 for the strongest sharpen
+
+void main()
+{
+    // Stay half a texel inside the drawn part so filtering never reads past its edge
+    vec2 texel = 1.0 / vec2(textureSize(sceneColor, 0));
+    vec2 low = 0.5 * texel;
+    vec2 high = renderScale - 0.5 * texel;
+    vec2 uv = clamp(ScreenUV * renderScale, low, high);
+    vec3 center = texture(sceneColor, uv).rgb;
+    if (sharpness <= 0.0) {
+        FragColor = vec4(center, 1.0);
+        return;
+    }
+
+    vec3 north = texture(sceneColor, clamp(uv + vec2(0.0, texel.y), low, high)).rgb;
+    vec3 south = texture(sceneColor, clamp(uv - vec2(0.0, texel.y), low, high)).rgb;
+    vec3 east = texture(sceneColor, clamp(uv + vec2(texel.x, 0.0), low, high)).rgb;
+    vec3 west = texture(sceneColor, clamp(uv - vec2(texel.x, 0.0), low, high)).rgb;
+    vec3 minColor = min(center, min(min(north, south), min(east, west)));
+    vec3 maxColor = max(center, max(max(north, south), max(east, west)));
+
+    // Negative neighbour weight, smaller where the local range is already close to black or white
+    vec3 amplitude = sqrt(clamp(min(minColor, 1.0 - maxColor) / max(maxColor, vec3(0.0001)), 0.0, 1.0));
+    vec3 weight = -amplitude * mix(0.125, 0.2, sharpness);
+    vec3 result = (center + (north + south + east + west) * weight) / (1.0 + 4.0 * weight);
+    FragColor = vec4(clamp(result, 0.0, 1.0), 1.0);
+}
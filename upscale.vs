@@ -0,0 +1,10 @@
+#version 330 core
+// Full-screen triangle of the dynamic resolution upscale, its corners come from gl_VertexID
+out vec2 ScreenUV;
+
+void main()
+{
+    vec2 corner = vec2(float((gl_VertexID << 1) & 2), float(gl_VertexID & 2));
+    ScreenUV = corner;
+    gl_Position = vec4(corner * 2.0 - 1.0, 0.0, 1.0);
+}